@@ -0,0 +1,302 @@
+// AdaptivePerf: comprehensive profiling tool based on Linux perf
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "bench.hpp"
+#include "server.hpp"
+#include "uring.hpp"
+#include "stats.hpp"
+#include <fstream>
+#include <thread>
+#include <unistd.h>
+#include <boost/algorithm/string.hpp>
+#include <Poco/Net/StreamSocket.h>
+#include <Poco/Net/SocketAddress.h>
+
+namespace aperf {
+  /**
+     Reads a sample stream recorded by the AdaptivePerf "perf" Python scripts
+     (see APERF_DUMP_DIR) or synthesised by adaptiveperf-bench-generate.
+
+     Every line of the file is one message of the subclient protocol.
+     "<STOP>" is appended if the file doesn't end with it.
+
+     @param path The path to the stream file.
+  */
+  std::vector<std::string> read_stream_file(fs::path path) {
+    std::ifstream stream(path);
+
+    if (!stream) {
+      throw std::runtime_error("Could not open " + path.string() + ".");
+    }
+
+    std::vector<std::string> lines;
+    std::string line;
+
+    while (std::getline(stream, line)) {
+      if (!line.empty()) {
+        lines.push_back(line);
+      }
+    }
+
+    if (lines.empty() || lines.back() != "<STOP>") {
+      lines.push_back("<STOP>");
+    }
+
+    return lines;
+  }
+
+  /**
+     Replays sample streams through StdClient and StdSubclient running
+     in the current process, acting as the AdaptivePerf frontend and
+     the "perf" Python scripts.
+
+     Each stream is sent by a separate thread to a separate subclient
+     as fast as possible. The profile start timestamp sent to the client is
+     the smallest timestamp found in the streams so that no sample is dropped.
+
+     @param streams     The streams to replay, one per subclient.
+     @param transport   The transport between the subclients and the
+                        senders: "pipe", "tcp", "unix" or "uring" (TCP
+                        with data received through one io_uring thread,
+                        available only when compiled with io_uring
+                        support).
+     @param working_dir The working directory of the client.
+     @param result_dir  The name of the result directory of the session
+                        (relative to working_dir).
+     @param buf_size    The buffer size for communication, in bytes.
+     @param port        The first port to try for the subclients if
+                        transport is "tcp" or "uring".
+     @param timeline_buckets_ms The time bucket sizes in ms of timeline flame
+                                graphs the server should produce (see
+                                SessionSettings).
+  */
+  ReplayResult replay_session(std::vector<std::vector<std::string> > &streams,
+                              std::string transport,
+                              fs::path working_dir,
+                              std::string result_dir,
+                              unsigned int buf_size,
+                              unsigned short port,
+                              std::vector<unsigned long long> timeline_buckets_ms) {
+    ReplayResult result;
+    unsigned long long start_tstamp = ULLONG_MAX;
+
+    for (auto &stream : streams) {
+      for (auto &line : stream) {
+        std::size_t time_pos = line.find("\"time\":");
+
+        if (time_pos != std::string::npos) {
+          try {
+            start_tstamp = std::min(start_tstamp,
+                                    std::stoull(line.substr(time_pos + 7)));
+          } catch (...) { }
+        }
+
+        if (line.find("\"type\": \"sample\"") != std::string::npos ||
+            line.find("\"type\":\"sample\"") != std::string::npos) {
+          result.samples++;
+        }
+
+        if (line != "<STOP>") {
+          result.lines++;
+        }
+      }
+    }
+
+    if (start_tstamp == ULLONG_MAX) {
+      start_tstamp = 0;
+    }
+
+    int read_fd[2];
+    int write_fd[2];
+
+    if (pipe(read_fd) != 0 || pipe(write_fd) != 0) {
+      throw std::runtime_error("Could not open pipes for the client connection.");
+    }
+
+    std::unique_ptr<Connection> connection =
+      std::make_unique<FileDescriptor>(write_fd, read_fd, buf_size);
+    std::unique_ptr<Connection> server_connection =
+      std::make_unique<FileDescriptor>(read_fd, write_fd, buf_size);
+
+    std::unique_ptr<Acceptor::Factory> acceptor_factory;
+
+    if (transport == "pipe") {
+      acceptor_factory = std::make_unique<PipeAcceptor::Factory>();
+    } else if (transport == "tcp") {
+      acceptor_factory = std::make_unique<TCPAcceptor::Factory>("127.0.0.1",
+                                                                port, true);
+#ifdef IO_URING_AVAILABLE
+    } else if (transport == "uring") {
+      std::vector<std::shared_ptr<IoUringReactor> > reactors;
+      reactors.push_back(std::make_shared<IoUringReactor>());
+      acceptor_factory = std::make_unique<IoUringAcceptor::Factory>("127.0.0.1",
+                                                                    port, true,
+                                                                    reactors);
+#endif
+    } else if (transport == "unix") {
+      fs::path socket_path = fs::temp_directory_path() /
+        ("aperf-bench-" + std::to_string(getpid()) + ".sock");
+      acceptor_factory = std::make_unique<UnixSocketAcceptor::Factory>(socket_path,
+                                                                       true);
+    } else {
+      throw std::runtime_error("Unsupported transport \"" + transport + "\".");
+    }
+
+    std::unique_ptr<Subclient::Factory> subclient_factory =
+      std::make_unique<StdSubclient::Factory>(acceptor_factory);
+    StdClient::Factory client_factory(subclient_factory);
+
+    std::unique_ptr<Acceptor> file_acceptor = nullptr;
+    std::unique_ptr<Client> client =
+      client_factory.make_client(server_connection, file_acceptor, 30);
+
+    std::thread client_thread([&client, working_dir]() {
+      client->process(working_dir);
+    });
+
+    connection->write("protocol " + std::to_string(PROTOCOL_VERSION), true);
+    connection->write("start" + std::to_string(streams.size()) + " " + result_dir, true);
+    connection->write("replay", true);
+
+    nlohmann::json session_settings;
+    session_settings["timeline_buckets_ms"] = timeline_buckets_ms;
+    connection->write(nlohmann::to_string(session_settings), true);
+
+    std::vector<std::string> instrs;
+    boost::split(instrs, connection->read(), boost::is_any_of(" "));
+
+    if (instrs.size() != streams.size() + 1) {
+      client_thread.join();
+      throw std::runtime_error("Unexpected subclient connection instructions received.");
+    }
+
+    std::vector<std::unique_ptr<Connection> > stream_connections;
+
+    for (int i = 1; i < instrs.size(); i++) {
+      std::vector<std::string> parts;
+      boost::split(parts, instrs[i], boost::is_any_of("_"));
+
+      if (transport == "pipe") {
+        int fds[2] = {-1, std::stoi(parts[1])};
+        stream_connections.push_back(std::make_unique<FileDescriptor>(nullptr, fds,
+                                                                      buf_size));
+        std::string connect_msg = "connect";
+        stream_connections.back()->write(connect_msg.size(),
+                                         (char *)connect_msg.c_str());
+      } else if (transport == "unix") {
+        Poco::Net::SocketAddress address(Poco::Net::SocketAddress::UNIX_LOCAL,
+                                         instrs[i]);
+        Poco::Net::StreamSocket socket(address);
+        stream_connections.push_back(std::make_unique<UnixSocket>(socket, instrs[i],
+                                                                  buf_size));
+      } else {
+        Poco::Net::SocketAddress address(parts[0], std::stoi(parts[1]));
+        Poco::Net::StreamSocket socket(address);
+        stream_connections.push_back(std::make_unique<TCPSocket>(socket, buf_size));
+      }
+    }
+
+    if (connection->read() != "start_profile") {
+      client_thread.join();
+      throw std::runtime_error("The client has not sent start_profile.");
+    }
+
+    connection->write(std::to_string(start_tstamp), true);
+
+    if (connection->read() != "tstamp_ack") {
+      client_thread.join();
+      throw std::runtime_error("The client has not acknowledged the timestamp.");
+    }
+
+    Stopwatch wall_watch;
+    std::vector<std::thread> senders;
+
+    for (int i = 0; i < streams.size(); i++) {
+      senders.push_back(std::thread([&, i]() {
+        for (auto &line : streams[i]) {
+          stream_connections[i]->write(line, true);
+        }
+      }));
+    }
+
+    for (auto &sender : senders) {
+      sender.join();
+    }
+
+    result.send_ns = wall_watch.elapsed_ns();
+
+    connection->write("overhead {}", true);
+
+    std::string msg = connection->read();
+    result.wall_ns = wall_watch.elapsed_ns();
+
+    if (msg != "profiling_finished") {
+      client_thread.join();
+      throw std::runtime_error("The client has sent \"" + msg + "\" instead of "
+                               "profiling_finished.");
+    }
+
+    connection->read();
+    client_thread.join();
+
+    result.peak_rss_kb = get_peak_rss_kb();
+
+    std::ifstream stats_stream(working_dir / result_dir / "processed" /
+                               "server_stats.json");
+
+    if (stats_stream) {
+      result.server_stats = nlohmann::json::parse(stats_stream);
+    }
+
+    return result;
+  }
+
+  /**
+     Summarises a ReplayResult object in form of a JSON object.
+
+     @param result The result to summarise.
+  */
+  nlohmann::json replay_result_to_json(ReplayResult &result) {
+    nlohmann::json summary;
+    summary["lines"] = result.lines;
+    summary["samples"] = result.samples;
+    summary["send_ns"] = result.send_ns;
+    summary["wall_ns"] = result.wall_ns;
+    summary["samples_per_second"] = result.wall_ns == 0 ? 0.0 :
+      result.samples * 1e9 / result.wall_ns;
+    summary["lines_per_second"] = result.wall_ns == 0 ? 0.0 :
+      result.lines * 1e9 / result.wall_ns;
+    summary["peak_rss_kb"] = result.peak_rss_kb;
+
+    unsigned long long p50 = 0, p99 = 0, nodes = 0;
+    unsigned long long recurse_ns = 0, recurse_time_ordered_ns = 0, parse_ns = 0;
+    unsigned long long timeline_ns = 0;
+
+    if (result.server_stats.contains("subclients")) {
+      for (auto &subclient : result.server_stats["subclients"]) {
+        p50 = std::max(p50, (unsigned long long)subclient["line_latency"]["p50_ns"]);
+        p99 = std::max(p99, (unsigned long long)subclient["line_latency"]["p99_ns"]);
+        nodes += (unsigned long long)subclient["tree_nodes"];
+        parse_ns += (unsigned long long)subclient["parse_ns"];
+        recurse_ns += (unsigned long long)subclient["recurse_ns"];
+        recurse_time_ordered_ns += (unsigned long long)subclient["recurse_time_ordered_ns"];
+        timeline_ns += (unsigned long long)subclient["timeline_ns"];
+      }
+    }
+
+    summary["line_p50_ns"] = p50;
+    summary["line_p99_ns"] = p99;
+    summary["tree_nodes"] = nodes;
+    summary["parse_ns"] = parse_ns;
+    summary["recurse_ns"] = recurse_ns;
+    summary["recurse_time_ordered_ns"] = recurse_time_ordered_ns;
+    summary["timeline_ns"] = timeline_ns;
+
+    if (result.server_stats.contains("merge_ns")) {
+      summary["merge_ns"] = result.server_stats["merge_ns"];
+      summary["save_ns"] = result.server_stats["save_ns"];
+    }
+
+    return summary;
+  }
+};
@@ -0,0 +1,39 @@
+// AdaptivePerf: comprehensive profiling tool based on Linux perf
+// Copyright (C) CERN. See LICENSE for details.
+
+#ifndef BENCH_HPP_
+#define BENCH_HPP_
+
+#include <filesystem>
+#include <string>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+namespace aperf {
+  namespace fs = std::filesystem;
+
+  /**
+     A structure describing the result of replaying sample streams
+     through adaptiveperf-server.
+  */
+  struct ReplayResult {
+    unsigned long long lines = 0;
+    unsigned long long samples = 0;
+    unsigned long long send_ns = 0;
+    unsigned long long wall_ns = 0;
+    unsigned long long peak_rss_kb = 0;
+    nlohmann::json server_stats;
+  };
+
+  std::vector<std::string> read_stream_file(fs::path path);
+  ReplayResult replay_session(std::vector<std::vector<std::string> > &streams,
+                              std::string transport,
+                              fs::path working_dir,
+                              std::string result_dir,
+                              unsigned int buf_size,
+                              unsigned short port,
+                              std::vector<unsigned long long> timeline_buckets_ms);
+  nlohmann::json replay_result_to_json(ReplayResult &result);
+};
+
+#endif
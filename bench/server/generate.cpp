@@ -0,0 +1,158 @@
+// AdaptivePerf: comprehensive profiling tool based on Linux perf
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "generate.hpp"
+#include <algorithm>
+#include <random>
+#include <sstream>
+#include <nlohmann/json.hpp>
+
+namespace aperf {
+  static unsigned long long mix(unsigned long long x) {
+    // splitmix64 finaliser
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+  }
+
+  /**
+     Generates synthetic sample streams in the format sent by the
+     AdaptivePerf "perf" Python scripts to adaptiveperf-server, i.e.
+     one JSON sample per line terminated by "<STOP>".
+
+     Threads are assigned to streams in a round-robin fashion, in the same
+     way as the "perf" Python scripts do. Samples of the threads sharing
+     a stream are interleaved round-robin.
+
+     Consecutive samples of a thread share a random prefix of their
+     callchains so that the time-ordered trees are not built solely
+     from unique paths.
+
+     @param settings     The shape of the workload.
+     @param stream_count The number of streams to generate.
+  */
+  std::vector<std::vector<std::string> > generate_streams(GeneratorSettings &settings,
+                                                          unsigned int stream_count) {
+    struct thread_state {
+      int pid;
+      int tid;
+      unsigned long long time;
+      std::vector<unsigned long long> nodes;
+    };
+
+    std::mt19937_64 generator(settings.seed);
+    std::uniform_real_distribution<double> offcpu_dist(0, 1);
+    std::uniform_int_distribution<unsigned long long> offcpu_period_dist(1, 10);
+
+    unsigned int depth = std::clamp(settings.depth, 1U, (unsigned int)MAX_STACK_DEPTH);
+    unsigned int fan_out = std::max(settings.fan_out, 1U);
+    unsigned int symbols = std::max(settings.symbols, 1U);
+    unsigned int processes = std::clamp(settings.processes, 1U,
+                                        std::max(settings.threads, 1U));
+
+    std::uniform_int_distribution<unsigned int> depth_dist(std::max(depth / 2, 1U),
+                                                           depth);
+    std::uniform_int_distribution<unsigned int> child_dist(0, fan_out - 1);
+
+    std::vector<struct thread_state> threads(settings.threads);
+
+    for (int i = 0; i < settings.threads; i++) {
+      int pid = 1000 + (i % processes) * 100000;
+      threads[i].pid = pid;
+      threads[i].tid = i < processes ? pid : pid + i / processes;
+      threads[i].time = settings.start_time;
+    }
+
+    // IDs of threads and processes spawned in a fork-heavy workload
+    int next_id = 1000 + processes * 100000;
+
+    std::vector<std::vector<std::string> > streams(std::max(stream_count, 1U));
+
+    for (unsigned long long s = 0; s < settings.samples; s++) {
+      for (int i = 0; i < threads.size(); i++) {
+        struct thread_state &thread = threads[i];
+
+        bool offcpu = offcpu_dist(generator) < settings.offcpu_fraction;
+        unsigned long long period = offcpu ?
+          offcpu_period_dist(generator) * settings.interval_ns : settings.interval_ns;
+
+        thread.time += period;
+
+        unsigned int sample_depth = depth_dist(generator);
+        std::uniform_int_distribution<unsigned int> keep_dist(
+          0, std::min(sample_depth, (unsigned int)thread.nodes.size()));
+        thread.nodes.resize(keep_dist(generator));
+
+        while (thread.nodes.size() < sample_depth) {
+          unsigned long long parent = thread.nodes.empty() ? 0 : thread.nodes.back();
+          thread.nodes.push_back(mix(parent * fan_out + child_dist(generator) + 1));
+        }
+
+        nlohmann::json callchain = nlohmann::json::array();
+
+        for (auto &node : thread.nodes) {
+          std::stringstream offset;
+          offset << "0x" << std::hex << (node >> 48);
+          callchain.push_back({"s" + std::to_string(node % symbols), offset.str()});
+        }
+
+        nlohmann::json sample;
+        sample["type"] = "sample";
+        sample["event_type"] = offcpu ? "offcpu-time" : "task-clock";
+        sample["pid"] = thread.pid;
+        sample["tid"] = thread.tid;
+        sample["time"] = thread.time;
+        sample["period"] = period;
+        sample["callchain"] = callchain;
+
+        streams[i % streams.size()].push_back(sample.dump());
+
+        if (settings.thread_lifetime > 0 &&
+            (s + i + 1) % settings.thread_lifetime == 0) {
+          bool main_thread = i < processes;
+          int new_tid = next_id++;
+          int parent_tid = main_thread ? thread.tid : threads[i % processes].tid;
+
+          nlohmann::json syscall;
+          syscall["type"] = "syscall";
+          syscall["ret_value"] = new_tid;
+          syscall["callchain"] = callchain;
+
+          nlohmann::json spawn;
+          spawn["type"] = "syscall_meta";
+          spawn["subtype"] = "new_proc";
+          spawn["comm"] = "p" + std::to_string(i % processes);
+          spawn["pid"] = main_thread ? thread.pid : threads[i % processes].pid;
+          spawn["tid"] = parent_tid;
+          spawn["time"] = thread.time;
+          spawn["ret_value"] = new_tid;
+
+          nlohmann::json exit;
+          exit["type"] = "syscall_meta";
+          exit["subtype"] = "exit";
+          exit["comm"] = spawn["comm"];
+          exit["pid"] = thread.pid;
+          exit["tid"] = thread.tid;
+          exit["time"] = thread.time;
+          exit["ret_value"] = 0;
+
+          streams[0].push_back(syscall.dump());
+          streams[0].push_back(spawn.dump());
+          streams[0].push_back(exit.dump());
+
+          thread.pid = main_thread ? new_tid : threads[i % processes].pid;
+          thread.tid = new_tid;
+
+          thread.nodes.clear();
+        }
+      }
+    }
+
+    for (auto &stream : streams) {
+      stream.push_back("<STOP>");
+    }
+
+    return streams;
+  }
+};
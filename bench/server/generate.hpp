@@ -0,0 +1,56 @@
+// AdaptivePerf: comprehensive profiling tool based on Linux perf
+// Copyright (C) CERN. See LICENSE for details.
+
+#ifndef GENERATE_HPP_
+#define GENERATE_HPP_
+
+#include <string>
+#include <vector>
+
+#define MAX_STACK_DEPTH 1024
+
+namespace aperf {
+  /**
+     A structure describing the shape of a synthetic workload
+     generated by generate_streams().
+
+     threads threads are spread over processes processes and each
+     of them produces samples samples. Every sample is either on-CPU
+     ("task-clock", period of interval_ns) or off-CPU ("offcpu-time",
+     with probability offcpu_fraction and a period of 1-10 * interval_ns).
+
+     Callchains are random walks over a call tree where every function
+     has fan_out possible callees and the function names are drawn from
+     symbols distinct symbols. Their depth is between depth / 2 and
+     depth frames (depth is capped to MAX_STACK_DEPTH, i.e. the default
+     max_stack of "perf").
+
+     If thread_lifetime is non-zero, the workload is fork-heavy: every
+     thread exits after thread_lifetime samples and is replaced by a new
+     thread with a fresh TID (or by a new process with a fresh PID if
+     the thread is the main thread of its process), along with the
+     "syscall" and "syscall_meta" messages describing the spawning and
+     the exit. These messages are put into the first stream, as if it was
+     also the stream of the syscall profiler.
+
+     The same settings (including seed) always produce the same streams.
+  */
+  struct GeneratorSettings {
+    unsigned int threads = 4;
+    unsigned int processes = 1;
+    unsigned long long samples = 10000;
+    unsigned int depth = 32;
+    unsigned int fan_out = 4;
+    unsigned int symbols = 1000;
+    double offcpu_fraction = 0.2;
+    unsigned long long interval_ns = 1000000;
+    unsigned long long start_time = 1000000000;
+    unsigned long long seed = 1;
+    unsigned long long thread_lifetime = 0;
+  };
+
+  std::vector<std::vector<std::string> > generate_streams(GeneratorSettings &settings,
+                                                          unsigned int stream_count);
+};
+
+#endif
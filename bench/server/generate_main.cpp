@@ -0,0 +1,67 @@
+// AdaptivePerf: comprehensive profiling tool based on Linux perf
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "generate.hpp"
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <CLI/CLI.hpp>
+
+/**
+   Entry point to adaptiveperf-bench-generate, writing synthetic sample
+   streams to files which can be replayed by adaptiveperf-bench-replay.
+*/
+int main(int argc, char **argv) {
+  CLI::App app("Synthetic workload generator for adaptiveperf-server benchmarks");
+
+  aperf::GeneratorSettings settings;
+  unsigned int stream_count = 1;
+  std::string output_dir = "streams";
+
+  app.add_option("-o", output_dir,
+                 "Directory where the streams should be saved to as "
+                 "<index>.jsonl (default: streams)");
+  app.add_option("-s", stream_count, "Number of streams, i.e. subclients (default: 1)");
+  app.add_option("-t", settings.threads, "Number of threads (default: 4)");
+  app.add_option("-P", settings.processes, "Number of processes (default: 1)");
+  app.add_option("-n", settings.samples, "Number of samples per thread (default: 10000)");
+  app.add_option("-d", settings.depth,
+                 "Maximum callchain depth, up to " + std::to_string(MAX_STACK_DEPTH) +
+                 " (default: 32)");
+  app.add_option("-f", settings.fan_out,
+                 "Number of possible callees of every function (default: 4)");
+  app.add_option("-y", settings.symbols, "Number of distinct symbols (default: 1000)");
+  app.add_option("-c", settings.offcpu_fraction,
+                 "Fraction of off-CPU samples between 0 and 1 (default: 0.2)");
+  app.add_option("-i", settings.interval_ns,
+                 "On-CPU sampling period in ns (default: 1000000)");
+  app.add_option("-r", settings.seed, "Random seed (default: 1)");
+  app.add_option("-l", settings.thread_lifetime,
+                 "Number of samples after which every thread exits and is "
+                 "replaced by a newly-spawned one, 0 for no replacement "
+                 "(default: 0)");
+
+  CLI11_PARSE(app, argc, argv);
+
+  std::vector<std::vector<std::string> > streams =
+    aperf::generate_streams(settings, stream_count);
+
+  std::filesystem::create_directories(output_dir);
+
+  for (int i = 0; i < streams.size(); i++) {
+    std::filesystem::path path =
+      std::filesystem::path(output_dir) / (std::to_string(i) + ".jsonl");
+    std::ofstream stream(path);
+
+    if (!stream) {
+      std::cerr << "Could not open " << path.string() << " for writing." << std::endl;
+      return 1;
+    }
+
+    for (auto &line : streams[i]) {
+      stream << line << std::endl;
+    }
+  }
+
+  return 0;
+}
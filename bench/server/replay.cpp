@@ -0,0 +1,104 @@
+// AdaptivePerf: comprehensive profiling tool based on Linux perf
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "bench.hpp"
+#include <algorithm>
+#include <iostream>
+#include <CLI/CLI.hpp>
+
+/**
+   Entry point to adaptiveperf-bench-replay, replaying sample streams
+   recorded once with APERF_DUMP_DIR set (or generated by
+   adaptiveperf-bench-generate) through adaptiveperf-server and printing
+   its throughput, per-line latency and peak memory usage as JSON.
+*/
+int main(int argc, char **argv) {
+  CLI::App app("Replay benchmark for adaptiveperf-server");
+
+  std::vector<std::string> stream_paths;
+  app.add_option("STREAMS", stream_paths,
+                 "Stream files to replay, one per subclient "
+                 "(e.g. produced by setting APERF_DUMP_DIR)")->required();
+
+  std::string transport = "all";
+  app.add_option("-t", transport,
+                 "Transport between perf-script and adaptiveperf-server: "
+                 "pipe, tcp, unix, uring (TCP received through io_uring, "
+                 "if compiled in), both (pipe and tcp), or all (default: all)")
+    ->check(CLI::IsMember({"pipe", "tcp", "unix", "uring", "both", "all"}));
+
+  unsigned int repeats = 3;
+  app.add_option("-r", repeats, "Number of replays per transport (default: 3)");
+
+  std::string working_dir = "bench_results";
+  app.add_option("-o", working_dir,
+                 "Directory where adaptiveperf-server should save "
+                 "its results (default: bench_results)");
+
+  unsigned int buf_size = 1024;
+  app.add_option("-b", buf_size,
+                 "Buffer size for communication in bytes (default: 1024)");
+
+  unsigned short port = 5001;
+  app.add_option("-p", port,
+                 "First port to try for the TCP transport (default: 5001)");
+
+  std::vector<unsigned long long> timeline_buckets = {10, 100, 1000};
+  app.add_option("-B", timeline_buckets,
+                 "Comma-separated time bucket sizes in ms of timeline "
+                 "flame graphs, 0 for none (default: 10,100,1000)")
+    ->delimiter(',');
+
+  CLI11_PARSE(app, argc, argv);
+
+  timeline_buckets.erase(std::remove(timeline_buckets.begin(),
+                                     timeline_buckets.end(), 0),
+                         timeline_buckets.end());
+
+  try {
+    std::vector<std::vector<std::string> > streams;
+
+    for (auto &path : stream_paths) {
+      streams.push_back(aperf::read_stream_file(path));
+    }
+
+    std::vector<std::string> transports;
+
+    if (transport == "both") {
+      transports = {"pipe", "tcp"};
+    } else if (transport == "all") {
+      transports = {"pipe", "tcp", "unix"};
+
+#ifdef IO_URING_AVAILABLE
+      transports.push_back("uring");
+#endif
+    } else {
+      transports = {transport};
+    }
+
+    std::filesystem::create_directories(working_dir);
+
+    nlohmann::json report;
+
+    for (auto &cur_transport : transports) {
+      nlohmann::json runs = nlohmann::json::array();
+
+      for (int i = 0; i < repeats; i++) {
+        aperf::ReplayResult result =
+          aperf::replay_session(streams, cur_transport, working_dir,
+                                cur_transport + "_" + std::to_string(i),
+                                buf_size, port, timeline_buckets);
+        runs.push_back(aperf::replay_result_to_json(result));
+      }
+
+      report[cur_transport] = runs;
+    }
+
+    std::cout << report.dump(2) << std::endl;
+  } catch (std::exception &e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
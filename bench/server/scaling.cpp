@@ -0,0 +1,132 @@
+// AdaptivePerf: comprehensive profiling tool based on Linux perf
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "bench.hpp"
+#include "generate.hpp"
+#include <algorithm>
+#include <iostream>
+#include <CLI/CLI.hpp>
+
+/**
+   Entry point to adaptiveperf-bench-scaling, replaying synthetic workloads
+   of varying callchain depths and thread counts through adaptiveperf-server
+   and printing the throughput curves as JSON.
+
+   For every (depth, thread count) point, the overall throughput (in samples
+   per second of wall time) is reported along with the throughputs of
+   building the aggregated and the time-ordered trees alone (in samples per
+   second of time spent in StdSubclient::recurse(), summed over subclients).
+*/
+int main(int argc, char **argv) {
+  CLI::App app("Scaling benchmark for adaptiveperf-server");
+
+  aperf::GeneratorSettings settings;
+  settings.samples = 2000;
+
+  std::vector<unsigned int> depths = {1, 8, 32, 128, 512, MAX_STACK_DEPTH};
+  app.add_option("-d", depths,
+                 "Comma-separated callchain depths to test "
+                 "(default: 1,8,32,128,512," + std::to_string(MAX_STACK_DEPTH) + ")")
+    ->delimiter(',');
+
+  std::vector<unsigned int> thread_counts = {1, 4, 16, 64};
+  app.add_option("-t", thread_counts,
+                 "Comma-separated thread counts to test (default: 1,4,16,64)")
+    ->delimiter(',');
+
+  unsigned int stream_count = 1;
+  app.add_option("-s", stream_count, "Number of streams, i.e. subclients (default: 1)");
+
+  app.add_option("-n", settings.samples, "Number of samples per thread (default: 2000)");
+  app.add_option("-f", settings.fan_out,
+                 "Number of possible callees of every function (default: 4)");
+  app.add_option("-y", settings.symbols, "Number of distinct symbols (default: 1000)");
+  app.add_option("-c", settings.offcpu_fraction,
+                 "Fraction of off-CPU samples between 0 and 1 (default: 0.2)");
+  app.add_option("-r", settings.seed, "Random seed (default: 1)");
+  app.add_option("-l", settings.thread_lifetime,
+                 "Number of samples after which every thread exits and is "
+                 "replaced by a newly-spawned one for a fork-heavy workload, "
+                 "0 for no replacement (default: 0)");
+
+  std::string transport = "pipe";
+  app.add_option("-T", transport,
+                 "Transport between perf-script and adaptiveperf-server: "
+                 "pipe, tcp, unix or uring (default: pipe)");
+
+  std::string working_dir = "bench_results";
+  app.add_option("-o", working_dir,
+                 "Directory where adaptiveperf-server should save "
+                 "its results (default: bench_results)");
+
+  unsigned int buf_size = 1024;
+  app.add_option("-b", buf_size,
+                 "Buffer size for communication in bytes (default: 1024)");
+
+  unsigned short port = 5001;
+  app.add_option("-p", port,
+                 "First port to try for the TCP transport (default: 5001)");
+
+  std::vector<unsigned long long> timeline_buckets = {10, 100, 1000};
+  app.add_option("-B", timeline_buckets,
+                 "Comma-separated time bucket sizes in ms of timeline "
+                 "flame graphs, 0 for none (default: 10,100,1000)")
+    ->delimiter(',');
+
+  CLI11_PARSE(app, argc, argv);
+
+  timeline_buckets.erase(std::remove(timeline_buckets.begin(),
+                                     timeline_buckets.end(), 0),
+                         timeline_buckets.end());
+
+  try {
+    std::filesystem::create_directories(working_dir);
+
+    nlohmann::json report = nlohmann::json::array();
+
+    for (auto depth : depths) {
+      for (auto threads : thread_counts) {
+        settings.depth = depth;
+        settings.threads = threads;
+
+        std::vector<std::vector<std::string> > streams =
+          aperf::generate_streams(settings, stream_count);
+
+        aperf::ReplayResult result =
+          aperf::replay_session(streams, transport, working_dir,
+                                "scaling_" + std::to_string(depth) + "_" +
+                                std::to_string(threads),
+                                buf_size, port, timeline_buckets);
+        nlohmann::json summary = aperf::replay_result_to_json(result);
+
+        unsigned long long recurse_ns = summary["recurse_ns"];
+        unsigned long long recurse_time_ordered_ns = summary["recurse_time_ordered_ns"];
+
+        nlohmann::json point;
+        point["depth"] = depth;
+        point["threads"] = threads;
+        point["samples"] = result.samples;
+        point["samples_per_second"] = summary["samples_per_second"];
+        point["aggregated_samples_per_second"] = recurse_ns == 0 ? 0.0 :
+          result.samples * 1e9 / recurse_ns;
+        point["time_ordered_samples_per_second"] = recurse_time_ordered_ns == 0 ? 0.0 :
+          result.samples * 1e9 / recurse_time_ordered_ns;
+        point["line_p99_ns"] = summary["line_p99_ns"];
+        point["timeline_ns"] = summary["timeline_ns"];
+        point["tree_nodes"] = summary["tree_nodes"];
+        point["peak_rss_kb"] = summary["peak_rss_kb"];
+
+        report.push_back(point);
+        std::cerr << "depth " << depth << ", threads " << threads << ": ";
+        std::cerr << point["samples_per_second"] << " samples/s" << std::endl;
+      }
+    }
+
+    std::cout << report.dump(2) << std::endl;
+  } catch (std::exception &e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,245 @@
+// AdaptivePerf: comprehensive profiling tool based on Linux perf
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "socket.hpp"
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <Poco/Net/ServerSocket.h>
+#include <Poco/Net/NetException.h>
+#include <nlohmann/json.hpp>
+#include <CLI/CLI.hpp>
+
+namespace net = Poco::Net;
+
+/**
+   A TCP socket reading with a timeout as TCPSocket did before it
+   switched to poll: by setting the receive timeout of the socket
+   before every read and resetting it afterwards.
+*/
+class SetsockoptTCPSocket : public aperf::TCPSocket {
+public:
+  SetsockoptTCPSocket(net::StreamSocket &sock,
+                      unsigned int buf_size) : TCPSocket(sock, buf_size) { }
+
+  int read(char *buf, unsigned int len, long timeout_seconds) {
+    try {
+      this->socket.setReceiveTimeout(Poco::Timespan(timeout_seconds, 0));
+      int bytes = this->socket.receiveBytes(buf, len);
+      this->socket.setReceiveTimeout(Poco::Timespan());
+      return bytes;
+    } catch (net::NetException &e) {
+      this->socket.setReceiveTimeout(Poco::Timespan());
+      throw aperf::ConnectionException(e);
+    } catch (Poco::TimeoutException &e) {
+      this->socket.setReceiveTimeout(Poco::Timespan());
+      throw aperf::TimeoutException();
+    }
+  }
+};
+
+/**
+   Opens a counter of system calls made by the calling thread, using
+   the raw_syscalls:sys_enter tracepoint.
+
+   Returns -1 if the tracepoint is not available (e.g. tracefs is not
+   mounted or perf_event_paranoid does not allow it).
+*/
+static int open_syscall_counter() {
+  unsigned long long id = 0;
+
+  for (const char *path : {"/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+                           "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id"}) {
+    std::ifstream f(path);
+
+    if (f >> id) {
+      break;
+    }
+  }
+
+  if (id == 0) {
+    return -1;
+  }
+
+  struct perf_event_attr attr;
+  std::memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_TRACEPOINT;
+  attr.size = sizeof(attr);
+  attr.config = id;
+  attr.disabled = 1;
+
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static unsigned long long cpu_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned long long wall_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+   Sends a given number of bytes through a loopback TCP connection
+   and receives them with Connection::read(char *, unsigned int, long),
+   returning the measurements of the receiving end as JSON.
+*/
+static nlohmann::json run(std::string method, unsigned long long total_bytes,
+                          unsigned int chunk_size, unsigned int read_size,
+                          long timeout_seconds) {
+  net::ServerSocket server;
+  server.bind(net::SocketAddress("127.0.0.1", 0), true);
+  server.listen();
+  unsigned short port = server.address().port();
+
+  std::future<void> sender = std::async(std::launch::async, [&]() {
+    net::StreamSocket socket;
+    socket.connect(net::SocketAddress("127.0.0.1", port));
+    std::string chunk(chunk_size, 'x');
+
+    for (unsigned long long sent = 0; sent < total_bytes; sent += chunk_size) {
+      socket.sendBytes(chunk.data(), std::min((unsigned long long)chunk_size,
+                                              total_bytes - sent));
+    }
+
+    socket.close();
+  });
+
+  net::StreamSocket accepted = server.acceptConnection();
+  std::unique_ptr<aperf::Connection> connection;
+
+  if (method == "setsockopt") {
+    connection = std::make_unique<SetsockoptTCPSocket>(accepted, read_size);
+  } else {
+    connection = std::make_unique<aperf::TCPSocket>(accepted, read_size);
+  }
+
+  long timeout = method == "none" ? NO_TIMEOUT : timeout_seconds;
+  std::unique_ptr<char[]> buf(new char[read_size]);
+  unsigned long long bytes_total = 0;
+  unsigned long long reads = 0;
+  int bytes;
+
+  int counter = open_syscall_counter();
+
+  if (counter != -1) {
+    ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+    ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+  }
+
+  unsigned long long start_cpu = cpu_ns();
+  unsigned long long start_wall = wall_ns();
+
+  while ((bytes = connection->read(buf.get(), read_size, timeout)) > 0) {
+    bytes_total += bytes;
+    reads++;
+  }
+
+  unsigned long long used_cpu = cpu_ns() - start_cpu;
+  unsigned long long used_wall = wall_ns() - start_wall;
+  long long syscalls = -1;
+
+  if (counter != -1) {
+    ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+
+    if (::read(counter, &syscalls, sizeof(syscalls)) != sizeof(syscalls)) {
+      syscalls = -1;
+    }
+
+    close(counter);
+  }
+
+  sender.get();
+
+  if (bytes_total != total_bytes) {
+    throw std::runtime_error(method + " has received " +
+                             std::to_string(bytes_total) + " bytes instead of " +
+                             std::to_string(total_bytes) + ".");
+  }
+
+  nlohmann::json result = {
+    {"reads", reads},
+    {"cpu_ns_per_read", (double)used_cpu / reads},
+    {"cpu_ms_per_mb", used_cpu / 1000000.0 / (total_bytes / 1000000.0)},
+    {"mb_per_s", total_bytes / 1000000.0 / (used_wall / 1000000000.0)}
+  };
+
+  if (syscalls == -1) {
+    result["syscalls_per_read"] = nullptr;
+  } else {
+    result["syscalls_per_read"] = (double)syscalls / reads;
+  }
+
+  return result;
+}
+
+/**
+   Entry point to adaptiveperf-bench-socket, measuring the cost of reads
+   with a timeout from TCPSocket (as used e.g. when receiving files) and
+   printing it as JSON.
+
+   The same loopback transfer is received with every method: "none" reads
+   without a timeout (the baseline), "poll" reads with a timeout as
+   TCPSocket does and "setsockopt" reads with a timeout by changing the
+   receive timeout of the socket around every read. For every method, the
+   number of reads, the CPU time of the receiving thread per read and per
+   MB, the throughput and the number of system calls per read are
+   reported. The last one is null if the raw_syscalls:sys_enter tracepoint
+   cannot be used (e.g. without root).
+*/
+int main(int argc, char **argv) {
+  CLI::App app("Socket read benchmark for adaptiveperf-server");
+
+  unsigned long long total_mb = 256;
+  app.add_option("-s", total_mb, "Number of MB to transfer per method (default: 256)");
+
+  unsigned int chunk_size = 4096;
+  app.add_option("-c", chunk_size, "Size of every send in bytes (default: 4096)");
+
+  unsigned int read_size = FILE_BUFFER_SIZE;
+  app.add_option("-b", read_size,
+                 "Size of every read in bytes (default: " +
+                 std::to_string(FILE_BUFFER_SIZE) + ")");
+
+  long timeout_seconds = 5;
+  app.add_option("-t", timeout_seconds,
+                 "Read timeout in seconds for the methods with a timeout (default: 5)");
+
+  std::vector<std::string> methods = {"none", "poll", "setsockopt"};
+  app.add_option("-m", methods,
+                 "Comma-separated methods to test (default: none,poll,setsockopt)")
+    ->delimiter(',');
+
+  CLI11_PARSE(app, argc, argv);
+
+  try {
+    nlohmann::json report;
+    report["bytes"] = total_mb * 1000000;
+
+    for (std::string &method : methods) {
+      if (method != "none" && method != "poll" && method != "setsockopt") {
+        throw std::runtime_error("Unknown method: " + method + ".");
+      }
+
+      report[method] = run(method, total_mb * 1000000, chunk_size,
+                           read_size, timeout_seconds);
+    }
+
+    std::cout << report.dump(2) << std::endl;
+  } catch (std::exception &e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
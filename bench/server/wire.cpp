@@ -0,0 +1,171 @@
+// AdaptivePerf: comprehensive profiling tool based on Linux perf
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "bench.hpp"
+#include "generate.hpp"
+#include "compress.hpp"
+#include <algorithm>
+#include <iostream>
+#include <time.h>
+#include <CLI/CLI.hpp>
+
+static unsigned long long cpu_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+   Entry point to adaptiveperf-bench-wire, measuring the trade-off between
+   throughput and CPU time of the wire compression methods (see
+   CompressedConnection) on sample streams and printing it as JSON.
+
+   Every stream is compressed line by line, as the "perf" Python scripts
+   send it, and decompressed again. For every method, the compression
+   ratio and the CPU time of both ends per MB of input are reported along
+   with the throughput expected on a link of a given speed, i.e. the input
+   bytes divided by the longest of the compression time, the decompression
+   time and the transfer time of the compressed bytes (as the three
+   overlap when streaming). "none" is the uncompressed baseline.
+*/
+int main(int argc, char **argv) {
+  CLI::App app("Wire compression benchmark for adaptiveperf-server");
+
+  std::vector<std::string> stream_paths;
+  app.add_option("STREAMS", stream_paths,
+                 "Stream files to compress (e.g. produced by setting "
+                 "APERF_DUMP_DIR). If none is provided, synthetic streams "
+                 "are generated as by adaptiveperf-bench-generate.");
+
+  std::vector<std::string> methods;
+
+  for (std::string &name : aperf::WireCodec::get_supported()) {
+    int max_level = name == "zstd" ? 19 : 9;
+
+    for (int level : {1, 3, 6, 9, 19}) {
+      if (level <= max_level) {
+        methods.push_back(name + ":" + std::to_string(level));
+      }
+    }
+  }
+
+  app.add_option("-m", methods,
+                 "Comma-separated methods to test as \"<method>:<level>\" "
+                 "(default: levels 1, 3, 6, 9 (and 19 for zstd) of every "
+                 "method compiled in)")
+    ->delimiter(',');
+
+  double link_mbit = 1000;
+  app.add_option("-L", link_mbit,
+                 "Link speed in Mbit/s for the expected throughput (default: 1000)");
+
+  aperf::GeneratorSettings settings;
+  app.add_option("-n", settings.samples,
+                 "Number of samples per thread of synthetic streams (default: 10000)");
+  app.add_option("-d", settings.depth,
+                 "Maximum callchain depth of synthetic streams (default: 32)");
+  app.add_option("-t", settings.threads,
+                 "Number of threads of synthetic streams (default: 4)");
+
+  CLI11_PARSE(app, argc, argv);
+
+  try {
+    std::vector<std::vector<std::string> > streams;
+
+    if (stream_paths.empty()) {
+      streams = aperf::generate_streams(settings, 1);
+    } else {
+      for (auto &path : stream_paths) {
+        streams.push_back(aperf::read_stream_file(path));
+      }
+    }
+
+    unsigned long long raw_bytes = 0;
+
+    for (auto &stream : streams) {
+      for (std::string &line : stream) {
+        line += "\n";
+        raw_bytes += line.size();
+      }
+    }
+
+    double link_bytes_per_ns = link_mbit * 1000000 / 8 / 1000000000;
+    double raw_mb = raw_bytes / 1000000.0;
+
+    nlohmann::json report;
+    report["raw_bytes"] = raw_bytes;
+    report["link_mbit"] = link_mbit;
+    report["none"] = {
+      {"wire_bytes", raw_bytes},
+      {"ratio", 1.0},
+      {"expected_mb_per_s", raw_mb / (raw_bytes / link_bytes_per_ns / 1000000000)}
+    };
+
+    for (std::string &method : methods) {
+      std::string name = method.substr(0, method.find(':'));
+      int level = method.find(':') == std::string::npos ? -1 :
+        std::stoi(method.substr(method.find(':') + 1));
+
+      unsigned long long wire_bytes = 0;
+      unsigned long long compress_ns = 0;
+      unsigned long long decompress_ns = 0;
+
+      for (auto &stream : streams) {
+        std::unique_ptr<aperf::WireCodec> compressor = aperf::WireCodec::make(name, level);
+        std::unique_ptr<aperf::WireCodec> decompressor = aperf::WireCodec::make(name, level);
+        std::string compressed, decompressed;
+
+        unsigned long long start = cpu_ns();
+
+        for (std::string &line : stream) {
+          compressor->compress(line.data(), line.size(),
+                               aperf::WireCodec::NO_FLUSH, compressed);
+        }
+
+        compressor->compress(nullptr, 0, aperf::WireCodec::END, compressed);
+        compress_ns += cpu_ns() - start;
+        wire_bytes += compressed.size();
+
+        start = cpu_ns();
+
+        for (std::size_t pos = 0; pos < compressed.size(); pos += 65536) {
+          decompressor->decompress(compressed.data() + pos,
+                                   std::min((std::size_t)65536, compressed.size() - pos),
+                                   decompressed);
+        }
+
+        decompress_ns += cpu_ns() - start;
+
+        std::size_t expected_size = 0;
+
+        for (std::string &line : stream) {
+          expected_size += line.size();
+        }
+
+        if (decompressed.size() != expected_size) {
+          throw std::runtime_error(method + " has not reproduced the input.");
+        }
+      }
+
+      double bottleneck_ns = std::max({(double)compress_ns, (double)decompress_ns,
+                                       wire_bytes / link_bytes_per_ns});
+
+      report[method] = {
+        {"wire_bytes", wire_bytes},
+        {"ratio", (double)raw_bytes / wire_bytes},
+        {"compress_cpu_ms_per_mb", compress_ns / 1000000.0 / raw_mb},
+        {"decompress_cpu_ms_per_mb", decompress_ns / 1000000.0 / raw_mb},
+        {"compress_mb_per_s", raw_mb / (compress_ns / 1000000000.0)},
+        {"decompress_mb_per_s", raw_mb / (decompress_ns / 1000000000.0)},
+        {"expected_mb_per_s", raw_mb / (bottleneck_ns / 1000000000.0)}
+      };
+    }
+
+    std::cout << report.dump(2) << std::endl;
+  } catch (std::exception &e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
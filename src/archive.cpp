@@ -2,70 +2,217 @@
 // Copyright (C) CERN. See LICENSE for details.
 
 #include "archive.hpp"
-#include <fstream>
+#include <chrono>
+#include <climits>
+#include <deque>
+#include <future>
+#include <regex>
+#include <time.h>
+#include <zlib.h>
+
+// ZIP constants, see the PKWARE APPNOTE
+#define ZIP_LOCAL_HEADER_SIG 0x04034b50
+#define ZIP_CENTRAL_HEADER_SIG 0x02014b50
+#define ZIP_END_SIG 0x06054b50
+#define ZIP64_END_SIG 0x06064b50
+#define ZIP64_LOCATOR_SIG 0x07064b50
+#define ZIP_VERSION 20
+#define ZIP64_VERSION 45
+#define ZIP_FLAG_UTF8 0x0800
+#define ZIP_METHOD_STORE 0
+#define ZIP_METHOD_DEFLATE 8
+#define ZIP_MAX_16 0xffffULL
+#define ZIP_MAX_32 0xffffffffULL
+
+// The maximum number of bytes passed to a single zlib or Connection call
+#define ARCHIVE_MAX_CHUNK (1U << 30)
 
 namespace aperf {
-  Archive::Archive(fs::path path, unsigned int buf_size) {
+  static unsigned long long now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  static void put16(std::string &buf, unsigned int value) {
+    buf.push_back(value & 0xff);
+    buf.push_back((value >> 8) & 0xff);
+  }
+
+  static void put32(std::string &buf, unsigned long long value) {
+    put16(buf, value & 0xffff);
+    put16(buf, (value >> 16) & 0xffff);
+  }
+
+  static void put64(std::string &buf, unsigned long long value) {
+    put32(buf, value & 0xffffffff);
+    put32(buf, value >> 32);
+  }
+
+  /**
+     Parses the compression method, sets up libarchive if the method
+     needs it, and initialises the state of the ZIP writer (internal method).
+
+     The level is set to -1 for "store", to the deflate level for "deflate",
+     and to 0 if libarchive is used (i.e. this->arch is not null then).
+
+     @param compression See the Archive constructors.
+  */
+  void Archive::init(std::string compression) {
     this->arch = nullptr;
     this->arch_entry = nullptr;
-    this->buf_size = buf_size;
+    this->closed = false;
+    this->offset = 0;
+    this->entry_count = 0;
 
-    if (fs::exists(path)) {
-      throw Archive::FileExistsException();
+    if (compression.empty()) {
+      compression = ARCHIVE_DEFAULT_COMPRESSION;
     }
 
-    this->arch = archive_write_new();
+    std::smatch match;
 
-    if (!this->arch) {
-      throw Archive::InitException();
+    if (!std::regex_match(compression, match,
+                          std::regex("^(store|deflate|zstd)(?:\\:(\\d{1,2}))?$"))) {
+      throw Archive::CompressionException("Unknown compression method, it must be "
+                                          "\"store\", \"deflate[:<level>]\", or "
+                                          "\"zstd[:<level>]\".");
     }
 
-    this->arch_entry = archive_entry_new();
+    std::string method = match[1];
+    bool level_set = match[2].matched;
+    int level = level_set ? std::stoi(match[2]) : -1;
 
-    if (!this->arch_entry) {
-      throw Archive::InitException();
+    if (method == "store") {
+      if (level_set) {
+        throw Archive::CompressionException("\"store\" does not accept a level.");
+      }
+
+      this->level = -1;
+    } else if (method == "deflate") {
+      if (level_set && level > 9) {
+        throw Archive::CompressionException("The deflate level must be between 0 and 9.");
+      }
+
+      this->level = level_set ? level : 9;
+    } else {
+      if (level_set && (level < 1 || level > 22)) {
+        throw Archive::CompressionException("The zstd level must be between 1 and 22.");
+      }
+
+      this->level = 0;
+      this->arch = archive_write_new();
+
+      if (!this->arch) {
+        throw Archive::InitException();
+      }
+
+      this->arch_entry = archive_entry_new();
+
+      if (!this->arch_entry) {
+        this->free_arch();
+        throw Archive::InitException();
+      }
+
+      if (archive_write_set_format_zip(this->arch) != ARCHIVE_OK) {
+        this->free_arch();
+        throw Archive::InitException();
+      }
+
+      std::string options = "zip:compression=zstd";
+
+      if (level_set) {
+        options += ",zip:compression-level=" + std::to_string(level);
+      }
+
+      if (archive_write_set_options(this->arch, options.c_str()) != ARCHIVE_OK) {
+        this->free_arch();
+        throw Archive::CompressionException("zstd is not supported in ZIP files by "
+                                            "the installed libarchive.");
+      }
     }
 
-    if (archive_write_set_format_zip(this->arch) != ARCHIVE_OK) {
-      throw Archive::InitException();
+    time_t now = time(nullptr);
+    struct tm local;
+    localtime_r(&now, &local);
+
+    if (local.tm_year < 80) {
+      this->dos_time = 0;
+      this->dos_date = (1 << 5) | 1;
+    } else {
+      this->dos_time = (local.tm_hour << 11) | (local.tm_min << 5) | (local.tm_sec / 2);
+      this->dos_date = ((local.tm_year - 80) << 9) | ((local.tm_mon + 1) << 5) | local.tm_mday;
     }
+  }
 
-    if (archive_write_set_options(this->arch, "compression-level=9") !=
-        ARCHIVE_OK) {
-      throw Archive::InitException();
+  /**
+     Frees the libarchive objects if there are any (internal method).
+
+     The constructors call this before throwing an exception, as the
+     destructor is not run then.
+  */
+  void Archive::free_arch() {
+    if (this->arch_entry) {
+      archive_entry_free(this->arch_entry);
+      this->arch_entry = nullptr;
     }
 
-    if (archive_write_open_filename(this->arch, path.c_str()) != ARCHIVE_OK) {
-      throw Archive::FileOpenException(this->arch);
+    if (this->arch) {
+      archive_write_free(this->arch);
+      this->arch = nullptr;
     }
   }
 
-  Archive::Archive(std::unique_ptr<Connection> &conn, bool padding,
-                   unsigned int buf_size) {
+  bool Archive::is_zstd_supported() {
+    struct archive *arch = archive_write_new();
+
+    if (!arch) {
+      return false;
+    }
+
+    bool supported = archive_write_set_format_zip(arch) == ARCHIVE_OK &&
+      archive_write_set_options(arch, "zip:compression=zstd") == ARCHIVE_OK;
+
+    archive_write_free(arch);
+    return supported;
+  }
+
+  Archive::Archive(fs::path path, unsigned int buf_size,
+                   std::string compression) {
     this->arch = nullptr;
     this->arch_entry = nullptr;
     this->buf_size = buf_size;
-    this->conn = std::move(conn);
-
-    this->arch = archive_write_new();
 
-    if (!this->arch) {
-      throw Archive::InitException();
+    if (fs::exists(path)) {
+      throw Archive::FileExistsException();
     }
 
-    this->arch_entry = archive_entry_new();
+    this->init(compression);
 
-    if (!this->arch_entry) {
-      throw Archive::InitException();
-    }
+    if (this->arch) {
+      if (archive_write_open_filename(this->arch, path.c_str()) != ARCHIVE_OK) {
+        Archive::FileOpenException e(this->arch);
+        this->free_arch();
+        throw e;
+      }
+    } else {
+      this->file.open(path, std::ios::binary);
 
-    if (archive_write_set_format_zip(this->arch) != ARCHIVE_OK) {
-      throw Archive::InitException();
+      if (!this->file) {
+        throw Archive::FileOpenException();
+      }
     }
+  }
 
-    if (archive_write_set_options(this->arch, "compression-level=9") !=
-        ARCHIVE_OK) {
-      throw Archive::InitException();
+  Archive::Archive(std::unique_ptr<Connection> &conn, bool padding,
+                   unsigned int buf_size, std::string compression) {
+    this->arch = nullptr;
+    this->arch_entry = nullptr;
+    this->buf_size = buf_size;
+    this->conn = std::move(conn);
+
+    this->init(compression);
+
+    if (!this->arch) {
+      return;
     }
 
     auto archive_open_padding =
@@ -101,15 +248,233 @@ namespace aperf {
                             archive_write,
                             archive_return_ok,
                             archive_return_ok) != ARCHIVE_OK) {
-      throw Archive::FileOpenException(this->arch);
+      Archive::FileOpenException e(this->arch);
+      this->free_arch();
+      throw e;
+    }
+  }
+
+  /**
+     Writes raw bytes to the archive file or the connection (internal method).
+
+     @param buf The bytes to write.
+     @param len The number of bytes to write.
+  */
+  void Archive::write_bytes(const char *buf, unsigned long long len) {
+    this->offset += len;
+
+    if (this->conn) {
+      while (len > 0) {
+        unsigned int to_write = std::min(len, (unsigned long long)ARCHIVE_MAX_CHUNK);
+
+        try {
+          this->conn->write(to_write, (char *)buf);
+        } catch (std::exception &e) {
+          throw Archive::FileIOException();
+        }
+
+        buf += to_write;
+        len -= to_write;
+      }
+    } else {
+      this->file.write(buf, len);
+
+      if (!this->file) {
+        throw Archive::FileIOException();
+      }
+    }
+  }
+
+  /**
+     Reads a file to be added to the archive into an entry (internal method).
+
+     @param e    The entry where the file content should be stored.
+     @param path The path to the file.
+  */
+  void Archive::read_entry(entry &e, fs::path path) {
+    if (!fs::exists(path)) {
+      throw Archive::FileDoesNotExistException();
+    }
+
+    if (!fs::is_regular_file(path)) {
+      throw Archive::NotRegularFileException();
+    }
+
+    std::ifstream stream(path, std::ios::binary);
+
+    if (!stream) {
+      throw Archive::FileOpenException();
+    }
+
+    e.data.resize(fs::file_size(path));
+    stream.read(e.data.data(), e.data.size());
+
+    if (stream.bad() || (unsigned long long)stream.gcount() != e.data.size()) {
+      throw Archive::FileIOException();
     }
   }
 
+  /**
+     Computes the CRC-32 of an entry and compresses its content in place,
+     keeping it uncompressed if deflate does not make it smaller
+     (internal method).
+
+     This can be called by multiple threads at the same time for
+     different entries.
+
+     @param e     The entry with the uncompressed content.
+     @param level The deflate level or -1 for no compression.
+  */
+  void Archive::compress_entry(entry &e, int level) {
+    e.size = e.data.size();
+    e.crc = crc32_z(0, (const Bytef *)e.data.data(), e.data.size());
+    e.deflated = false;
+
+    if (level < 0 || e.data.empty()) {
+      return;
+    }
+
+    z_stream strm;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+
+    if (deflateInit2(&strm, level, Z_DEFLATED, -MAX_WBITS, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+      throw Archive::InitException();
+    }
+
+    std::string compressed;
+    compressed.resize(deflateBound(&strm, e.data.size()));
+
+    unsigned long long in_size = e.data.size(), out_size = compressed.size();
+    unsigned long long in_pos = 0, out_pos = 0;
+    int ret = Z_OK;
+
+    // deflateBound() guarantees enough output space, so every call
+    // either makes progress or finishes the stream
+    while (ret == Z_OK) {
+      unsigned int avail_in = std::min(in_size - in_pos, (unsigned long long)ARCHIVE_MAX_CHUNK);
+      unsigned int avail_out = std::min(out_size - out_pos, (unsigned long long)ARCHIVE_MAX_CHUNK);
+
+      strm.next_in = (Bytef *)e.data.data() + in_pos;
+      strm.avail_in = avail_in;
+      strm.next_out = (Bytef *)compressed.data() + out_pos;
+      strm.avail_out = avail_out;
+
+      ret = deflate(&strm, in_pos + avail_in == in_size ? Z_FINISH : Z_NO_FLUSH);
+
+      in_pos += avail_in - strm.avail_in;
+      out_pos += avail_out - strm.avail_out;
+    }
+
+    deflateEnd(&strm);
+
+    if (ret != Z_STREAM_END) {
+      throw Archive::FileIOException();
+    }
+
+    if (out_pos < e.data.size()) {
+      compressed.resize(out_pos);
+      e.data = std::move(compressed);
+      e.deflated = true;
+    }
+  }
+
+  /**
+     Writes a compressed entry to the archive as a local file header followed
+     by the entry data and records it for the central directory (internal method).
+
+     @param e The entry after compress_entry().
+  */
+  void Archive::write_entry(entry &e) {
+    unsigned long long csize = e.data.size();
+    bool zip64_sizes = e.size >= ZIP_MAX_32 || csize >= ZIP_MAX_32;
+    bool zip64_offset = this->offset >= ZIP_MAX_32;
+    unsigned int method = e.deflated ? ZIP_METHOD_DEFLATE : ZIP_METHOD_STORE;
+    unsigned int version = zip64_sizes || zip64_offset ? ZIP64_VERSION : ZIP_VERSION;
+
+    if (e.name.size() > ZIP_MAX_16) {
+      throw Archive::FileIOException();
+    }
+
+    std::string header;
+    put32(header, ZIP_LOCAL_HEADER_SIG);
+    put16(header, version);
+    put16(header, ZIP_FLAG_UTF8);
+    put16(header, method);
+    put16(header, this->dos_time);
+    put16(header, this->dos_date);
+    put32(header, e.crc);
+    put32(header, zip64_sizes ? ZIP_MAX_32 : csize);
+    put32(header, zip64_sizes ? ZIP_MAX_32 : e.size);
+    put16(header, e.name.size());
+    put16(header, zip64_sizes ? 20 : 0);
+    header += e.name;
+
+    if (zip64_sizes) {
+      put16(header, 0x0001);
+      put16(header, 16);
+      put64(header, e.size);
+      put64(header, csize);
+    }
+
+    std::string extra;
+
+    if (zip64_sizes || zip64_offset) {
+      put16(extra, 0x0001);
+      put16(extra, (zip64_sizes ? 16 : 0) + (zip64_offset ? 8 : 0));
+
+      if (zip64_sizes) {
+        put64(extra, e.size);
+        put64(extra, csize);
+      }
+
+      if (zip64_offset) {
+        put64(extra, this->offset);
+      }
+    }
+
+    std::string &central = this->central_dir;
+    put32(central, ZIP_CENTRAL_HEADER_SIG);
+    put16(central, (3 << 8) | ZIP64_VERSION);
+    put16(central, version);
+    put16(central, ZIP_FLAG_UTF8);
+    put16(central, method);
+    put16(central, this->dos_time);
+    put16(central, this->dos_date);
+    put32(central, e.crc);
+    put32(central, zip64_sizes ? ZIP_MAX_32 : csize);
+    put32(central, zip64_sizes ? ZIP_MAX_32 : e.size);
+    put16(central, e.name.size());
+    put16(central, extra.size());
+    put16(central, 0);
+    put16(central, 0);
+    put16(central, 0);
+    put32(central, 0100644ULL << 16);
+    put32(central, zip64_offset ? ZIP_MAX_32 : this->offset);
+    central += e.name;
+    central += extra;
+
+    this->write_bytes(header.data(), header.size());
+    this->write_bytes(e.data.data(), e.data.size());
+    this->entry_count++;
+  }
+
   void Archive::add_file(std::string filename, fs::path path) {
-    if (!this->arch) {
+    if (this->closed) {
       throw Archive::AlreadyClosedException();
     }
 
+    if (!this->arch) {
+      entry e;
+      e.name = filename;
+      read_entry(e, path);
+      compress_entry(e, this->level);
+      this->write_entry(e);
+      return;
+    }
+
     if (!fs::exists(path)) {
       throw Archive::FileDoesNotExistException();
     }
@@ -161,12 +526,111 @@ namespace aperf {
     }
   }
 
+  Archive::Stats Archive::add_files(std::vector<std::pair<std::string, fs::path> > &files,
+                                    unsigned int threads) {
+    if (this->closed) {
+      throw Archive::AlreadyClosedException();
+    }
+
+    Stats stats;
+    unsigned long long start = now_ns();
+
+    stats.files = files.size();
+
+    if (this->arch) {
+      // libarchive compresses entries sequentially inside its writer
+      for (auto &file : files) {
+        this->add_file(file.first, file.second);
+        stats.bytes_in += fs::file_size(file.second);
+      }
+
+      stats.write_ns = now_ns() - start;
+      stats.total_ns = stats.write_ns;
+      return stats;
+    }
+
+    stats.threads = std::max(threads, 1U);
+
+    int level = this->level;
+    unsigned long long start_offset = this->offset;
+
+    auto process = [level](std::string name, fs::path path) {
+      entry e;
+      e.name = name;
+
+      unsigned long long read_start = now_ns();
+      read_entry(e, path);
+      unsigned long long compress_start = now_ns();
+      compress_entry(e, level);
+
+      e.read_ns = compress_start - read_start;
+      e.compress_ns = now_ns() - compress_start;
+      return e;
+    };
+
+    // At most two entries per thread are in flight so that the memory
+    // usage is bounded regardless of the number of files
+    std::deque<std::future<entry> > pending;
+
+    auto write_front = [&]() {
+      entry e = pending.front().get();
+      pending.pop_front();
+
+      unsigned long long write_start = now_ns();
+      this->write_entry(e);
+      stats.write_ns += now_ns() - write_start;
+
+      stats.bytes_in += e.size;
+      stats.read_ns += e.read_ns;
+      stats.compress_ns += e.compress_ns;
+    };
+
+    for (auto &file : files) {
+      if (pending.size() >= 2 * stats.threads) {
+        write_front();
+      }
+
+      if (stats.threads == 1) {
+        std::promise<entry> result;
+        result.set_value(process(file.first, file.second));
+        pending.push_back(result.get_future());
+      } else {
+        pending.push_back(std::async(std::launch::async, process,
+                                     file.first, file.second));
+      }
+    }
+
+    while (!pending.empty()) {
+      write_front();
+    }
+
+    stats.bytes_out = this->offset - start_offset;
+    stats.total_ns = now_ns() - start;
+    return stats;
+  }
+
   void Archive::add_file_stream(std::string filename, std::istream &stream,
                                 unsigned int size) {
-    if (!this->arch) {
+    if (this->closed) {
       throw Archive::AlreadyClosedException();
     }
 
+    if (!this->arch) {
+      entry e;
+      e.name = filename;
+      e.data.resize(size);
+      stream.read(e.data.data(), size);
+
+      if (stream.bad()) {
+        throw Archive::FileIOException();
+      }
+
+      // The rest of data is already padded with zeroes by resize()
+      compress_entry(e, this->level);
+      this->write_entry(e);
+      return;
+    }
+
     archive_entry_clear(this->arch_entry);
 
     archive_entry_set_pathname(this->arch_entry, filename.c_str());
@@ -229,6 +693,12 @@ namespace aperf {
   }
 
   void Archive::close() {
+    if (this->closed) {
+      return;
+    }
+
+    this->closed = true;
+
     if (this->arch) {
       if (archive_write_close(this->arch) != ARCHIVE_OK) {
         throw Archive::CloseException(this->arch);
@@ -237,16 +707,64 @@ namespace aperf {
       archive_write_free(this->arch);
 
       this->arch = nullptr;
+      return;
     }
-  }
 
-  Archive::~Archive() {
-    if (this->arch_entry) {
-      archive_entry_free(this->arch_entry);
+    unsigned long long cd_offset = this->offset;
+    unsigned long long cd_size = this->central_dir.size();
+    std::string end;
+
+    if (this->entry_count >= ZIP_MAX_16 || cd_offset >= ZIP_MAX_32 ||
+        cd_size >= ZIP_MAX_32) {
+      unsigned long long zip64_end_offset = cd_offset + cd_size;
+
+      put32(end, ZIP64_END_SIG);
+      put64(end, 44);
+      put16(end, (3 << 8) | ZIP64_VERSION);
+      put16(end, ZIP64_VERSION);
+      put32(end, 0);
+      put32(end, 0);
+      put64(end, this->entry_count);
+      put64(end, this->entry_count);
+      put64(end, cd_size);
+      put64(end, cd_offset);
+
+      put32(end, ZIP64_LOCATOR_SIG);
+      put32(end, 0);
+      put64(end, zip64_end_offset);
+      put32(end, 1);
+    }
+
+    put32(end, ZIP_END_SIG);
+    put16(end, 0);
+    put16(end, 0);
+    put16(end, std::min(this->entry_count, ZIP_MAX_16));
+    put16(end, std::min(this->entry_count, ZIP_MAX_16));
+    put32(end, std::min(cd_size, ZIP_MAX_32));
+    put32(end, std::min(cd_offset, ZIP_MAX_32));
+    put16(end, 0);
+
+    this->write_bytes(this->central_dir.data(), cd_size);
+    this->write_bytes(end.data(), end.size());
+    this->central_dir.clear();
+
+    if (this->file.is_open()) {
+      this->file.close();
+
+      if (!this->file) {
+        throw Archive::CloseException();
+      }
     }
+  }
 
+  Archive::~Archive() {
     if (this->arch) {
-      archive_write_free(this->arch);
+      this->free_arch();
+    } else if (!this->closed) {
+      // Mirror libarchive, which finishes the archive when freed
+      try {
+        this->close();
+      } catch (...) { }
     }
   }
 };
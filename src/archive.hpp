@@ -6,22 +6,77 @@
 
 #include "server/socket.hpp"
 #include <filesystem>
+#include <fstream>
 #include <istream>
+#include <string>
+#include <vector>
 #include <archive.h>
 #include <archive_entry.h>
 
+#define ARCHIVE_DEFAULT_COMPRESSION "deflate:9"
+
 namespace aperf {
   namespace fs = std::filesystem;
 
   /**
-     A class describing an archive file to be written to.
+     A class describing a ZIP archive file to be written to.
+
+     Entries compressed with "store" or "deflate" are encoded by zlib and
+     laid out by the class itself, which allows add_files() to compress
+     them in parallel while writing them in order. Other compression
+     methods (i.e. "zstd") are handled by libarchive sequentially and only
+     if the installed libarchive supports them in ZIP files.
   */
   class Archive {
+  public:
+    /**
+       A structure describing the statistics of adding files
+       to the archive with add_files().
+
+       read_ns and compress_ns are summed over all threads, so they
+       can be larger than total_ns.
+    */
+    struct Stats {
+      unsigned long long files = 0;
+      unsigned long long bytes_in = 0;
+      unsigned long long bytes_out = 0;
+      unsigned long long read_ns = 0;
+      unsigned long long compress_ns = 0;
+      unsigned long long write_ns = 0;
+      unsigned long long total_ns = 0;
+      unsigned int threads = 1;
+    };
+
   private:
+    struct entry {
+      std::string name;
+      std::string data;
+      unsigned long long size;
+      unsigned int crc;
+      bool deflated;
+      unsigned long long read_ns;
+      unsigned long long compress_ns;
+    };
+
     struct archive *arch;
     struct archive_entry *arch_entry;
     unsigned int buf_size;
     std::unique_ptr<Connection> conn;
+    std::ofstream file;
+    bool closed;
+    int level;
+    unsigned long long offset;
+    unsigned long long entry_count;
+    std::string central_dir;
+    unsigned short dos_time;
+    unsigned short dos_date;
+
+    void init(std::string compression);
+    void free_arch();
+    void write_bytes(const char *buf, unsigned long long len);
+    void write_entry(entry &e);
+    static void compress_entry(entry &e, int level);
+    static void read_entry(entry &e, fs::path path);
 
   public:
     /**
@@ -32,11 +87,16 @@ namespace aperf {
        have been written. Therefore, you should explicitly call close()
        (which may throw an exception) before the object goes out of scope.
 
-       @param path     The path to an archive file to be created. The file
-                       must not exist yet.
-       @param buf_size A number of bytes of the internal buffers.
+       @param path        The path to an archive file to be created. The file
+                          must not exist yet.
+       @param buf_size    A number of bytes of the internal buffers.
+       @param compression The compression method of the entries in form of
+                          "store", "deflate[:<level 0-9>]", or
+                          "zstd[:<level 1-22>]". An empty string means
+                          ARCHIVE_DEFAULT_COMPRESSION.
     */
-    Archive(fs::path path, unsigned int buf_size = 1024);
+    Archive(fs::path path, unsigned int buf_size = 1024,
+            std::string compression = ARCHIVE_DEFAULT_COMPRESSION);
 
     /**
        Constructs an Archive object with all archive file data to be sent
@@ -47,15 +107,27 @@ namespace aperf {
        Therefore, you *DO NOT* need to call close() before the object goes out of
        scope or anywhere else.
 
-       @param conn     A Connection object which all archive file data
-                       will be sent through.
-       @param padding  Whether padding is allowed to be added to the last block
-                       of the archive file data if necessary. If you are not
-                       sure, this should be set to true (default).
-       @param buf_size A number of bytes of the internal buffers.
+       @param conn        A Connection object which all archive file data
+                          will be sent through.
+       @param padding     Whether padding is allowed to be added to the last block
+                          of the archive file data if necessary. If you are not
+                          sure, this should be set to true (default). It has
+                          no effect for "store" and "deflate", which never
+                          add padding.
+       @param buf_size    A number of bytes of the internal buffers.
+       @param compression The compression method of the entries (see the
+                          other constructor).
     */
     Archive(std::unique_ptr<Connection> &conn, bool padding = true,
-            unsigned int buf_size = 1024);
+            unsigned int buf_size = 1024,
+            std::string compression = ARCHIVE_DEFAULT_COMPRESSION);
+
+    /**
+       Checks whether the installed libarchive supports zstd compression
+       in ZIP files, i.e. whether "zstd[:<level>]" can be used as the
+       compression method.
+    */
+    static bool is_zstd_supported();
 
     /**
        Adds a file to the root of the archive file.
@@ -66,6 +138,23 @@ namespace aperf {
     */
     void add_file(std::string filename, fs::path path);
 
+    /**
+       Adds files to the root of the archive file in the given order,
+       reading and compressing up to a given number of them at the same
+       time while a single writer stores them in order.
+
+       The resulting archive file is the same regardless of the number
+       of threads.
+
+       @param files   The list of (name inside the archive, path) pairs
+                      of files to be added. The same restrictions as
+                      in add_file() apply.
+       @param threads The maximum number of files read and compressed
+                      concurrently. 0 is treated as 1.
+    */
+    Stats add_files(std::vector<std::pair<std::string, fs::path> > &files,
+                    unsigned int threads);
+
     /**
        Saves data extracted from a stream to the root of the archive file
        as a regular file.
@@ -89,19 +178,26 @@ namespace aperf {
 
     class Exception : public std::exception {
     private:
-      const char *message;
+      // The message is copied as the error string of libarchive is
+      // freed along with the archive object.
+      std::string message;
 
     public:
       Exception(struct archive *arch) {
-        this->message = archive_error_string(arch);
+        const char *message = archive_error_string(arch);
+        this->message = message ? message : typeid(*this).name();
       }
 
       Exception() {
         this->message = typeid(*this).name();
       }
 
+      Exception(const char *message) {
+        this->message = message;
+      }
+
       const char *what() const noexcept override {
-        return this->message;
+        return this->message.c_str();
       }
     };
 
@@ -113,6 +209,7 @@ namespace aperf {
     class AlreadyClosedException : public Exception { using Exception::Exception; };
     class FileDoesNotExistException : public Exception { using Exception::Exception; };
     class NotRegularFileException : public Exception { using Exception::Exception; };
+    class CompressionException : public Exception { using Exception::Exception; };
   };
 };
 
@@ -3,21 +3,26 @@
 
 #include "archive.hpp"
 #include <unordered_set>
+#include <vector>
 #include <filesystem>
 #include <nlohmann/json.hpp>
 
 namespace aperf {
-  void create_src_archive(Archive &archive,
-                          std::unordered_set<fs::path> &src_paths,
-                          bool close) {
+  Archive::Stats create_src_archive(Archive &archive,
+                                    std::unordered_set<fs::path> &src_paths,
+                                    bool close, unsigned int threads = 1) {
     nlohmann::json src_mapping = nlohmann::json::object();
+    std::vector<std::pair<std::string, fs::path> > files;
+
     for (const fs::path &path : src_paths) {
       std::string filename =
         std::to_string(src_mapping.size()) + path.extension().string();
       src_mapping[path.string()] = filename;
-      archive.add_file(filename, path);
+      files.push_back(std::make_pair(filename, path));
     }
 
+    Archive::Stats stats = archive.add_files(files, threads);
+
     std::string src_mapping_str = nlohmann::to_string(src_mapping) + '\n';
     std::stringstream s;
     s << src_mapping_str;
@@ -26,6 +31,19 @@ namespace aperf {
     if (close) {
       archive.close();
     }
+
+    return stats;
+  }
+
+  std::string format_archive_stats(Archive::Stats &stats) {
+    return std::to_string(stats.files) + " files, " +
+      std::to_string(stats.bytes_in) + " -> " +
+      std::to_string(stats.bytes_out) + " bytes in " +
+      std::to_string(stats.total_ns / 1000000) + " ms (" +
+      std::to_string(stats.threads) + " threads; reading " +
+      std::to_string(stats.read_ns / 1000000) + " ms, compression " +
+      std::to_string(stats.compress_ns / 1000000) + " ms, writing " +
+      std::to_string(stats.write_ns / 1000000) + " ms)";
   }
 };
 
@@ -5,10 +5,12 @@
 #include "print.hpp"
 #include "profiling.hpp"
 #include "profilers.hpp"
+#include "archive.hpp"
 #include "server/socket.hpp"
 #include "cmd.hpp"
 #include <boost/algorithm/string.hpp>
 #include <boost/program_options/parsers.hpp>
+#include <functional>
 #include <regex>
 #include <sys/wait.h>
 
@@ -41,11 +43,445 @@ namespace aperf {
     }
   };
 
+  /**
+     Reads the path to the patched "perf" executable from the
+     AdaptivePerf config file, printing an error if it cannot be
+     determined (internal function).
+
+     Returns 0 on success and 2 otherwise.
+
+     @param perf_path The path where the result should be stored.
+  */
+  static int read_perf_path(fs::path &perf_path) {
+    print("Reading config file...", false, false);
+    std::ifstream config_f(APERF_CONFIG_FILE);
+
+    if (!config_f) {
+      print("Cannot open " APERF_CONFIG_FILE "!", true, true);
+      return 2;
+    }
+
+    std::unordered_map<std::string, std::string> config;
+    int cur_line = 1;
+
+    while (config_f) {
+      std::string line;
+      std::getline(config_f, line);
+
+      if (line.empty() || line[0] == '#') {
+        cur_line++;
+        continue;
+      }
+
+      std::smatch match;
+
+      if (!std::regex_match(line, match,
+                            std::regex("^(\\S+)\\s*\\=\\s*(.+)$"))) {
+        print("Syntax error in line " + std::to_string(cur_line) + " of "
+              APERF_CONFIG_FILE "!", true, true);
+        return 2;
+      }
+
+      config[match[1]] = match[2];
+      cur_line++;
+    }
+
+    if (config.find("perf_path") == config.end()) {
+      print("You must specify the path to your patched \"perf\" installation "
+            "(perf_path) in " APERF_CONFIG_FILE "!", true, true);
+      return 2;
+    }
+
+    perf_path = fs::path(config["perf_path"]) / "bin" / "perf";
+
+    if (!fs::exists(perf_path)) {
+      print(perf_path.string() + " does not exist!", true, true);
+      print("Hint: You may want to verify the contents of " APERF_CONFIG_FILE ".",
+            false, true);
+      return 2;
+    }
+
+    if (!fs::is_regular_file(perf_path)) {
+      print(perf_path.string() + " is not a regular file!", true, true);
+      print("Hint: You may want to verify the contents of " APERF_CONFIG_FILE ".",
+            false, true);
+      return 2;
+    }
+
+    return 0;
+  }
+
+  /**
+     Constructs the profilers used by AdaptivePerf (internal function).
+
+     Returns the dictionary of extra perf events, mapping their names
+     to their website titles.
+
+     @param profilers      The list where the profilers should be stored.
+     @param perf_path      The path to the patched "perf" executable.
+     @param cpu_config     A CPUConfig object describing what cores
+                           the profilers should run on.
+     @param profiler_info  The profiler options in JSON: "freq",
+                           "off_cpu_freq", "buffer", "off_cpu_buffer",
+                           and "events" (a list of EVENT,PERIOD,TITLE
+                           strings as accepted by -e).
+     @param server_buffer  The communication buffer size in bytes for
+                           the profiler connections to
+                           adaptiveperf-server.
+     @param chunks         The number of time chunks a recording should be
+                           split into (see Profiler::set_chunk()). Every
+                           profiler except the thread tree one is
+                           constructed once per chunk.
+     @param start_time     The timestamp in ns where the second chunk
+                           begins at the earliest, i.e. the profile start.
+     @param end_time       The timestamp in ns where the last chunk begins
+                           at the latest, i.e. the profile end.
+  */
+  static std::unordered_map<std::string, std::string>
+  make_profilers(std::vector<std::unique_ptr<Profiler> > &profilers,
+                 fs::path perf_path, CPUConfig &cpu_config,
+                 nlohmann::json &profiler_info,
+                 unsigned int server_buffer,
+                 unsigned int chunks = 1,
+                 unsigned long long start_time = 0,
+                 unsigned long long end_time = 0) {
+    // Chunks split the time between start_time and end_time equally,
+    // with the first and last ones extended to everything before and
+    // after, and they are added in their chronological order.
+    auto add_chunked = [&](PerfEvent &event, std::string name) {
+      if (chunks == 1) {
+        profilers.push_back(std::make_unique<Perf>(perf_path, event, cpu_config, name));
+        return;
+      }
+
+      for (unsigned int i = 0; i < chunks; i++) {
+        profilers.push_back(std::make_unique<Perf>(perf_path, event, cpu_config,
+                                                   name + " (chunk " +
+                                                   std::to_string(i + 1) + "/" +
+                                                   std::to_string(chunks) + ")"));
+
+        unsigned long long from = i == 0 ? 0 :
+          start_time + (end_time - start_time) * i / chunks;
+        unsigned long long to = i == chunks - 1 ? 0 :
+          start_time + (end_time - start_time) * (i + 1) / chunks;
+
+        profilers.back()->set_chunk(i, chunks, from, to);
+      }
+    };
+
+    unsigned int buffer = profiler_info["buffer"].get<unsigned int>();
+
+    PerfEvent main(profiler_info["freq"].get<unsigned int>(),
+                   profiler_info["off_cpu_freq"].get<int>(), buffer,
+                   profiler_info["off_cpu_buffer"].get<unsigned int>());
+    PerfEvent syscall_tree;
+
+    profilers.push_back(std::make_unique<Perf>(perf_path, syscall_tree, cpu_config,
+                                               "Thread tree profiler"));
+    add_chunked(main, "On-CPU/Off-CPU profiler");
+
+    std::unordered_map<std::string, std::string> event_dict;
+
+    for (auto &elem : profiler_info["events"]) {
+      std::string event_str = elem.get<std::string>();
+      std::vector<std::string> parts;
+      boost::split(parts, event_str, boost::is_any_of(","));
+
+      std::string event_name = parts[0];
+      int period = std::stoi(parts[1]);
+      std::string website_title = parts[2];
+
+      PerfEvent event(event_name, period, buffer);
+      add_chunked(event, event_name);
+
+      event_dict[event_name] = website_title;
+    }
+
+    PipeAcceptor::Factory generic_acceptor_factory;
+
+    for (int i = 0; i < profilers.size(); i++) {
+      std::unique_ptr<Acceptor> acceptor =
+        generic_acceptor_factory.make_acceptor(1);
+      profilers[i]->set_acceptor(acceptor, server_buffer);
+    }
+
+    return event_dict;
+  }
+
+  /**
+     Runs a session of the frontend in a fresh temporary directory,
+     handling its errors and terminating the children it has left
+     running (internal function).
+
+     Returns the exit code of the session.
+
+     @param session    The session to be run, called with the temporary
+                       directory and the list where the PIDs of spawned
+                       children should be stored. It should return 0 on
+                       success, 1 when the profiling requirements are not
+                       met, and another non-zero exit code otherwise.
+     @param start_time The time in ms since the epoch when the frontend
+                       has started.
+     @param done_msg   The message printed after the total time
+                       on success.
+  */
+  static int run_session(std::function<int(fs::path,
+                                           std::vector<pid_t> &)> session,
+                         long start_time, std::string done_msg) {
+    pid_t current_pid = getpid();
+    fs::path tmp_dir = fs::temp_directory_path() /
+      ("adaptiveperf.pid." + std::to_string(current_pid));
+
+    if (fs::exists(tmp_dir)) {
+      fs::remove_all(tmp_dir);
+    }
+
+    std::vector<pid_t> spawned_children;
+    int to_return = 0;
+
+    try {
+      int code = session(tmp_dir, spawned_children);
+
+      auto end_time =
+        ch::duration_cast<ch::milliseconds>(ch::system_clock::now().time_since_epoch()).count();
+
+      if (code == 0) {
+        fs::remove_all(tmp_dir);
+
+        print("Done in " + std::to_string(end_time - start_time) + " ms in total! " +
+              done_msg, false, false);
+      } else if (code != 1) {
+        print("For investigating what has gone wrong, you can check the files created in " +
+              tmp_dir.string() + ".", false, true);
+      }
+
+      to_return = code;
+    } catch (ConnectionException &e) {
+      print("I/O error has occurred! Exiting.", false, true);
+      print("Details: " + std::string(e.what()), false, true);
+      print("For investigating what has gone wrong, you can check the files created in " +
+            tmp_dir.string() + ".", false, true);
+
+      to_return = 2;
+    } catch (std::exception &e) {
+      print("A fatal error has occurred! If the issue persits, "
+            "please contact the AdaptivePerf developers, citing \"" +
+            std::string(e.what()) + "\".", false, true);
+      print("For investigating what has gone wrong, you can check the files created in " +
+            tmp_dir.string() + ".", false, true);
+
+      to_return = 2;
+    }
+
+    for (auto &pid : spawned_children) {
+      int status = waitpid(pid, nullptr, WNOHANG);
+
+      if (status == 0) {
+        kill(pid, SIGTERM);
+      }
+    }
+
+    return to_return;
+  }
+
+  /**
+     Entry point to "adaptiveperf process", post-processing a recording
+     made with "adaptiveperf -R" (see start_processing_session()).
+
+     argv[0] is expected to be "process".
+  */
+  int process_entrypoint(int argc, char **argv) {
+    CLI::App app("Post-process a recording made by adaptiveperf -R", "adaptiveperf process");
+
+    app.formatter(std::make_shared<PrettyFormatter>());
+
+    std::string record_dir;
+    app.add_option("DIR", record_dir, "Directory with the recording (required)")
+      ->required()
+      ->check(CLI::ExistingDirectory);
+
+    int num_proc = std::thread::hardware_concurrency();
+
+    if (num_proc < 1) {
+      num_proc = 1;
+    }
+
+    unsigned int threads = 0;
+    app.add_option("-p,--post-process", threads, "Number of cores to use for "
+                   "post-processing (must not be greater than " +
+                   std::to_string(num_proc) + "). Use 0 to use all "
+                   "cores. (default: 0)")
+      ->check(CLI::Range(0, num_proc))
+      ->option_text("UINT");
+
+    unsigned int jobs = 1;
+    app.add_option("-j,--jobs", jobs, "Split the recording into this number "
+                   "of consecutive time chunks and post-process them with "
+                   "separate perf-script instances at the same time (the "
+                   "thread tree is always post-processed as a whole). The "
+                   "results describe the same samples as without splitting, "
+                   "but compressed symbol names are 10-character hashes "
+                   "instead of sequential codes (so the keys of "
+                   "*_callchains.json and the names in flame graphs differ) "
+                   "and aggregated flame graphs may rarely attribute samples "
+                   "to the on-CPU instead of the off-CPU node of the same "
+                   "function or vice versa. Recommended for long recordings "
+                   "on machines with many cores. (default: 1)")
+      ->check(OnlyMinRange(1))
+      ->option_text("UINT>0");
+
+    std::string address = "";
+    app.add_option("-a,--address", address, "Delegate post-processing to "
+                   "another machine running adaptiveperf-server, in the same "
+                   "way as in profiling.")
+      ->check([](const std::string &arg) {
+        if (!std::regex_match(arg, std::regex("^(unix:.+|.+\\:[0-9]+)$"))) {
+          return "The value must be in form of \"<address>:<port>\" or \"unix:<path>\".";
+        }
+
+        return "";
+      })
+      ->option_text("ADDRESS:PORT|unix:PATH");
+
+    std::string codes_dst = "";
+    app.add_option("-c,--codes", codes_dst, "Send the list of detected source "
+                   "code files to a specified destination, in the same way "
+                   "as in profiling.")
+      ->check([](const std::string &arg) {
+        if (!std::regex_match(arg, std::regex("^(file\\:.+|fd:\\d+|srv)$"))) {
+          return "The value must be in form of \"srv\", \"file:<path>\", or "
+            "\"fd:<number>\".";
+        }
+
+        return "";
+      })
+      ->option_text("TYPE[:ARG]");
+
+    std::vector<std::string> wire_compression;
+    app.add_option("-Z,--wire-compression", wire_compression, "Compress "
+                   "the data sent to adaptiveperf-server, in the same way "
+                   "as in profiling. Only to be used with -a. "
+                   "(default: no compression)")
+      ->delimiter(',')
+      ->check([](const std::string &arg) {
+        if (!std::regex_match(arg, std::regex("^(zlib(\\:[1-9])?|"
+                                              "zstd(\\:([1-9]|1[0-9]|2[0-2]))?)$"))) {
+          return "Every method must be in form of \"zstd[:<level 1-22>]\" or "
+            "\"zlib[:<level 1-9>]\".";
+        }
+
+        return "";
+      })
+      ->option_text("METHOD[:LEVEL],...")
+      ->needs("-a");
+
+    unsigned int server_buffer = 1024;
+    app.add_option("-s,--server-buffer", server_buffer, "Communication "
+                   "buffer size in bytes for internal adaptiveperf-server. "
+                   "Not to be used with -a. (default when no -a: 1024)")
+      ->check(OnlyMinRange(1))
+      ->option_text("UINT>0")
+      ->excludes("-a");
+
+    quiet = false;
+    app.add_flag("-q,--quiet", quiet, "Do not print anything (if set, check "
+                 "exit code for any errors)");
+
+    CLI11_PARSE(app, argc, argv);
+
+    if (codes_dst == "srv" && address == "") {
+      std::cerr << "--codes cannot be set to \"srv\" if no -a option is "
+        "specified!" << std::endl;
+      return 3;
+    }
+
+    auto start_time =
+      ch::duration_cast<ch::milliseconds>(ch::system_clock::now().time_since_epoch()).count();
+
+    print_notice();
+
+    fs::path perf_path;
+    int code = read_perf_path(perf_path);
+
+    if (code != 0) {
+      return code;
+    }
+
+    print("Reading the recording...", false, false);
+
+    fs::path session_path = fs::path(record_dir) / RECORD_SESSION_FILE;
+    std::ifstream session_stream(session_path);
+
+    if (!session_stream) {
+      print("Cannot open " + session_path.string() + "! Has the recording "
+            "finished successfully?", true, true);
+      return 2;
+    }
+
+    nlohmann::json record_info;
+    std::vector<std::unique_ptr<Profiler> > profilers;
+
+    // Post-processing doesn't compete with any profiled command, so
+    // all cores (or as many as requested) can be used for it.
+    int used = threads == 0 ? num_proc : threads;
+    CPUConfig cpu_config(std::string(used, 'p') + std::string(num_proc - used, ' '));
+
+    cpu_set_t cpu_set = cpu_config.get_cpu_profiler_set();
+    sched_setaffinity(0, sizeof(cpu_set), &cpu_set);
+
+    try {
+      record_info = nlohmann::json::parse(session_stream);
+
+      unsigned long long start_tstamp = 0, end_tstamp = 0;
+
+      if (jobs > 1 && !record_info.contains("end_tstamp")) {
+        print("The recording does not say when it has ended, so it cannot "
+              "be split. Processing it as a whole.", true, false);
+        jobs = 1;
+      }
+
+      if (jobs > 1) {
+        start_tstamp = std::stoull(record_info["tstamp"].get<std::string>());
+        end_tstamp = std::stoull(record_info["end_tstamp"].get<std::string>());
+
+        if (end_tstamp <= start_tstamp) {
+          print("The recording is too short to be split, processing it "
+                "as a whole.", true, false);
+          jobs = 1;
+        }
+      }
+
+      make_profilers(profilers, perf_path, cpu_config, record_info["profilers"],
+                     server_buffer, jobs, start_tstamp, end_tstamp);
+      record_info["session_settings"]["wire_compression"] = wire_compression;
+      record_info["session_settings"]["time_chunks"] = jobs;
+    } catch (std::exception &e) {
+      print(session_path.string() + " is not a valid recording description! "
+            "Exiting.", true, true);
+      print("Details: " + std::string(e.what()), false, true);
+      return 2;
+    }
+
+    return run_session([&](fs::path tmp_dir, std::vector<pid_t> &spawned_children) {
+      return start_processing_session(profilers, record_dir, record_info,
+                                      address, server_buffer, cpu_config,
+                                      tmp_dir, codes_dst);
+    }, start_time, "You can check the results directory now.");
+  }
+
   /**
      Entry point to the AdaptivePerf frontend when it is run from
      the command line.
+
+     "adaptiveperf process ..." is handled by process_entrypoint().
+     A command called "process" can still be profiled by putting "--"
+     before it.
   */
   int main_entrypoint(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "process") == 0) {
+      return process_entrypoint(argc - 1, argv + 1);
+    }
+
     CLI::App app("Comprehensive profiling tool based on Linux perf");
 
     app.formatter(std::make_shared<PrettyFormatter>());
@@ -103,15 +539,17 @@ namespace aperf {
     std::string address = "";
     app.add_option("-a,--address", address, "Delegate post-processing to "
                    "another machine running adaptiveperf-server. All results "
-                   "will be stored on that machine.")
+                   "will be stored on that machine. Use \"unix:<path>\" for "
+                   "adaptiveperf-server listening on a Unix domain socket "
+                   "on the same machine (see its -u option).")
       ->check([](const std::string &arg) {
-        if (!std::regex_match(arg, std::regex("^.+\\:[0-9]+$"))) {
-          return "The value must be in form of \"<address>:<port>\".";
+        if (!std::regex_match(arg, std::regex("^(unix:.+|.+\\:[0-9]+)$"))) {
+          return "The value must be in form of \"<address>:<port>\" or \"unix:<path>\".";
         }
 
         return "";
       })
-      ->option_text("ADDRESS:PORT");
+      ->option_text("ADDRESS:PORT|unix:PATH");
 
     std::string codes_dst = "";
     app.add_option("-c,--codes", codes_dst, "Send the newline-separated list "
@@ -134,6 +572,51 @@ namespace aperf {
       })
       ->option_text("TYPE[:ARG]");
 
+    std::string src_compression = ARCHIVE_DEFAULT_COMPRESSION;
+    app.add_option("-z,--src-compression", src_compression, "Compression "
+                   "of the source code archive: \"store\" (no compression, "
+                   "fastest), \"deflate[:<level 0-9>]\", or "
+                   "\"zstd[:<level 1-22>]\" (only if libarchive supports zstd "
+                   "in ZIP files). Files are compressed in parallel on the "
+                   "profiler cores. (default: " ARCHIVE_DEFAULT_COMPRESSION ")")
+      ->check([](const std::string &arg) {
+        if (!std::regex_match(arg, std::regex("^(store|deflate(\\:[0-9])?|"
+                                              "zstd(\\:([1-9]|1[0-9]|2[0-2]))?)$"))) {
+          return "The value must be in form of \"store\", \"deflate[:<level 0-9>]\", "
+            "or \"zstd[:<level 1-22>]\".";
+        }
+
+        if (arg.rfind("zstd", 0) == 0 && !Archive::is_zstd_supported()) {
+          return "zstd is not supported in ZIP files by the installed libarchive.";
+        }
+
+        return "";
+      })
+      ->option_text("METHOD[:LEVEL]");
+
+    std::vector<std::string> wire_compression;
+    app.add_option("-Z,--wire-compression", wire_compression, "Compress "
+                   "the data sent to adaptiveperf-server (the perf-script "
+                   "output and the result files) with the first of the "
+                   "comma-separated methods supported by both ends: "
+                   "\"zstd[:<level 1-22>]\" (only if compiled with libzstd "
+                   "on both ends) or \"zlib[:<level 1-9>]\". This is worth "
+                   "it for adaptiveperf-server on another machine behind "
+                   "a slow link, at the cost of CPU time. Only to be used "
+                   "with -a. (default: no compression)")
+      ->delimiter(',')
+      ->check([](const std::string &arg) {
+        if (!std::regex_match(arg, std::regex("^(zlib(\\:[1-9])?|"
+                                              "zstd(\\:([1-9]|1[0-9]|2[0-2]))?)$"))) {
+          return "Every method must be in form of \"zstd[:<level 1-22>]\" or "
+            "\"zlib[:<level 1-9>]\".";
+        }
+
+        return "";
+      })
+      ->option_text("METHOD[:LEVEL],...")
+      ->needs("-a");
+
     unsigned int server_buffer = 1024;
     app.add_option("-s,--server-buffer", server_buffer, "Communication "
                    "buffer size in bytes for internal adaptiveperf-server. "
@@ -152,6 +635,84 @@ namespace aperf {
       ->check(OnlyMinRange(1))
       ->option_text("UINT>0");
 
+    std::string record_dir = "";
+    app.add_option("-R,--record", record_dir, "Only record the events to "
+                   "files in a specified directory while the command runs, "
+                   "leaving post-processing for later (run \"adaptiveperf "
+                   "process DIR\" to do it, also on all cores and with "
+                   "other adaptiveperf-server). This keeps post-processing "
+                   "from competing with the profiled command for CPU time "
+                   "and memory bandwidth. Not to be used with -a or -c "
+                   "(these go to \"adaptiveperf process\").")
+      ->excludes("-a")
+      ->excludes("-c")
+      ->option_text("DIR");
+
+    int record_compression = 0;
+    app.add_option("--record-compression", record_compression, "Compress "
+                   "the recorded events with zstd at a given level (1-22), "
+                   "trading profiler CPU time for disk space and I/O. "
+                   "Use 0 to not compress. Only to be used with -R. "
+                   "(default: 0)")
+      ->check(CLI::Range(0, 22))
+      ->option_text("UINT")
+      ->needs("-R");
+
+    std::vector<unsigned long long> timeline_buckets = {10, 100, 1000};
+    app.add_option("-t,--timeline", timeline_buckets, "Comma-separated sizes "
+                   "of time buckets in ms for which per-thread flame graphs "
+                   "should be produced (saved to timeline.json in the "
+                   "\"processed\" directory), e.g. for scrubbing through "
+                   "the profiled run in a website. Use 0 to not produce "
+                   "these flame graphs. (default: 10,100,1000)")
+      ->delimiter(',')
+      ->option_text("UINT,...");
+
+    bool pack_threads = false;
+    app.add_flag("-k,--pack", pack_threads, "Save the per-thread results "
+                 "into a single indexed container file (threads.pack in "
+                 "the \"processed\" directory) rather than into one file "
+                 "per thread. Recommended for programs spawning thousands "
+                 "of threads.");
+
+    std::string group_threads = "";
+    app.add_option("-g,--group", group_threads, "Merge the flame graphs "
+                   "of threads into groups rather than saving them per "
+                   "thread: \"name\" merges threads with the same name "
+                   "within a process (e.g. all workers of a thread pool) "
+                   "and \"process\" merges all threads of a process. "
+                   "Per-thread totals are still saved in the metadata. "
+                   "Recommended for programs spawning thousands of "
+                   "short-lived threads.")
+      ->check(CLI::IsMember({"name", "process"}))
+      ->option_text("TEXT");
+
+    double prune_fraction = 0;
+    app.add_option("--prune", prune_fraction, "Collapse subtrees of flame "
+                   "graphs worth less than this fraction of the total into "
+                   "\"[pruned]\" nodes (e.g. 0.0001), while preserving "
+                   "the totals. Use 0 to not prune by fraction. (default: 0)")
+      ->check(CLI::Range(0.0, 1.0));
+
+    unsigned long long max_nodes = 0;
+    app.add_option("--max-nodes", max_nodes, "Prune every flame graph so that "
+                   "it has at most this number of nodes (in the same way as "
+                   "--prune). Use 0 for no limit. (default: 0)");
+
+    bool fold_recursion = false;
+    app.add_flag("-r,--fold-recursion", fold_recursion, "Fold direct and "
+                 "mutual recursion cycles in flame graphs into single nodes "
+                 "annotated with recursion depth statistics. Recommended "
+                 "for deeply recursive programs, especially when "
+                 "kernel.perf_event_max_stack is raised.");
+
+    bool raw_export = false;
+    app.add_flag("-x,--raw-export", raw_export, "Additionally save every "
+                 "received sample (timestamp, PID, TID, CPU, period, and "
+                 "stack ID) into compact columnar logs in the \"raw\" "
+                 "subdirectory of the results, for analysis with external "
+                 "tools. See the README for the format.");
+
     std::vector<std::string> event_strs;
     app.add_option("-e,--event", event_strs, "Extra perf event to be used "
                    "for sampling with a given period (i.e. do a sample on "
@@ -229,60 +790,11 @@ namespace aperf {
 
       print_notice();
 
-      print("Reading config file...", false, false);
-      std::ifstream config_f(APERF_CONFIG_FILE);
-
-      if (!config_f) {
-        print("Cannot open " APERF_CONFIG_FILE "!", true, true);
-        return 2;
-      }
-
-      std::unordered_map<std::string, std::string> config;
-      int cur_line = 1;
-
-      while (config_f) {
-        std::string line;
-        std::getline(config_f, line);
-
-        if (line.empty() || line[0] == '#') {
-          cur_line++;
-          continue;
-        }
-
-        std::smatch match;
-
-        if (!std::regex_match(line, match,
-                              std::regex("^(\\S+)\\s*\\=\\s*(.+)$"))) {
-          print("Syntax error in line " + std::to_string(cur_line) + " of "
-                APERF_CONFIG_FILE "!", true, true);
-          return 2;
-        }
-
-        config[match[1]] = match[2];
-        cur_line++;
-      }
-
-      if (config.find("perf_path") == config.end()) {
-        print("You must specify the path to your patched \"perf\" installation "
-              "(perf_path) in " APERF_CONFIG_FILE "!", true, true);
-        return 2;
-      }
+      fs::path perf_path;
+      int code = read_perf_path(perf_path);
 
-      fs::path perf_path(config["perf_path"]);
-      perf_path = perf_path / "bin" / "perf";
-
-      if (!fs::exists(perf_path)) {
-        print(perf_path.string() + " does not exist!", true, true);
-        print("Hint: You may want to verify the contents of " APERF_CONFIG_FILE ".",
-              false, true);
-        return 2;
-      }
-
-      if (!fs::is_regular_file(perf_path)) {
-        print(perf_path.string() + " is not a regular file!", true, true);
-        print("Hint: You may want to verify the contents of " APERF_CONFIG_FILE ".",
-              false, true);
-        return 2;
+      if (code != 0) {
+        return code;
       }
 
       print("Checking CPU specification...", false, false);
@@ -297,97 +809,51 @@ namespace aperf {
       cpu_set_t cpu_set = cpu_config.get_cpu_profiler_set();
       sched_setaffinity(0, sizeof(cpu_set), &cpu_set);
 
-      std::vector<std::unique_ptr<Profiler> > profilers;
-
-      PerfEvent main(freq, off_cpu_freq, buffer, off_cpu_buffer);
-      PerfEvent syscall_tree;
+      nlohmann::json record_info;
+      record_info["profilers"]["freq"] = freq;
+      record_info["profilers"]["off_cpu_freq"] = off_cpu_freq;
+      record_info["profilers"]["buffer"] = buffer;
+      record_info["profilers"]["off_cpu_buffer"] = off_cpu_buffer;
+      record_info["profilers"]["events"] = event_strs;
 
-      profilers.push_back(std::make_unique<Perf>(perf_path, syscall_tree, cpu_config,
-                                                 "Thread tree profiler"));
-      profilers.push_back(std::make_unique<Perf>(perf_path, main, cpu_config,
-                                                 "On-CPU/Off-CPU profiler"));
-
-      std::unordered_map<std::string, std::string> event_dict;
-
-      for (std::string &event_str : event_strs) {
-        std::vector<std::string> parts;
-        boost::split(parts, event_str, boost::is_any_of(","));
-
-        std::string event_name = parts[0];
-        int period = std::stoi(parts[1]);
-        std::string website_title = parts[2];
-
-        PerfEvent event(event_name, period, buffer);
-        profilers.push_back(std::make_unique<Perf>(perf_path, event, cpu_config,
-                                                   event_name));
-
-        event_dict[event_name] = website_title;
-      }
-
-      PipeAcceptor::Factory generic_acceptor_factory;
-
-      for (int i = 0; i < profilers.size(); i++) {
-        std::unique_ptr<Acceptor> acceptor =
-          generic_acceptor_factory.make_acceptor(1);
-        profilers[i]->set_acceptor(acceptor, server_buffer);
-      }
-
-      pid_t current_pid = getpid();
-      fs::path tmp_dir = fs::temp_directory_path() /
-        ("adaptiveperf.pid." + std::to_string(current_pid));
-
-      if (fs::exists(tmp_dir)) {
-        fs::remove_all(tmp_dir);
-      }
-
-      std::vector<pid_t> spawned_children;
-      int to_return = 0;
-
-      try {
-        int code = start_profiling_session(profilers, command_elements, address, server_buffer,
-                                           warmup, cpu_config, tmp_dir, spawned_children,
-                                           event_dict, codes_dst);
-
-        auto end_time =
-          ch::duration_cast<ch::milliseconds>(ch::system_clock::now().time_since_epoch()).count();
+      std::vector<std::unique_ptr<Profiler> > profilers;
+      std::unordered_map<std::string, std::string> event_dict =
+        make_profilers(profilers, perf_path, cpu_config, record_info["profilers"],
+                       server_buffer);
 
-        if (code == 0) {
-          fs::remove_all(tmp_dir);
+      nlohmann::json session_settings;
+      session_settings["timeline_buckets_ms"] = nlohmann::json::array();
 
-          print("Done in " + std::to_string(end_time - start_time) + " ms in total! "
-                "You can check the results directory now.", false, false);
-        } else if (code != 1) {
-          print("For investigating what has gone wrong, you can check the files created in " +
-                tmp_dir.string() + ".", false, true);
+      for (auto bucket : timeline_buckets) {
+        if (bucket > 0) {
+          session_settings["timeline_buckets_ms"].push_back(bucket);
         }
-
-        to_return = code;
-      } catch (ConnectionException &e) {
-        print("I/O error has occurred! Exiting.", false, true);
-        print("Details: " + std::string(e.what()), false, true);
-        print("For investigating what has gone wrong, you can check the files created in " +
-              tmp_dir.string() + ".", false, true);
-
-        to_return = 2;
-      } catch (std::exception &e) {
-        print("A fatal error has occurred! If the issue persits, "
-              "please contact the AdaptivePerf developers, citing \"" +
-              std::string(e.what()) + "\".", false, true);
-        print("For investigating what has gone wrong, you can check the files created in " +
-              tmp_dir.string() + ".", false, true);
-
-        to_return = 2;
       }
 
-      for (auto &pid : spawned_children) {
-        int status = waitpid(pid, nullptr, WNOHANG);
-
-        if (status == 0) {
-          kill(pid, SIGTERM);
-        }
+      session_settings["pack_threads"] = pack_threads;
+      session_settings["group_threads"] = group_threads;
+      session_settings["prune_min_fraction"] = prune_fraction;
+      session_settings["prune_max_nodes"] = max_nodes;
+      session_settings["fold_recursion"] = fold_recursion;
+      session_settings["raw_export"] = raw_export;
+      session_settings["src_compression"] = src_compression;
+      session_settings["wire_compression"] = wire_compression;
+
+      if (record_dir != "") {
+        return run_session([&](fs::path tmp_dir, std::vector<pid_t> &spawned_children) {
+          return start_recording_session(profilers, command_elements, warmup,
+                                         cpu_config, tmp_dir, spawned_children,
+                                         event_dict, session_settings,
+                                         record_dir, record_compression,
+                                         record_info);
+        }, start_time, "You can post-process the recording now.");
       }
 
-      return to_return;
+      return run_session([&](fs::path tmp_dir, std::vector<pid_t> &spawned_children) {
+        return start_profiling_session(profilers, command_elements, address, server_buffer,
+                                       warmup, cpu_config, tmp_dir, spawned_children,
+                                       event_dict, codes_dst, session_settings);
+      }, start_time, "You can check the results directory now.");
     }
   }
 };
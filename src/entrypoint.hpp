@@ -14,6 +14,7 @@ namespace aperf {
   extern const char *version;
 
   int main_entrypoint(int argc, char **argv);
+  int process_entrypoint(int argc, char **argv);
 };
 
 #endif
@@ -0,0 +1,349 @@
+// AdaptivePerf: comprehensive profiling tool based on Linux perf
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "overhead.hpp"
+#include <chrono>
+#include <fstream>
+#include <regex>
+#include <sstream>
+#include <unistd.h>
+
+namespace aperf {
+  namespace ch = std::chrono;
+
+  static unsigned long long get_current_ms() {
+    return ch::duration_cast<ch::milliseconds>(
+      ch::steady_clock::now().time_since_epoch()).count();
+  }
+
+  /**
+     Constructs an OverheadMonitor object.
+
+     @param interval_ms The interval between two consecutive samples
+                        of the resource usage of monitored processes,
+                        in milliseconds.
+  */
+  OverheadMonitor::OverheadMonitor(unsigned int interval_ms) {
+    this->interval_ms = interval_ms;
+    this->stopped = true;
+  }
+
+  OverheadMonitor::~OverheadMonitor() {
+    this->stop();
+  }
+
+  /**
+     Adds a process to be monitored.
+
+     Processes can be added before and after calling start().
+
+     @param name The name describing the process in the summary
+                 returned by get_summary().
+     @param pid  The PID of the process.
+  */
+  void OverheadMonitor::add_process(std::string name, pid_t pid) {
+    struct monitored_process process;
+    process.name = name;
+    process.pid = pid;
+    process.last_sample_ms = get_current_ms();
+    process.peak_cpu_percent = 0;
+    process.samples = 0;
+
+    read_proc_usage(pid, process.last_usage);
+
+    std::lock_guard lock(this->processes_mutex);
+    this->processes.push_back(process);
+  }
+
+  /**
+     Starts sampling the monitored processes in a separate thread.
+  */
+  void OverheadMonitor::start() {
+    {
+      std::lock_guard lock(this->processes_mutex);
+
+      if (!this->stopped) {
+        return;
+      }
+
+      this->stopped = false;
+    }
+
+    this->sampling_thread = std::thread([this]() {
+      std::unique_lock lock(this->processes_mutex);
+
+      while (!this->stopped) {
+        this->stop_cond.wait_for(lock, ch::milliseconds(this->interval_ms));
+
+        if (!this->stopped) {
+          this->sample();
+        }
+      }
+    });
+  }
+
+  /**
+     Stops sampling the monitored processes, taking one final sample
+     of the processes which are still running.
+  */
+  void OverheadMonitor::stop() {
+    {
+      std::lock_guard lock(this->processes_mutex);
+
+      if (this->stopped) {
+        return;
+      }
+
+      this->stopped = true;
+    }
+
+    this->stop_cond.notify_all();
+    this->sampling_thread.join();
+
+    std::lock_guard lock(this->processes_mutex);
+    this->sample();
+  }
+
+  /**
+     Samples the resource usage of all monitored processes
+     (internal method, processes_mutex must be locked by the caller).
+
+     Processes which no longer exist keep their last sampled usage.
+  */
+  void OverheadMonitor::sample() {
+    unsigned long long now = get_current_ms();
+
+    for (auto &process : this->processes) {
+      ProcessUsage usage;
+
+      if (!read_proc_usage(process.pid, usage)) {
+        continue;
+      }
+
+      unsigned long long elapsed = now - process.last_sample_ms;
+
+      if (elapsed > 0) {
+        unsigned long long cpu_delta =
+          (usage.user_ms + usage.sys_ms) -
+          (process.last_usage.user_ms + process.last_usage.sys_ms);
+        double cpu_percent = 100.0 * cpu_delta / elapsed;
+
+        if (cpu_percent > process.peak_cpu_percent) {
+          process.peak_cpu_percent = cpu_percent;
+        }
+      }
+
+      process.last_usage = usage;
+      process.last_sample_ms = now;
+      process.samples++;
+    }
+  }
+
+  /**
+     Gets the summary of the resource usage of all monitored processes
+     in form of a JSON object, mapping process names to their last
+     sampled usage and their peak CPU utilisation between two samples
+     (in percent, where 100% corresponds to one fully-used core).
+  */
+  nlohmann::json OverheadMonitor::get_summary() {
+    std::lock_guard lock(this->processes_mutex);
+    nlohmann::json summary = nlohmann::json::object();
+
+    for (auto &process : this->processes) {
+      nlohmann::json &elem = summary[process.name];
+      elem = usage_to_json(process.last_usage);
+      elem["pid"] = process.pid;
+      elem["peak_cpu_percent"] = process.peak_cpu_percent;
+      elem["samples"] = process.samples;
+    }
+
+    return summary;
+  }
+
+  /**
+     Reads the current resource usage of a process from /proc/<pid>/stat
+     and /proc/<pid>/status.
+
+     Returns false if the usage could not be read (e.g. because the process
+     no longer exists), true otherwise.
+
+     @param pid   The PID of the process.
+     @param usage The structure where the usage should be stored.
+  */
+  bool read_proc_usage(pid_t pid, ProcessUsage &usage) {
+    fs::path proc_path = fs::path("/proc") / std::to_string(pid);
+    std::ifstream stat_stream(proc_path / "stat");
+    std::string stat;
+
+    if (!stat_stream || !std::getline(stat_stream, stat)) {
+      return false;
+    }
+
+    // The process name is in parentheses and can contain spaces, so
+    // the fields are counted from the last closing parenthesis.
+    std::size_t name_end = stat.rfind(')');
+
+    if (name_end == std::string::npos) {
+      return false;
+    }
+
+    std::istringstream fields(stat.substr(name_end + 1));
+    std::string field;
+    unsigned long long utime = 0, stime = 0;
+
+    // utime and stime are the 14th and 15th fields of /proc/<pid>/stat,
+    // i.e. the 12th and 13th ones after the process name.
+    for (int i = 1; i <= 13 && fields >> field; i++) {
+      if (i == 12) {
+        utime = std::stoull(field);
+      } else if (i == 13) {
+        stime = std::stoull(field);
+      }
+    }
+
+    long ticks_per_second = sysconf(_SC_CLK_TCK);
+
+    if (ticks_per_second <= 0) {
+      return false;
+    }
+
+    usage.user_ms = utime * 1000 / ticks_per_second;
+    usage.sys_ms = stime * 1000 / ticks_per_second;
+
+    std::ifstream status_stream(proc_path / "status");
+    std::string line;
+
+    while (std::getline(status_stream, line)) {
+      std::istringstream line_stream(line);
+      std::string key;
+      unsigned long long value;
+
+      if (!(line_stream >> key >> value)) {
+        continue;
+      }
+
+      if (key == "voluntary_ctxt_switches:") {
+        usage.voluntary_ctx_switches = value;
+      } else if (key == "nonvoluntary_ctxt_switches:") {
+        usage.involuntary_ctx_switches = value;
+      }
+    }
+
+    return true;
+  }
+
+  /**
+     Converts a ProcessUsage structure to a JSON object.
+
+     @param usage The usage to convert.
+  */
+  nlohmann::json usage_to_json(const ProcessUsage &usage) {
+    nlohmann::json result;
+    result["user_ms"] = usage.user_ms;
+    result["sys_ms"] = usage.sys_ms;
+    result["voluntary_ctx_switches"] = usage.voluntary_ctx_switches;
+    result["involuntary_ctx_switches"] = usage.involuntary_ctx_switches;
+    return result;
+  }
+
+  /**
+     Converts a structure returned by getrusage() or wait4() to
+     a ProcessUsage structure.
+
+     @param usage The structure to convert.
+  */
+  ProcessUsage rusage_to_usage(const struct rusage &usage) {
+    ProcessUsage result;
+    result.user_ms = usage.ru_utime.tv_sec * 1000ULL + usage.ru_utime.tv_usec / 1000;
+    result.sys_ms = usage.ru_stime.tv_sec * 1000ULL + usage.ru_stime.tv_usec / 1000;
+    result.voluntary_ctx_switches = usage.ru_nvcsw;
+    result.involuntary_ctx_switches = usage.ru_nivcsw;
+    return result;
+  }
+
+  /**
+     Parses the lost event counts reported by "perf" in its log file
+     and returns them in form of a JSON object.
+
+     "perf" reports lost events in the following forms:
+     "Processed X events and lost Y chunks!" (for PERF_RECORD_LOST) and
+     "Processed X samples and lost Y% samples!" (for PERF_RECORD_LOST_SAMPLES).
+
+     @param log_path The path to the log file (e.g. perf_record_main_stderr.log).
+  */
+  nlohmann::json parse_perf_lost_counts(fs::path log_path) {
+    nlohmann::json result;
+    result["processed_events"] = 0;
+    result["lost_chunks"] = 0;
+    result["processed_samples"] = 0;
+    result["lost_samples_percent"] = 0.0;
+
+    std::ifstream stream(log_path);
+    std::string line;
+
+    std::regex chunks_regex("Processed (\\d+) events and lost (\\d+) chunks");
+    std::regex samples_regex("Processed (\\d+) samples and lost ([\\d\\.]+)%");
+
+    while (std::getline(stream, line)) {
+      std::smatch match;
+
+      if (std::regex_search(line, match, chunks_regex)) {
+        result["processed_events"] = std::stoull(match[1]);
+        result["lost_chunks"] = std::stoull(match[2]);
+      } else if (std::regex_search(line, match, samples_regex)) {
+        result["processed_samples"] = std::stoull(match[1]);
+        result["lost_samples_percent"] = std::stod(match[2]);
+      }
+    }
+
+    return result;
+  }
+
+  /**
+     Parses the lost events printed by "perf script --show-lost-events --ns"
+     in its log file and returns them in form of a JSON array of
+     [PID, TID, timestamp in ns, number of lost events] arrays.
+
+     PID is -1 if "perf" hasn't printed it.
+
+     @param log_path The path to the log file (e.g. perf_script_main_stdout.log).
+  */
+  nlohmann::json parse_perf_lost_events(fs::path log_path) {
+    nlohmann::json result = nlohmann::json::array();
+
+    std::ifstream stream(log_path);
+    std::string line;
+
+    std::regex lost_regex("^(.*?)PERF_RECORD_LOST(?:_SAMPLES)?(?:\\s+lost\\s+(\\d+))?");
+    std::regex prefix_regex("(?:(\\d+)/)?(\\d+)\\s+(?:\\[\\d+\\]\\s+)?(\\d+)\\.(\\d+):\\s*$");
+
+    while (std::getline(stream, line)) {
+      std::smatch match;
+
+      if (!std::regex_search(line, match, lost_regex)) {
+        continue;
+      }
+
+      std::string prefix = match[1];
+      unsigned long long lost = match[2].matched ? std::stoull(match[2]) : 1;
+      std::smatch prefix_match;
+
+      if (!std::regex_search(prefix, prefix_match, prefix_regex)) {
+        continue;
+      }
+
+      long long pid = prefix_match[1].matched ? std::stoll(prefix_match[1]) : -1;
+      long long tid = std::stoll(prefix_match[2]);
+
+      std::string fraction = prefix_match[4];
+      fraction.resize(9, '0');
+
+      unsigned long long timestamp = std::stoull(prefix_match[3]) * 1000000000ULL +
+        std::stoull(fraction);
+
+      result.push_back({pid, tid, timestamp, lost});
+    }
+
+    return result;
+  }
+};
@@ -0,0 +1,73 @@
+// AdaptivePerf: comprehensive profiling tool based on Linux perf
+// Copyright (C) CERN. See LICENSE for details.
+
+#ifndef OVERHEAD_HPP_
+#define OVERHEAD_HPP_
+
+#include <condition_variable>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <nlohmann/json.hpp>
+
+namespace aperf {
+  namespace fs = std::filesystem;
+
+  /**
+     A structure describing the resource usage of a process
+     at a given point in time.
+  */
+  struct ProcessUsage {
+    unsigned long long user_ms = 0;
+    unsigned long long sys_ms = 0;
+    unsigned long long voluntary_ctx_switches = 0;
+    unsigned long long involuntary_ctx_switches = 0;
+  };
+
+  /**
+     A class periodically sampling the CPU time and context switches
+     of processes involved in profiling (e.g. "perf" and AdaptivePerf
+     itself) in order to quantify how much profiling perturbs the
+     profiled program.
+  */
+  class OverheadMonitor {
+  private:
+    struct monitored_process {
+      std::string name;
+      pid_t pid;
+      ProcessUsage last_usage;
+      unsigned long long last_sample_ms;
+      double peak_cpu_percent;
+      unsigned long long samples;
+    };
+
+    unsigned int interval_ms;
+    std::vector<struct monitored_process> processes;
+    std::mutex processes_mutex;
+    std::condition_variable stop_cond;
+    bool stopped;
+    std::thread sampling_thread;
+
+    void sample();
+
+  public:
+    OverheadMonitor(unsigned int interval_ms = 100);
+    ~OverheadMonitor();
+    void add_process(std::string name, pid_t pid);
+    void start();
+    void stop();
+    nlohmann::json get_summary();
+  };
+
+  bool read_proc_usage(pid_t pid, ProcessUsage &usage);
+  nlohmann::json usage_to_json(const ProcessUsage &usage);
+  ProcessUsage rusage_to_usage(const struct rusage &usage);
+  nlohmann::json parse_perf_lost_counts(fs::path log_path);
+  nlohmann::json parse_perf_lost_events(fs::path log_path);
+};
+
+#endif
@@ -8,6 +8,11 @@
 #include <sys/wait.h>
 #endif
 
+#if BOOST_OS_LINUX
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 namespace aperf {
   Process::Process(std::vector<std::string> &command,
                    unsigned int buf_size) {
@@ -22,6 +27,7 @@ namespace aperf {
     this->started = false;
     this->writable = true;
     this->buf_size = buf_size;
+    this->usage_available = false;
 
 #ifdef BOOST_OS_UNIX
     this->stdout_fd = nullptr;
@@ -31,6 +37,7 @@ namespace aperf {
     this->stdin_pipe[1] = -1;
     this->stdout_pipe[0] = -1;
     this->stdout_pipe[1] = -1;
+    this->pidfd = -1;
 #endif
   }
 
@@ -49,6 +56,12 @@ namespace aperf {
       waitpid(this->id, nullptr, 0);
 #endif
     }
+
+#ifdef BOOST_OS_UNIX
+    if (this->pidfd != -1) {
+      close(this->pidfd);
+    }
+#endif
   }
 
   void Process::add_env(std::string key, std::string value) {
@@ -276,6 +289,18 @@ namespace aperf {
 
     this->started = true;
     this->id = forked;
+
+#if BOOST_OS_LINUX && defined(SYS_pidfd_open)
+    // The pidfd is opened before anyone can reap the process so that it
+    // always refers to this process and not to one reusing its PID.
+    // Kernels older than 5.3 do not support it, -1 is kept then.
+    if (this->pidfd != -1) {
+      close(this->pidfd);
+    }
+
+    this->pidfd = syscall(SYS_pidfd_open, forked, 0);
+#endif
+
     return forked;
 #else
     this->notifiable = false;
@@ -335,7 +360,7 @@ namespace aperf {
     if (this->started) {
 #ifdef BOOST_OS_UNIX
       int status;
-      int result = waitpid(this->id, &status, 0);
+      int result = wait4(this->id, &status, 0, &this->usage);
 
       if (result != this->id) {
         throw Process::WaitException();
@@ -343,6 +368,7 @@ namespace aperf {
 
       this->started = false;
       this->notifiable = false;
+      this->usage_available = true;
 
       return WEXITSTATUS(status);
 #else
@@ -359,12 +385,66 @@ namespace aperf {
     }
 
 #ifdef BOOST_OS_UNIX
-    return waitpid(this->id, nullptr, WNOHANG) == 0;
+    // WNOWAIT leaves the process waitable so that join() can still
+    // obtain its exit code and resource usage.
+    siginfo_t info;
+    info.si_pid = 0;
+
+    if (waitid(P_PID, this->id, &info, WEXITED | WNOHANG | WNOWAIT) != 0) {
+      return false;
+    }
+
+    return info.si_pid == 0;
 #else
     throw Process::NotImplementedException();
 #endif
   }
 
+#ifdef BOOST_OS_UNIX
+  /**
+     Gets a pidfd of the process, i.e. a file descriptor becoming
+     readable (POLLIN) when the process exits, so that waiting for its exit
+     can be combined with waiting for other events in poll().
+
+     -1 is returned if start() hasn't been called before or pidfds are
+     not supported (Linux older than 5.3 or a platform other than Linux).
+     The file descriptor is owned by the Process object.
+  */
+  int Process::get_pidfd() {
+    return this->pidfd;
+  }
+#endif
+
+  /**
+     Gets the PID of the process.
+
+     The returned value is meaningful only after start() has been called.
+  */
+  int Process::get_id() {
+    return this->id;
+  }
+
+#ifdef BOOST_OS_UNIX
+  /**
+     Gets the resource usage (e.g. CPU time and context switches) of
+     the process after it has finished executing and saves it to the
+     structure referenced by usage.
+
+     Returns false if the usage is not available because join() hasn't
+     successfully returned yet, true otherwise.
+
+     @param usage The structure where the resource usage should be stored.
+  */
+  bool Process::get_usage(struct rusage &usage) {
+    if (!this->usage_available) {
+      return false;
+    }
+
+    usage = this->usage;
+    return true;
+  }
+#endif
+
   void Process::close_stdin() {
     if (!this->writable) {
       throw Process::NotWritableException();
@@ -10,6 +10,10 @@
 #include <filesystem>
 #include <boost/predef.h>
 
+#ifdef BOOST_OS_UNIX
+#include <sys/resource.h>
+#endif
+
 namespace aperf {
   namespace fs = std::filesystem;
 
@@ -31,7 +35,10 @@ namespace aperf {
     int *stdout_fd;
     std::unique_ptr<FileDescriptor> stdout_reader;
     std::unique_ptr<FileDescriptor> stdin_writer;
+    struct rusage usage;
+    int pidfd;
 #endif
+    bool usage_available;
     bool started;
     int id;
 
@@ -62,6 +69,11 @@ namespace aperf {
     void write_stdin(char *buf, unsigned int size);
     int join();
     bool is_running();
+    int get_id();
+#ifdef BOOST_OS_UNIX
+    bool get_usage(struct rusage &usage);
+    int get_pidfd();
+#endif
     void close_stdin();
 
     class NotifyException : public std::exception { };
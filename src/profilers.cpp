@@ -2,6 +2,8 @@
 // Copyright (C) CERN. See LICENSE for details.
 
 #include "profilers.hpp"
+#include "overhead.hpp"
+#include <algorithm>
 #include <cstdlib>
 #include <future>
 #include <iostream>
@@ -15,6 +17,32 @@
 #endif
 
 namespace aperf {
+  /**
+     Checks whether a child process is still running without reaping it
+     (internal function), so that whoever waits for it can still obtain its
+     exit code.
+  */
+  static bool is_child_running(pid_t pid) {
+    siginfo_t info;
+    info.si_pid = 0;
+
+    if (waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) != 0) {
+      return false;
+    }
+
+    return info.si_pid == 0;
+  }
+
+  /**
+     Converts a timestamp in ns to the "<seconds>.<nanoseconds>" form
+     accepted by the --time option of "perf" (internal function).
+  */
+  static std::string get_perf_time(unsigned long long timestamp) {
+    std::string ns = std::to_string(timestamp % 1000000000ULL);
+    return std::to_string(timestamp / 1000000000ULL) + "." +
+      std::string(9 - ns.size(), '0') + ns;
+  }
+
   /**
      Constructs a PerfEvent object corresponding to thread tree
      profiling.
@@ -109,16 +137,12 @@ namespace aperf {
                    fs::path result_out,
                    fs::path result_processed,
                    bool capture_immediately) {
-    std::string instrs = connection_instrs.get_instructions(this->get_thread_count());
-
-    fs::path stdout, stderr_record, stderr_script;
+    std::string suffix;
     std::vector<std::string> argv_record;
     std::vector<std::string> argv_script;
 
     if (this->perf_event.name == "<thread_tree>") {
-      stdout = result_out / "perf_script_syscall_stdout.log";
-      stderr_record = result_out / "perf_record_syscall_stderr.log";
-      stderr_script = result_out / "perf_script_syscall_stderr.log";
+      suffix = "syscall";
 
       argv_record = {perf_path.string(), "record", "-o", "-", "--call-graph", "fp", "-k",
                      "CLOCK_MONOTONIC", "--buffer-events", "1", "-e",
@@ -126,12 +150,10 @@ namespace aperf {
                      "sched:sched_process_fork,sched:sched_process_exit",
                      "--sorted-stream", "--pid=" + std::to_string(pid)};
       argv_script = {perf_path.string(), "script", "-s", APERF_SCRIPT_PATH "/adaptiveperf-syscall-process.py",
-                     "--demangle", "--demangle-kernel",
+                     "--demangle", "--demangle-kernel", "--show-lost-events", "--ns",
                      "--max-stack=" + std::to_string(this->max_stack)};
     } else if (this->perf_event.name == "<main>") {
-      stdout = result_out / "perf_script_main_stdout.log";
-      stderr_record = result_out / "perf_record_main_stderr.log";
-      stderr_script = result_out / "perf_script_main_stderr.log";
+      suffix = "main";
 
       argv_record = {perf_path.string(), "record", "-o", "-", "--call-graph", "fp", "-k",
                      "CLOCK_MONOTONIC", "--sorted-stream", "-e",
@@ -141,12 +163,10 @@ namespace aperf {
                      "--buffer-off-cpu-events", this->perf_event.options[3],
                      "--pid=" + std::to_string(pid)};
       argv_script = {perf_path.string(), "script", "-s", APERF_SCRIPT_PATH "/adaptiveperf-process.py",
-                     "--demangle", "--demangle-kernel",
+                     "--demangle", "--demangle-kernel", "--show-lost-events", "--ns",
                      "--max-stack=" + std::to_string(this->max_stack)};
     } else {
-      stdout = result_out / ("perf_script_" + this->perf_event.name + "_stdout.log");
-      stderr_record = result_out / ("perf_record_" + this->perf_event.name + "_stderr.log");
-      stderr_script = result_out / ("perf_script_" + this->perf_event.name + "_stderr.log");
+      suffix = this->perf_event.name;
 
       argv_record = {perf_path.string(), "record", "-o", "-", "--call-graph", "fp", "-k",
                      "CLOCK_MONOTONIC", "--sorted-stream", "-e",
@@ -154,42 +174,114 @@ namespace aperf {
                      "--buffer-events", this->perf_event.options[1],
                      "--pid=" + std::to_string(pid)};
       argv_script = {perf_path.string(), "script", "-s", APERF_SCRIPT_PATH "/adaptiveperf-process.py",
-                     "--demangle", "--demangle-kernel",
+                     "--demangle", "--demangle-kernel", "--show-lost-events", "--ns",
                      "--max-stack=" + std::to_string(this->max_stack)};
     }
 
-    this->record_proc = std::make_unique<Process>(argv_record);
-    this->record_proc->set_redirect_stderr(stderr_record);
+    // In the RECORD mode, perf-record writes to a file instead of piping
+    // events to perf-script, which reads the file later in the PROCESS mode.
+    fs::path data_path = this->record_dir / ("perf_" + suffix + ".data");
+
+    if (this->chunk_count > 1) {
+      suffix += "_chunk" + std::to_string(this->chunk);
+    }
+
+    fs::path stdout = result_out / ("perf_script_" + suffix + "_stdout.log");
+    fs::path stderr_record = result_out / ("perf_record_" + suffix + "_stderr.log");
+    fs::path stderr_script = result_out / ("perf_script_" + suffix + "_stderr.log");
+
+    if (this->mode == RECORD) {
+      argv_record[3] = data_path.string();
+
+      if (this->record_compression > 0) {
+        argv_record.push_back("--compression-level=" +
+                              std::to_string(this->record_compression));
+      }
+    } else if (this->mode == PROCESS) {
+      argv_script.push_back("-i");
+      argv_script.push_back(data_path.string());
+
+      if (this->chunk_count > 1) {
+        // Both ends of a "perf" time range are inclusive
+        argv_script.push_back("--time");
+        argv_script.push_back((this->chunk_from == 0 ? "" :
+                               get_perf_time(this->chunk_from)) + "," +
+                              (this->chunk_to == 0 ? "" :
+                               get_perf_time(this->chunk_to - 1)));
+      }
+    }
+
+    if (this->mode != PROCESS) {
+      this->record_proc = std::make_unique<Process>(argv_record);
+      this->record_proc->set_redirect_stderr(stderr_record);
+      this->stderr_record = stderr_record;
+    }
+
+    if (this->mode != RECORD) {
+      std::string instrs = connection_instrs.get_instructions(this->get_thread_count());
+
+      this->script_proc = std::make_unique<Process>(argv_script);
+      this->script_proc->add_env("APERF_SERV_CONNECT", instrs);
+
+      std::string wire_compression = connection_instrs.get_wire_compression();
+
+      if (!wire_compression.empty()) {
+        this->script_proc->add_env("APERF_WIRE_COMPRESSION", wire_compression);
+      }
+
+      if (this->mode == PROCESS) {
+        this->script_proc->add_env("APERF_OFFLINE", "1");
+
+        if (this->chunk_count > 1) {
+          this->script_proc->add_env("APERF_CHUNK", std::to_string(this->chunk) + "/" +
+                                     std::to_string(this->chunk_count));
+        }
+      }
+
+      if (this->acceptor.get() != nullptr) {
+        std::string instrs = this->acceptor->get_type() + " " +
+                             this->acceptor->get_connection_instructions();
+        this->script_proc->add_env("APERF_CONNECT", instrs);
+      }
 
-    this->script_proc = std::make_unique<Process>(argv_script);
-    this->script_proc->add_env("APERF_SERV_CONNECT", instrs);
+      this->script_proc->set_redirect_stdout(stdout);
+      this->script_proc->set_redirect_stderr(stderr_script);
 
-    if (this->acceptor.get() != nullptr) {
-      std::string instrs = this->acceptor->get_type() + " " +
-                           this->acceptor->get_connection_instructions();
-      this->script_proc->add_env("APERF_CONNECT", instrs);
+      this->stderr_script = stderr_script;
+      this->stdout_script = stdout;
     }
 
-    this->script_proc->set_redirect_stdout(stdout);
-    this->script_proc->set_redirect_stderr(stderr_script);
+    if (this->mode == LIVE) {
+      this->record_proc->set_redirect_stdout(*(this->script_proc));
+    } else if (this->mode == RECORD) {
+      this->record_proc->set_redirect_stdout(result_out / ("perf_record_" + suffix +
+                                                           "_stdout.log"));
+    }
 
-    this->record_proc->set_redirect_stdout(*(this->script_proc));
+    if (this->script_proc.get() != nullptr) {
+      this->script_proc->start(false, this->cpu_config, true, result_processed);
+    }
 
-    this->script_proc->start(false, this->cpu_config, true, result_processed);
-    this->record_proc->start(false, this->cpu_config, true, result_processed);
+    if (this->record_proc.get() != nullptr) {
+      this->record_proc->start(false, this->cpu_config, true, result_processed);
+    }
 
-    if (this->acceptor.get() != nullptr) {
+    if (this->mode != RECORD && this->acceptor.get() != nullptr) {
       this->connection = this->acceptor->accept(this->buf_size);
     }
 
-    this->process = std::async([&, this]() {
-      this->record_proc->close_stdin();
-      int code = this->record_proc->join();
+    this->process = std::async([pid, this]() {
+      int code;
 
-      if (code != 0) {
-        int status = waitpid(pid, nullptr, WNOHANG);
+      if (this->record_proc.get() != nullptr) {
+        this->record_proc->close_stdin();
+        code = this->record_proc->join();
+      } else {
+        code = 0;
+      }
 
-        if (status == 0) {
+      if (code != 0) {
+        if (is_child_running(pid)) {
           print("Profiler \"" + this->get_name() + "\" (perf-record) has "
                 "returned non-zero exit code " + std::to_string(code) + ". "
                 "Terminating the profiled command wrapper.", true, true);
@@ -226,12 +318,23 @@ namespace aperf {
         return code;
       }
 
+      if (this->script_proc.get() == nullptr) {
+        return code;
+      }
+
+      if (this->mode == PROCESS) {
+        // perf-script reads events from a file
+        this->script_proc->close_stdin();
+      }
+
       code = this->script_proc->join();
 
       if (code != 0) {
-        int status = waitpid(pid, nullptr, WNOHANG);
-
-        if (status == 0) {
+        if (this->mode == PROCESS) {
+          print("Profiler \"" + this->get_name() + "\" (perf-script) "
+                "has returned non-zero exit code " + std::to_string(code) + ".",
+                true, true);
+        } else if (is_child_running(pid)) {
           print("Profiler \"" + this->get_name() + "\" (perf-script) "
                 "has returned non-zero exit code " + std::to_string(code) + ". "
                 "Terminating the profiled command wrapper.", true, true);
@@ -279,7 +382,9 @@ namespace aperf {
     if (this->perf_event.name == "<thread_tree>") {
       return 1;
     } else {
-      return this->cpu_config.get_profiler_thread_count();
+      // The cores are shared by all chunks of a recording
+      return std::max(1, this->cpu_config.get_profiler_thread_count() /
+                      (int)this->chunk_count);
     }
   }
 
@@ -298,4 +403,85 @@ namespace aperf {
   std::vector<std::unique_ptr<Requirement> > &Perf::get_requirements() {
     return this->requirements;
   }
+
+  std::vector<std::pair<std::string, pid_t> > Perf::get_processes() {
+    std::vector<std::pair<std::string, pid_t> > processes;
+
+    if (this->record_proc.get() != nullptr) {
+      processes.push_back(std::make_pair("perf-record", this->record_proc->get_id()));
+    }
+
+    // perf-script also runs the Python script streaming events to
+    // adaptiveperf-server, so its usage includes the script.
+    if (this->script_proc.get() != nullptr) {
+      processes.push_back(std::make_pair("perf-script", this->script_proc->get_id()));
+    }
+
+    return processes;
+  }
+
+  std::vector<std::pair<std::string, int> > Perf::get_pidfds() {
+    std::vector<std::pair<std::string, int> > pidfds;
+
+    if (this->record_proc.get() != nullptr &&
+        this->record_proc->get_pidfd() != -1) {
+      pidfds.push_back(std::make_pair("perf-record", this->record_proc->get_pidfd()));
+    }
+
+    if (this->script_proc.get() != nullptr &&
+        this->script_proc->get_pidfd() != -1) {
+      pidfds.push_back(std::make_pair("perf-script", this->script_proc->get_pidfd()));
+    }
+
+    return pidfds;
+  }
+
+  nlohmann::json Perf::get_overhead_info() {
+    nlohmann::json info;
+    info["processes"] = nlohmann::json::object();
+    info["lost"] = nlohmann::json::object();
+
+    struct rusage usage;
+
+    if (this->record_proc.get() != nullptr &&
+        this->record_proc->get_usage(usage)) {
+      info["processes"]["perf-record"] = usage_to_json(rusage_to_usage(usage));
+    }
+
+    if (this->script_proc.get() != nullptr &&
+        this->script_proc->get_usage(usage)) {
+      info["processes"]["perf-script"] = usage_to_json(rusage_to_usage(usage));
+    }
+
+    if (!this->stderr_record.empty()) {
+      info["lost"]["perf-record"] = parse_perf_lost_counts(this->stderr_record);
+    }
+
+    if (!this->stderr_script.empty()) {
+      info["lost"]["perf-script"] = parse_perf_lost_counts(this->stderr_script);
+      nlohmann::json events = parse_perf_lost_events(this->stdout_script);
+
+      // Every chunk reads the whole recording, so only the lost events
+      // within its time range are reported to avoid counting them
+      // more than once.
+      if (this->chunk_count > 1) {
+        nlohmann::json chunk_events = nlohmann::json::array();
+
+        for (auto &event : events) {
+          unsigned long long timestamp = event[2];
+
+          if (timestamp >= this->chunk_from &&
+              (this->chunk_to == 0 || timestamp < this->chunk_to)) {
+            chunk_events.push_back(event);
+          }
+        }
+
+        events.swap(chunk_events);
+      }
+
+      info["lost"]["perf-script"]["events"] = events;
+    }
+
+    return info;
+  }
 };
@@ -60,6 +60,9 @@ namespace aperf {
     int max_stack;
     std::unique_ptr<Process> record_proc;
     std::unique_ptr<Process> script_proc;
+    fs::path stderr_record;
+    fs::path stderr_script;
+    fs::path stdout_script;
 
   public:
     Perf(fs::path perf_path,
@@ -78,6 +81,9 @@ namespace aperf {
     void pause();
     int wait();
     std::vector<std::unique_ptr<Requirement> > &get_requirements();
+    std::vector<std::pair<std::string, pid_t> > get_processes();
+    std::vector<std::pair<std::string, int> > get_pidfds();
+    nlohmann::json get_overhead_info();
   };
 };
 
@@ -6,9 +6,12 @@
 #include "profiling.hpp"
 #include "print.hpp"
 #include "server/server.hpp"
+#include "server/codestore.hpp"
+#include "server/compress.hpp"
 #include "archive.hpp"
 #include "process.hpp"
 #include "common.hpp"
+#include "overhead.hpp"
 #include <filesystem>
 #include <iomanip>
 #include <queue>
@@ -17,9 +20,13 @@
 #include <mutex>
 #include <thread>
 #include <fstream>
+#include <unordered_map>
 #include <unordered_set>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <signal.h>
 #include <Poco/Net/StreamSocket.h>
 #include <boost/core/demangle.hpp>
 #include <boost/algorithm/string.hpp>
@@ -124,8 +131,16 @@ namespace aperf {
                                   takes form of "<field1>_<field2>_..._<fieldX>"
                                   where the number of fields and their content
                                   are implementation-dependent.
+     @param wire_compression      The compression methods that the profilers
+                                  should offer when connecting to
+                                  adaptiveperf-server (see
+                                  CompressedConnection), empty for no
+                                  compression.
   */
-  ServerConnInstrs::ServerConnInstrs(std::string all_connection_instrs) {
+  ServerConnInstrs::ServerConnInstrs(std::string all_connection_instrs,
+                                     std::vector<std::string> wire_compression) {
+    this->wire_compression = wire_compression;
+
     std::vector<std::string> parts;
     boost::split(parts, all_connection_instrs, boost::is_any_of(" "));
 
@@ -169,6 +184,15 @@ namespace aperf {
     return result;
   }
 
+  /**
+     Gets the compression methods that the profilers should offer when
+     connecting to adaptiveperf-server as a comma-separated list of
+     "<method>[:<level>]" strings, empty for no compression.
+  */
+  std::string ServerConnInstrs::get_wire_compression() {
+    return boost::algorithm::join(this->wire_compression, ",");
+  }
+
   /**
      Analyses the current machine configuration and returns the most
      appropriate CPUConfig object, taking into account user considerations.
@@ -269,64 +293,76 @@ namespace aperf {
   }
 
   /**
-     Starts a profiling session.
-
-     @param profilers        A list of profilers used to profile the command.
-     @param command_elements A command to be profiled, in form of a vector of string parts
-                             (e.g. "adaptiveperf -f 100 test" becomes ["adaptiveperf",
-                             "-f", "100", "test"]).
-     @param server_address   The address and port of an external instance of adaptiveperf-server.
-                             If the external instance usage is not planned, server_address
-                             should be an empty string.
-     @param buf_size         A size of buffer for communication with adaptiveperf-server,
-                             in bytes.
-     @param warmup           A number of seconds between the profilers indicating their
-                             readiness and the actual execution of the command. This may have to
-                             be high on machines with weaker configurations.
-     @param cpu_config       A CPUConfig object describing how available cores should be used
-                             for profiling. It's recommended to call get_cpu_config() for this.
-     @param tmp_dir          A temporary directory where profiling-related files will be stored.
-     @param spawned_children A list of PIDs of children spawned during the profiling session.
-                             This will be populated as the function executes and it's mostly
-                             important in the context of cleaning up after the session finishes
-                             or terminates with an error.
-     @param event_dict       A dictionary mapping custom "perf" event names to their website
-                             titles (e.g. "page-faults" -> "Page faults"). This dictionary will
-                             be saved to event_dict.data in the "processed" directory.
-     @param codes_dst        TODO
+     Waits until a connection becomes readable or one of the processes
+     with given pidfds exits, whichever happens first (internal function).
+
+     Returns -1 if the connection is readable (also if some processes
+     have exited at the same time, so that a message sent before the
+     exits is not missed), the index of an exited process in pidfds
+     otherwise, and -2 if timeout_seconds have passed
+     without any of these. -1 is also returned immediately if the
+     connection cannot be polled (see Connection::get_poll_fd()), e.g.
+     because it has data buffered already.
+
+     @param connection      The connection to wait for, null if only
+                            the processes should be waited for.
+     @param pidfds          The pidfds of the processes to wait for.
+     @param timeout_seconds A maximum number of seconds to wait. Use
+                            NO_TIMEOUT for no timeout.
   */
-  int start_profiling_session(std::vector<std::unique_ptr<Profiler> > &profilers,
-                              std::vector<std::string> &command_elements,
-                              std::string server_address,
-                              unsigned int buf_size, unsigned int warmup,
-                              CPUConfig &cpu_config, fs::path tmp_dir,
-                              std::vector<pid_t> &spawned_children,
-                              std::unordered_map<std::string, std::string> &event_dict,
-                              std::string codes_dst) {
-    print("Verifying profiler requirements...", false, false);
-
-    bool requirements_fulfilled = true;
-    std::string last_requirement = "";
+  static int wait_for_event(Connection *connection, std::vector<int> &pidfds,
+                            long timeout_seconds) {
+    std::vector<struct pollfd> poll_structs;
 
-    for (int i = 0; i < profilers.size() && requirements_fulfilled; i++) {
-      std::vector<std::unique_ptr<Requirement> > &requirements = profilers[i]->get_requirements();
+    if (connection != nullptr) {
+      int fd = connection->get_poll_fd();
 
-      for (int j = 0; j < requirements.size() && requirements_fulfilled; j++) {
-        last_requirement = requirements[j]->get_name();
-        requirements_fulfilled = requirements_fulfilled && requirements[j]->check();
+      if (fd == -1) {
+        return -1;
       }
+
+      poll_structs.push_back({fd, POLLIN, 0});
     }
 
-    if (!requirements_fulfilled) {
-      print("Requirement \"" + last_requirement + "\" is not met! Exiting.",
-            true, true);
-      return 1;
+    for (int pidfd : pidfds) {
+      poll_structs.push_back({pidfd, POLLIN, 0});
     }
 
-    print("Preparing for profiling...", false, false);
+    int timeout_ms = timeout_seconds == NO_TIMEOUT ? -1 : 1000 * timeout_seconds;
+    int code;
 
-    std::string profiled_filename = fs::path(command_elements[0]).filename();
+    do {
+      code = poll(poll_structs.data(), poll_structs.size(), timeout_ms);
+    } while (code == -1 && errno == EINTR);
+
+    if (code == -1) {
+      throw std::runtime_error("Could not poll the profiling session events, "
+                               "code " + std::to_string(errno) + ".");
+    } else if (code == 0) {
+      return -2;
+    }
+
+    if (connection != nullptr && poll_structs[0].revents != 0) {
+      return -1;
+    }
+
+    int offset = connection != nullptr ? 1 : 0;
+
+    for (int i = 0; i < pidfds.size(); i++) {
+      if (poll_structs[offset + i].revents != 0) {
+        return i;
+      }
+    }
+
+    return -1;
+  }
 
+  /**
+     Gets the name of the results directory of a profiling session,
+     made of the current UTC time, the hostname, and the file name of
+     the profiled command (internal function).
+  */
+  static std::string get_result_name(std::string profiled_filename) {
     const time_t t = std::time(nullptr);
     struct tm *tm = std::gmtime(&t);
 
@@ -336,13 +372,23 @@ namespace aperf {
     char hostname[HOST_NAME_MAX];
     gethostname(hostname, HOST_NAME_MAX);
 
-    std::string result_name = stream.str() + "_" + hostname + "__" + profiled_filename;
+    return stream.str() + "_" + hostname + "__" + profiled_filename;
+  }
 
-    fs::path results_dir = fs::absolute(tmp_dir / "results");
-    fs::path result_dir = results_dir / result_name;
-    fs::path result_out = result_dir / "out";
-    fs::path result_processed = result_dir / "processed";
+  /**
+     Creates the directories of results of a profiling session and saves
+     event_dict.data to the "processed" one (internal function).
+
+     Returns false (after printing what has gone wrong) if this fails.
 
+     @param result_dir       The results directory.
+     @param result_out       The "out" directory inside result_dir.
+     @param result_processed The "processed" directory inside result_dir.
+     @param event_dict       See start_profiling_session().
+  */
+  static bool create_result_dirs(fs::path result_dir, fs::path result_out,
+                                 fs::path result_processed,
+                                 std::unordered_map<std::string, std::string> &event_dict) {
     try {
       fs::create_directories(result_dir);
       fs::create_directories(result_out);
@@ -352,7 +398,7 @@ namespace aperf {
             result_dir.string() + ", " +
             result_out.string() + ", " +
             result_processed.string() + "! Exiting.", true, true);
-      return 2;
+      return false;
     }
 
     {
@@ -362,7 +408,7 @@ namespace aperf {
         print("Could not open " +
               fs::absolute(result_processed / "event_dict.data").string() +
               " for writing!", true, true);
-        return 2;
+        return false;
       }
 
       for (auto &elem : event_dict) {
@@ -370,22 +416,123 @@ namespace aperf {
       }
     }
 
-    print("Starting profiled program wrapper...", true, false);
+    return true;
+  }
 
-    Process wrapper(command_elements);
+  /**
+     Prints the command to be profiled (internal function).
+  */
+  static void print_command(std::vector<std::string> &command_elements) {
+    std::string command_list_str = "[";
 
-    wrapper.set_redirect_stdout(result_out / "stdout.log");
-    wrapper.set_redirect_stderr(result_out / "stderr.log");
+    for (auto command_element : command_elements) {
+      boost::algorithm::replace_all(command_element, "\"", "\\\"");
+      command_list_str += "\"" + command_element + "\", ";
+    }
 
-    int wrapper_id = wrapper.start(true, cpu_config, false);
-    spawned_children.push_back(wrapper_id);
+    command_list_str = command_list_str.substr(0, command_list_str.size() - 2) + "]";
 
-    if (server_address == "") {
-      print("Starting adaptiveperf-server and profilers...", true, false);
-    } else {
-      print("Connecting to adaptiveperf-server and starting profilers...", true, false);
+    print("Executing the following command (as passed to the exec syscall): " +
+          command_list_str, true, false);
+  }
+
+  /**
+     Gets a timestamp in the form sent to adaptiveperf-server (e.g. the one
+     of the start of profiling), i.e. the current CLOCK_MONOTONIC time in ns
+     (internal function).
+
+     Returns an empty string (after printing what has gone wrong) if
+     the time cannot be obtained.
+
+     @param what What the timestamp is of, e.g. "profile start", for
+                 the error message.
+  */
+  static std::string get_monotonic_tstamp(std::string what) {
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+      print("Calling clock_gettime() to get the " + what + " timestamp has failed! "
+            "Exiting.", true, true);
+      return "";
+    }
+
+    return std::to_string(ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+  }
+
+  /**
+     Appends the pidfds of the processes of all profilers (see
+     Profiler::get_pidfds()) to a vector, along with their names
+     to another one and their process names and PIDs (see
+     Profiler::get_processes()) to a third one (internal function).
+  */
+  static void add_profiler_pidfds(std::vector<std::unique_ptr<Profiler> > &profilers,
+                                  std::vector<int> &pidfds,
+                                  std::vector<std::string> &pidfd_names,
+                                  std::vector<std::pair<std::string, pid_t> > &pidfd_processes) {
+    for (int i = 0; i < profilers.size(); i++) {
+      std::unordered_map<std::string, pid_t> pids;
+
+      for (auto &process : profilers[i]->get_processes()) {
+        pids[process.first] = process.second;
+      }
+
+      for (auto &elem : profilers[i]->get_pidfds()) {
+        pidfds.push_back(elem.second);
+        pidfd_names.push_back("\"" + profilers[i]->get_name() + "\" (" +
+                              elem.first + ")");
+        pidfd_processes.push_back(std::make_pair(elem.first, pids[elem.first]));
+      }
+    }
+  }
+
+  /**
+     Checks whether the requirements of all profilers are satisfied,
+     printing the first one which is not (internal function).
+  */
+  static bool check_requirements(std::vector<std::unique_ptr<Profiler> > &profilers) {
+    print("Verifying profiler requirements...", false, false);
+
+    bool requirements_fulfilled = true;
+    std::string last_requirement = "";
+
+    for (int i = 0; i < profilers.size() && requirements_fulfilled; i++) {
+      std::vector<std::unique_ptr<Requirement> > &requirements = profilers[i]->get_requirements();
+
+      for (int j = 0; j < requirements.size() && requirements_fulfilled; j++) {
+        last_requirement = requirements[j]->get_name();
+        requirements_fulfilled = requirements_fulfilled && requirements[j]->check();
+      }
+    }
+
+    if (!requirements_fulfilled) {
+      print("Requirement \"" + last_requirement + "\" is not met! Exiting.",
+            true, true);
+      return false;
     }
 
+    return true;
+  }
+
+  /**
+     Connects to adaptiveperf-server, starting it in a separate thread
+     if no external instance is used (internal function).
+
+     Returns a null pointer if the connection cannot be established.
+
+     @param server_address The address and port of an external instance of
+                           adaptiveperf-server (or "unix:<path>"), an empty
+                           string for starting an internal instance.
+     @param buf_size       A size of buffer for communication with
+                           adaptiveperf-server, in bytes.
+     @param results_dir    The directory where an internal instance of
+                           adaptiveperf-server should save the results.
+     @param tmp_dir        A temporary directory where profiling-related
+                           files are stored.
+  */
+  static std::unique_ptr<Connection> connect_to_server(std::string server_address,
+                                                       unsigned int buf_size,
+                                                       fs::path results_dir,
+                                                       fs::path tmp_dir) {
     std::unique_ptr<Connection> connection;
 
     if (server_address == "") {
@@ -395,13 +542,13 @@ namespace aperf {
       if (pipe(read_fd) != 0) {
         print("Could not open read pipe for FileDescriptor, "
               "code " + std::to_string(errno) + ". Exiting.", true, true);
-        return 2;
+        return nullptr;
       }
 
       if (pipe(write_fd) != 0) {
         print("Could not open write pipe for FileDescriptor, "
               "code " + std::to_string(errno) + ". Exiting.", true, true);
-        return 2;
+        return nullptr;
       }
 
       connection = std::make_unique<FileDescriptor>(write_fd, read_fd, buf_size);
@@ -433,6 +580,12 @@ namespace aperf {
       });
 
       client_thread.detach();
+    } else if (server_address.rfind("unix:", 0) == 0) {
+      std::string path = server_address.substr(5);
+      Poco::Net::SocketAddress address(Poco::Net::SocketAddress::UNIX_LOCAL, path);
+      Poco::Net::StreamSocket socket(address);
+
+      connection = std::make_unique<UnixSocket>(socket, path, buf_size);
     } else {
       Poco::Net::SocketAddress address(server_address);
       Poco::Net::StreamSocket socket(address);
@@ -440,203 +593,383 @@ namespace aperf {
       connection = std::make_unique<TCPSocket>(socket, buf_size);
     }
 
+    return connection;
+  }
+
+  /**
+     Starts a session in adaptiveperf-server and returns the connection
+     instructions for the profilers sent by it (internal function).
+
+     Returns a null pointer if adaptiveperf-server has reported an error.
+
+     @param connection        The connection to adaptiveperf-server.
+     @param profilers         The profilers to be connected to
+                              adaptiveperf-server.
+     @param result_name       The name of the results directory.
+     @param profiled_filename The file name of the profiled command.
+     @param session_settings  The settings of the session (see
+                              SessionSettings).
+  */
+  static std::unique_ptr<ServerConnInstrs>
+  start_server_session(std::unique_ptr<Connection> &connection,
+                       std::vector<std::unique_ptr<Profiler> > &profilers,
+                       std::string result_name,
+                       std::string profiled_filename,
+                       nlohmann::json &session_settings) {
     unsigned int pipe_triggers = 0;
 
     for (int i = 0; i < profilers.size(); i++) {
       pipe_triggers += profilers[i]->get_thread_count();
     }
 
+    connection->write("protocol " + std::to_string(PROTOCOL_VERSION));
     connection->write("start" + std::to_string(pipe_triggers) + " " + result_name);
     connection->write(profiled_filename);
+    connection->write(nlohmann::to_string(session_settings));
 
     std::string all_connection_instrs = connection->read();
 
+    // Servers older than the protocol negotiation reject the "protocol"
+    // line as a wrong command, while newer ones report the protocol version
+    // they do not support.
+    if (all_connection_instrs == "error_wrong_command" ||
+        all_connection_instrs == "error_protocol") {
+      print("adaptiveperf-server does not support the communication protocol "
+            "of this frontend (version " + std::to_string(PROTOCOL_VERSION) +
+            "), i.e. adaptiveperf and adaptiveperf-server are of incompatible "
+            "versions! Please use the same version of AdaptivePerf for both. "
+            "Exiting.", true, true);
+      return nullptr;
+    }
+
     if (std::regex_match(all_connection_instrs, std::regex("^error.*$"))) {
       print("adaptiveperf-server has encountered an error (start)! Exiting.", true, true);
-      return 2;
+      return nullptr;
     }
 
-    ServerConnInstrs connection_instrs(all_connection_instrs);
+    std::vector<std::string> wire_compression;
 
-    for (int i = 0; i < profilers.size(); i++) {
-      profilers[i]->start(wrapper_id, connection_instrs, result_out,
-                          result_processed, true);
+    if (session_settings.contains("wire_compression")) {
+      wire_compression =
+        session_settings["wire_compression"].get<std::vector<std::string> >();
     }
 
-    print("Waiting for profilers to signal their readiness. If AdaptivePerf "
-          "hangs here, you may want to check the files in " +
-          tmp_dir.string() + ".", true, false);
+    return std::make_unique<ServerConnInstrs>(all_connection_instrs, wire_compression);
+  }
 
-    auto profiler_and_wrapper_handler =
-      [&](int code, long start_time, long end_time) {
-        bool error = false;
-        for (int i = 0; i < profilers.size(); i++) {
-          int code = profilers[i]->wait();
+  /**
+     Waits for all profilers to finish and checks their exit codes along
+     with the exit code of the profiled command wrapper, printing what has
+     gone wrong if anything (internal function).
+
+     Returns 0 if everything has succeeded and 2 otherwise.
+
+     @param profilers  The profilers to wait for.
+     @param code       The exit code of the profiled command wrapper, 0 if
+                       there is no wrapper.
+     @param start_time The time when the profiled command was started, in ms
+                       (-1 if unknown).
+     @param end_time   The time when the profiled command finished, in ms
+                       (-1 if unknown).
+  */
+  static int check_profilers_and_wrapper(std::vector<std::unique_ptr<Profiler> > &profilers,
+                                         int code, long start_time, long end_time) {
+    bool error = false;
+    for (int i = 0; i < profilers.size(); i++) {
+      int code = profilers[i]->wait();
 
-          if (code != 0) {
-            error = true;
-            break;
-          }
-        }
+      if (code != 0) {
+        error = true;
+        break;
+      }
+    }
 
-        if (error) {
-          print("One or more profilers have encountered an error.", true, true);
-        }
+    if (error) {
+      print("One or more profilers have encountered an error.", true, true);
+    }
 
-        if (code == 0) {
-          if (start_time != -1 && end_time != -1) {
-            print("Command execution completed in ~" +
-                      std::to_string(end_time - start_time) + " ms!",
-                  true, false);
-          }
-        } else if (code == Process::ERROR_NOT_FOUND) {
-          print("Provided command does not exist!", true, true);
-          error = true;
-        } else if (code == Process::ERROR_NO_ACCESS) {
-          print("Cannot access the provided command!", true, true);
-          print("Hint: You may want to mark your file as executable by running \"chmod +x <file>\".", true, true);
-          error = true;
-        } else {
-          print("Profiled program wrapper has finished with non-zero exit code " +
-                std::to_string(code) + ".", true, true);
-
-          switch (code) {
-          case Process::ERROR_START_PROFILE:
-            print("Hint: Code " + std::to_string(code) + " suggests something "
-                  "bad happened when instructing the wrapper to execute the "
-                  "profiled command.", true, true);
-            break;
-
-          case Process::ERROR_STDOUT:
-            print("Hint: Code " + std::to_string(code) + " suggests something "
-                  "bad happened when opening the stdout log file for writing.", true, true);
-            break;
-
-          case Process::ERROR_STDERR:
-            print("Hint: Code " + std::to_string(code) + " suggests something "
-                  "bad happened when opening the stderr log file for writing.", true, true);
-            break;
-
-          case Process::ERROR_STDOUT_DUP2:
-            print("Hint: Code " + std::to_string(code) + " suggests something "
-                  "bad happened when redirecting stdout of the profiled command "
-                  "wrapper to the stdout log file.", true, true);
-            break;
-
-          case Process::ERROR_STDERR_DUP2:
-            print("Hint: Code " + std::to_string(code) + " suggests something "
-                  "bad happened when redirecting stderr of the profiled command "
-                  "wrapper to the stderr log file.", true, true);
-            break;
-
-          case Process::ERROR_AFFINITY:
-            print("Hint: Code " + std::to_string(code) + " suggests something "
-                  "bad happened when isolating the profiled command wrapper "
-                  "CPU-wise from the profilers.", true, true);
-            break;
-          }
+    if (code == 0) {
+      if (start_time != -1 && end_time != -1) {
+        print("Command execution completed in ~" +
+                  std::to_string(end_time - start_time) + " ms!",
+              true, false);
+      }
+    } else if (code == Process::ERROR_NOT_FOUND) {
+      print("Provided command does not exist!", true, true);
+      error = true;
+    } else if (code == Process::ERROR_NO_ACCESS) {
+      print("Cannot access the provided command!", true, true);
+      print("Hint: You may want to mark your file as executable by running \"chmod +x <file>\".", true, true);
+      error = true;
+    } else {
+      print("Profiled program wrapper has finished with non-zero exit code " +
+            std::to_string(code) + ".", true, true);
+
+      switch (code) {
+      case Process::ERROR_START_PROFILE:
+        print("Hint: Code " + std::to_string(code) + " suggests something "
+              "bad happened when instructing the wrapper to execute the "
+              "profiled command.", true, true);
+        break;
 
-          error = true;
-        }
+      case Process::ERROR_STDOUT:
+        print("Hint: Code " + std::to_string(code) + " suggests something "
+              "bad happened when opening the stdout log file for writing.", true, true);
+        break;
 
-        if (error) {
-          print("Errors have occurred! Exiting.", true, true);
-          return 2;
-        } else {
-          return 0;
-        }
-      };
+      case Process::ERROR_STDERR:
+        print("Hint: Code " + std::to_string(code) + " suggests something "
+              "bad happened when opening the stderr log file for writing.", true, true);
+        break;
 
-    std::string notification_msg;
+      case Process::ERROR_STDOUT_DUP2:
+        print("Hint: Code " + std::to_string(code) + " suggests something "
+              "bad happened when redirecting stdout of the profiled command "
+              "wrapper to the stdout log file.", true, true);
+        break;
 
-    while (true) {
-      try {
-        notification_msg = connection->read(NOTIFY_TIMEOUT);
+      case Process::ERROR_STDERR_DUP2:
+        print("Hint: Code " + std::to_string(code) + " suggests something "
+              "bad happened when redirecting stderr of the profiled command "
+              "wrapper to the stderr log file.", true, true);
+        break;
+
+      case Process::ERROR_AFFINITY:
+        print("Hint: Code " + std::to_string(code) + " suggests something "
+              "bad happened when isolating the profiled command wrapper "
+              "CPU-wise from the profilers.", true, true);
         break;
-      } catch (TimeoutException &e) {
-        if (!wrapper.is_running()) {
-          int code = profiler_and_wrapper_handler(wrapper.join(), -1, -1);
-          if (code != 0) {
-            return code;
-          }
-        }
       }
+
+      error = true;
     }
 
-    if (notification_msg != "start_profile") {
-      print("adaptiveperf-server has sent something else than a notification "
-            "of the profiler readiness! Exiting.", true, true);
+    if (error) {
+      print("Errors have occurred! Exiting.", true, true);
       return 2;
+    } else {
+      return 0;
     }
+  }
 
-    print("All profilers have signalled their readiness, waiting " +
-          std::to_string(warmup) + " second(s)...", true, false);
-    std::this_thread::sleep_for(warmup * 1s);
-
-    print("Profiling...", false, false);
+  /**
+     Checks whether an exited process has exited with an error, without
+     reaping it so that its profiler can still obtain its exit code
+     (internal function).
 
-    std::string command_list_str = "[";
+     Returns false if the process has exited with code 0, it has not
+     exited yet, or it has already been reaped (e.g. by its profiler,
+     which reacts to its errors itself).
 
-    for (auto command_element : command_elements) {
-      boost::algorithm::replace_all(command_element, "\"", "\\\"");
-      command_list_str += "\"" + command_element + "\", ";
+     @param pid The PID of the process.
+  */
+  static bool has_exited_with_error(pid_t pid) {
+    // WNOWAIT leaves the process waitable.
+    siginfo_t info;
+    info.si_pid = 0;
+
+    if (waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) != 0 ||
+        info.si_pid == 0) {
+      return false;
     }
 
-    command_list_str = command_list_str.substr(0, command_list_str.size() - 2) + "]";
-
-    print("Executing the following command (as passed to the exec syscall): " +
-          command_list_str, true, false);
+    return info.si_code != CLD_EXITED || info.si_status != 0;
+  }
 
-    struct timespec ts;
+  /**
+     Waits until the profiled command wrapper exits or any profiler
+     process exits earlier, terminating the wrapper in the latter case if
+     the profile would be incomplete anyway, i.e. if the process is
+     a "perf-record" process or it has exited with an error (internal
+     function).
+
+     A profiler process already reaped by its profiler is not checked
+     for errors here, as its profiler reacts to them itself.
+
+     @param pidfds          The pidfds of the wrapper (pidfds[0]) and the
+                            processes of the profilers. Nothing is done if
+                            there are no pidfds of the profilers.
+     @param pidfd_names     The names of the processes corresponding to
+                            pidfds.
+     @param pidfd_processes The process names (see Profiler::get_processes())
+                            and PIDs corresponding to pidfds.
+     @param wrapper_id      The PID of the wrapper.
+  */
+  static void wait_for_wrapper(std::vector<int> &pidfds,
+                               std::vector<std::string> &pidfd_names,
+                               std::vector<std::pair<std::string, pid_t> > &pidfd_processes,
+                               pid_t wrapper_id) {
+    if (pidfds.size() > 1) {
+      int event = wait_for_event(nullptr, pidfds, NO_TIMEOUT);
+
+      if (event <= 0) {
+        return;
+      }
 
-    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
-      print("Calling clock_gettime() to get the profile start timestamp has failed! "
-            "Exiting.", true, true);
-      return 2;
-    }
+      std::vector<int> wrapper_pidfd = {pidfds[0]};
 
-    std::string tstamp_msg = std::to_string(ts.tv_sec * 1000000000ULL + ts.tv_nsec);
-    connection->write(tstamp_msg);
+      if (wait_for_event(nullptr, wrapper_pidfd, 0) == 0) {
+        return;
+      }
 
-    notification_msg = connection->read();
+      if (pidfd_processes[event].first != "perf-record" &&
+          !has_exited_with_error(pidfd_processes[event].second)) {
+        return;
+      }
 
-    if (notification_msg != "tstamp_ack") {
-      print("adaptiveperf-server has sent something else than a notification "
-            "of acknowledging the profile start timestamp receipt! Exiting.", true, true);
-      return 2;
+      print("Profiler " + pidfd_names[event] + " has exited before the profiled "
+            "command finished. Terminating the profiled command wrapper.", true, true);
+      kill(wrapper_id, SIGTERM);
     }
+  }
 
-    auto start_time =
-      ch::duration_cast<ch::milliseconds>(ch::system_clock::now().time_since_epoch()).count();
+  /**
+     Gets the profiling overhead as sent to adaptiveperf-server at the end
+     of a profiling session (internal function).
+
+     @param profilers             The profilers used, already finished.
+     @param overhead_monitor      The monitor of the resource usage during
+                                  profiling, already stopped.
+     @param frontend_process_name The name of the AdaptivePerf frontend
+                                  process in overhead_monitor.
+     @param start_time            The time when the profiled command was
+                                  started, in ms.
+     @param end_time              The time when the profiled command
+                                  finished, in ms.
+  */
+  static nlohmann::json get_overhead(std::vector<std::unique_ptr<Profiler> > &profilers,
+                                     OverheadMonitor &overhead_monitor,
+                                     std::string frontend_process_name,
+                                     long start_time, long end_time) {
+    nlohmann::json overhead;
+    overhead["command_wall_time_ms"] = end_time - start_time;
+    overhead["processes"] = overhead_monitor.get_summary();
+    overhead["lost"] = nlohmann::json::object();
+
+    // The final resource usage reported by the kernel after the
+    // processes have finished takes precedence over the last sample.
+    for (int i = 0; i < profilers.size(); i++) {
+      nlohmann::json info = profilers[i]->get_overhead_info();
 
-    wrapper.notify();
-    wrapper.close_stdin();
-    int exit_code = wrapper.join();
+      for (auto &elem : info["processes"].items()) {
+        overhead["processes"][profilers[i]->get_name() + " (" +
+                              elem.key() + ")"].update(elem.value());
+      }
 
-    auto end_time =
-      ch::duration_cast<ch::milliseconds>(ch::system_clock::now().time_since_epoch()).count();
+      overhead["lost"][profilers[i]->get_name()] = info["lost"];
+    }
 
-    int code = profiler_and_wrapper_handler(exit_code, start_time, end_time);
+    struct rusage frontend_usage;
 
-    if (code != 0) {
-      return code;
+    if (getrusage(RUSAGE_SELF, &frontend_usage) == 0) {
+      overhead["processes"][frontend_process_name].update(
+        usage_to_json(rusage_to_usage(frontend_usage)));
     }
 
-    std::string msg = connection->read();
+    unsigned long long total_cpu_ms = 0;
 
-    if (msg != "out_files" && msg != "profiling_finished") {
-      print("adaptiveperf-server has not indicated its successful completion! Exiting.",
-            true, true);
-      return 2;
+    for (auto &elem : overhead["processes"]) {
+      total_cpu_ms += (unsigned long long)elem["user_ms"] +
+        (unsigned long long)elem["sys_ms"];
     }
 
-    print("Processing results...", false, false);
+    overhead["total_cpu_ms"] = total_cpu_ms;
+    overhead["cpu_overhead_percent"] = end_time > start_time ?
+      100.0 * total_cpu_ms / (end_time - start_time) : 0.0;
 
-    std::unordered_set<fs::path> perf_map_paths;
-    std::unordered_map<std::string, std::unordered_set<std::string> > dso_offsets;
-    bool perf_maps_expected = false;
+    return overhead;
+  }
 
-    for (int i = 0; i < profilers.size(); i++) {
+  /**
+     Prints a warning if the profilers have reported lost events in the
+     profiling overhead returned by get_overhead() (internal function).
+  */
+  static void warn_about_lost_events(nlohmann::json &overhead) {
+    unsigned long long lost_events = 0;
+    bool samples_lost = false;
+
+    for (auto &profiler : overhead["lost"]) {
+      for (auto &process : profiler) {
+        lost_events += (unsigned long long)process["lost_chunks"];
+
+        if ((double)process["lost_samples_percent"] > 0) {
+          samples_lost = true;
+        }
+
+        if (process.contains("events")) {
+          for (auto &event : process["events"]) {
+            lost_events += (unsigned long long)event[3];
+          }
+        }
+      }
+    }
+
+    if (lost_events > 0 || samples_lost) {
+      print("\"perf\" has reported lost events, so some parts of the profile "
+            "are missing (they are marked in \"lost_samples\" in metadata.json)! "
+            "Consider increasing the number of post-processing threads (-p) "
+            "or lowering the sampling frequency (-F).", true, true);
+    }
+  }
+
+  /**
+     Finishes a session in adaptiveperf-server after the profilers have
+     sent all events and the profiling overhead has been sent: handles
+     the messages of the profilers (e.g. symbol maps and source code
+     details) and saves or transfers the result files (internal function).
+
+     Returns 0 on success and 2 otherwise.
+
+     @param profilers        The profilers used, already finished.
+     @param connection       The connection to adaptiveperf-server.
+     @param server_address   See connect_to_server().
+     @param buf_size         A size of buffer for communication with
+                             adaptiveperf-server, in bytes.
+     @param cpu_config       A CPUConfig object describing how available
+                             cores should be used.
+     @param results_dir      The directory where an internal instance of
+                             adaptiveperf-server saves the results.
+     @param result_out       The path to the "out" directory of results of
+                             the session.
+     @param result_processed The path to the "processed" directory of
+                             results of the session.
+     @param codes_dst        See start_profiling_session().
+     @param session_settings The settings of the session (see
+                             SessionSettings).
+  */
+  static int finish_session(std::vector<std::unique_ptr<Profiler> > &profilers,
+                            std::unique_ptr<Connection> &connection,
+                            std::string server_address,
+                            unsigned int buf_size,
+                            CPUConfig &cpu_config,
+                            fs::path results_dir,
+                            fs::path result_out,
+                            fs::path result_processed,
+                            std::string codes_dst,
+                            nlohmann::json &session_settings) {
+    std::vector<std::string> wire_compression;
+
+    if (session_settings.contains("wire_compression")) {
+      wire_compression =
+        session_settings["wire_compression"].get<std::vector<std::string> >();
+    }
+
+    std::string msg = connection->read();
+
+    if (msg != "out_files" && msg != "profiling_finished") {
+      print("adaptiveperf-server has not indicated its successful completion! Exiting.",
+            true, true);
+      return 2;
+    }
+
+    print("Processing results...", false, false);
+
+    std::unordered_set<fs::path> perf_map_paths;
+    std::unordered_map<std::string, std::unordered_set<std::string> > dso_offsets;
+    bool perf_maps_expected = false;
+    unsigned long long backpressure_stall_ns = 0;
+
+    for (int i = 0; i < profilers.size(); i++) {
       std::unique_ptr<Connection> &generic_connection = profilers[i]->get_connection();
 
       if (generic_connection.get() == nullptr) {
@@ -702,6 +1035,18 @@ namespace aperf {
                 perf_maps_expected = true;
               }
             }
+          } else if (parsed["type"] == "backpressure") {
+            if (!parsed["data"].is_object() ||
+                !parsed["data"].contains("stall_time_ns")) {
+              print("Message received from profiler \"" +
+                    profilers[i]->get_name() + "\" "
+                    "is a JSON object of type \"backpressure\", but its \"data\" "
+                    "element is not a JSON object with \"stall_time_ns\", ignoring.",
+                    true, false);
+              continue;
+            }
+
+            backpressure_stall_ns += (unsigned long long)parsed["data"]["stall_time_ns"];
           } else if (parsed["type"] == "sources") {
             if (!parsed["data"].is_object()) {
               print("Message received from profiler \"" +
@@ -742,6 +1087,15 @@ namespace aperf {
       }
     }
 
+    if (backpressure_stall_ns > 0) {
+      print("Sending events to adaptiveperf-server has been stalled for ~" +
+            std::to_string(backpressure_stall_ns / 1000000) + " ms in total "
+            "because adaptiveperf-server could not keep up (the affected regions "
+            "are marked in \"backpressure\" in metadata.json). Consider increasing "
+            "the number of post-processing threads (-p) or lowering the sampling "
+            "frequency (-F).", true, false);
+    }
+
     nlohmann::json sources_json = nlohmann::json::object();
 
     // The number of threads needs to stay at 1 here because of a bug
@@ -873,7 +1227,7 @@ namespace aperf {
         std::string file_address = match[1];
         int file_port = std::stoi(match[2]);
 
-        get_file_connection = [file_address, file_port]() {
+        get_file_connection = [file_address, file_port, wire_compression]() {
           std::unique_ptr<Connection> file_connection;
 
           Poco::Net::SocketAddress address(file_address, file_port);
@@ -882,6 +1236,31 @@ namespace aperf {
           // buf_size = 1 because it is only for string read which is unused here
           file_connection = std::make_unique<TCPSocket>(socket, 1);
 
+          if (!wire_compression.empty()) {
+            file_connection = CompressedConnection::negotiate(std::move(file_connection),
+                                                              wire_compression);
+          }
+
+          return file_connection;
+        };
+      } else if (general_match[1] == "unix") {
+        std::string file_path = general_match[2];
+
+        get_file_connection = [file_path, wire_compression]() {
+          std::unique_ptr<Connection> file_connection;
+
+          Poco::Net::SocketAddress address(Poco::Net::SocketAddress::UNIX_LOCAL,
+                                           file_path);
+          Poco::Net::StreamSocket socket(address);
+
+          // buf_size = 1 because it is only for string read which is unused here
+          file_connection = std::make_unique<UnixSocket>(socket, file_path, 1);
+
+          if (!wire_compression.empty()) {
+            file_connection = CompressedConnection::negotiate(std::move(file_connection),
+                                                              wire_compression);
+          }
+
           return file_connection;
         };
       } else {
@@ -942,23 +1321,102 @@ namespace aperf {
 
           check_data_transfer("the source code paths");
         } else if (codes_dst == "") {
-          connection->write("p src.zip", true);
+          // Servers with a code store (adaptiveperf-server -c) receive the hashes
+          // of the files first and ask only for the files they do not have yet.
+          // Other servers reply with an error and receive the whole archive.
+          connection->write("h src.zip", true);
+
+          if (connection->read() == "code_store") {
+            std::vector<std::pair<std::string, fs::path> > hashed_files;
+
+            // A separate scope is needed for the file connection to close
+            // automatically after the transfer is finished.
+            {
+              std::unique_ptr<Connection> file_connection = get_file_connection();
+
+              for (const fs::path &path : src_paths) {
+                try {
+                  std::string hash = CodeStore::hash_file(path);
+                  file_connection->write(hash + " " + path.string());
+                  hashed_files.push_back(std::make_pair(hash, path));
+                } catch (std::runtime_error &e) {
+                  print("Could not read " + path.string() + ", it will not be sent.",
+                        true, true);
+                }
+              }
+            }
 
-          try {
-            std::unique_ptr<Connection> file_connection = get_file_connection();
-            Archive archive(file_connection, false, buf_size);
-            create_src_archive(archive, src_paths, true);
-          } catch (nlohmann::json::exception &e) {
-            print("A JSON error related to creating the source code archive has occurred! "
-                  "Details: " + std::string(e.what()), true, true);
-          } catch (Archive::Exception &e) {
-            print("A source code archive creation error has occurred! "
-                  "Details: " +
-                  std::string(e.what()),
-                  true, true);
-          }
+            std::string missing_msg = connection->read();
+            std::smatch missing_match;
+
+            if (std::regex_match(missing_msg, missing_match,
+                                 std::regex("^code_store_missing (\\d+)$"))) {
+              unsigned long long missing_count = std::stoull(missing_match[1]);
+              std::unordered_set<std::string> missing;
+
+              for (unsigned long long i = 0; i < missing_count; i++) {
+                missing.insert(connection->read());
+              }
+
+              if (missing_count > 0) {
+                std::vector<std::pair<std::string, fs::path> > missing_files;
+
+                for (auto &elem : hashed_files) {
+                  if (missing.erase(elem.first) > 0) {
+                    missing_files.push_back(elem);
+                  }
+                }
+
+                try {
+                  std::unique_ptr<Connection> file_connection = get_file_connection();
+                  Archive archive(file_connection, false, buf_size,
+                                  session_settings["src_compression"]);
+                  Archive::Stats archive_stats =
+                    archive.add_files(missing_files,
+                                      cpu_config.get_profiler_thread_count());
+                  archive.close();
+                  print("Source code files missing in the code store of adaptiveperf-server "
+                        "sent: " + format_archive_stats(archive_stats) + ".", true, false);
+                } catch (Archive::Exception &e) {
+                  print("A source code archive creation error has occurred! "
+                        "Details: " + std::string(e.what()), true, true);
+                }
+              }
+
+              print(std::to_string(hashed_files.size() - missing_count) + " of " +
+                    std::to_string(hashed_files.size()) + " source code files were already "
+                    "in the code store of adaptiveperf-server.", true, false);
 
-          check_data_transfer("the source code archive");
+              check_data_transfer("the source code files");
+            } else {
+              print("Received an incorrect list of source code files missing in the code store "
+                    "of adaptiveperf-server!", true, true);
+              transfer_error = true;
+            }
+          } else {
+            connection->write("p src.zip", true);
+
+            try {
+              std::unique_ptr<Connection> file_connection = get_file_connection();
+              Archive archive(file_connection, false, buf_size,
+                              session_settings["src_compression"]);
+              Archive::Stats archive_stats =
+                create_src_archive(archive, src_paths, true,
+                                   cpu_config.get_profiler_thread_count());
+              print("Source code archive sent: " + format_archive_stats(archive_stats) + ".",
+                    true, false);
+            } catch (nlohmann::json::exception &e) {
+              print("A JSON error related to creating the source code archive has occurred! "
+                    "Details: " + std::string(e.what()), true, true);
+            } catch (Archive::Exception &e) {
+              print("A source code archive creation error has occurred! "
+                    "Details: " +
+                    std::string(e.what()),
+                    true, true);
+            }
+
+            check_data_transfer("the source code archive");
+          }
         }
 
 
@@ -1042,8 +1500,13 @@ namespace aperf {
 
       if (!src_paths.empty() && codes_dst == "") {
         try {
-          Archive archive(result_processed / "src.zip");
-          create_src_archive(archive, src_paths, true);
+          Archive archive(result_processed / "src.zip", 1024,
+                          session_settings["src_compression"]);
+          Archive::Stats archive_stats =
+            create_src_archive(archive, src_paths, true,
+                               cpu_config.get_profiler_thread_count());
+          print("Source code archive created: " + format_archive_stats(archive_stats) + ".",
+                true, false);
         } catch (nlohmann::json::exception &e) {
           print("A JSON error related to creating the source code archive has occurred! "
                 "Details: " + std::string(e.what()), true, true);
@@ -1091,6 +1554,234 @@ namespace aperf {
                fs::copy_options::recursive);
     }
 
+    return 0;
+  }
+
+  /**
+     Starts a profiling session.
+
+     @param profilers        A list of profilers used to profile the command.
+     @param command_elements A command to be profiled, in form of a vector of string parts
+                             (e.g. "adaptiveperf -f 100 test" becomes ["adaptiveperf",
+                             "-f", "100", "test"]).
+     @param server_address   The address and port of an external instance of adaptiveperf-server.
+                             If the external instance usage is not planned, server_address
+                             should be an empty string.
+     @param buf_size         A size of buffer for communication with adaptiveperf-server,
+                             in bytes.
+     @param warmup           A number of seconds between the profilers indicating their
+                             readiness and the actual execution of the command. This may have to
+                             be high on machines with weaker configurations.
+     @param cpu_config       A CPUConfig object describing how available cores should be used
+                             for profiling. It's recommended to call get_cpu_config() for this.
+     @param tmp_dir          A temporary directory where profiling-related files will be stored.
+     @param spawned_children A list of PIDs of children spawned during the profiling session.
+                             This will be populated as the function executes and it's mostly
+                             important in the context of cleaning up after the session finishes
+                             or terminates with an error.
+     @param event_dict       A dictionary mapping custom "perf" event names to their website
+                             titles (e.g. "page-faults" -> "Page faults"). This dictionary will
+                             be saved to event_dict.data in the "processed" directory.
+     @param codes_dst        TODO
+     @param session_settings The settings of the profiling session to be sent to
+                             adaptiveperf-server in form of a JSON object (see
+                             SessionSettings).
+  */
+  int start_profiling_session(std::vector<std::unique_ptr<Profiler> > &profilers,
+                              std::vector<std::string> &command_elements,
+                              std::string server_address,
+                              unsigned int buf_size, unsigned int warmup,
+                              CPUConfig &cpu_config, fs::path tmp_dir,
+                              std::vector<pid_t> &spawned_children,
+                              std::unordered_map<std::string, std::string> &event_dict,
+                              std::string codes_dst,
+                              nlohmann::json &session_settings) {
+    if (!check_requirements(profilers)) {
+      return 1;
+    }
+
+    print("Preparing for profiling...", false, false);
+
+    std::string profiled_filename = fs::path(command_elements[0]).filename();
+    std::string result_name = get_result_name(profiled_filename);
+
+    fs::path results_dir = fs::absolute(tmp_dir / "results");
+    fs::path result_dir = results_dir / result_name;
+    fs::path result_out = result_dir / "out";
+    fs::path result_processed = result_dir / "processed";
+
+    if (!create_result_dirs(result_dir, result_out, result_processed, event_dict)) {
+      return 2;
+    }
+
+    print("Starting profiled program wrapper...", true, false);
+
+    Process wrapper(command_elements);
+
+    wrapper.set_redirect_stdout(result_out / "stdout.log");
+    wrapper.set_redirect_stderr(result_out / "stderr.log");
+
+    int wrapper_id = wrapper.start(true, cpu_config, false);
+    spawned_children.push_back(wrapper_id);
+
+    if (server_address == "") {
+      print("Starting adaptiveperf-server and profilers...", true, false);
+    } else {
+      print("Connecting to adaptiveperf-server and starting profilers...", true, false);
+    }
+
+    std::unique_ptr<Connection> connection = connect_to_server(server_address, buf_size,
+                                                               results_dir, tmp_dir);
+
+    if (connection.get() == nullptr) {
+      return 2;
+    }
+
+    std::unique_ptr<ServerConnInstrs> connection_instrs =
+      start_server_session(connection, profilers, result_name, profiled_filename,
+                           session_settings);
+
+    if (connection_instrs.get() == nullptr) {
+      return 2;
+    }
+
+    for (int i = 0; i < profilers.size(); i++) {
+      profilers[i]->start(wrapper_id, *connection_instrs, result_out,
+                          result_processed, true);
+    }
+
+    OverheadMonitor overhead_monitor;
+    std::string frontend_process_name = server_address == "" ?
+      "adaptiveperf (incl. adaptiveperf-server)" : "adaptiveperf";
+
+    overhead_monitor.add_process(frontend_process_name, getpid());
+
+    for (int i = 0; i < profilers.size(); i++) {
+      for (auto &process : profilers[i]->get_processes()) {
+        overhead_monitor.add_process(profilers[i]->get_name() + " (" +
+                                     process.first + ")", process.second);
+      }
+    }
+
+    overhead_monitor.start();
+
+    print("Waiting for profilers to signal their readiness. If AdaptivePerf "
+          "hangs here, you may want to check the files in " +
+          tmp_dir.string() + ".", true, false);
+
+    // adaptiveperf-server, the profiled command wrapper, and the processes
+    // spawned by the profilers are all waited for at once so that any of
+    // them failing is reacted to immediately. pidfds[0] is the wrapper.
+    // If pidfds are not supported, only the wrapper is checked, every
+    // NOTIFY_TIMEOUT seconds.
+    std::vector<int> pidfds;
+    std::vector<std::string> pidfd_names;
+    std::vector<std::pair<std::string, pid_t> > pidfd_processes;
+
+    if (wrapper.get_pidfd() != -1) {
+      pidfds.push_back(wrapper.get_pidfd());
+      pidfd_names.push_back("");
+      pidfd_processes.push_back(std::make_pair("", wrapper_id));
+
+      add_profiler_pidfds(profilers, pidfds, pidfd_names, pidfd_processes);
+    }
+
+    std::string notification_msg;
+
+    while (true) {
+      int event = wait_for_event(connection.get(), pidfds,
+                                 pidfds.empty() ? NOTIFY_TIMEOUT : NO_TIMEOUT);
+
+      if (event == -1) {
+        notification_msg = connection->read();
+        break;
+      } else if (event == -2 && wrapper.is_running()) {
+        continue;
+      } else if (event > 0) {
+        print("Profiler " + pidfd_names[event] + " has exited before signalling "
+              "its readiness. Terminating the profiled command wrapper.", true, true);
+        kill(wrapper_id, SIGTERM);
+      }
+
+      int code = check_profilers_and_wrapper(profilers, wrapper.join(), -1, -1);
+
+      if (code == 0) {
+        print("Profiled program wrapper has finished before the profilers "
+              "signalled their readiness! Exiting.", true, true);
+        code = 2;
+      }
+
+      return code;
+    }
+
+    if (notification_msg != "start_profile") {
+      print("adaptiveperf-server has sent something else than a notification "
+            "of the profiler readiness! Exiting.", true, true);
+      return 2;
+    }
+
+    print("All profilers have signalled their readiness, waiting " +
+          std::to_string(warmup) + " second(s)...", true, false);
+    std::this_thread::sleep_for(warmup * 1s);
+
+    print("Profiling...", false, false);
+
+    print_command(command_elements);
+
+    std::string tstamp_msg = get_monotonic_tstamp("profile start");
+
+    if (tstamp_msg.empty()) {
+      return 2;
+    }
+
+    connection->write(tstamp_msg);
+
+    notification_msg = connection->read();
+
+    if (notification_msg != "tstamp_ack") {
+      print("adaptiveperf-server has sent something else than a notification "
+            "of acknowledging the profile start timestamp receipt! Exiting.", true, true);
+      return 2;
+    }
+
+    auto start_time =
+      ch::duration_cast<ch::milliseconds>(ch::system_clock::now().time_since_epoch()).count();
+
+    wrapper.notify();
+    wrapper.close_stdin();
+
+    // The profilers should run for as long as the profiled command does
+    wait_for_wrapper(pidfds, pidfd_names, pidfd_processes, wrapper_id);
+
+    int exit_code = wrapper.join();
+
+    auto end_time =
+      ch::duration_cast<ch::milliseconds>(ch::system_clock::now().time_since_epoch()).count();
+
+    int code = check_profilers_and_wrapper(profilers, exit_code, start_time, end_time);
+
+    if (code != 0) {
+      return code;
+    }
+
+    overhead_monitor.stop();
+
+    nlohmann::json overhead = get_overhead(profilers, overhead_monitor,
+                                           frontend_process_name, start_time,
+                                           end_time);
+
+    connection->write("overhead " + nlohmann::to_string(overhead));
+
+    warn_about_lost_events(overhead);
+
+    code = finish_session(profilers, connection, server_address, buf_size,
+                          cpu_config, results_dir, result_out, result_processed,
+                          codes_dst, session_settings);
+
+    if (code != 0) {
+      return code;
+    }
+
     auto overall_end_time =
       ch::duration_cast<ch::milliseconds>(ch::system_clock::now().time_since_epoch()).count();
 
@@ -1099,4 +1790,431 @@ namespace aperf {
 
     return 0;
   }
+
+  /**
+     Starts a profiling session where the profilers only record events
+     to files (see Profiler::RECORD), so that post-processing doesn't
+     compete with the profiled command for CPU time and memory bandwidth.
+     The recording can be post-processed later by
+     start_processing_session(), e.g. by running "adaptiveperf process".
+
+     record_dir contains the recorded events, the "out" directory with
+     the logs of the profiled command and the profilers, and
+     RECORD_SESSION_FILE describing the session.
+
+     @param profilers          A list of profilers used to profile the
+                               command. They are switched to the RECORD mode.
+     @param command_elements   See start_profiling_session().
+     @param warmup             A number of seconds between starting the
+                               profilers and the actual execution of the
+                               command.
+     @param cpu_config         See start_profiling_session().
+     @param tmp_dir            See start_profiling_session().
+     @param spawned_children   See start_profiling_session().
+     @param event_dict         See start_profiling_session().
+     @param session_settings   See start_profiling_session(). They are used
+                               when the recording is processed.
+     @param record_dir         The directory where the recording should be
+                               saved. It is created if it doesn't exist, but
+                               it must not contain another recording.
+     @param record_compression See Profiler::set_mode().
+     @param record_info        Details of the session which are needed for
+                               processing the recording, but are not known
+                               to this function (e.g. how to construct the
+                               profilers again). They are saved to
+                               RECORD_SESSION_FILE along with
+                               "result_name", "profiled_filename",
+                               "event_dict", "session_settings", "tstamp"
+                               (the profile start timestamp), "end_tstamp"
+                               (the timestamp of the profiled command exit),
+                               and "overhead" (the profiling overhead).
+  */
+  int start_recording_session(std::vector<std::unique_ptr<Profiler> > &profilers,
+                              std::vector<std::string> &command_elements,
+                              unsigned int warmup,
+                              CPUConfig &cpu_config, fs::path tmp_dir,
+                              std::vector<pid_t> &spawned_children,
+                              std::unordered_map<std::string, std::string> &event_dict,
+                              nlohmann::json &session_settings,
+                              fs::path record_dir, int record_compression,
+                              nlohmann::json &record_info) {
+    if (!check_requirements(profilers)) {
+      return 1;
+    }
+
+    print("Preparing for recording...", false, false);
+
+    std::string profiled_filename = fs::path(command_elements[0]).filename();
+    std::string result_name = get_result_name(profiled_filename);
+
+    record_dir = fs::absolute(record_dir);
+    fs::path record_out = record_dir / "out";
+
+    if (fs::exists(record_dir / RECORD_SESSION_FILE)) {
+      print(record_dir.string() + " already contains a recording! Exiting.",
+            true, true);
+      return 2;
+    }
+
+    try {
+      fs::create_directories(record_out);
+    } catch (fs::filesystem_error) {
+      print("Could not create " + record_out.string() + "! Exiting.", true, true);
+      return 2;
+    }
+
+    print("Starting profiled program wrapper...", true, false);
+
+    Process wrapper(command_elements);
+
+    wrapper.set_redirect_stdout(record_out / "stdout.log");
+    wrapper.set_redirect_stderr(record_out / "stderr.log");
+
+    int wrapper_id = wrapper.start(true, cpu_config, false);
+    spawned_children.push_back(wrapper_id);
+
+    print("Starting profilers...", true, false);
+
+    // There is no adaptiveperf-server to connect to when recording
+    ServerConnInstrs connection_instrs("");
+
+    for (int i = 0; i < profilers.size(); i++) {
+      profilers[i]->set_mode(Profiler::RECORD, record_dir, record_compression);
+      profilers[i]->start(wrapper_id, connection_instrs, record_out,
+                          record_dir, true);
+    }
+
+    OverheadMonitor overhead_monitor;
+    overhead_monitor.add_process("adaptiveperf", getpid());
+
+    for (int i = 0; i < profilers.size(); i++) {
+      for (auto &process : profilers[i]->get_processes()) {
+        overhead_monitor.add_process(profilers[i]->get_name() + " (" +
+                                     process.first + ")", process.second);
+      }
+    }
+
+    overhead_monitor.start();
+
+    // Nothing signals that the profilers are ready when they only
+    // record events, so they are given the warmup time to start.
+    print("Waiting " + std::to_string(warmup) + " second(s) for the profilers "
+          "to start...", true, false);
+
+    std::vector<int> pidfds;
+    std::vector<std::string> pidfd_names;
+    std::vector<std::pair<std::string, pid_t> > pidfd_processes;
+    int event = -2;
+
+    if (wrapper.get_pidfd() != -1) {
+      pidfds.push_back(wrapper.get_pidfd());
+      pidfd_names.push_back("");
+      pidfd_processes.push_back(std::make_pair("", wrapper_id));
+
+      add_profiler_pidfds(profilers, pidfds, pidfd_names, pidfd_processes);
+      event = wait_for_event(nullptr, pidfds, warmup);
+    } else {
+      std::this_thread::sleep_for(warmup * 1s);
+    }
+
+    if (event != -2 || !wrapper.is_running()) {
+      if (event > 0) {
+        print("Profiler " + pidfd_names[event] + " has exited before the profiled "
+              "command started. Terminating the profiled command wrapper.", true, true);
+        kill(wrapper_id, SIGTERM);
+      }
+
+      int code = check_profilers_and_wrapper(profilers, wrapper.join(), -1, -1);
+
+      if (code == 0) {
+        print("Profiled program wrapper has finished before the profiled command "
+              "started! Exiting.", true, true);
+        code = 2;
+      }
+
+      return code;
+    }
+
+    print("Recording...", false, false);
+    print_command(command_elements);
+
+    std::string tstamp_msg = get_monotonic_tstamp("profile start");
+
+    if (tstamp_msg.empty()) {
+      return 2;
+    }
+
+    auto start_time =
+      ch::duration_cast<ch::milliseconds>(ch::system_clock::now().time_since_epoch()).count();
+
+    wrapper.notify();
+    wrapper.close_stdin();
+
+    // The profilers should run for as long as the profiled command does
+    wait_for_wrapper(pidfds, pidfd_names, pidfd_processes, wrapper_id);
+
+    int exit_code = wrapper.join();
+
+    // The end of the profiled run is needed for splitting the recording
+    // into time chunks when it is processed
+    std::string end_tstamp_msg = get_monotonic_tstamp("profile end");
+
+    auto end_time =
+      ch::duration_cast<ch::milliseconds>(ch::system_clock::now().time_since_epoch()).count();
+
+    // The profilers are checked (and so waited for) even if the end
+    // timestamp couldn't be obtained.
+    int code = check_profilers_and_wrapper(profilers, exit_code, start_time, end_time);
+
+    if (code != 0) {
+      return code;
+    }
+
+    if (end_tstamp_msg.empty()) {
+      return 2;
+    }
+
+    overhead_monitor.stop();
+
+    nlohmann::json overhead = get_overhead(profilers, overhead_monitor,
+                                           "adaptiveperf", start_time, end_time);
+
+    warn_about_lost_events(overhead);
+
+    record_info["result_name"] = result_name;
+    record_info["profiled_filename"] = profiled_filename;
+    record_info["event_dict"] = event_dict;
+    record_info["session_settings"] = session_settings;
+    record_info["tstamp"] = tstamp_msg;
+    record_info["end_tstamp"] = end_tstamp_msg;
+    record_info["overhead"] = overhead;
+
+    std::ofstream session_stream(record_dir / RECORD_SESSION_FILE);
+
+    if (!session_stream) {
+      print("Could not open " + (record_dir / RECORD_SESSION_FILE).string() +
+            " for writing! Exiting.", true, true);
+      return 2;
+    }
+
+    session_stream << record_info.dump(2) << std::endl;
+
+    print("Recording saved to " + record_dir.string() + ". Run \"adaptiveperf "
+          "process " + record_dir.string() + "\" to process it.", false, false);
+
+    return 0;
+  }
+
+  /**
+     Starts a session post-processing a recording made by
+     start_recording_session(), producing the same results as
+     start_profiling_session() would.
+
+     All profilers post-process their recorded events at the same time,
+     using as many threads as cpu_config allows.
+
+     @param profilers      A list of profilers constructed in the same way
+                           as for the recording. They are switched to
+                           the PROCESS mode.
+     @param record_dir     The directory with the recording.
+     @param record_info    The parsed RECORD_SESSION_FILE of the recording.
+                           Its "session_settings" are sent to
+                           adaptiveperf-server, so they can be modified
+                           before calling this function (e.g. to set
+                           "wire_compression").
+     @param server_address See start_profiling_session().
+     @param buf_size       See start_profiling_session().
+     @param cpu_config     A CPUConfig object describing what cores should be
+                           used for post-processing.
+     @param tmp_dir        See start_profiling_session().
+     @param codes_dst      See start_profiling_session().
+  */
+  int start_processing_session(std::vector<std::unique_ptr<Profiler> > &profilers,
+                               fs::path record_dir, nlohmann::json &record_info,
+                               std::string server_address,
+                               unsigned int buf_size,
+                               CPUConfig &cpu_config, fs::path tmp_dir,
+                               std::string codes_dst) {
+    print("Preparing for processing...", false, false);
+
+    std::string result_name;
+    std::string profiled_filename;
+    std::unordered_map<std::string, std::string> event_dict;
+    std::string tstamp_msg;
+    nlohmann::json overhead;
+
+    try {
+      result_name = record_info["result_name"].get<std::string>();
+      profiled_filename = record_info["profiled_filename"].get<std::string>();
+      event_dict = record_info["event_dict"].get<std::unordered_map<std::string,
+                                                                    std::string> >();
+      tstamp_msg = record_info["tstamp"].get<std::string>();
+      overhead = record_info["overhead"];
+    } catch (nlohmann::json::exception &e) {
+      print((record_dir / RECORD_SESSION_FILE).string() + " does not describe "
+            "a complete recording! Exiting.", true, true);
+      return 2;
+    }
+
+    nlohmann::json &session_settings = record_info["session_settings"];
+
+    record_dir = fs::absolute(record_dir);
+
+    fs::path results_dir = fs::absolute(tmp_dir / "results");
+    fs::path result_dir = results_dir / result_name;
+    fs::path result_out = result_dir / "out";
+    fs::path result_processed = result_dir / "processed";
+
+    if (!create_result_dirs(result_dir, result_out, result_processed, event_dict)) {
+      return 2;
+    }
+
+    // The logs of the profiled command and perf-record end up in the "out"
+    // directory in the same way as when the events are processed live.
+    try {
+      fs::copy(record_dir / "out", result_out, fs::copy_options::recursive);
+    } catch (fs::filesystem_error &e) {
+      print("Could not copy the logs from " + (record_dir / "out").string() +
+            "! Exiting.", true, true);
+      return 2;
+    }
+
+    if (server_address == "") {
+      print("Starting adaptiveperf-server and profilers...", true, false);
+    } else {
+      print("Connecting to adaptiveperf-server and starting profilers...", true, false);
+    }
+
+    std::unique_ptr<Connection> connection = connect_to_server(server_address, buf_size,
+                                                               results_dir, tmp_dir);
+
+    if (connection.get() == nullptr) {
+      return 2;
+    }
+
+    std::unique_ptr<ServerConnInstrs> connection_instrs =
+      start_server_session(connection, profilers, result_name, profiled_filename,
+                           session_settings);
+
+    if (connection_instrs.get() == nullptr) {
+      return 2;
+    }
+
+    for (int i = 0; i < profilers.size(); i++) {
+      profilers[i]->set_mode(Profiler::PROCESS, record_dir);
+      profilers[i]->start(-1, *connection_instrs, result_out,
+                          result_processed, true);
+    }
+
+    OverheadMonitor overhead_monitor;
+    std::string frontend_process_name = server_address == "" ?
+      "adaptiveperf (incl. adaptiveperf-server)" : "adaptiveperf";
+
+    overhead_monitor.add_process(frontend_process_name, getpid());
+
+    for (int i = 0; i < profilers.size(); i++) {
+      for (auto &process : profilers[i]->get_processes()) {
+        overhead_monitor.add_process(profilers[i]->get_name() + " (" +
+                                     process.first + ")", process.second);
+      }
+    }
+
+    overhead_monitor.start();
+
+    std::vector<int> pidfds;
+    std::vector<std::string> pidfd_names;
+    std::vector<std::pair<std::string, pid_t> > pidfd_processes;
+
+    add_profiler_pidfds(profilers, pidfds, pidfd_names, pidfd_processes);
+
+    while (true) {
+      int event = wait_for_event(connection.get(), pidfds, NO_TIMEOUT);
+
+      if (event == -1) {
+        break;
+      }
+
+      if (has_exited_with_error(pidfd_processes[event].second)) {
+        print("Profiler " + pidfd_names[event] + " has exited with an error before "
+              "signalling its readiness! Exiting.", true, true);
+        return 2;
+      }
+
+      // A profiler process can legitimately finish before the readiness
+      // is signalled, e.g. perf-script processing a short recording, so
+      // only the other processes are waited for from now on.
+      pidfds.erase(pidfds.begin() + event);
+      pidfd_names.erase(pidfd_names.begin() + event);
+      pidfd_processes.erase(pidfd_processes.begin() + event);
+    }
+
+    if (connection->read() != "start_profile") {
+      print("adaptiveperf-server has sent something else than a notification "
+            "of the profiler readiness! Exiting.", true, true);
+      return 2;
+    }
+
+    print("Processing...", false, false);
+
+    // The recorded profile start timestamp is sent as the events are
+    // relative to it
+    connection->write(tstamp_msg);
+
+    if (connection->read() != "tstamp_ack") {
+      print("adaptiveperf-server has sent something else than a notification "
+            "of acknowledging the profile start timestamp receipt! Exiting.", true, true);
+      return 2;
+    }
+
+    auto start_time =
+      ch::duration_cast<ch::milliseconds>(ch::system_clock::now().time_since_epoch()).count();
+
+    int code = check_profilers_and_wrapper(profilers, 0, -1, -1);
+
+    if (code != 0) {
+      return code;
+    }
+
+    auto end_time =
+      ch::duration_cast<ch::milliseconds>(ch::system_clock::now().time_since_epoch()).count();
+
+    overhead_monitor.stop();
+
+    // The overhead of recording stays the profiling overhead as that is what
+    // the profiled command competed with. The events lost by perf-script
+    // are added to the ones lost by perf-record and the resources used for
+    // processing are reported separately.
+    nlohmann::json processing = get_overhead(profilers, overhead_monitor,
+                                             frontend_process_name, start_time,
+                                             end_time);
+
+    for (auto &elem : processing["lost"].items()) {
+      overhead["lost"][elem.key()].update(elem.value());
+    }
+
+    overhead["processing"] = nlohmann::json::object();
+    overhead["processing"]["wall_time_ms"] = end_time - start_time;
+    overhead["processing"]["processes"] = processing["processes"];
+    overhead["processing"]["total_cpu_ms"] = processing["total_cpu_ms"];
+
+    connection->write("overhead " + nlohmann::to_string(overhead));
+
+    warn_about_lost_events(overhead);
+
+    code = finish_session(profilers, connection, server_address, buf_size,
+                          cpu_config, results_dir, result_out, result_processed,
+                          codes_dst, session_settings);
+
+    if (code != 0) {
+      return code;
+    }
+
+    auto overall_end_time =
+      ch::duration_cast<ch::milliseconds>(ch::system_clock::now().time_since_epoch()).count();
+
+    print("Processing done in ~" +
+          std::to_string(overall_end_time - start_time) + " ms!", false, false);
+
+    return 0;
+  }
 };
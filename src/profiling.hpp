@@ -14,8 +14,11 @@
 #include <queue>
 #include <sched.h>
 #include <thread>
+#include <nlohmann/json.hpp>
 #include "server/socket.hpp"
 
+#define RECORD_SESSION_FILE "session.json"
+
 namespace aperf {
   namespace fs = std::filesystem;
 
@@ -93,20 +96,53 @@ namespace aperf {
   private:
     std::string type;
     std::queue<std::string> methods;
+    std::vector<std::string> wire_compression;
 
   public:
-    ServerConnInstrs(std::string all_connection_instrs);
+    ServerConnInstrs(std::string all_connection_instrs,
+                     std::vector<std::string> wire_compression = {});
     std::string get_instructions(int thread_count);
+    std::string get_wire_compression();
   };
 
   /**
      A class describing a profiler.
   */
   class Profiler {
+  public:
+    /**
+       A mode in which the profiler is run by start() (see set_mode()).
+    */
+    enum Mode {
+      /**
+         Events are captured and post-processed at the same time.
+      */
+      LIVE,
+
+      /**
+         Events are only captured and saved to files in the record
+         directory, to be post-processed later in the PROCESS mode.
+      */
+      RECORD,
+
+      /**
+         Events saved to the record directory in the RECORD mode are
+         post-processed. No process is profiled.
+      */
+      PROCESS
+    };
+
   protected:
     std::unique_ptr<Acceptor> acceptor;
     std::unique_ptr<Connection> connection;
     unsigned int buf_size;
+    Mode mode = LIVE;
+    fs::path record_dir;
+    int record_compression = 0;
+    unsigned int chunk = 0;
+    unsigned int chunk_count = 1;
+    unsigned long long chunk_from = 0;
+    unsigned long long chunk_to = 0;
 
   public:
     virtual ~Profiler() { }
@@ -122,10 +158,12 @@ namespace aperf {
 
        @param pid                 The PID of a process the profiler should
                                   be attached to. This may be left unused by
-                                  classes deriving from Profiler.
+                                  classes deriving from Profiler and it is
+                                  unused in the PROCESS mode.
        @param connection_instrs   adaptiveperf-server connection
                                   instructions, sent by adaptiveperf-server
-                                  during the initial setup phase.
+                                  during the initial setup phase. They are
+                                  unused in the RECORD mode.
        @param result_out          The path to the "out" directory of
                                   results of the current profiling session.
        @param result_processed    The path to the "processed" directory of
@@ -171,6 +209,36 @@ namespace aperf {
     */
     virtual std::vector<std::unique_ptr<Requirement> > &get_requirements() = 0;
 
+    /**
+       Gets the names and PIDs of the processes spawned by the profiler
+       (e.g. for measuring the profiling overhead).
+
+       An empty vector is returned if start() hasn't been called before.
+    */
+    virtual std::vector<std::pair<std::string, pid_t> > get_processes() = 0;
+
+    /**
+       Gets the names and pidfds of the processes spawned by the profiler
+       (see Process::get_pidfd()) so that their exit can be detected
+       immediately. The names are the same as in get_processes().
+
+       The processes without a pidfd are skipped, so an empty vector is
+       returned if pidfds are not supported or start() hasn't been called
+       before.
+    */
+    virtual std::vector<std::pair<std::string, int> > get_pidfds() = 0;
+
+    /**
+       Gets the overhead information collected after the profiler has
+       finished executing, in form of a JSON object with two elements:
+       "processes" (mapping the names returned by get_processes() to the final
+       resource usage of the processes) and "lost" (describing events lost
+       by the profiler, the format is profiler-dependent).
+
+       This should be called only after wait() returns.
+    */
+    virtual nlohmann::json get_overhead_info() = 0;
+
     /**
        Sets the acceptor used for establishing a connection for
        exchanging generic messages with the profiler.
@@ -185,6 +253,51 @@ namespace aperf {
       this->buf_size = buf_size;
     }
 
+    /**
+       Sets the mode in which the profiler is run by start(). The LIVE mode
+       is used by default.
+
+       @param mode               The mode to use.
+       @param record_dir         The directory where captured events are
+                                 saved to in the RECORD mode and read from
+                                 in the PROCESS mode. It is unused in the
+                                 LIVE mode.
+       @param record_compression The compression level of the files with
+                                 captured events in the RECORD mode, 0 for
+                                 no compression. Its meaning is
+                                 profiler-dependent.
+    */
+    void set_mode(Mode mode, fs::path record_dir = "",
+                  int record_compression = 0) {
+      this->mode = mode;
+      this->record_dir = record_dir;
+      this->record_compression = record_compression;
+    }
+
+    /**
+       Restricts post-processing in the PROCESS mode to the events in
+       a time range, so that a recording can be post-processed by several
+       instances of the profiler at the same time, one per time chunk.
+
+       The chunks must cover consecutive time ranges and the profilers
+       must be started in the chronological order of their chunks (see
+       SessionSettings).
+
+       @param chunk       The index of the chunk, starting from 0.
+       @param chunk_count The number of chunks the recording is split into.
+       @param from        The smallest timestamp of an event to
+                          post-process, in ns. 0 means no lower bound.
+       @param to          The timestamp from which events should no longer
+                          be post-processed, in ns. 0 means no upper bound.
+    */
+    void set_chunk(unsigned int chunk, unsigned int chunk_count,
+                   unsigned long long from, unsigned long long to) {
+      this->chunk = chunk;
+      this->chunk_count = chunk_count;
+      this->chunk_from = from;
+      this->chunk_to = to;
+    }
+
     /**
        Gets the connection used for exchanging generic messages with
        the profiler.
@@ -205,7 +318,23 @@ namespace aperf {
                               CPUConfig &cpu_config, fs::path tmp_dir,
                               std::vector<pid_t> &spawned_children,
                               std::unordered_map<std::string, std::string> &event_dict,
-                              std::string codes_dst);
+                              std::string codes_dst,
+                              nlohmann::json &session_settings);
+  int start_recording_session(std::vector<std::unique_ptr<Profiler> > &profilers,
+                              std::vector<std::string> &command_elements,
+                              unsigned int warmup,
+                              CPUConfig &cpu_config, fs::path tmp_dir,
+                              std::vector<pid_t> &spawned_children,
+                              std::unordered_map<std::string, std::string> &event_dict,
+                              nlohmann::json &session_settings,
+                              fs::path record_dir, int record_compression,
+                              nlohmann::json &record_info);
+  int start_processing_session(std::vector<std::unique_ptr<Profiler> > &profilers,
+                               fs::path record_dir, nlohmann::json &record_info,
+                               std::string server_address,
+                               unsigned int buf_size,
+                               CPUConfig &cpu_config, fs::path tmp_dir,
+                               std::string codes_dst);
 };
 
 #endif
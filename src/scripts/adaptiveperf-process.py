@@ -9,7 +9,11 @@ import sys
 import subprocess
 import json
 import re
+import fcntl
+import hashlib
 import socket
+import zlib
+import time
 from pathlib import Path
 from collections import defaultdict
 
@@ -19,6 +23,28 @@ sys.path.append(os.environ['PERF_EXEC_PATH'] +
 from perf_trace_context import *
 from Core import *
 
+# Writes to adaptiveperf-server blocking for at least STALL_THRESHOLD_NS
+# are considered back-pressure stalls (i.e. adaptiveperf-server not keeping
+# up with the incoming events). They are aggregated per thread and per
+# time bucket of BACKPRESSURE_BUCKET_NS, based on the timestamp of the sample
+# being sent.
+STALL_THRESHOLD_NS = 1000000
+BACKPRESSURE_BUCKET_NS = 100000000
+
+# APERF_OFFLINE is set when events are read from a recording (adaptiveperf
+# process) rather than streamed by perf-record. Slow writes cannot make
+# "perf" lose events then, so they are not counted as stalls.
+OFFLINE = os.environ.get('APERF_OFFLINE') == '1'
+
+# APERF_CHUNK is set to "<index>/<count>" when a recording is split into
+# time chunks post-processed by several perf-script instances at the same
+# time. Symbol names are then compressed into codes derived from their
+# hashes rather than assigned in order of appearance, so that all instances
+# produce the same codes, and the instances merge their dictionaries into
+# the same <event type>_callchains.json file.
+CHUNKED = 'APERF_CHUNK' in os.environ
+CHUNK_CODE_LENGTH = 10
+
 cur_code_sym = [32]  # In ASCII
 
 def next_code(cur_code):
@@ -38,12 +64,34 @@ def next_code(cur_code):
     return res
 
 
+def hash_code(sym):
+    digest = hashlib.blake2b(json.dumps(sym).encode('utf-8'), digest_size=8)
+    value = int.from_bytes(digest.digest(), 'little')
+    res = ''
+
+    for i in range(CHUNK_CODE_LENGTH):
+        res += chr(32 + value % 95)
+        value //= 95
+
+    return res
+
+
+class SymbolDict(dict):
+    def __missing__(self, sym):
+        code = hash_code(sym) if CHUNKED else next_code(cur_code_sym)
+        self[sym] = code
+        return code
+
+
 event_streams = []
 next_index = 0
-symbol_dict = defaultdict(lambda: next_code(cur_code_sym))
+symbol_dict = SymbolDict()
 dso_dict = defaultdict(set)
 overall_event_type = None
 perf_map_paths = set()
+stalls = defaultdict(lambda: [0, 0])
+dump_files = {}
+compressors = {}
 
 
 def get_next_event_stream():
@@ -57,9 +105,90 @@ event_stream_dict = defaultdict(lambda: defaultdict(get_next_event_stream))
 frontend_stream = None
 
 
+# If APERF_DUMP_DIR is set, everything sent to adaptiveperf-server is also
+# written to <APERF_DUMP_DIR>/<script PID>_<stream index>.jsonl so that
+# it can be replayed later by adaptiveperf-bench-replay.
+def open_dump_files(streams):
+    dump_dir = os.environ.get('APERF_DUMP_DIR')
+
+    if dump_dir is None:
+        return
+
+    Path(dump_dir).mkdir(parents=True, exist_ok=True)
+
+    for i, stream in enumerate(streams):
+        dump_files[stream] = open(Path(dump_dir) / f'{os.getpid()}_{i}.jsonl',
+                                  mode='w')
+
+
+# If APERF_WIRE_COMPRESSION is set (to a comma-separated list of
+# "<method>[:<level>]" in order of preference), the data sent to
+# adaptiveperf-server through a socket are compressed with the first
+# method supported by both ends, agreed on right after connecting
+# (see CompressedConnection in adaptiveperf-server).
+def make_zstd_compressor(level):
+    try:
+        from compression import zstd
+        return zstd.ZstdCompressor(level=level)
+    except ImportError:
+        import zstandard
+        return zstandard.ZstdCompressor(level=level).compressobj()
+
+
+def negotiate_compression(stream):
+    methods = os.environ.get('APERF_WIRE_COMPRESSION')
+
+    if methods is None:
+        return
+
+    levels = {}
+
+    for method in methods.split(','):
+        name, _, level = method.partition(':')
+        level = int(level) if level != '' else None
+
+        if name == 'zlib':
+            levels.setdefault(name, 1 if level is None else level)
+        elif name == 'zstd':
+            try:
+                make_zstd_compressor(3)
+                levels.setdefault(name, 3 if level is None else level)
+            except ImportError:
+                pass
+
+    offer = ','.join(levels.keys()) if len(levels) > 0 else 'none'
+    stream.sendall(f'compress {offer}\n'.encode('ascii'))
+
+    reply = b''
+
+    while not reply.endswith(b'\n'):
+        data = stream.recv(1)
+
+        if len(data) == 0:
+            raise ConnectionError('adaptiveperf-server closed the connection '
+                                  'during the compression negotiation')
+
+        reply += data
+
+    method = reply.decode('ascii').strip().split(' ')[-1]
+
+    if method == 'zlib':
+        compressors[stream] = zlib.compressobj(levels[method])
+    elif method == 'zstd':
+        compressors[stream] = make_zstd_compressor(levels[method])
+
+
 def write(stream, msg):
+    if stream in dump_files:
+        dump_files[stream].write(msg + '\n')
+
     if isinstance(stream, socket.socket):
-        stream.sendall((msg + '\n').encode('utf-8'))
+        data = (msg + '\n').encode('utf-8')
+
+        if stream in compressors:
+            data = compressors[stream].compress(data)
+
+        stream.sendall(data)
     else:
         if 'b' in stream.mode:
             stream.write((msg + '\n').encode('utf-8'))
@@ -69,6 +198,26 @@ def write(stream, msg):
         stream.flush()
 
 
+def merge_callchains_file(path, reverse_symbol_dict):
+    with open(path, mode='a+') as f:
+        fcntl.flock(f, fcntl.LOCK_EX)
+        f.seek(0)
+        content = f.read()
+        merged = json.loads(content) if content.strip() != '' else {}
+
+        for code, sym in reverse_symbol_dict.items():
+            if merged.setdefault(code, list(sym)) != list(sym):
+                print(f'Symbol code {code!r} is used for both {merged[code]} '
+                      f'and {list(sym)}, keeping the former.', file=sys.stderr)
+
+        f.seek(0)
+        f.truncate()
+
+        # Keys are sorted so that the result doesn't depend on the order
+        # in which the instances finish
+        f.write(json.dumps(merged, sort_keys=True) + '\n')
+
+
 def trace_begin():
     global event_streams, frontend_stream
 
@@ -80,6 +229,12 @@ def trace_begin():
         if serv_connect[0] == 'tcp':
             stream = socket.socket()
             stream.connect((parts[0], int(parts[1])))
+            negotiate_compression(stream)
+            event_streams.append(stream)
+        elif serv_connect[0] == 'unix':
+            stream = socket.socket(socket.AF_UNIX)
+            stream.connect(i)
+            negotiate_compression(stream)
             event_streams.append(stream)
         elif serv_connect[0] == 'pipe':
             stream = os.fdopen(int(parts[1]), 'wb')
@@ -87,6 +242,8 @@ def trace_begin():
             stream.flush()
             event_streams.append(stream)
 
+    open_dump_files(event_streams)
+
     frontend_connect = os.environ['APERF_CONNECT'].split(' ')
     instrs = frontend_connect[1:]
     parts = instrs[0].split('_')
@@ -107,6 +264,7 @@ def process_event(param_dict):
     tid = param_dict['sample']['tid']
     timestamp = param_dict['sample']['time']
     period = param_dict['sample']['period']
+    cpu = param_dict['sample'].get('cpu', -1)
     raw_callchain = param_dict['callchain']
 
     parsed_event_type = re.search(r'^([^/]+)', event_type).group(1)
@@ -152,29 +310,67 @@ def process_event(param_dict):
 
     callchain = list(map(process_callchain_elem, raw_callchain))[::-1]
 
+    write_start = time.monotonic_ns()
+
     write(event_stream_dict[pid][tid], json.dumps({
         'type': 'sample',
         'event_type': parsed_event_type,
-        'pid': str(pid),
-        'tid': str(tid),
+        'pid': pid,
+        'tid': tid,
         'time': timestamp,
         'period': period,
+        'cpu': cpu,
         'callchain': callchain
     }))
 
+    write_time = time.monotonic_ns() - write_start
+
+    if not OFFLINE and write_time >= STALL_THRESHOLD_NS:
+        stall = stalls[(pid, tid, timestamp // BACKPRESSURE_BUCKET_NS)]
+        stall[0] += write_time
+        stall[1] += 1
+
 
 def trace_end():
     global event_streams, callchain_dict, overall_event_type, perf_map_paths
 
+    stream_stalls = defaultdict(list)
+
+    for (pid, tid, bucket), (stall_time, stall_count) in stalls.items():
+        stream_stalls[event_stream_dict[pid][tid]].append(
+            [pid, tid, bucket * BACKPRESSURE_BUCKET_NS,
+             stall_time, stall_count])
+
     for stream in event_streams:
+        if stream in stream_stalls:
+            write(stream, json.dumps({
+                'type': 'backpressure',
+                'data': stream_stalls[stream]
+            }))
+
         write(stream, '<STOP>')
+
+        if stream in compressors:
+            stream.sendall(compressors[stream].flush())
+
         stream.close()
 
+        if stream in dump_files:
+            dump_files[stream].close()
+
     if overall_event_type is not None:
         reverse_symbol_dict = {v: k for k, v in symbol_dict.items()}
 
-        with open(f'{overall_event_type}_callchains.json', mode='w') as f:
-            f.write(json.dumps(reverse_symbol_dict) + '\n')
+        if len(reverse_symbol_dict) < len(symbol_dict):
+            print('Some symbols have been compressed into the same codes, '
+                  'so their names may be wrong.', file=sys.stderr)
+
+        if CHUNKED:
+            merge_callchains_file(f'{overall_event_type}_callchains.json',
+                                  reverse_symbol_dict)
+        else:
+            with open(f'{overall_event_type}_callchains.json', mode='w') as f:
+                f.write(json.dumps(reverse_symbol_dict) + '\n')
 
         write(frontend_stream, json.dumps({
             'type': 'sources',
@@ -186,5 +382,13 @@ def trace_end():
             'data': list(perf_map_paths)
         }))
 
+        write(frontend_stream, json.dumps({
+            'type': 'backpressure',
+            'data': {
+                'stall_time_ns': sum(s[0] for s in stalls.values()),
+                'stall_count': sum(s[1] for s in stalls.values())
+            }
+        }))
+
     write(frontend_stream, '<STOP>')
     frontend_stream.close()
@@ -11,6 +11,7 @@ import re
 import json
 import subprocess
 import socket
+import zlib
 from pathlib import Path
 from collections import defaultdict
 
@@ -42,11 +43,94 @@ tid_dict = {}
 symbol_dict = defaultdict(lambda: next_code(cur_code_sym))
 dso_dict = defaultdict(set)
 perf_map_paths = set()
+dump_files = {}
+compressors = {}
+
+
+# If APERF_DUMP_DIR is set, everything sent to adaptiveperf-server is also
+# written to <APERF_DUMP_DIR>/<script PID>_<stream index>.jsonl so that
+# it can be replayed later by adaptiveperf-bench-replay.
+def open_dump_files(streams):
+    dump_dir = os.environ.get('APERF_DUMP_DIR')
+
+    if dump_dir is None:
+        return
+
+    Path(dump_dir).mkdir(parents=True, exist_ok=True)
+
+    for i, stream in enumerate(streams):
+        dump_files[stream] = open(Path(dump_dir) / f'{os.getpid()}_{i}.jsonl',
+                                  mode='w')
+
+
+# If APERF_WIRE_COMPRESSION is set (to a comma-separated list of
+# "<method>[:<level>]" in order of preference), the data sent to
+# adaptiveperf-server through a socket are compressed with the first
+# method supported by both ends, agreed on right after connecting
+# (see CompressedConnection in adaptiveperf-server).
+def make_zstd_compressor(level):
+    try:
+        from compression import zstd
+        return zstd.ZstdCompressor(level=level)
+    except ImportError:
+        import zstandard
+        return zstandard.ZstdCompressor(level=level).compressobj()
+
+
+def negotiate_compression(stream):
+    methods = os.environ.get('APERF_WIRE_COMPRESSION')
+
+    if methods is None:
+        return
+
+    levels = {}
+
+    for method in methods.split(','):
+        name, _, level = method.partition(':')
+        level = int(level) if level != '' else None
+
+        if name == 'zlib':
+            levels.setdefault(name, 1 if level is None else level)
+        elif name == 'zstd':
+            try:
+                make_zstd_compressor(3)
+                levels.setdefault(name, 3 if level is None else level)
+            except ImportError:
+                pass
+
+    offer = ','.join(levels.keys()) if len(levels) > 0 else 'none'
+    stream.sendall(f'compress {offer}\n'.encode('ascii'))
+
+    reply = b''
+
+    while not reply.endswith(b'\n'):
+        data = stream.recv(1)
+
+        if len(data) == 0:
+            raise ConnectionError('adaptiveperf-server closed the connection '
+                                  'during the compression negotiation')
+
+        reply += data
+
+    method = reply.decode('ascii').strip().split(' ')[-1]
+
+    if method == 'zlib':
+        compressors[stream] = zlib.compressobj(levels[method])
+    elif method == 'zstd':
+        compressors[stream] = make_zstd_compressor(levels[method])
 
 
 def write(stream, msg):
+    if stream in dump_files:
+        dump_files[stream].write(msg + '\n')
+
     if isinstance(stream, socket.socket):
-        stream.sendall((msg + '\n').encode('utf-8'))
+        data = (msg + '\n').encode('utf-8')
+
+        if stream in compressors:
+            data = compressors[stream].compress(data)
+
+        stream.sendall(data)
     else:
         if 'b' in stream.mode:
             stream.write((msg + '\n').encode('utf-8'))
@@ -99,7 +183,7 @@ def syscall_callback(stack, ret_value):
 
     write(event_stream, json.dumps({
         'type': 'syscall',
-        'ret_value': str(ret_value),
+        'ret_value': ret_value,
         'callchain': callchain
     }))
 
@@ -110,10 +194,10 @@ def syscall_tree_callback(syscall_type, comm_name, pid, tid, time,
         'type': 'syscall_meta',
         'subtype': syscall_type,
         'comm': comm_name,
-        'pid': str(pid),
-        'tid': str(tid),
+        'pid': pid,
+        'tid': tid,
         'time': time,
-        'ret_value': str(ret_value)
+        'ret_value': ret_value
     }))
 
 
@@ -127,11 +211,18 @@ def trace_begin():
         event_stream = socket.socket()
         event_stream.connect((parts[0],
                               int(parts[1])))
+        negotiate_compression(event_stream)
+    elif serv_connect[0] == 'unix':
+        event_stream = socket.socket(socket.AF_UNIX)
+        event_stream.connect(serv_connect[1])
+        negotiate_compression(event_stream)
     elif serv_connect[0] == 'pipe':
         event_stream = os.fdopen(int(parts[1]), 'wb')
         event_stream.write('connect'.encode('ascii'))
         event_stream.flush()
 
+    open_dump_files([event_stream])
+
     frontend_connect = os.environ['APERF_CONNECT'].split(' ')
     instrs = frontend_connect[1:]
     parts = instrs[0].split('_')
@@ -147,8 +238,15 @@ def trace_end():
     global event_stream, callchain_dict, perf_map_paths
 
     write(event_stream, '<STOP>')
+
+    if event_stream in compressors:
+        event_stream.sendall(compressors[event_stream].flush())
+
     event_stream.close()
 
+    if event_stream in dump_files:
+        dump_files[event_stream].close()
+
     reverse_symbol_dict = {v: k for k, v in symbol_dict.items()}
 
     with open('syscall_callchains.json', mode='w') as f:
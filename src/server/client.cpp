@@ -3,7 +3,12 @@
 
 #include "server.hpp"
 #include "archive.hpp"
+#include "compress.hpp"
 #include "common.hpp"
+#include "pack.hpp"
+#include "stats.hpp"
+#include "tree.hpp"
+#include <boost/asio.hpp>
 #include <future>
 #include <filesystem>
 #include <fstream>
@@ -11,27 +16,90 @@
 #include <regex>
 #include <cmath>
 #include <unordered_set>
+#include <map>
+#include <thread>
 #include <time.h>
 
+// The width of time buckets lost samples are aggregated into, in ns
+#define LOST_SAMPLES_BUCKET_NS 100000000ULL
+
 namespace aperf {
   namespace fs = std::filesystem;
 
+  /**
+     Appends the timeline flame graphs of a thread (see
+     StdSubclient::build_timeline()) to the ones the thread already has,
+     merging the flame graphs of the same time bucket (internal function).
+
+     Both must use the same symbol name indices and the time buckets of
+     src must not precede the last time bucket of dst, as when the results
+     of consecutive time chunks of a recording are appended in order.
+
+     @param dst The timeline flame graphs to append to, in form of an object
+                mapping bucket sizes to arrays of [bucket index, flame graph].
+                If it is null, src is moved into it.
+     @param src The timeline flame graphs to append, in the same form.
+  */
+  static void append_timeline(nlohmann::json &dst, nlohmann::json &src) {
+    if (dst.is_null()) {
+      dst.swap(src);
+      return;
+    }
+
+    for (auto &bucket_size : src.items()) {
+      nlohmann::json &dst_buckets = dst[bucket_size.key()];
+
+      for (auto &bucket : bucket_size.value()) {
+        if (!dst_buckets.empty() && dst_buckets.back()[0] == bucket[0]) {
+          merge_flat_trees(dst_buckets.back()[1], bucket[1]);
+        } else {
+          dst_buckets.push_back(bucket);
+        }
+      }
+    }
+  }
+
   StdClient::StdClient(std::shared_ptr<Subclient::Factory> &subclient_factory,
                        std::unique_ptr<Connection> &connection,
                        std::unique_ptr<Acceptor> &file_acceptor,
-                       unsigned long long file_timeout_seconds) : InitClient(subclient_factory,
-                                                                             connection,
-                                                                             file_acceptor,
-                                                                             file_timeout_seconds) {
+                       unsigned long long file_timeout_seconds,
+                       bool print_stats,
+                       std::shared_ptr<CodeStore> &code_store) : InitClient(subclient_factory,
+                                                                            connection,
+                                                                            file_acceptor,
+                                                                            file_timeout_seconds) {
+    this->code_store = code_store;
     this->profile_start = false;
     this->accepted = 0;
+    this->raw_export_count = 0;
+    this->print_stats = print_stats;
   }
 
   void StdClient::process(fs::path working_dir) {
+    Stopwatch session_watch;
+    nlohmann::json stats;
+
     try {
       fs::path result_path, processed_path, out_path;
 
       std::string msg = this->connection->read();
+      unsigned int protocol_version = 1;
+
+      if (msg.rfind("protocol ", 0) == 0) {
+        try {
+          protocol_version = std::stoul(msg.substr(9));
+        } catch (...) {
+          protocol_version = 0;
+        }
+
+        if (protocol_version < 1 || protocol_version > PROTOCOL_VERSION) {
+          std::cerr << "Unsupported protocol version received: " << msg << std::endl;
+          this->connection->write("error_protocol", true);
+          return;
+        }
+
+        msg = this->connection->read();
+      }
 
       std::regex start_regex("^start([1-9]\\d*) (.+)$");
       std::smatch match;
@@ -61,13 +129,153 @@ namespace aperf {
       }
 
       std::string profiled_filename = this->connection->read();
-      std::unique_ptr<Subclient> subclients[subclient_cnt];
-      std::shared_future<void> threads[subclient_cnt];
+
+      // Frontends older than protocol version 3 don't send the session
+      // settings, so the defaults are used for them.
+      if (protocol_version >= 3) {
+        std::string settings_msg = this->connection->read();
+
+        try {
+          nlohmann::json settings = nlohmann::json::parse(settings_msg);
+
+          if (settings.contains("timeline_buckets_ms")) {
+            this->session_settings.timeline_buckets_ms =
+              settings["timeline_buckets_ms"].template get<std::vector<unsigned long long> >();
+          }
+
+          if (settings.contains("pack_threads")) {
+            this->session_settings.pack_threads = settings["pack_threads"];
+          }
+
+          if (settings.contains("group_threads")) {
+            this->session_settings.group_threads = settings["group_threads"];
+          }
+
+          if (settings.contains("prune_min_fraction")) {
+            this->session_settings.prune_min_fraction = settings["prune_min_fraction"];
+          }
+
+          if (settings.contains("prune_max_nodes")) {
+            this->session_settings.prune_max_nodes = settings["prune_max_nodes"];
+          }
+
+          if (settings.contains("fold_recursion")) {
+            this->session_settings.fold_recursion = settings["fold_recursion"];
+          }
+
+          if (settings.contains("raw_export")) {
+            this->session_settings.raw_export = settings["raw_export"];
+          }
+
+          if (settings.contains("src_compression")) {
+            this->session_settings.src_compression = settings["src_compression"];
+          }
+
+          if (settings.contains("wire_compression")) {
+            this->session_settings.wire_compression =
+              settings["wire_compression"].template get<std::vector<std::string> >();
+          }
+
+          if (settings.contains("time_chunks")) {
+            this->session_settings.time_chunks = settings["time_chunks"];
+          }
+        } catch (...) {
+          std::cerr << "Wrong session settings received: " << settings_msg << std::endl;
+          this->connection->write("error_settings", true);
+          return;
+        }
+      }
+
+      if (!this->session_settings.wire_compression.empty() &&
+          this->file_acceptor != nullptr) {
+        this->file_acceptor =
+          std::make_unique<CompressedAcceptor>(this->file_acceptor,
+                                               this->session_settings.wire_compression,
+                                               NO_TIMEOUT);
+      }
+
+      if (this->session_settings.raw_export) {
+        this->raw_export_dir = processed_path / "raw";
+
+        try {
+          fs::create_directory(this->raw_export_dir);
+        } catch (std::exception &e) {
+          std::cerr << "Could not create the raw export directory! Error details:";
+          std::cerr << std::endl;
+          std::cerr << e.what() << std::endl;
+          this->connection->write("error_result_dir", true);
+          return;
+        }
+      }
+
+      bool group = this->session_settings.group_threads == "name" ||
+        this->session_settings.group_threads == "process";
+
+      // Trees of threads from several time chunks are merged before
+      // they can be pruned and serialised, as with grouping.
+      bool merge = group || this->session_settings.time_chunks > 1;
+
+      std::vector<std::unique_ptr<Subclient> > subclients(subclient_cnt);
+
+      // Post-processing and merging work is run on a pool of as many
+      // threads as there are CPUs rather than on a new thread per
+      // subclient, thread, or group.
+      boost::asio::thread_pool pool(std::max(1U, std::thread::hardware_concurrency()));
+
+      auto run_in_pool = [&pool](auto func) {
+        auto task = std::make_shared<std::packaged_task<decltype(func())()> >(func);
+        auto future = task->get_future();
+        boost::asio::post(pool, [task]() { (*task)(); });
+        return future;
+      };
+
+      // The result of every subclient is post-processed in the pool (see
+      // post_process_result()) as soon as the subclient finishes and the
+      // profiling start timestamp is known, with the subclient posting
+      // the work itself so that no thread of the pool waits for unfinished
+      // subclients. If trees are not merged, this includes their
+      // serialisation, so saving threads starts while other subclients
+      // are still running. Only moving the post-processed results into the
+      // session-wide objects is done sequentially, in the subclient order
+      // so that the output is deterministic.
+      std::vector<std::future<unsigned long long> > post_threads(subclient_cnt);
+      std::vector<std::future<void> > threads(subclient_cnt);
+
+      // Subclients waiting for the profiling start timestamp are released
+      // (with the promise broken) if this method returns before receiving it.
+      std::promise<unsigned long long> profile_start_promise;
+      this->profile_start_future = profile_start_promise.get_future().share();
 
       for (int i = 0; i < subclient_cnt; i++) {
         subclients[i] = this->subclient_factory->make_subclient(*this, profiled_filename,
                                                                 this->connection->get_buf_size());
-        threads[i] = std::async(&Subclient::process, subclients[i].get());
+        Subclient *subclient = subclients[i].get();
+
+        auto post_task =
+          std::make_shared<std::packaged_task<unsigned long long(std::exception_ptr)> >(
+            [this, subclient, merge](std::exception_ptr error) {
+              if (error) {
+                std::rethrow_exception(error);
+              }
+
+              return this->post_process_result(subclient->get_result(), !merge);
+            });
+
+        post_threads[i] = post_task->get_future();
+
+        threads[i] = std::async([this, subclient, post_task, &pool]() {
+          std::exception_ptr error;
+
+          try {
+            subclient->process();
+          } catch (...) {
+            error = std::current_exception();
+          }
+
+          if (error || this->wait_for_profile_start_tstamp(nullptr)) {
+            boost::asio::post(pool, [post_task, error]() { (*post_task)(error); });
+          }
+        });
       }
 
       std::string instr_msg = subclient_factory->get_type();
@@ -95,69 +303,158 @@ namespace aperf {
 
       this->profile_start_tstamp = std::stoull(tstamp_msg);
       this->profile_start = true;
+      profile_start_promise.set_value(this->profile_start_tstamp);
 
       this->connection->write("tstamp_ack", true);
 
       nlohmann::json final_output;
       nlohmann::json metadata;
 
-      std::unordered_set<std::string> tids;
+      unsigned long long subclient_wait_ns = 0;
+      Stopwatch merge_watch;
+      stats["subclients"] = nlohmann::json::array();
+
+      std::unordered_set<int> tids;
 
       metadata["thread_tree"] = nlohmann::json::array();
       metadata["callchains"] = nlohmann::json::object();
       metadata["offcpu_regions"] = nlohmann::json::object();
       metadata["sampled_times"] = nlohmann::json::object();
+      metadata["backpressure"] = nlohmann::json::object();
+      metadata["lost_samples"] = nlohmann::json::object();
+
+      nlohmann::json timeline;
+      std::unordered_map<std::string, unsigned int> timeline_frames;
+
+      timeline["bucket_sizes_ms"] = this->session_settings.timeline_buckets_ms;
+      timeline["frames"] = nlohmann::json::array();
+      timeline["threads"] = nlohmann::json::object();
+
+      // Trees of a thread from later time chunks, to be merged into the
+      // trees from the first chunk in the chronological order.
+      std::unordered_map<nlohmann::json *, std::vector<nlohmann::json *> > chunk_trees;
+
+      unsigned long long pruned_nodes = 0;
 
       for (int i = 0; i < subclient_cnt; i++) {
-        threads[i].get();
+        Stopwatch wait_watch;
+        pruned_nodes += post_threads[i].get();
+        subclient_wait_ns += wait_watch.elapsed_ns();
+
         nlohmann::json &thread_result = subclients[i]->get_result();
+
+        if (thread_result.contains("stats")) {
+          stats["subclients"].push_back(thread_result["stats"]);
+        }
+
         for (auto &elem : thread_result.items()) {
           if (elem.key() == "syscall_meta") {
-            for (auto &tid : elem.value()[0]) {
-              std::string tid_str = tid.template get<std::string>();
+            for (auto &thread : elem.value()) {
+              int tid = thread["identifier"];
               metadata["thread_tree"].push_back(nlohmann::json::object());
               nlohmann::json &new_object = metadata["thread_tree"].back();
-              new_object.swap(elem.value()[1][tid_str]);
-              new_object["identifier"] = tid;
+              new_object.swap(thread);
+              new_object["identifier"] = std::to_string(tid);
 
-              tids.insert(tid_str);
+              if (!new_object["parent"].is_null()) {
+                new_object["parent"] = std::to_string((int)new_object["parent"]);
+              }
+
+              tids.insert(tid);
             }
           } else if (elem.key() == "syscall") {
             for (auto &elem2 : elem.value().items()) {
               metadata["callchains"][elem2.key()].swap(elem2.value());
             }
+          } else if (elem.key() == "backpressure") {
+            for (auto &elem2 : elem.value().items()) {
+              for (auto &stall : elem2.value()) {
+                metadata["backpressure"][elem2.key()].push_back(stall);
+              }
+            }
+          } else if (elem.key() == "timeline") {
+            // Every subclient has its own frame table, so frame indices
+            // are remapped to the shared one here.
+            std::vector<unsigned int> frame_map;
+
+            for (auto &frame : elem.value()["frames"]) {
+              std::string name = frame.template get<std::string>();
+
+              if (timeline_frames.find(name) == timeline_frames.end()) {
+                timeline_frames[name] = timeline["frames"].size();
+                timeline["frames"].push_back(name);
+              }
+
+              frame_map.push_back(timeline_frames[name]);
+            }
+
+            for (auto &thread : elem.value()["threads"].items()) {
+              for (auto &bucket_size : thread.value().items()) {
+                for (auto &bucket : bucket_size.value()) {
+                  nlohmann::json &nodes = bucket[1];
+
+                  for (int j = 1; j < nodes.size(); j += 4) {
+                    nodes[j] = frame_map[(unsigned int)nodes[j]];
+                  }
+                }
+              }
+
+              append_timeline(timeline["threads"][thread.key()], thread.value());
+            }
           }
         }
 
         for (auto &elem : thread_result.items()) {
           if (elem.key().rfind("sample", 0) == 0) {
-            for (auto &elem2 : elem.value().items()) {
-              std::regex pid_tid_regex("^(\\d+)_(\\d+)$");
-              std::smatch pid_tid_match;
-
-              if (!std::regex_search(elem2.key(), pid_tid_match, pid_tid_regex)) {
-                std::cerr << "Could not process PID/TID key " << elem2.key() << ", this should not happen!";
-                std::cerr << std::endl;
-                continue;
-              }
-
-              if (tids.find(pid_tid_match[2]) == tids.end()) {
+            // Every element is [PID, TID, per-thread results].
+            for (auto &thread : elem.value()) {
+              int pid = thread[0];
+              int tid = thread[1];
+              std::string pid_str = std::to_string(pid);
+              std::string tid_str = std::to_string(tid);
+              std::string pid_tid = pid_str + "_" + tid_str;
+
+              if (tids.find(tid) == tids.end()) {
                 nlohmann::json new_elem;
-                new_elem["identifier"] = pid_tid_match[2];
+                new_elem["identifier"] = tid_str;
                 new_elem["parent"] = nullptr;
-                new_elem["tag"] = {
-                  "?", std::string(pid_tid_match[1]) + "/" + std::string(pid_tid_match[2]), -1, -1};
+                new_elem["tag"] = {"?", pid_str + "/" + tid_str, -1, -1};
 
                 metadata["thread_tree"].push_back(new_elem);
+                tids.insert(tid);
               }
 
-              for (auto &elem3 : elem2.value().items()) {
+              // A thread has results in more than one subclient only if
+              // the recording is split into time chunks, in which case
+              // they come in the chronological order.
+              for (auto &elem3 : thread[2].items()) {
                 if (elem3.key() == "sampled_time") {
-                  metadata["sampled_times"][elem2.key()].swap(elem3.value());
+                  nlohmann::json &sampled_time = metadata["sampled_times"][pid_tid];
+
+                  if (sampled_time.is_null()) {
+                    sampled_time.swap(elem3.value());
+                  } else {
+                    sampled_time = (unsigned long long)sampled_time +
+                      (unsigned long long)elem3.value();
+                  }
                 } else if (elem3.key() == "offcpu_regions") {
-                  metadata["offcpu_regions"][elem2.key()].swap(elem3.value());
+                  nlohmann::json &regions = metadata["offcpu_regions"][pid_tid];
+
+                  if (regions.is_null()) {
+                    regions.swap(elem3.value());
+                  } else {
+                    for (auto &region : elem3.value()) {
+                      regions.push_back(region);
+                    }
+                  }
                 } else if (elem3.key() != "first_time") {
-                  final_output[elem2.key()][elem3.key()].swap(elem3.value());
+                  nlohmann::json &trees = final_output[pid_tid][elem3.key()];
+
+                  if (trees.is_null()) {
+                    trees.swap(elem3.value());
+                  } else {
+                    chunk_trees[&trees].push_back(&elem3.value());
+                  }
                 }
               }
             }
@@ -165,12 +462,208 @@ namespace aperf {
         }
       }
 
-      for (auto &regions : metadata["offcpu_regions"].items()) {
-        for (int i = 0; i < regions.value().size(); i++) {
-          regions.value()[i][0] = (unsigned long long)regions.value()[i][0] - this->profile_start_tstamp;
+      // Chunks of a thread are merged one by one as time-ordered trees can
+      // only be appended chronologically, but different threads are merged
+      // in parallel.
+      std::vector<std::future<void> > chunk_futures;
+
+      for (auto &elem : chunk_trees) {
+        nlohmann::json *trees = elem.first;
+        std::vector<nlohmann::json *> *chunks = &elem.second;
+
+        chunk_futures.push_back(run_in_pool([trees, chunks]() {
+          for (nlohmann::json *chunk : *chunks) {
+            merge_trees((*trees)[0], (*chunk)[0]);
+            append_time_ordered_tree((*trees)[1], (*chunk)[1]);
+          }
+        }));
+      }
+
+      for (auto &future : chunk_futures) {
+        future.get();
+      }
+
+      // If requested, trees of threads sharing the same process (and the same
+      // dominant name if grouping by name) are merged into group-level
+      // trees. Time-ordered trees can't be merged meaningfully, so only
+      // aggregated trees are kept for groups. Per-thread totals and
+      // the group membership are saved to metadata.
+      if (group) {
+        std::unordered_map<std::string, std::string> tid_to_name;
+
+        for (auto &thread : metadata["thread_tree"]) {
+          tid_to_name[thread["identifier"].template get<std::string>()] = thread["tag"][0];
+        }
+
+        nlohmann::json grouped_output;
+        std::unordered_map<nlohmann::json *, std::vector<nlohmann::json *> > group_trees;
+        std::unordered_map<std::string, std::string> group_keys;
+        std::unordered_map<std::string, unsigned int> group_counts;
+
+        metadata["thread_groups"] = nlohmann::json::object();
+        metadata["thread_totals"] = nlohmann::json::object();
+
+        for (auto &elem : final_output.items()) {
+          std::string pid_tid = elem.key();
+          std::size_t separator = pid_tid.find('_');
+          std::string pid = pid_tid.substr(0, separator);
+          std::string tid = pid_tid.substr(separator + 1);
+          std::string name = tid_to_name.find(tid) == tid_to_name.end() ?
+            "?" : tid_to_name[tid];
+
+          std::string group_id = this->session_settings.group_threads == "name" ?
+            pid + "/" + name : pid;
+
+          if (group_keys.find(group_id) == group_keys.end()) {
+            group_keys[group_id] = pid + "_g" + std::to_string(group_counts[pid]++);
+
+            nlohmann::json &group = metadata["thread_groups"][group_keys[group_id]];
+            group["name"] = this->session_settings.group_threads == "name" ? name : "*";
+            group["threads"] = nlohmann::json::array();
+          }
+
+          std::string &group_key = group_keys[group_id];
+          metadata["thread_groups"][group_key]["threads"].push_back(pid_tid);
+
+          for (auto &event : elem.value().items()) {
+            metadata["thread_totals"][pid_tid][event.key()] = event.value()[0]["value"];
+
+            nlohmann::json &group_event = grouped_output[group_key][event.key()];
+
+            if (group_event.is_null()) {
+              group_event = nlohmann::json::array({nullptr});
+            }
+
+            group_trees[&group_event[0]].push_back(&event.value()[0]);
+          }
+        }
+
+        // Threads of a group are merged in their order, but different
+        // groups are merged in parallel.
+        std::vector<std::future<void> > group_futures;
+
+        for (auto &elem : group_trees) {
+          nlohmann::json *group_tree = elem.first;
+          std::vector<nlohmann::json *> *thread_trees = &elem.second;
+
+          group_futures.push_back(run_in_pool([group_tree, thread_trees]() {
+            for (nlohmann::json *thread_tree : *thread_trees) {
+              merge_trees(*group_tree, *thread_tree);
+            }
+          }));
+        }
+
+        for (auto &future : group_futures) {
+          future.get();
+        }
+
+        final_output.swap(grouped_output);
+      }
+
+      // Merged trees are pruned and serialised only now, as pruning
+      // loses information needed for merging trees.
+      if (merge) {
+        std::vector<std::future<unsigned long long> > merge_futures;
+
+        for (auto &elem : final_output.items()) {
+          nlohmann::json *events = &elem.value();
+          merge_futures.push_back(run_in_pool([this, events]() {
+            return this->post_process_trees(*events, true);
+          }));
+        }
+
+        for (auto &merge_future : merge_futures) {
+          pruned_nodes += merge_future.get();
         }
       }
 
+      stats["pruned_nodes"] = pruned_nodes;
+
+      // Frontends older than protocol version 2 don't send the overhead
+      // message and wait for the reply below instead.
+      if (protocol_version >= 2) {
+        std::string overhead_msg = this->connection->read();
+
+        if (overhead_msg.rfind("overhead ", 0) != 0) {
+          std::cerr << "Wrong overhead message received: " << overhead_msg << std::endl;
+          this->connection->write("error_overhead", true);
+          return;
+        }
+
+        try {
+          metadata["overhead"] = nlohmann::json::parse(overhead_msg.substr(9));
+        } catch (...) {
+          std::cerr << "Could not parse the overhead information to JSON, ignoring." << std::endl;
+        }
+      }
+
+      // Lost events reported by the profilers are attributed to threads
+      // and time buckets so that the affected regions can be marked.
+      // If a profiler doesn't report a PID, it is looked up in the thread
+      // tree by TID.
+      if (metadata.contains("overhead") && metadata["overhead"].is_object() &&
+          metadata["overhead"].contains("lost")) {
+        std::unordered_map<std::string, std::string> tid_to_pid;
+
+        for (auto &thread : metadata["thread_tree"]) {
+          std::string pid_tid = thread["tag"][1];
+          std::size_t slash_pos = pid_tid.find('/');
+
+          if (slash_pos != std::string::npos) {
+            tid_to_pid[pid_tid.substr(slash_pos + 1)] = pid_tid.substr(0, slash_pos);
+          }
+        }
+
+        std::map<std::string, std::map<unsigned long long, unsigned long long> > lost_buckets;
+
+        try {
+          for (auto &profiler : metadata["overhead"]["lost"]) {
+            for (auto &process : profiler) {
+              if (!process.is_object() || !process.contains("events")) {
+                continue;
+              }
+
+              for (auto &event : process["events"]) {
+                long long pid = event[0];
+                std::string tid = std::to_string((long long)event[1]);
+                unsigned long long time = event[2];
+                unsigned long long lost = event[3];
+
+                std::string pid_str;
+
+                if (pid != -1) {
+                  pid_str = std::to_string(pid);
+                } else if (tid_to_pid.find(tid) != tid_to_pid.end()) {
+                  pid_str = tid_to_pid[tid];
+                } else {
+                  pid_str = "?";
+                }
+
+                unsigned long long rel_time = time > this->profile_start_tstamp ?
+                  time - this->profile_start_tstamp : 0;
+                lost_buckets[pid_str + "_" + tid][rel_time - rel_time % LOST_SAMPLES_BUCKET_NS] += lost;
+              }
+
+              process.erase("events");
+            }
+          }
+        } catch (...) {
+          std::cerr << "The lost event information is invalid, ignoring." << std::endl;
+        }
+
+        for (auto &thread : lost_buckets) {
+          for (auto &bucket : thread.second) {
+            nlohmann::json lost_arr = {bucket.first, bucket.second};
+            metadata["lost_samples"][thread.first].push_back(lost_arr);
+          }
+        }
+      }
+
+      stats["subclient_wait_ns"] = subclient_wait_ns;
+      stats["merge_ns"] = merge_watch.elapsed_ns() - subclient_wait_ns;
+
+      Stopwatch save_watch;
+
       auto save = [](std::string path, nlohmann::json *output) {
         std::ofstream f;
         f.open(path);
@@ -178,23 +671,70 @@ namespace aperf {
         f.close();
       };
 
-      std::shared_future<void> futures[final_output.size() + 1];
+      // Every value of final_output is an object mapping event names to
+      // flame graphs already serialised by post_process_trees(), so it is
+      // assembled into the same text as dumping the object with
+      // unserialised flame graphs would produce.
+      auto assemble = [](nlohmann::json &events) {
+        std::string result = "{";
 
-      futures[0] = std::async(save, processed_path / "metadata.json",
-                              &metadata);
+        for (auto &event : events.items()) {
+          if (result.size() > 1) {
+            result += ",";
+          }
+
+          result += nlohmann::json(event.key()).dump();
+          result += ":";
+          result += event.value().template get_ref<std::string &>();
+        }
 
-      int future_index = 1;
+        result += "}";
+        return result;
+      };
 
-      for (auto &elem : final_output.items()) {
-        futures[future_index++] = std::async(save,
-                                             processed_path / (elem.key() + ".json"),
-                                             &elem.value());
+      auto save_assembled = [assemble](std::string path, nlohmann::json *events) {
+        std::ofstream f;
+        f.open(path);
+        f << assemble(*events) << std::endl;
+        f.close();
+      };
+
+      std::vector<std::shared_future<void> > futures;
+
+      futures.push_back(std::async(save, processed_path / "metadata.json",
+                                   &metadata));
+
+      if (!this->session_settings.timeline_buckets_ms.empty()) {
+        futures.push_back(std::async(save, processed_path / "timeline.json",
+                                     &timeline));
+      }
+
+      if (this->session_settings.pack_threads) {
+        futures.push_back(std::async([assemble, &final_output, &processed_path]() {
+          std::map<std::string, std::string> entries;
+
+          for (auto &elem : final_output.items()) {
+            entries[elem.key()] = assemble(elem.value());
+          }
+
+          write_pack(processed_path / "threads.pack", entries);
+        }));
+      } else {
+        for (auto &elem : final_output.items()) {
+          futures.push_back(std::async(save_assembled,
+                                       processed_path / (elem.key() + ".json"),
+                                       &elem.value()));
+        }
       }
 
-      for (int i = 0; i < final_output.size() + 1; i++) {
-        futures[i].get();
+      for (auto &future : futures) {
+        future.get();
       }
 
+      stats["save_ns"] = save_watch.elapsed_ns();
+      stats["saved_files"] = futures.size();
+      stats["file_transfers"] = nlohmann::json::array();
+
       if (this->file_acceptor == nullptr) {
         this->connection->write("profiling_finished", true);
       } else {
@@ -221,6 +761,18 @@ namespace aperf {
           bool processed;
           bool error = false;
 
+          if (x[0] == 'h' && x[1] == ' ') {
+            if (!this->code_store) {
+              this->connection->write("error_no_code_store", true);
+            } else if (this->receive_src_hashes(processed_path / x.substr(2), stats)) {
+              this->connection->write("out_file_ok", true);
+            } else {
+              this->connection->write("error_out_file", true);
+            }
+
+            continue;
+          }
+
           if (x[0] == 'p') {
             processed = true;
           } else if (x[0] == 'o') {
@@ -243,6 +795,9 @@ namespace aperf {
           std::unique_ptr<Connection> file_connection =
             this->file_acceptor->accept(1);
 
+          Stopwatch transfer_watch;
+          unsigned long long bytes_transferred = 0;
+
           try {
             if (name == "code_paths.lst") {
               std::unordered_set<fs::path> src_paths;
@@ -258,43 +813,61 @@ namespace aperf {
                 }
               }
 
-              Archive archive(processed_path / "src.zip");
-              create_src_archive(archive, src_paths, true);
-            } else {
-              std::ofstream f(path, std::ios_base::out | std::ios_base::binary);
+              if (this->code_store) {
+                std::map<std::string, std::string> hashes;
+                unsigned long long added_files = 0;
 
-              if (!f) {
+                for (const fs::path &src_path : src_paths) {
+                  bool added;
+                  hashes[src_path.string()] = this->code_store->add_file(src_path, &added);
+                  added_files += added;
+                }
+
+                this->code_store->write_index(processed_path / "src.zip", hashes,
+                                              this->session_settings.src_compression);
+
+                nlohmann::json &code_store_stats = stats["code_store"];
+                code_store_stats["files"] = hashes.size();
+                code_store_stats["added_files"] = added_files;
+                code_store_stats["bytes_received"] = 0;
+                code_store_stats["rejected_files"] = 0;
+              } else {
+                Archive archive(processed_path / "src.zip", 1024,
+                                this->session_settings.src_compression);
+                Archive::Stats archive_stats =
+                  create_src_archive(archive, src_paths, true,
+                                     std::thread::hardware_concurrency());
+
+                nlohmann::json &src_archive = stats["src_archive"];
+                src_archive["files"] = archive_stats.files;
+                src_archive["bytes_in"] = archive_stats.bytes_in;
+                src_archive["bytes_out"] = archive_stats.bytes_out;
+                src_archive["read_ns"] = archive_stats.read_ns;
+                src_archive["compress_ns"] = archive_stats.compress_ns;
+                src_archive["write_ns"] = archive_stats.write_ns;
+                src_archive["total_ns"] = archive_stats.total_ns;
+                src_archive["threads"] = archive_stats.threads;
+              }
+            } else {
+              try {
+                bytes_transferred =
+                  file_connection->read(path, this->file_timeout_seconds);
+              } catch (std::runtime_error &e) {
                 std::cerr << "Error for " << type << " file " << path.filename() << ": ";
-                std::cerr << "Could not open the output stream." << std::endl;
-                this->connection->write("error_out_file", true);
-                continue;
+                std::cerr << e.what() << std::endl;
+                error = true;
               }
+            }
 
-              std::unique_ptr<char> buf(new char[FILE_BUFFER_SIZE]);
-
-              int bytes_received = 0;
-              bool stop = false;
-
-              while (!stop && !error) {
-                bytes_received = file_connection->read(buf.get(),
-                                                       FILE_BUFFER_SIZE,
-                                                       this->file_timeout_seconds);
+            unsigned long long transfer_ns = transfer_watch.elapsed_ns();
 
-                if (bytes_received == 0) {
-                  stop = true;
-                } else {
-                  f.write(buf.get(), bytes_received);
-
-                  if (!f) {
-                    std::cerr << "Error for " << type << " file "
-                              << path.filename() << ": ";
-                    std::cerr << "Could not write to the output stream."
-                              << std::endl;
-                    error = true;
-                  }
-                }
-              }
-            }
+            nlohmann::json transfer_stats;
+            transfer_stats["name"] = type + "/" + name;
+            transfer_stats["bytes"] = bytes_transferred;
+            transfer_stats["ns"] = transfer_ns;
+            transfer_stats["mb_per_second"] = transfer_ns == 0 ? 0.0 :
+              bytes_transferred * 1e3 / transfer_ns;
+            stats["file_transfers"].push_back(transfer_stats);
 
             if (error) {
               this->connection->write("error_out_file", true);
@@ -311,12 +884,271 @@ namespace aperf {
         }
       }
 
+      stats["session_ns"] = session_watch.elapsed_ns();
+      stats["peak_rss_kb"] = get_peak_rss_kb();
+
+      std::ofstream stats_stream(processed_path / "server_stats.json");
+      stats_stream << stats << std::endl;
+      stats_stream.close();
+
+      if (this->print_stats) {
+        this->print_session_stats(result_dir, stats);
+      }
+
       this->connection->write("finished", true);
     } catch (...) {
       std::rethrow_exception(std::current_exception());
     }
   }
 
+  /**
+     Post-processes the flame graphs of one thread or thread group
+     (internal method): prunes them if requested in the session settings
+     and optionally serialises them.
+
+     Returns the number of tree nodes removed by pruning.
+
+     @param events    The JSON object mapping event names to arrays of
+                      flame graphs. If serialise is true, every array is
+                      replaced by a JSON string with its serialised form.
+     @param serialise Whether the flame graphs should be serialised.
+  */
+  unsigned long long StdClient::post_process_trees(nlohmann::json &events,
+                                                   bool serialise) {
+    unsigned long long pruned_nodes = 0;
+
+    for (auto &event : events.items()) {
+      if (this->session_settings.prune_min_fraction > 0 ||
+          this->session_settings.prune_max_nodes > 0) {
+        for (int i = 0; i < event.value().size(); i++) {
+          pruned_nodes += prune_tree(event.value()[i],
+                                     this->session_settings.prune_min_fraction,
+                                     this->session_settings.prune_max_nodes,
+                                     i == 1);
+        }
+      }
+
+      if (serialise) {
+        event.value() = event.value().dump();
+      }
+    }
+
+    return pruned_nodes;
+  }
+
+  /**
+     Post-processes the result of a finished subclient (internal method).
+
+     Off-CPU regions are made relative to the profile start and, if
+     process_trees is true, post_process_trees() is called for every
+     thread with serialisation enabled. Different results can be
+     post-processed in parallel.
+
+     Returns the number of tree nodes removed by pruning.
+
+     @param result        The result returned by get_result() of the subclient.
+     @param process_trees Whether the flame graphs should be pruned and
+                          serialised as well. This must be false if they
+                          are to be merged afterwards.
+  */
+  unsigned long long StdClient::post_process_result(nlohmann::json &result,
+                                                    bool process_trees) {
+    unsigned long long pruned_nodes = 0;
+
+    for (auto &elem : result.items()) {
+      if (elem.key().rfind("sample", 0) != 0) {
+        continue;
+      }
+
+      for (auto &thread : elem.value()) {
+        nlohmann::json &thread_result = thread[2];
+
+        if (thread_result.contains("offcpu_regions")) {
+          for (auto &region : thread_result["offcpu_regions"]) {
+            region[0] = (unsigned long long)region[0] - this->profile_start_tstamp;
+          }
+        }
+
+        if (process_trees) {
+          nlohmann::json events = nlohmann::json::object();
+
+          for (auto &elem2 : thread_result.items()) {
+            if (elem2.key() != "sampled_time" && elem2.key() != "offcpu_regions" &&
+                elem2.key() != "first_time") {
+              events[elem2.key()].swap(elem2.value());
+            }
+          }
+
+          pruned_nodes += this->post_process_trees(events, true);
+
+          for (auto &event : events.items()) {
+            thread_result[event.key()].swap(event.value());
+          }
+        }
+      }
+    }
+
+    return pruned_nodes;
+  }
+
+  /**
+     Prints a human-readable summary of the self-profiling statistics
+     of the server collected during a profiling session.
+
+     @param result_dir The name of the result directory of the session.
+     @param stats      The statistics as saved to server_stats.json.
+  */
+  void StdClient::print_session_stats(std::string result_dir,
+                                      nlohmann::json &stats) {
+    std::cout << "Session " << result_dir << " finished in ";
+    std::cout << (unsigned long long)stats["session_ns"] / 1000000 << " ms ";
+    std::cout << "(peak RSS: " << stats["peak_rss_kb"] << " kB)" << std::endl;
+
+    for (int i = 0; i < stats["subclients"].size(); i++) {
+      nlohmann::json &subclient = stats["subclients"][i];
+      std::cout << "  Subclient " << i << ": " << subclient["lines"] << " lines, ";
+      std::cout << subclient["bytes"] << " bytes, ";
+      std::cout << (unsigned long long)subclient["lines_per_second"] << " lines/s, ";
+      std::cout << "parse " << (unsigned long long)subclient["parse_ns"] / 1000000 << " ms, ";
+      std::cout << "tree insertion " << ((unsigned long long)subclient["recurse_ns"] +
+                                         (unsigned long long)subclient["recurse_time_ordered_ns"]) / 1000000;
+      std::cout << " ms, " << subclient["tree_nodes"] << " tree nodes, ";
+      std::cout << "p99 line latency " << subclient["line_latency"]["p99_ns"] << " ns" << std::endl;
+    }
+
+    std::cout << "  Merging: " << (unsigned long long)stats["merge_ns"] / 1000000 << " ms, ";
+    std::cout << "saving: " << (unsigned long long)stats["save_ns"] / 1000000 << " ms, ";
+    std::cout << "pruned tree nodes: " << stats["pruned_nodes"] << std::endl;
+
+    if (stats.contains("src_archive")) {
+      nlohmann::json &src_archive = stats["src_archive"];
+      std::cout << "  Source code archive: " << src_archive["files"] << " files, ";
+      std::cout << src_archive["bytes_in"] << " -> " << src_archive["bytes_out"] << " bytes, ";
+      std::cout << (unsigned long long)src_archive["total_ns"] / 1000000 << " ms on ";
+      std::cout << src_archive["threads"] << " threads (compression ";
+      std::cout << (unsigned long long)src_archive["compress_ns"] / 1000000 << " ms, writing ";
+      std::cout << (unsigned long long)src_archive["write_ns"] / 1000000 << " ms)" << std::endl;
+    }
+
+    if (stats.contains("code_store")) {
+      nlohmann::json &code_store_stats = stats["code_store"];
+      std::cout << "  Source code store: " << code_store_stats["files"] << " files, ";
+      std::cout << code_store_stats["added_files"] << " added (";
+      std::cout << code_store_stats["bytes_received"] << " bytes received), ";
+      std::cout << code_store_stats["rejected_files"] << " rejected" << std::endl;
+    }
+
+    for (auto &transfer : stats["file_transfers"]) {
+      std::cout << "  Transfer of " << transfer["name"].get<std::string>() << ": ";
+      std::cout << transfer["bytes"] << " bytes, " << transfer["mb_per_second"] << " MB/s" << std::endl;
+    }
+  }
+
+  /**
+     Handles the "h" command of the frontend, i.e. receives the list of
+     source code files as (hash, path) pairs, asks the frontend for the
+     files which are not in the code store yet, adds them to the store,
+     and writes the source code archive referencing the store (internal
+     method).
+
+     After the "code_store" reply, the frontend sends "<hash> <path>" lines
+     through a file connection and closes it. The client then replies
+     "code_store_missing <N>" followed by N lines with the missing hashes.
+     If N > 0, the frontend sends an archive with the missing files named
+     after their hashes through another file connection.
+
+     Returns false if the files could not be received, true otherwise.
+
+     @param archive_path The path to the source code archive to be written.
+     @param stats        The session statistics object where the code
+                         store statistics should be saved under "code_store".
+  */
+  bool StdClient::receive_src_hashes(fs::path archive_path,
+                                     nlohmann::json &stats) {
+    this->connection->write("code_store", true);
+
+    std::map<std::string, std::string> hashes;
+    std::vector<std::string> missing;
+
+    {
+      std::unique_ptr<Connection> file_connection =
+        this->file_acceptor->accept(this->connection->get_buf_size());
+
+      while (true) {
+        std::string line = file_connection->read(this->file_timeout_seconds);
+
+        if (line.empty()) {
+          break;
+        }
+
+        std::string hash = line.substr(0, CODE_STORE_HASH_LENGTH);
+
+        if (line.length() < CODE_STORE_HASH_LENGTH + 2 ||
+            line[CODE_STORE_HASH_LENGTH] != ' ' ||
+            !CodeStore::is_valid_hash(hash)) {
+          std::cerr << "Wrong source code file hash line received: " << line << std::endl;
+          continue;
+        }
+
+        hashes[line.substr(CODE_STORE_HASH_LENGTH + 1)] = hash;
+      }
+    }
+
+    std::unordered_set<std::string> requested;
+
+    for (auto &elem : hashes) {
+      if (!this->code_store->contains(elem.second) &&
+          requested.insert(elem.second).second) {
+        missing.push_back(elem.second);
+      }
+    }
+
+    this->connection->write("code_store_missing " + std::to_string(missing.size()), true);
+
+    for (std::string &hash : missing) {
+      this->connection->write(hash, true);
+    }
+
+    unsigned long long bytes_received = 0;
+    unsigned long long rejected = 0;
+    bool ok = true;
+
+    if (!missing.empty()) {
+      fs::path upload_path = archive_path;
+      upload_path += ".upload";
+
+      try {
+        // buf_size = 1 because it is only for string read which is unused here
+        std::unique_ptr<Connection> file_connection = this->file_acceptor->accept(1);
+        bytes_received = file_connection->read(upload_path, this->file_timeout_seconds);
+        this->code_store->add_archive(upload_path, &rejected);
+      } catch (std::exception &e) {
+        std::cerr << "Could not add the received source code files to the store: ";
+        std::cerr << e.what() << std::endl;
+        ok = false;
+      }
+
+      fs::remove(upload_path);
+    }
+
+    try {
+      this->code_store->write_index(archive_path, hashes,
+                                    this->session_settings.src_compression);
+    } catch (std::exception &e) {
+      std::cerr << "Could not write " << archive_path.filename() << ": ";
+      std::cerr << e.what() << std::endl;
+      ok = false;
+    }
+
+    nlohmann::json &code_store_stats = stats["code_store"];
+    code_store_stats["files"] = hashes.size();
+    code_store_stats["added_files"] = ok ? missing.size() - rejected : 0;
+    code_store_stats["bytes_received"] = bytes_received;
+    code_store_stats["rejected_files"] = rejected;
+
+    return ok;
+  }
+
   void StdClient::notify() {
     {
       std::lock_guard lock(this->accepted_mutex);
@@ -325,6 +1157,19 @@ namespace aperf {
     this->accepted_cond.notify_all();
   }
 
+  SessionSettings &StdClient::get_session_settings() {
+    return this->session_settings;
+  }
+
+  fs::path StdClient::get_raw_export_path() {
+    if (!this->session_settings.raw_export) {
+      return fs::path();
+    }
+
+    std::lock_guard lock(this->raw_export_mutex);
+    return this->raw_export_dir / std::to_string(this->raw_export_count++);
+  }
+
   bool StdClient::get_profile_start_tstamp(unsigned long long *tstamp) {
     if (!this->profile_start || !tstamp) {
       return false;
@@ -333,4 +1178,24 @@ namespace aperf {
     *tstamp = this->profile_start_tstamp;
     return true;
   }
+
+  bool StdClient::wait_for_profile_start_tstamp(unsigned long long *tstamp) {
+    std::shared_future<unsigned long long> future = this->profile_start_future;
+
+    if (!future.valid()) {
+      return false;
+    }
+
+    try {
+      unsigned long long value = future.get();
+
+      if (tstamp) {
+        *tstamp = value;
+      }
+
+      return true;
+    } catch (std::future_error &e) {
+      return false;
+    }
+  }
 };
@@ -0,0 +1,318 @@
+// AdaptivePerf: comprehensive profiling tool based on Linux perf
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "codestore.hpp"
+#include "archive.hpp"
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <unistd.h>
+#include <archive.h>
+#include <archive_entry.h>
+#include <nlohmann/json.hpp>
+#include <Poco/SHA2Engine.h>
+
+#define CODE_STORE_BUFFER_SIZE 65536
+
+namespace aperf {
+  /**
+     Constructs a CodeStore object, creating the store directory
+     if it does not exist.
+
+     @param root The path to the store directory.
+  */
+  CodeStore::CodeStore(fs::path root) {
+    fs::create_directories(root / "tmp");
+    this->root = fs::canonical(root);
+  }
+
+  /**
+     Computes the hex SHA-256 hash of the content of a file.
+
+     An exception is thrown if the file cannot be read.
+
+     @param path The path to the file.
+  */
+  std::string CodeStore::hash_file(fs::path path) {
+    std::ifstream stream(path, std::ios::binary);
+
+    if (!stream) {
+      throw std::runtime_error("Could not open " + path.string() + " for reading.");
+    }
+
+    Poco::SHA2Engine engine(Poco::SHA2Engine::SHA_256);
+    std::unique_ptr<char[]> buf(new char[CODE_STORE_BUFFER_SIZE]);
+
+    while (stream) {
+      stream.read(buf.get(), CODE_STORE_BUFFER_SIZE);
+      engine.update(buf.get(), stream.gcount());
+    }
+
+    if (stream.bad()) {
+      throw std::runtime_error("Could not read " + path.string() + ".");
+    }
+
+    return Poco::DigestEngine::digestToHex(engine.digest());
+  }
+
+  /**
+     Computes the hex SHA-256 hash of a string.
+
+     @param data The string to hash.
+  */
+  std::string CodeStore::hash_data(const std::string &data) {
+    Poco::SHA2Engine engine(Poco::SHA2Engine::SHA_256);
+    engine.update(data.data(), data.size());
+    return Poco::DigestEngine::digestToHex(engine.digest());
+  }
+
+  /**
+     Checks whether a string is a hex SHA-256 hash in the form
+     produced by hash_file() and hash_data().
+
+     @param hash The string to check.
+  */
+  bool CodeStore::is_valid_hash(const std::string &hash) {
+    if (hash.size() != CODE_STORE_HASH_LENGTH) {
+      return false;
+    }
+
+    for (char c : hash) {
+      if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  /**
+     Gets the path to a unique temporary file inside the store
+     (internal method).
+  */
+  fs::path CodeStore::make_temp_path() {
+    static std::atomic<unsigned long long> counter(0);
+
+    std::stringstream name;
+    name << getpid() << "_" << std::this_thread::get_id() << "_" << counter++;
+    return this->root / "tmp" / name.str();
+  }
+
+  /**
+     Gets the absolute path to the store directory.
+  */
+  fs::path CodeStore::get_root() {
+    return this->root;
+  }
+
+  /**
+     Gets the path to the blob with a given hash (regardless of
+     whether the blob exists).
+
+     @param hash The hex SHA-256 hash of the blob.
+  */
+  fs::path CodeStore::get_blob_path(const std::string &hash) {
+    return this->root / this->get_blob_ref(hash);
+  }
+
+  /**
+     Gets the path to the blob with a given hash relative to the
+     store directory, as referenced by the index written by write_index().
+
+     @param hash The hex SHA-256 hash of the blob.
+  */
+  std::string CodeStore::get_blob_ref(const std::string &hash) {
+    return hash.substr(0, 2) + "/" + hash;
+  }
+
+  /**
+     Checks whether the blob with a given hash exists in the store.
+
+     @param hash The hex SHA-256 hash of the blob.
+  */
+  bool CodeStore::contains(const std::string &hash) {
+    return is_valid_hash(hash) && fs::exists(this->get_blob_path(hash));
+  }
+
+  /**
+     Adds a file to the store if its content is not there yet.
+
+     Returns the hash of the file.
+
+     @param path  The path to the file.
+     @param added A pointer to the variable where it should be stored
+                  whether the file has been copied to the store. It
+                  can be null.
+  */
+  std::string CodeStore::add_file(fs::path path, bool *added) {
+    std::string hash = hash_file(path);
+    bool copy = !this->contains(hash);
+
+    if (copy) {
+      fs::path temp_path = this->make_temp_path();
+      fs::copy_file(path, temp_path);
+      fs::create_directories(this->get_blob_path(hash).parent_path());
+      fs::rename(temp_path, this->get_blob_path(hash));
+    }
+
+    if (added) {
+      *added = copy;
+    }
+
+    return hash;
+  }
+
+  /**
+     Adds a blob to the store if it is not there yet.
+
+     Returns false if the hash of the data does not match the given one
+     (in which case nothing is added), true otherwise.
+
+     @param hash The expected hex SHA-256 hash of the data.
+     @param data The content of the blob.
+  */
+  bool CodeStore::add_blob(const std::string &hash, const std::string &data) {
+    if (!is_valid_hash(hash) || hash_data(data) != hash) {
+      return false;
+    }
+
+    if (this->contains(hash)) {
+      return true;
+    }
+
+    fs::path temp_path = this->make_temp_path();
+
+    {
+      std::ofstream stream(temp_path, std::ios::binary);
+      stream.write(data.data(), data.size());
+
+      if (!stream) {
+        throw std::runtime_error("Could not write to " + temp_path.string() + ".");
+      }
+    }
+
+    fs::create_directories(this->get_blob_path(hash).parent_path());
+    fs::rename(temp_path, this->get_blob_path(hash));
+    return true;
+  }
+
+  /**
+     Adds all entries of an archive file to the store, where every entry
+     is named after the hex SHA-256 hash of its content.
+
+     Returns the number of added entries (including the ones which were
+     already in the store).
+
+     @param path     The path to the archive file (any format
+                     supported by libarchive).
+     @param rejected A pointer to the variable where the number of entries
+                     whose content does not match their names should be
+                     stored. It can be null.
+  */
+  unsigned long long CodeStore::add_archive(fs::path path,
+                                            unsigned long long *rejected) {
+    struct archive *arch = archive_read_new();
+
+    if (!arch) {
+      throw std::runtime_error("Could not initialise libarchive.");
+    }
+
+    archive_read_support_format_all(arch);
+    archive_read_support_filter_all(arch);
+
+    if (archive_read_open_filename(arch, path.c_str(),
+                                   CODE_STORE_BUFFER_SIZE) != ARCHIVE_OK) {
+      std::string message = archive_error_string(arch);
+      archive_read_free(arch);
+      throw std::runtime_error("Could not open " + path.string() + ": " + message);
+    }
+
+    unsigned long long added = 0, bad = 0;
+    struct archive_entry *entry;
+    int ret;
+
+    while ((ret = archive_read_next_header(arch, &entry)) == ARCHIVE_OK) {
+      std::string hash = archive_entry_pathname(entry);
+      std::string data;
+      char buf[CODE_STORE_BUFFER_SIZE];
+      la_ssize_t bytes_read;
+
+      while ((bytes_read = archive_read_data(arch, buf, CODE_STORE_BUFFER_SIZE)) > 0) {
+        data.append(buf, bytes_read);
+      }
+
+      // A truncated or corrupted upload must not be accepted partially
+      if (bytes_read < 0) {
+        std::string message = archive_error_string(arch);
+        archive_read_free(arch);
+        throw std::runtime_error("Could not read " + path.string() + ": " + message);
+      }
+
+      if (this->add_blob(hash, data)) {
+        added++;
+      } else {
+        bad++;
+      }
+    }
+
+    std::string message = ret == ARCHIVE_EOF ? "" : archive_error_string(arch);
+    archive_read_free(arch);
+
+    if (ret != ARCHIVE_EOF && ret != ARCHIVE_OK) {
+      throw std::runtime_error("Could not read " + path.string() + ": " + message);
+    }
+
+    if (rejected) {
+      *rejected = bad;
+    }
+
+    return added;
+  }
+
+  /**
+     Writes a source code archive referencing blobs of the store instead
+     of containing copies of the source code files.
+
+     The archive contains index.json mapping the original paths to the
+     blob paths relative to the store directory and store.json with
+     the absolute path to the store directory under "root" and the hash
+     algorithm under "algorithm".
+
+     @param path        The path to the archive file to be created.
+     @param hashes      The map from the original paths to the hashes of
+                        the files. Paths whose blobs are not in the store
+                        are skipped.
+     @param compression The compression method of the archive (see
+                        the Archive constructors).
+  */
+  void CodeStore::write_index(fs::path path,
+                              std::map<std::string, std::string> &hashes,
+                              std::string compression) {
+    nlohmann::json index = nlohmann::json::object();
+
+    for (auto &elem : hashes) {
+      if (this->contains(elem.second)) {
+        index[elem.first] = this->get_blob_ref(elem.second);
+      }
+    }
+
+    nlohmann::json store;
+    store["root"] = this->root.string();
+    store["algorithm"] = "sha256";
+
+    Archive archive(path, 1024, compression);
+
+    std::string index_str = nlohmann::to_string(index) + '\n';
+    std::stringstream index_stream;
+    index_stream << index_str;
+    archive.add_file_stream("index.json", index_stream, index_str.length());
+
+    std::string store_str = nlohmann::to_string(store) + '\n';
+    std::stringstream store_stream;
+    store_stream << store_str;
+    archive.add_file_stream("store.json", store_stream, store_str.length());
+
+    archive.close();
+  }
+};
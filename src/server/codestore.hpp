@@ -0,0 +1,48 @@
+// AdaptivePerf: comprehensive profiling tool based on Linux perf
+// Copyright (C) CERN. See LICENSE for details.
+
+#ifndef CODESTORE_HPP_
+#define CODESTORE_HPP_
+
+#include <filesystem>
+#include <map>
+#include <string>
+
+#define CODE_STORE_HASH_LENGTH 64
+
+namespace aperf {
+  namespace fs = std::filesystem;
+
+  /**
+     A class describing a content-addressed store of source code files
+     shared by all profiling sessions of adaptiveperf-server.
+
+     Every file is stored once as a blob named after the hex SHA-256 hash
+     of its content, in a subdirectory named after the first two characters
+     of the hash. Blobs are written to a temporary file first and then
+     renamed, so multiple clients can add the same blob at the same time.
+  */
+  class CodeStore {
+  private:
+    fs::path root;
+
+    fs::path make_temp_path();
+
+  public:
+    CodeStore(fs::path root);
+    static std::string hash_file(fs::path path);
+    static std::string hash_data(const std::string &data);
+    static bool is_valid_hash(const std::string &hash);
+    fs::path get_root();
+    fs::path get_blob_path(const std::string &hash);
+    std::string get_blob_ref(const std::string &hash);
+    bool contains(const std::string &hash);
+    std::string add_file(fs::path path, bool *added = nullptr);
+    bool add_blob(const std::string &hash, const std::string &data);
+    unsigned long long add_archive(fs::path path, unsigned long long *rejected);
+    void write_index(fs::path path, std::map<std::string, std::string> &hashes,
+                     std::string compression);
+  };
+};
+
+#endif
@@ -0,0 +1,571 @@
+// AdaptivePerf: comprehensive profiling tool based on Linux perf
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "compress.hpp"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <regex>
+#include <sstream>
+#include <zlib.h>
+
+#ifdef ZSTD_AVAILABLE
+#include <zstd.h>
+#endif
+
+// The size of the chunks the codecs produce their output in
+#define WIRE_CHUNK_SIZE 65536
+
+namespace aperf {
+  /**
+     A WireCodec implementation using zlib (deflate with the zlib
+     wrapper, as produced by zlib.compressobj() in Python).
+  */
+  class ZlibCodec : public WireCodec {
+  private:
+    int level;
+    z_stream deflate_strm;
+    z_stream inflate_strm;
+    bool deflate_init;
+    bool inflate_init;
+
+  public:
+    ZlibCodec(int level) {
+      this->level = level;
+      this->deflate_init = false;
+      this->inflate_init = false;
+    }
+
+    ~ZlibCodec() {
+      if (this->deflate_init) {
+        deflateEnd(&this->deflate_strm);
+      }
+
+      if (this->inflate_init) {
+        inflateEnd(&this->inflate_strm);
+      }
+    }
+
+    void compress(const char *data, std::size_t len,
+                  Mode mode, std::string &out) {
+      if (!this->deflate_init) {
+        std::memset(&this->deflate_strm, 0, sizeof(z_stream));
+
+        if (deflateInit(&this->deflate_strm, this->level) != Z_OK) {
+          throw std::runtime_error("Could not initialise zlib compression.");
+        }
+
+        this->deflate_init = true;
+      }
+
+      int flush = mode == END ? Z_FINISH : (mode == FLUSH ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+      this->deflate_strm.next_in = (Bytef *)data;
+      this->deflate_strm.avail_in = len;
+
+      while (true) {
+        std::size_t prev_size = out.size();
+        out.resize(prev_size + WIRE_CHUNK_SIZE);
+        this->deflate_strm.next_out = (Bytef *)out.data() + prev_size;
+        this->deflate_strm.avail_out = WIRE_CHUNK_SIZE;
+
+        int ret = deflate(&this->deflate_strm, flush);
+        out.resize(out.size() - this->deflate_strm.avail_out);
+
+        if (ret == Z_STREAM_ERROR) {
+          throw std::runtime_error("zlib compression error.");
+        }
+
+        if (ret == Z_STREAM_END) {
+          deflateEnd(&this->deflate_strm);
+          this->deflate_init = false;
+          break;
+        }
+
+        if (this->deflate_strm.avail_out > 0 && this->deflate_strm.avail_in == 0) {
+          break;
+        }
+      }
+    }
+
+    void decompress(const char *data, std::size_t len,
+                    std::string &out) {
+      while (len > 0) {
+        if (!this->inflate_init) {
+          std::memset(&this->inflate_strm, 0, sizeof(z_stream));
+
+          if (inflateInit(&this->inflate_strm) != Z_OK) {
+            throw std::runtime_error("Could not initialise zlib decompression.");
+          }
+
+          this->inflate_init = true;
+        }
+
+        this->inflate_strm.next_in = (Bytef *)data;
+        this->inflate_strm.avail_in = len;
+        int ret;
+
+        do {
+          std::size_t prev_size = out.size();
+          out.resize(prev_size + WIRE_CHUNK_SIZE);
+          this->inflate_strm.next_out = (Bytef *)out.data() + prev_size;
+          this->inflate_strm.avail_out = WIRE_CHUNK_SIZE;
+
+          ret = inflate(&this->inflate_strm, Z_NO_FLUSH);
+          out.resize(out.size() - this->inflate_strm.avail_out);
+
+          if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+            throw std::runtime_error("Incorrect zlib-compressed data received.");
+          }
+        } while (ret == Z_OK && this->inflate_strm.avail_out == 0);
+
+        data += len - this->inflate_strm.avail_in;
+        len = this->inflate_strm.avail_in;
+
+        if (ret == Z_STREAM_END) {
+          inflateEnd(&this->inflate_strm);
+          this->inflate_init = false;
+        } else {
+          break;
+        }
+      }
+    }
+
+    std::string get_name() {
+      return "zlib";
+    }
+  };
+
+#ifdef ZSTD_AVAILABLE
+  /**
+     A WireCodec implementation using Zstandard.
+  */
+  class ZstdCodec : public WireCodec {
+  private:
+    ZSTD_CCtx *cctx;
+    ZSTD_DCtx *dctx;
+
+  public:
+    ZstdCodec(int level) {
+      this->cctx = ZSTD_createCCtx();
+      this->dctx = ZSTD_createDCtx();
+
+      if (this->cctx == nullptr || this->dctx == nullptr) {
+        ZSTD_freeCCtx(this->cctx);
+        ZSTD_freeDCtx(this->dctx);
+        throw std::runtime_error("Could not initialise zstd.");
+      }
+
+      ZSTD_CCtx_setParameter(this->cctx, ZSTD_c_compressionLevel, level);
+    }
+
+    ~ZstdCodec() {
+      ZSTD_freeCCtx(this->cctx);
+      ZSTD_freeDCtx(this->dctx);
+    }
+
+    void compress(const char *data, std::size_t len,
+                  Mode mode, std::string &out) {
+      ZSTD_EndDirective directive = mode == END ? ZSTD_e_end :
+        (mode == FLUSH ? ZSTD_e_flush : ZSTD_e_continue);
+      ZSTD_inBuffer input = { data, len, 0 };
+
+      while (true) {
+        std::size_t prev_size = out.size();
+        out.resize(prev_size + WIRE_CHUNK_SIZE);
+        ZSTD_outBuffer output = { out.data() + prev_size, WIRE_CHUNK_SIZE, 0 };
+
+        std::size_t remaining = ZSTD_compressStream2(this->cctx, &output,
+                                                     &input, directive);
+        out.resize(prev_size + output.pos);
+
+        if (ZSTD_isError(remaining)) {
+          throw std::runtime_error("zstd compression error: " +
+                                   std::string(ZSTD_getErrorName(remaining)));
+        }
+
+        if (directive == ZSTD_e_continue ? input.pos == input.size : remaining == 0) {
+          break;
+        }
+      }
+    }
+
+    void decompress(const char *data, std::size_t len,
+                    std::string &out) {
+      ZSTD_inBuffer input = { data, len, 0 };
+
+      while (true) {
+        std::size_t prev_size = out.size();
+        out.resize(prev_size + WIRE_CHUNK_SIZE);
+        ZSTD_outBuffer output = { out.data() + prev_size, WIRE_CHUNK_SIZE, 0 };
+
+        std::size_t ret = ZSTD_decompressStream(this->dctx, &output, &input);
+        out.resize(prev_size + output.pos);
+
+        if (ZSTD_isError(ret)) {
+          throw std::runtime_error("Incorrect zstd-compressed data received: " +
+                                   std::string(ZSTD_getErrorName(ret)));
+        }
+
+        if (input.pos == input.size && output.pos < output.size) {
+          break;
+        }
+      }
+    }
+
+    std::string get_name() {
+      return "zstd";
+    }
+  };
+#endif
+
+  std::unique_ptr<WireCodec> WireCodec::make(std::string name, int level) {
+    if (name == "zlib") {
+      return std::make_unique<ZlibCodec>(level == -1 ? WIRE_ZLIB_DEFAULT_LEVEL : level);
+    }
+
+#ifdef ZSTD_AVAILABLE
+    if (name == "zstd") {
+      return std::make_unique<ZstdCodec>(level == -1 ? WIRE_ZSTD_DEFAULT_LEVEL : level);
+    }
+#endif
+
+    throw std::runtime_error("Unsupported wire compression method: " + name + ".");
+  }
+
+  std::vector<std::string> WireCodec::get_supported() {
+#ifdef ZSTD_AVAILABLE
+    return {"zstd", "zlib"};
+#else
+    return {"zlib"};
+#endif
+  }
+
+  CompressedConnection::CompressedConnection(std::unique_ptr<Connection> &connection,
+                                             std::unique_ptr<WireCodec> &codec) {
+    this->connection = std::move(connection);
+    this->codec = std::move(codec);
+    this->buf_size = this->connection->get_buf_size();
+
+    // The buffer size of the wrapped connection can be as small as 1 when
+    // only files are expected to be transferred through it.
+    this->wire_buf_size = std::max(this->buf_size, (unsigned int)WIRE_CHUNK_SIZE);
+    this->wire_buf.reset(new char[this->wire_buf_size]);
+    this->pending_pos = 0;
+    this->eof = false;
+    this->closed = false;
+    this->written = false;
+    this->raw_bytes = 0;
+    this->wire_bytes = 0;
+  }
+
+  CompressedConnection::~CompressedConnection() {
+    try {
+      this->close();
+    } catch (...) {
+
+    }
+  }
+
+  /**
+     Compresses nothing more in a given mode and sends the compressed
+     output accumulated so far if there is enough of it or the mode
+     is not WireCodec::NO_FLUSH (internal method).
+  */
+  void CompressedConnection::send(WireCodec::Mode mode) {
+    if (mode != WireCodec::NO_FLUSH) {
+      this->codec->compress(nullptr, 0, mode, this->out);
+    }
+
+    if (this->out.empty() ||
+        (mode == WireCodec::NO_FLUSH && this->out.size() < this->wire_buf_size)) {
+      return;
+    }
+
+    this->connection->write(this->out.size(), this->out.data());
+    this->wire_bytes += this->out.size();
+    this->out.clear();
+  }
+
+  /**
+     Finishes the compressed stream and closes the wrapped connection.
+  */
+  void CompressedConnection::close() {
+    if (this->closed) {
+      return;
+    }
+
+    this->closed = true;
+
+    if (this->written) {
+      this->send(WireCodec::END);
+    }
+
+    this->connection.reset();
+  }
+
+  int CompressedConnection::read(char *buf, unsigned int len, long timeout_seconds) {
+    while (this->pending_pos == this->pending.size()) {
+      this->pending.clear();
+      this->pending_pos = 0;
+
+      if (this->eof) {
+        return 0;
+      }
+
+      int bytes_received = this->connection->read(this->wire_buf.get(),
+                                                  this->wire_buf_size,
+                                                  timeout_seconds);
+
+      if (bytes_received == 0) {
+        this->eof = true;
+        return 0;
+      }
+
+      this->wire_bytes += bytes_received;
+
+      try {
+        this->codec->decompress(this->wire_buf.get(), bytes_received,
+                                this->pending);
+      } catch (std::runtime_error &e) {
+        throw ConnectionException(e);
+      }
+    }
+
+    std::size_t to_copy = std::min((std::size_t)len,
+                                   this->pending.size() - this->pending_pos);
+    std::memcpy(buf, this->pending.data() + this->pending_pos, to_copy);
+    this->pending_pos += to_copy;
+    this->raw_bytes += to_copy;
+
+    return to_copy;
+  }
+
+  /**
+     Reads a line from the connection.
+
+     Like in TCPSocket, empty lines are skipped and the last unterminated
+     line is returned when the other end closes the connection (or an empty
+     string if there is no such line).
+  */
+  std::string CompressedConnection::read(long timeout_seconds) {
+    std::string msg;
+
+    while (true) {
+      if (this->pending_pos == this->pending.size()) {
+        char c;
+
+        // This refills the decompressed data (and consumes one byte).
+        if (this->read(&c, 1, timeout_seconds) == 0) {
+          return msg;
+        }
+
+        if (c != '\n') {
+          msg += c;
+        } else if (!msg.empty()) {
+          return msg;
+        }
+
+        continue;
+      }
+
+      std::size_t newline = this->pending.find('\n', this->pending_pos);
+
+      if (newline == std::string::npos) {
+        msg.append(this->pending, this->pending_pos, std::string::npos);
+        this->raw_bytes += this->pending.size() - this->pending_pos;
+        this->pending_pos = this->pending.size();
+        continue;
+      }
+
+      msg.append(this->pending, this->pending_pos, newline - this->pending_pos);
+      this->raw_bytes += newline + 1 - this->pending_pos;
+      this->pending_pos = newline + 1;
+
+      if (!msg.empty()) {
+        return msg;
+      }
+    }
+  }
+
+  void CompressedConnection::write(std::string msg, bool new_line) {
+    if (new_line) {
+      msg += "\n";
+    }
+
+    this->write(msg.size(), msg.data());
+  }
+
+  void CompressedConnection::write(fs::path file) {
+    std::ifstream f(file, std::ios_base::in | std::ios_base::binary);
+
+    if (!f) {
+      throw ConnectionException();
+    }
+
+    std::unique_ptr<char[]> buf(new char[FILE_BUFFER_SIZE]);
+
+    while (f) {
+      f.read(buf.get(), FILE_BUFFER_SIZE);
+
+      if (f.gcount() > 0) {
+        this->write(f.gcount(), buf.get());
+      }
+    }
+
+    if (!f.eof()) {
+      throw ConnectionException();
+    }
+  }
+
+  void CompressedConnection::write(unsigned int len, char *buf) {
+    if (len == 0) {
+      return;
+    }
+
+    try {
+      this->codec->compress(buf, len, WireCodec::NO_FLUSH, this->out);
+    } catch (std::runtime_error &e) {
+      throw ConnectionException(e);
+    }
+
+    this->raw_bytes += len;
+    this->written = true;
+    this->send(WireCodec::NO_FLUSH);
+  }
+
+  unsigned int CompressedConnection::get_buf_size() {
+    return this->buf_size;
+  }
+
+  int CompressedConnection::get_poll_fd() {
+    if (this->pending_pos < this->pending.size() || this->eof) {
+      return -1;
+    }
+
+    return this->connection->get_poll_fd();
+  }
+
+  unsigned long long CompressedConnection::get_raw_bytes() {
+    return this->raw_bytes;
+  }
+
+  unsigned long long CompressedConnection::get_wire_bytes() {
+    return this->wire_bytes;
+  }
+
+  /**
+     Parses "<method>[:<level>]" strings, skipping the methods not
+     supported by this build (internal function).
+  */
+  static std::vector<std::pair<std::string, int> > parse_methods(std::vector<std::string> &methods) {
+    std::vector<std::string> supported = WireCodec::get_supported();
+    std::vector<std::pair<std::string, int> > result;
+
+    for (std::string &method : methods) {
+      std::smatch match;
+
+      if (!std::regex_match(method, match, std::regex("^([a-z0-9]+)(?:\\:(\\d{1,2}))?$"))) {
+        continue;
+      }
+
+      if (std::find(supported.begin(), supported.end(), match[1]) == supported.end()) {
+        continue;
+      }
+
+      result.push_back(std::make_pair(match[1].str(),
+                                      match[2].matched ? std::stoi(match[2]) : -1));
+    }
+
+    return result;
+  }
+
+  std::unique_ptr<Connection> CompressedConnection::negotiate(std::unique_ptr<Connection> connection,
+                                                              std::vector<std::string> methods) {
+    std::vector<std::pair<std::string, int> > parsed = parse_methods(methods);
+    std::string offer;
+
+    for (auto &method : parsed) {
+      offer += (offer.empty() ? "" : ",") + method.first;
+    }
+
+    connection->write("compress " + (offer.empty() ? "none" : offer), true);
+
+    std::string reply = connection->read();
+    std::smatch match;
+
+    if (!std::regex_match(reply, match, std::regex("^compress ([a-z0-9]+)$"))) {
+      throw ConnectionException();
+    }
+
+    if (match[1] == "none") {
+      return connection;
+    }
+
+    for (auto &method : parsed) {
+      if (method.first == match[1]) {
+        std::unique_ptr<WireCodec> codec = WireCodec::make(method.first, method.second);
+        return std::make_unique<CompressedConnection>(connection, codec);
+      }
+    }
+
+    throw ConnectionException();
+  }
+
+  std::unique_ptr<Connection> CompressedConnection::negotiate_accepted(std::unique_ptr<Connection> connection,
+                                                                       std::vector<std::string> methods,
+                                                                       long timeout_seconds) {
+    std::vector<std::pair<std::string, int> > parsed = parse_methods(methods);
+
+    // The connecting end waits for the reply before sending anything
+    // else, so no compressed data can be buffered by the wrapped
+    // connection while reading the offer line.
+    std::string offer = connection->read(timeout_seconds);
+    std::smatch match;
+
+    if (!std::regex_match(offer, match, std::regex("^compress ([a-z0-9,]+)$"))) {
+      throw ConnectionException();
+    }
+
+    std::stringstream offered(match[1]);
+    std::string name;
+
+    while (std::getline(offered, name, ',')) {
+      for (auto &method : parsed) {
+        if (method.first == name) {
+          connection->write("compress " + name, true);
+          std::unique_ptr<WireCodec> codec = WireCodec::make(method.first, method.second);
+          return std::make_unique<CompressedConnection>(connection, codec);
+        }
+      }
+    }
+
+    connection->write("compress none", true);
+    return connection;
+  }
+
+  CompressedAcceptor::CompressedAcceptor(std::unique_ptr<Acceptor> &acceptor,
+                                         std::vector<std::string> methods,
+                                         long timeout_seconds) : Acceptor(UNLIMITED_ACCEPTED) {
+    this->acceptor = std::move(acceptor);
+    this->methods = methods;
+    this->timeout_seconds = timeout_seconds;
+  }
+
+  std::unique_ptr<Connection> CompressedAcceptor::accept_connection(unsigned int buf_size) {
+    return CompressedConnection::negotiate_accepted(this->acceptor->accept(buf_size),
+                                                    this->methods,
+                                                    this->timeout_seconds);
+  }
+
+  void CompressedAcceptor::close() {
+    this->acceptor.reset();
+  }
+
+  std::string CompressedAcceptor::get_connection_instructions() {
+    return this->acceptor->get_connection_instructions();
+  }
+
+  std::string CompressedAcceptor::get_type() {
+    return this->acceptor->get_type();
+  }
+};
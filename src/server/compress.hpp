@@ -0,0 +1,254 @@
+// AdaptivePerf: comprehensive profiling tool based on Linux perf
+// Copyright (C) CERN. See LICENSE for details.
+
+#ifndef COMPRESS_HPP_
+#define COMPRESS_HPP_
+
+#include "socket.hpp"
+#include <vector>
+
+#define WIRE_ZLIB_DEFAULT_LEVEL 1
+#define WIRE_ZSTD_DEFAULT_LEVEL 3
+
+namespace aperf {
+  /**
+     An interface describing a streaming compression method used
+     for data sent through a connection.
+
+     One object compresses or decompresses a single stream of data,
+     so it keeps its state between calls.
+  */
+  class WireCodec {
+  public:
+    /**
+       A mode of WireCodec::compress().
+    */
+    enum Mode {
+      /**
+         Compressed output can be held back by the codec.
+      */
+      NO_FLUSH,
+
+      /**
+         All data passed so far must be decompressible from the output
+         produced so far.
+      */
+      FLUSH,
+
+      /**
+         The compressed stream must be finished.
+      */
+      END
+    };
+
+    virtual ~WireCodec() { }
+
+    /**
+       Compresses data, appending the compressed output to a string.
+
+       @param data The data to be compressed.
+       @param len  The number of bytes to be compressed.
+       @param mode See WireCodec::Mode.
+       @param out  The string where the compressed output should be
+                   appended to.
+
+       @throw std::runtime_error When the data cannot be compressed.
+    */
+    virtual void compress(const char *data, std::size_t len,
+                          Mode mode, std::string &out) = 0;
+
+    /**
+       Decompresses data, appending the decompressed output to a string.
+
+       Data following the end of a compressed stream are treated as
+       the beginning of a new one.
+
+       @param data The data to be decompressed.
+       @param len  The number of bytes to be decompressed.
+       @param out  The string where the decompressed output should be
+                   appended to.
+
+       @throw std::runtime_error When the data are not a valid compressed
+                                 stream.
+    */
+    virtual void decompress(const char *data, std::size_t len,
+                            std::string &out) = 0;
+
+    /**
+       Gets the name of the compression method as used in the
+       negotiation (e.g. "zlib").
+    */
+    virtual std::string get_name() = 0;
+
+    /**
+       Makes a WireCodec-derived object.
+
+       @param name  The name of the compression method (see
+                    get_supported()).
+       @param level The compression level, with -1 for the default one
+                    (WIRE_ZLIB_DEFAULT_LEVEL or WIRE_ZSTD_DEFAULT_LEVEL).
+
+       @throw std::runtime_error When the method is not supported.
+    */
+    static std::unique_ptr<WireCodec> make(std::string name, int level = -1);
+
+    /**
+       Gets the names of the compression methods supported by this build,
+       in order of preference: "zstd" (only if compiled with libzstd)
+       and "zlib".
+    */
+    static std::vector<std::string> get_supported();
+  };
+
+  /**
+     A class describing a connection whose data are compressed
+     on the wire, wrapping another connection.
+
+     The compression method is agreed on by both ends right after
+     the connection is established: the connecting end sends
+     "compress <method1>,<method2>,..." with the methods it can use in
+     order of preference (or "compress none") and the accepting end
+     replies with "compress <method>" for the first method it supports
+     as well or with "compress none". From then on, all data are
+     exchanged as a compressed stream if a method has been chosen and
+     as they are otherwise.
+
+     Compression helps when profiling through slow links (e.g.
+     adaptiveperf-server on another machine) as the perf-script output
+     and the other transferred files compress well, at the cost of
+     CPU time on both ends.
+
+     Written data are held by the compressor until enough of them are
+     compressed or the connection is closed, so this is meant for
+     connections where data flow in one direction after the
+     negotiation (e.g. subclient connections and file transfers).
+  */
+  class CompressedConnection : public Connection {
+  private:
+    std::unique_ptr<Connection> connection;
+    std::unique_ptr<WireCodec> codec;
+    unsigned int buf_size;
+    unsigned int wire_buf_size;
+    std::unique_ptr<char[]> wire_buf;
+    std::string pending;
+    std::size_t pending_pos;
+    std::string out;
+    bool eof;
+    bool closed;
+    bool written;
+    unsigned long long raw_bytes;
+    unsigned long long wire_bytes;
+
+    void send(WireCodec::Mode mode);
+
+  protected:
+    void close();
+
+  public:
+    using Connection::read;
+
+    CompressedConnection(std::unique_ptr<Connection> &connection,
+                         std::unique_ptr<WireCodec> &codec);
+    ~CompressedConnection();
+    int read(char *buf, unsigned int len, long timeout_seconds);
+    std::string read(long timeout_seconds = NO_TIMEOUT);
+    void write(std::string msg, bool new_line);
+    void write(fs::path file);
+    void write(unsigned int len, char *buf);
+    unsigned int get_buf_size();
+    int get_poll_fd();
+
+    /**
+       Gets the number of bytes passed to or returned by the connection
+       before compression or after decompression.
+    */
+    unsigned long long get_raw_bytes();
+
+    /**
+       Gets the number of compressed bytes sent or received through
+       the wrapped connection.
+    */
+    unsigned long long get_wire_bytes();
+
+    /**
+       Negotiates the compression method as the connecting end.
+
+       Returns a CompressedConnection object wrapping the connection
+       if a method has been agreed on and the connection itself
+       otherwise.
+
+       @param connection The connection just established with the
+                         accepting end.
+       @param methods    The compression methods that can be used,
+                         in order of preference, as "<method>" or
+                         "<method>:<level>" strings. The level is used
+                         only by this end. Methods not supported by
+                         this build are skipped.
+
+       @throw ConnectionException In case of connection errors or an
+                                  incorrect reply.
+    */
+    static std::unique_ptr<Connection> negotiate(std::unique_ptr<Connection> connection,
+                                                 std::vector<std::string> methods);
+
+    /**
+       Negotiates the compression method as the accepting end.
+
+       Returns a CompressedConnection object wrapping the connection
+       if a method has been agreed on and the connection itself
+       otherwise.
+
+       @param connection      The connection just accepted.
+       @param methods         The compression methods that can be used,
+                              as in negotiate(). The order of preference
+                              of the connecting end is followed.
+       @param timeout_seconds A maximum number of seconds that can pass
+                              while waiting for the offer of the
+                              connecting end. Use NO_TIMEOUT for
+                              no timeout.
+
+       @throw TimeoutException    In case of timeout (see timeout_seconds).
+       @throw ConnectionException In case of connection errors or an
+                                  incorrect offer.
+    */
+    static std::unique_ptr<Connection> negotiate_accepted(std::unique_ptr<Connection> connection,
+                                                          std::vector<std::string> methods,
+                                                          long timeout_seconds);
+  };
+
+  /**
+     A class describing an acceptor negotiating the compression method
+     of every connection accepted by another acceptor (see
+     CompressedConnection).
+
+     The other end must call CompressedConnection::negotiate() after
+     connecting as instructed by the wrapped acceptor.
+  */
+  class CompressedAcceptor : public Acceptor {
+  private:
+    std::unique_ptr<Acceptor> acceptor;
+    std::vector<std::string> methods;
+    long timeout_seconds;
+
+  protected:
+    std::unique_ptr<Connection> accept_connection(unsigned int buf_size);
+    void close();
+
+  public:
+    /**
+       Constructs a CompressedAcceptor object.
+
+       @param acceptor        The acceptor to be wrapped. It enforces the
+                              maximum number of accepted connections.
+       @param methods         See CompressedConnection::negotiate_accepted().
+       @param timeout_seconds See CompressedConnection::negotiate_accepted().
+    */
+    CompressedAcceptor(std::unique_ptr<Acceptor> &acceptor,
+                       std::vector<std::string> methods,
+                       long timeout_seconds);
+    std::string get_connection_instructions();
+    std::string get_type();
+  };
+};
+
+#endif
@@ -3,6 +3,7 @@
 
 #include "entrypoint.hpp"
 #include "server.hpp"
+#include "uring.hpp"
 #include "cmd.hpp"
 
 namespace aperf {
@@ -24,6 +25,21 @@ namespace aperf {
     unsigned short port = 5000;
     app.add_option("-p", port, "Port to bind to (default: 5000)");
 
+    std::string unix_path = "";
+    app.add_option("-u", unix_path,
+                   "Listen on a Unix domain socket at this path instead of "
+                   "TCP (-a and -p are then ignored). This is faster for "
+                   "frontends on the same machine, which connect with "
+                   "\"adaptiveperf -a unix:<path>\" (default: TCP)");
+
+    unsigned int uring_threads = 0;
+    app.add_option("-U", uring_threads,
+                   "Receive data from all TCP connections with this many "
+                   "io_uring threads instead of one blocking thread per "
+                   "connection, 0 for off. If io_uring is not available, "
+                   "a warning is printed and the option is ignored "
+                   "(default: 0)");
+
     unsigned int max_connections = 1;
     app.add_option("-m", max_connections,
                    "Max simultaneous connections to accept "
@@ -39,6 +55,21 @@ namespace aperf {
                    "Timeout for receiving file data from clients "
                    "in seconds (default: 30)");
 
+    bool print_stats = false;
+    app.add_flag("-S", print_stats,
+                 "Print server self-profiling statistics at the end of "
+                 "each profiling session (they are always saved to "
+                 "server_stats.json in the \"processed\" directory)");
+
+    std::string code_store_path = "";
+    app.add_option("-c", code_store_path,
+                   "Directory of a content-addressed store where source "
+                   "code files are kept once for all sessions (created if it "
+                   "does not exist). Frontends then upload only the files "
+                   "missing in the store and src.zip references the store "
+                   "instead of containing copies of the files "
+                   "(default: no store)");
+
     bool quiet = false;
     app.add_flag("-q", quiet, "Do not print anything except non-port-in-use errors");
 
@@ -49,27 +80,96 @@ namespace aperf {
       return 0;
     } else {
       try {
-        TCPAcceptor::Factory factory(address, port, false);
-        std::unique_ptr<Acceptor> acceptor =
-          factory.make_acceptor(UNLIMITED_ACCEPTED);
-
-        std::unique_ptr<Acceptor::Factory> acceptor_factory =
-          std::make_unique<TCPAcceptor::Factory>(address,
-                                                 port + 1, true);
-        std::unique_ptr<Acceptor::Factory> file_acceptor_factory =
-          std::make_unique<TCPAcceptor::Factory>(address,
-                                                 port + 1, true);
+        std::unique_ptr<Acceptor> acceptor;
+        std::unique_ptr<Acceptor::Factory> acceptor_factory;
+        std::unique_ptr<Acceptor::Factory> file_acceptor_factory;
+
+        bool use_uring = false;
+
+#ifdef IO_URING_AVAILABLE
+        std::vector<std::shared_ptr<IoUringReactor> > reactors;
+
+        if (uring_threads > 0 && unix_path.empty()) {
+          try {
+            for (int i = 0; i < uring_threads; i++) {
+              reactors.push_back(std::make_shared<IoUringReactor>());
+            }
+
+            use_uring = true;
+          } catch (std::runtime_error &e) {
+            reactors.clear();
+
+            if (!quiet) {
+              std::cerr << "Warning: " << e.what() << " Falling back to ";
+              std::cerr << "one thread per connection." << std::endl;
+            }
+          }
+        }
+#else
+        if (uring_threads > 0 && !quiet) {
+          std::cerr << "Warning: adaptiveperf-server has been compiled ";
+          std::cerr << "without io_uring support, ignoring -U." << std::endl;
+        }
+#endif
+
+        if (use_uring) {
+#ifdef IO_URING_AVAILABLE
+          IoUringAcceptor::Factory factory(address, port, false, reactors);
+          acceptor = factory.make_acceptor(UNLIMITED_ACCEPTED);
+
+          acceptor_factory =
+            std::make_unique<IoUringAcceptor::Factory>(address,
+                                                       port + 1, true,
+                                                       reactors);
+          file_acceptor_factory =
+            std::make_unique<IoUringAcceptor::Factory>(address,
+                                                       port + 1, true,
+                                                       reactors);
+#endif
+        } else if (unix_path.empty()) {
+          TCPAcceptor::Factory factory(address, port, false);
+          acceptor = factory.make_acceptor(UNLIMITED_ACCEPTED);
+
+          acceptor_factory =
+            std::make_unique<TCPAcceptor::Factory>(address,
+                                                   port + 1, true);
+          file_acceptor_factory =
+            std::make_unique<TCPAcceptor::Factory>(address,
+                                                   port + 1, true);
+        } else {
+          UnixSocketAcceptor::Factory factory(unix_path, false);
+          acceptor = factory.make_acceptor(UNLIMITED_ACCEPTED);
+
+          acceptor_factory =
+            std::make_unique<UnixSocketAcceptor::Factory>(unix_path, true);
+          file_acceptor_factory =
+            std::make_unique<UnixSocketAcceptor::Factory>(unix_path, true);
+        }
+
         std::unique_ptr<Subclient::Factory> subclient_factory =
           std::make_unique<StdSubclient::Factory>(acceptor_factory);
+        std::shared_ptr<CodeStore> code_store;
+
+        if (!code_store_path.empty()) {
+          code_store = std::make_shared<CodeStore>(code_store_path);
+        }
+
         std::unique_ptr<Client::Factory> client_factory =
-          std::make_unique<StdClient::Factory>(subclient_factory);
+          std::make_unique<StdClient::Factory>(subclient_factory,
+                                               print_stats && !quiet,
+                                               code_store);
 
         Server server(acceptor, max_connections, buf_size,
                       file_timeout_seconds);
 
         if (!quiet) {
-          std::cout << "Listening on " << address << ", port " << port;
-          std::cout << " (TCP)..." << std::endl;
+          if (unix_path.empty()) {
+            std::cout << "Listening on " << address << ", port " << port;
+            std::cout << (use_uring ? " (TCP, io_uring)..." : " (TCP)...") << std::endl;
+          } else {
+            std::cout << "Listening on " << unix_path;
+            std::cout << " (Unix domain socket)..." << std::endl;
+          }
         }
 
         server.run(client_factory, file_acceptor_factory);
@@ -77,8 +177,13 @@ namespace aperf {
         return 0;
       } catch (AlreadyInUseException &e) {
         if (!quiet) {
-          std::cerr << address << ":" << port << " is in use! Please use a ";
-          std::cerr << "different address and/or port." << std::endl;
+          if (unix_path.empty()) {
+            std::cerr << address << ":" << port << " is in use! Please use a ";
+            std::cerr << "different address and/or port." << std::endl;
+          } else {
+            std::cerr << unix_path << " is in use! Please use a ";
+            std::cerr << "different path." << std::endl;
+          }
         }
 
         return 100;
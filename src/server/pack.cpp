@@ -0,0 +1,136 @@
+// AdaptivePerf: comprehensive profiling tool based on Linux perf
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "pack.hpp"
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+namespace aperf {
+  /**
+     Writes already-serialised JSON objects into a single container file
+     with an offset index, sequentially in the calling thread.
+
+     The container consists of the JSON objects serialised one after another
+     (each followed by a newline), then the index (a JSON object mapping
+     keys to [offset, length] arrays in bytes, followed by a newline), and
+     finally the offset of the index as a zero-padded decimal number of
+     PACK_INDEX_OFFSET_WIDTH digits followed by a newline.
+
+     @param path    The path to the container file.
+     @param entries The map from keys to serialised JSON objects which
+                    should be written as separate entries.
+  */
+  void write_pack(fs::path path, std::map<std::string, std::string> &entries) {
+    std::ofstream stream(path, std::ios::binary);
+
+    if (!stream) {
+      throw std::runtime_error("Could not open " + path.string() + " for writing.");
+    }
+
+    nlohmann::json index = nlohmann::json::object();
+    unsigned long long offset = 0;
+
+    for (auto &entry : entries) {
+      std::string &data = entry.second;
+      stream.write(data.c_str(), data.size());
+      stream.put('\n');
+
+      index[entry.first] = {offset, data.size()};
+      offset += data.size() + 1;
+    }
+
+    std::string index_data = index.dump();
+    stream.write(index_data.c_str(), index_data.size());
+    stream.put('\n');
+
+    stream << std::setw(PACK_INDEX_OFFSET_WIDTH) << std::setfill('0') << offset;
+    stream.put('\n');
+
+    if (!stream) {
+      throw std::runtime_error("Could not write to " + path.string() + ".");
+    }
+  }
+
+  /**
+     Writes JSON objects into a single container file with an offset index,
+     sequentially in the calling thread (see the other overload of
+     write_pack() for the format).
+
+     @param path    The path to the container file.
+     @param entries The JSON object whose values should be written as
+                    separate entries, keyed by their keys.
+  */
+  void write_pack(fs::path path, nlohmann::json &entries) {
+    std::map<std::string, std::string> serialised_entries;
+
+    for (auto &entry : entries.items()) {
+      serialised_entries[entry.key()] = entry.value().dump();
+    }
+
+    write_pack(path, serialised_entries);
+  }
+
+  /**
+     Reads the offset index of a container file written by write_pack().
+
+     @param path The path to the container file.
+  */
+  nlohmann::json read_pack_index(fs::path path) {
+    std::ifstream stream(path, std::ios::binary);
+
+    if (!stream) {
+      throw std::runtime_error("Could not open " + path.string() + ".");
+    }
+
+    stream.seekg(-(PACK_INDEX_OFFSET_WIDTH + 1), std::ios::end);
+
+    char offset_buf[PACK_INDEX_OFFSET_WIDTH + 1];
+    stream.read(offset_buf, PACK_INDEX_OFFSET_WIDTH);
+    offset_buf[PACK_INDEX_OFFSET_WIDTH] = '\0';
+
+    if (!stream) {
+      throw std::runtime_error(path.string() + " is not a valid container file.");
+    }
+
+    stream.seekg(std::stoull(offset_buf));
+
+    std::string index_data;
+    std::getline(stream, index_data);
+
+    return nlohmann::json::parse(index_data);
+  }
+
+  /**
+     Reads one entry of a container file written by write_pack().
+
+     @param path  The path to the container file.
+     @param index The index returned by read_pack_index().
+     @param key   The key of the entry.
+  */
+  nlohmann::json read_pack_entry(fs::path path, nlohmann::json &index,
+                                 std::string key) {
+    if (!index.contains(key)) {
+      throw std::runtime_error("No entry \"" + key + "\" in " + path.string() + ".");
+    }
+
+    std::ifstream stream(path, std::ios::binary);
+
+    if (!stream) {
+      throw std::runtime_error("Could not open " + path.string() + ".");
+    }
+
+    unsigned long long offset = index[key][0];
+    unsigned long long length = index[key][1];
+
+    std::string data(length, '\0');
+    stream.seekg(offset);
+    stream.read(data.data(), length);
+
+    if (!stream) {
+      throw std::runtime_error(path.string() + " is not a valid container file.");
+    }
+
+    return nlohmann::json::parse(data);
+  }
+};
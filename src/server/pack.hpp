@@ -0,0 +1,24 @@
+// AdaptivePerf: comprehensive profiling tool based on Linux perf
+// Copyright (C) CERN. See LICENSE for details.
+
+#ifndef PACK_HPP_
+#define PACK_HPP_
+
+#include <filesystem>
+#include <map>
+#include <string>
+#include <nlohmann/json.hpp>
+
+#define PACK_INDEX_OFFSET_WIDTH 20
+
+namespace aperf {
+  namespace fs = std::filesystem;
+
+  void write_pack(fs::path path, std::map<std::string, std::string> &entries);
+  void write_pack(fs::path path, nlohmann::json &entries);
+  nlohmann::json read_pack_index(fs::path path);
+  nlohmann::json read_pack_entry(fs::path path, nlohmann::json &index,
+                                 std::string key);
+};
+
+#endif
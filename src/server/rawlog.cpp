@@ -0,0 +1,263 @@
+// AdaptivePerf: comprehensive profiling tool based on Linux perf
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "rawlog.hpp"
+#include <cstring>
+#include <stdexcept>
+
+namespace aperf {
+  static unsigned long long zigzag_encode(long long value) {
+    return ((unsigned long long)value << 1) ^ (unsigned long long)(value >> 63);
+  }
+
+  static long long zigzag_decode(unsigned long long value) {
+    return (long long)(value >> 1) ^ -(long long)(value & 1);
+  }
+
+  /**
+     Appends an unsigned number to a buffer as a LEB128 varint.
+
+     @param buf   The buffer to append the varint to.
+     @param value The number to encode.
+  */
+  void write_varint(std::string &buf, unsigned long long value) {
+    while (value >= 0x80) {
+      buf.push_back((char)((value & 0x7f) | 0x80));
+      value >>= 7;
+    }
+
+    buf.push_back((char)value);
+  }
+
+  /**
+     Reads a LEB128 varint from a buffer.
+
+     Returns false if the buffer ends before the varint does or
+     the varint does not fit in 64 bits, true otherwise.
+
+     @param buf   The buffer to read the varint from.
+     @param pos   The position in the buffer where the varint starts. It is
+                  advanced past the varint if true is returned.
+     @param value The variable where the decoded number should be stored.
+  */
+  bool read_varint(const std::string &buf, std::size_t &pos,
+                   unsigned long long &value) {
+    unsigned long long result = 0;
+    std::size_t cur = pos;
+
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (cur >= buf.size()) {
+        return false;
+      }
+
+      unsigned char byte = buf[cur++];
+      result |= (unsigned long long)(byte & 0x7f) << shift;
+
+      if (!(byte & 0x80)) {
+        value = result;
+        pos = cur;
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  /**
+     Constructs a RawSampleWriter object and creates the raw log file.
+
+     @param path The path to the raw log file.
+  */
+  RawSampleWriter::RawSampleWriter(fs::path path) {
+    this->path = path;
+    this->stream.open(path, std::ios::binary);
+
+    if (!this->stream) {
+      throw std::runtime_error("Could not open " + path.string() + " for writing.");
+    }
+
+    this->stream.write(RAW_MAGIC, std::strlen(RAW_MAGIC));
+    this->chunk.reserve(RAW_CHUNK_SAMPLES);
+  }
+
+  RawSampleWriter::~RawSampleWriter() {
+    try {
+      this->close();
+    } catch (...) { }
+  }
+
+  /**
+     Encodes the buffered samples as one chunk, writes it to the file,
+     and clears the buffer (internal method).
+  */
+  void RawSampleWriter::flush() {
+    if (this->chunk.empty()) {
+      return;
+    }
+
+    std::string columns[RAW_COLUMNS];
+    RawSample prev = {0, 0, 0, 0, 0, 0, false};
+
+    for (auto &sample : this->chunk) {
+      write_varint(columns[0], zigzag_encode((long long)(sample.timestamp - prev.timestamp)));
+      write_varint(columns[1], zigzag_encode((long long)sample.pid - prev.pid));
+      write_varint(columns[2], zigzag_encode((long long)sample.tid - prev.tid));
+      write_varint(columns[3], zigzag_encode((long long)sample.cpu - prev.cpu));
+      write_varint(columns[4], sample.period);
+      write_varint(columns[5], sample.stack_id);
+      write_varint(columns[6], sample.offcpu ? 1 : 0);
+      prev = sample;
+    }
+
+    std::string header;
+    write_varint(header, this->chunk.size());
+
+    for (int i = 0; i < RAW_COLUMNS; i++) {
+      write_varint(header, columns[i].size());
+      header += columns[i];
+    }
+
+    this->stream.write(header.c_str(), header.size());
+
+    if (!this->stream) {
+      throw std::runtime_error("Could not write to " + this->path.string() + ".");
+    }
+
+    this->chunk.clear();
+  }
+
+  /**
+     Adds a sample to the raw log, writing a chunk to the file if
+     RAW_CHUNK_SAMPLES samples have been buffered.
+
+     @param sample The sample to add.
+  */
+  void RawSampleWriter::add(RawSample &sample) {
+    this->chunk.push_back(sample);
+
+    if (this->chunk.size() >= RAW_CHUNK_SAMPLES) {
+      this->flush();
+    }
+  }
+
+  /**
+     Writes the remaining buffered samples and closes the raw log file.
+
+     Calling this method more than once has no further effect.
+  */
+  void RawSampleWriter::close() {
+    if (!this->stream.is_open()) {
+      return;
+    }
+
+    this->flush();
+    this->stream.close();
+  }
+
+  /**
+     Constructs a RawSampleReader object and checks the header of
+     the raw log file.
+
+     @param path The path to the raw log file.
+  */
+  RawSampleReader::RawSampleReader(fs::path path) {
+    this->path = path;
+    this->stream.open(path, std::ios::binary);
+
+    if (!this->stream) {
+      throw std::runtime_error("Could not open " + path.string() + " for reading.");
+    }
+
+    char magic[sizeof(RAW_MAGIC) - 1];
+    this->stream.read(magic, sizeof(magic));
+
+    if (!this->stream || std::memcmp(magic, RAW_MAGIC, sizeof(magic)) != 0) {
+      throw std::runtime_error(path.string() + " is not a raw sample log.");
+    }
+  }
+
+  /**
+     Reads and decodes the next chunk of the raw log file.
+
+     Returns false if there are no more chunks, true otherwise.
+
+     @param samples The vector where the samples of the chunk should
+                    be stored. Its previous content is discarded.
+  */
+  bool RawSampleReader::read_chunk(std::vector<RawSample> &samples) {
+    samples.clear();
+
+    auto read_stream_varint = [this](unsigned long long &value) {
+      value = 0;
+
+      for (int shift = 0; shift < 64; shift += 7) {
+        int byte = this->stream.get();
+
+        if (byte == EOF) {
+          return false;
+        }
+
+        value |= (unsigned long long)(byte & 0x7f) << shift;
+
+        if (!(byte & 0x80)) {
+          return true;
+        }
+      }
+
+      return false;
+    };
+
+    if (this->stream.peek() == EOF) {
+      return false;
+    }
+
+    unsigned long long count;
+    std::string columns[RAW_COLUMNS];
+
+    if (!read_stream_varint(count)) {
+      throw std::runtime_error(this->path.string() + " has a truncated chunk header.");
+    }
+
+    for (int i = 0; i < RAW_COLUMNS; i++) {
+      unsigned long long size;
+
+      if (!read_stream_varint(size)) {
+        throw std::runtime_error(this->path.string() + " has a truncated chunk header.");
+      }
+
+      columns[i].resize(size);
+      this->stream.read(columns[i].data(), size);
+
+      if (!this->stream) {
+        throw std::runtime_error(this->path.string() + " has a truncated chunk.");
+      }
+    }
+
+    std::size_t pos[RAW_COLUMNS] = {0};
+    RawSample prev = {0, 0, 0, 0, 0, 0, false};
+
+    for (unsigned long long i = 0; i < count; i++) {
+      unsigned long long values[RAW_COLUMNS];
+
+      for (int j = 0; j < RAW_COLUMNS; j++) {
+        if (!read_varint(columns[j], pos[j], values[j])) {
+          throw std::runtime_error(this->path.string() + " has a corrupted chunk.");
+        }
+      }
+
+      RawSample sample;
+      sample.timestamp = prev.timestamp + (unsigned long long)zigzag_decode(values[0]);
+      sample.pid = prev.pid + zigzag_decode(values[1]);
+      sample.tid = prev.tid + zigzag_decode(values[2]);
+      sample.cpu = prev.cpu + zigzag_decode(values[3]);
+      sample.period = values[4];
+      sample.stack_id = values[5];
+      sample.offcpu = values[6] != 0;
+
+      samples.push_back(sample);
+      prev = sample;
+    }
+
+    return true;
+  }
+};
@@ -0,0 +1,85 @@
+// AdaptivePerf: comprehensive profiling tool based on Linux perf
+// Copyright (C) CERN. See LICENSE for details.
+
+#ifndef RAWLOG_HPP_
+#define RAWLOG_HPP_
+
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#define RAW_MAGIC "APRAW01\n"
+#define RAW_CHUNK_SAMPLES 16384
+#define RAW_COLUMNS 7
+
+namespace aperf {
+  namespace fs = std::filesystem;
+
+  /**
+     A structure describing one sample in a raw sample log.
+
+     The timestamp and the period have the same meaning as in
+     SampleLogEntry, cpu is -1 if the CPU number is unknown, and
+     stack_id refers to the stack dictionary saved alongside the log.
+  */
+  struct RawSample {
+    unsigned long long timestamp;
+    int pid;
+    int tid;
+    int cpu;
+    unsigned long long period;
+    unsigned int stack_id;
+    bool offcpu;
+  };
+
+  /**
+     A class streaming samples into a raw columnar log file.
+
+     The file starts with RAW_MAGIC and is followed by chunks of at most
+     RAW_CHUNK_SAMPLES samples. Each chunk consists of the number of samples
+     and RAW_COLUMNS columns in the following order: timestamp, PID, TID, CPU,
+     period, stack ID, and off-CPU flag. Each column is preceded by its length
+     in bytes so that readers can skip columns they are not interested in.
+
+     All numbers are LEB128 varints. Timestamps, PIDs, TIDs, and CPUs are
+     stored as zigzag-encoded differences from the previous sample in
+     the chunk (the first sample of a chunk is relative to 0), so every
+     chunk can be decoded independently.
+
+     Only one chunk is held in memory at a time.
+  */
+  class RawSampleWriter {
+  private:
+    fs::path path;
+    std::ofstream stream;
+    std::vector<RawSample> chunk;
+
+    void flush();
+
+  public:
+    RawSampleWriter(fs::path path);
+    ~RawSampleWriter();
+    void add(RawSample &sample);
+    void close();
+  };
+
+  /**
+     A class reading a raw columnar log file written by RawSampleWriter.
+  */
+  class RawSampleReader {
+  private:
+    fs::path path;
+    std::ifstream stream;
+
+  public:
+    RawSampleReader(fs::path path);
+    bool read_chunk(std::vector<RawSample> &samples);
+  };
+
+  void write_varint(std::string &buf, unsigned long long value);
+  bool read_varint(const std::string &buf, std::size_t &pos,
+                   unsigned long long &value);
+};
+
+#endif
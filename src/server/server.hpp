@@ -5,12 +5,23 @@
 #define SERVER_HPP_
 
 #include "socket.hpp"
+#include "codestore.hpp"
+#include "stack.hpp"
+#include "tree.hpp"
 #include <nlohmann/json.hpp>
 #include <condition_variable>
+#include <future>
 #include <mutex>
 #include <string>
 #include <vector>
 
+// The version of the protocol between the frontend and the client. The
+// frontend announces it with "protocol <version>" before "start<N> ...",
+// and frontends not doing so are treated as speaking version 1.
+// Version 2 adds the "overhead <JSON>" message after profiling and
+// version 3 adds the session settings after the profiled filename.
+#define PROTOCOL_VERSION 3
+
 namespace aperf {
   /**
      An interface whose implementation can be sent a notification
@@ -24,6 +35,64 @@ namespace aperf {
     virtual void notify() = 0;
   };
 
+  /**
+     A structure describing the settings of a profiling session, sent by
+     the frontend to the client as a JSON object after the profiled filename
+     (see PROTOCOL_VERSION). Frontends not sending it get the defaults.
+
+     timeline_buckets_ms is the list of time bucket sizes in ms for which
+     per-thread timeline flame graphs should be produced (empty if
+     no timeline should be produced).
+
+     pack_threads is whether the per-thread results should be written into
+     a single container file (see write_pack()) rather than into one
+     file per thread.
+
+     group_threads is either empty (no grouping), "name" (trees of threads
+     with the same dominant name within a process should be merged), or
+     "process" (trees of all threads of a process should be merged).
+
+     prune_min_fraction and prune_max_nodes are the arguments of
+     prune_tree() applied to every flame graph before it is saved
+     (both 0 if no pruning should be done).
+
+     fold_recursion is whether direct and mutual recursion cycles in
+     callchains should be folded into single nodes annotated with
+     recursion depth statistics (see fold_recursion()).
+
+     raw_export is whether every subclient should additionally stream
+     the samples it receives into a raw columnar log (see RawSampleWriter)
+     in the "raw" subdirectory of the "processed" directory.
+
+     src_compression is the compression method of the source code archive
+     built by the client if the frontend sends only the list of source code
+     files (see the Archive constructors, empty for the default).
+
+     wire_compression is the list of compression methods the frontend
+     can use for the file and subclient connections, in order of
+     preference (see CompressedConnection). If it is empty, the
+     compression method is not negotiated on these connections at all.
+
+     time_chunks is the number of consecutive time ranges a recording is
+     split into when it is post-processed by several "perf" instances at
+     the same time (1 if it is not split). The results of threads
+     appearing in several subclients are then merged in the subclient
+     order, so subclients must be assigned to the time ranges in their
+     chronological order.
+  */
+  struct SessionSettings {
+    std::vector<unsigned long long> timeline_buckets_ms;
+    bool pack_threads = false;
+    std::string group_threads;
+    double prune_min_fraction = 0;
+    unsigned long long prune_max_nodes = 0;
+    bool fold_recursion = false;
+    bool raw_export = false;
+    std::string src_compression;
+    std::vector<std::string> wire_compression;
+    unsigned int time_chunks = 1;
+  };
+
   /**
      An interface describing a client.
 
@@ -80,6 +149,39 @@ namespace aperf {
                      should be stored. It can be null.
     */
     virtual bool get_profile_start_tstamp(unsigned long long *tstamp) = 0;
+
+    /**
+       Waits until the Unix timestamp of the start of profiling is received
+       and saves it to the variable referenced by tstamp if tstamp is not null.
+
+       Returns false if the client has stopped without receiving the timestamp
+       (e.g. because of an error), true otherwise.
+
+       The value referenced by tstamp is unchanged if false is returned or
+       tstamp is null.
+
+       @param tstamp A pointer to the variable where the profiling start timestamp
+                     should be stored. It can be null.
+    */
+    virtual bool wait_for_profile_start_tstamp(unsigned long long *tstamp) = 0;
+
+    /**
+       Gets the settings of the current profiling session sent by
+       the frontend.
+
+       This method should be called by a Subclient-derived object. The
+       settings are received before any subclient is made.
+    */
+    virtual SessionSettings &get_session_settings() = 0;
+
+    /**
+       Gets a path (without an extension) where a subclient should save its
+       raw sample export, or an empty path if raw export is disabled.
+
+       This method should be called by a Subclient-derived object. Every call
+       returns a different path.
+    */
+    virtual fs::path get_raw_export_path() = 0;
   };
 
   /**
@@ -198,6 +300,9 @@ namespace aperf {
     virtual void process(fs::path working_dir) = 0;
     virtual void notify() = 0;
     virtual bool get_profile_start_tstamp(unsigned long long *tstamp) = 0;
+    virtual bool wait_for_profile_start_tstamp(unsigned long long *tstamp) = 0;
+    virtual SessionSettings &get_session_settings() = 0;
+    virtual fs::path get_raw_export_path() = 0;
   };
 
   /**
@@ -209,16 +314,28 @@ namespace aperf {
   class StdSubclient : public InitSubclient {
   private:
     nlohmann::json json_result;
+    unsigned long long tree_nodes;
+    StackTable stack_table;
+    // Keyed by (PID << 32) | TID
+    std::unordered_map<unsigned long long, std::vector<SampleLogEntry> > sample_logs;
 
     StdSubclient(Client &context,
                  std::unique_ptr<Acceptor> &acceptor,
                  std::string profiled_filename,
                  unsigned int buf_size);
-    void recurse(nlohmann::json &cur_elem,
+    void recurse(TreeNode &root,
                  std::vector<std::pair<std::string, std::string> > &callchain_parts,
-                 int callchain_index,
+                 std::vector<unsigned int> &depths,
                  unsigned long long period,
                  bool time_ordered, bool offcpu);
+    void replay_log(std::vector<SampleLogEntry> &log,
+                    unsigned long long from,
+                    unsigned long long to,
+                    nlohmann::json &output,
+                    nlohmann::json &output_time_ordered,
+                    unsigned long long *recurse_ns,
+                    unsigned long long *recurse_time_ordered_ns);
+    void build_timeline(unsigned long long start_time);
 
   public:
     /**
@@ -256,6 +373,9 @@ namespace aperf {
 
     void process();
     nlohmann::json &get_result();
+    nlohmann::json get_sample_trees(int pid, int tid,
+                                    unsigned long long from,
+                                    unsigned long long to);
   };
 
   /**
@@ -271,11 +391,28 @@ namespace aperf {
     std::condition_variable accepted_cond;
     bool profile_start;
     unsigned long long profile_start_tstamp;
+    std::shared_future<unsigned long long> profile_start_future;
+    SessionSettings session_settings;
+    std::shared_ptr<CodeStore> code_store;
+    fs::path raw_export_dir;
+    unsigned int raw_export_count;
+    std::mutex raw_export_mutex;
+    bool print_stats;
 
     StdClient(std::shared_ptr<Subclient::Factory> &subclient_factory,
               std::unique_ptr<Connection> &connection,
               std::unique_ptr<Acceptor> &file_acceptor,
-              unsigned long long file_timeout_seconds);
+              unsigned long long file_timeout_seconds,
+              bool print_stats,
+              std::shared_ptr<CodeStore> &code_store);
+    unsigned long long post_process_trees(nlohmann::json &events,
+                                          bool serialise);
+    unsigned long long post_process_result(nlohmann::json &result,
+                                           bool process_trees);
+    void print_session_stats(std::string result_dir,
+                             nlohmann::json &stats);
+    bool receive_src_hashes(fs::path archive_path,
+                            nlohmann::json &stats);
 
   public:
     /**
@@ -284,16 +421,31 @@ namespace aperf {
     class Factory : public Client::Factory {
     private:
       std::shared_ptr<Subclient::Factory> factory;
+      bool print_stats;
+      std::shared_ptr<CodeStore> code_store;
 
     public:
       /**
          Constructs a StdClient::Factory object.
 
-         @param factory A Subclient factory for spawning new
-                        subclients by the client.
+         @param factory     A Subclient factory for spawning new
+                            subclients by the client.
+         @param print_stats Whether clients should print a summary of the
+                            server self-profiling statistics to stdout
+                            at the end of each profiling session (the
+                            statistics are always saved to
+                            server_stats.json in the "processed"
+                            directory regardless of this setting).
+         @param code_store  A store where clients should keep the source
+                            code files of all sessions instead of putting
+                            copies into every src.zip. It can be null.
       */
-      Factory(std::unique_ptr<Subclient::Factory> &factory) {
+      Factory(std::unique_ptr<Subclient::Factory> &factory,
+              bool print_stats = false,
+              std::shared_ptr<CodeStore> code_store = nullptr) {
         this->factory = std::move(factory);
+        this->print_stats = print_stats;
+        this->code_store = code_store;
       }
 
       std::unique_ptr<Client> make_client(std::unique_ptr<Connection> &connection,
@@ -303,13 +455,18 @@ namespace aperf {
           StdClient>(new StdClient(this->factory,
                                    connection,
                                    file_acceptor,
-                                   file_timeout_seconds));
+                                   file_timeout_seconds,
+                                   this->print_stats,
+                                   this->code_store));
       }
     };
 
     void process(fs::path working_dir);
     void notify();
     bool get_profile_start_tstamp(unsigned long long *tstamp);
+    bool wait_for_profile_start_tstamp(unsigned long long *tstamp);
+    SessionSettings &get_session_settings();
+    fs::path get_raw_export_path();
   };
 
   /**
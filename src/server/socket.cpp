@@ -3,10 +3,20 @@
 
 #include "socket.hpp"
 #include <iostream>
+#include <chrono>
 #include <cstring>
 #include <unistd.h>
 #include <fstream>
 #include <poll.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/file.h>
+
+#if BOOST_OS_LINUX
+#include <sys/sendfile.h>
+#endif
+
 #include <Poco/Buffer.h>
 #include <Poco/Net/NetException.h>
 #include <Poco/StreamCopier.h>
@@ -16,11 +26,258 @@
 namespace aperf {
   class charstreambuf : public std::streambuf {
   public:
-    charstreambuf(std::unique_ptr<char> &begin, unsigned int length) {
+    charstreambuf(std::unique_ptr<char[]> &begin, unsigned int length) {
       this->setg(begin.get(), begin.get(), begin.get() + length - 1);
     }
   };
 
+  /**
+     Reads data from the connection until the other end closes it
+     and saves them to a file, copying them through a buffer in user
+     space.
+  */
+  unsigned long long Connection::read(fs::path file, long timeout_seconds) {
+    std::ofstream f(file, std::ios_base::out | std::ios_base::binary);
+
+    if (!f) {
+      throw std::runtime_error("Could not open " + file.string() + " for writing.");
+    }
+
+    std::unique_ptr<char[]> buf(new char[FILE_BUFFER_SIZE]);
+    unsigned long long bytes_total = 0;
+    int bytes_received;
+
+    while ((bytes_received = this->read(buf.get(), FILE_BUFFER_SIZE,
+                                        timeout_seconds)) > 0) {
+      bytes_total += bytes_received;
+      f.write(buf.get(), bytes_received);
+
+      if (!f) {
+        throw std::runtime_error("Could not write to " + file.string() + ".");
+      }
+    }
+
+    return bytes_total;
+  }
+
+#ifdef BOOST_OS_UNIX
+  /**
+     A file descriptor closed automatically when it goes out of scope.
+  */
+  class fdguard {
+  public:
+    int fd;
+
+    fdguard(int fd) {
+      this->fd = fd;
+    }
+
+    ~fdguard() {
+      if (this->fd != -1) {
+        ::close(this->fd);
+      }
+    }
+  };
+#endif
+
+#if BOOST_OS_LINUX
+  /**
+     Checks whether an errno value returned by splice means that
+     the destination file could not be written (as opposed to a problem
+     with the connection).
+  */
+  static bool is_file_write_error(int code) {
+    return code == ENOSPC || code == EDQUOT || code == EFBIG || code == EIO;
+  }
+
+  /**
+     Sends a file to a file descriptor with sendfile, without copying
+     its content through user space.
+
+     Returns false if sendfile is not supported for the file descriptors
+     involved and nothing has been sent (in which case the caller should
+     fall back to a regular copy), true otherwise.
+
+     @param out_fd The file descriptor to send the file to (e.g. a socket
+                   or a pipe).
+     @param file   The path to the file to be sent.
+
+     @throw ConnectionException When the file cannot be opened or
+                                sendfile fails midway.
+  */
+  static bool send_file_zero_copy(int out_fd, fs::path file) {
+    fdguard in(::open(file.c_str(), O_RDONLY | O_CLOEXEC));
+
+    if (in.fd == -1) {
+      std::runtime_error err("Could not open the file " +
+                             file.string() + "!");
+      throw ConnectionException(err);
+    }
+
+    unsigned long long bytes_sent = 0;
+
+    while (true) {
+      // The file offset of in.fd is used and updated, so everything up to
+      // the end of the file is sent even if the file grows in the meantime
+      ssize_t bytes = ::sendfile(out_fd, in.fd, nullptr, FILE_BUFFER_SIZE);
+
+      if (bytes == 0) {
+        return true;
+      } else if (bytes > 0) {
+        bytes_sent += bytes;
+      } else if (errno == EINTR) {
+        continue;
+      } else if (errno == EAGAIN) {
+        struct pollfd poll_struct;
+        poll_struct.fd = out_fd;
+        poll_struct.events = POLLOUT;
+        ::poll(&poll_struct, 1, -1);
+      } else if ((errno == EINVAL || errno == ENOSYS) && bytes_sent == 0) {
+        return false;
+      } else {
+        std::runtime_error err("sendfile of " + file.string() +
+                               " to fd " + std::to_string(out_fd) +
+                               " failed after " + std::to_string(bytes_sent) +
+                               " bytes, code " + std::to_string(errno));
+        throw ConnectionException(err);
+      }
+    }
+  }
+
+  /**
+     Receives data from a file descriptor until the other end closes it
+     and appends them to another file descriptor with splice, without
+     copying them through user space.
+
+     Returns the number of bytes received, or -1 if splice is not supported
+     for the file descriptors involved and nothing has been received
+     (in which case the caller should fall back to a regular copy).
+
+     @param in_fd           The file descriptor to receive the data from
+                            (e.g. a socket or a pipe).
+     @param in_is_pipe      Whether in_fd is a pipe. If not, the data are
+                            moved through an intermediate pipe, as splice
+                            requires one end of every transfer to be a pipe.
+     @param out_fd          The file descriptor of the file where received
+                            data should be saved.
+     @param file            The path to the file where received data should
+                            be saved (used only in error messages).
+     @param timeout_seconds A maximum number of seconds that can pass while
+                            waiting for every portion of the data. Use
+                            NO_TIMEOUT for no timeout.
+
+     @throw TimeoutException    In case of timeout (see timeout_seconds).
+     @throw ConnectionException When splice fails midway.
+     @throw std::runtime_error  When the file cannot be written.
+  */
+  static long long splice_to_fd(int in_fd, bool in_is_pipe, int out_fd,
+                                fs::path file, long timeout_seconds) {
+    int pipe_fd[2] = {-1, -1};
+
+    if (!in_is_pipe) {
+      if (::pipe2(pipe_fd, O_CLOEXEC) != 0) {
+        return -1;
+      }
+
+      // This is only a hint, a smaller pipe just means more splice calls
+      ::fcntl(pipe_fd[1], F_SETPIPE_SZ, FILE_BUFFER_SIZE);
+    }
+
+    fdguard pipe_read(pipe_fd[0]);
+    fdguard pipe_write(pipe_fd[1]);
+    long long bytes_total = 0;
+
+    while (true) {
+      if (timeout_seconds != NO_TIMEOUT) {
+        struct pollfd poll_struct;
+        poll_struct.fd = in_fd;
+        poll_struct.events = POLLIN;
+
+        int code = ::poll(&poll_struct, 1, 1000 * timeout_seconds);
+
+        if (code == -1 && errno == EINTR) {
+          continue;
+        } else if (code == -1) {
+          throw ConnectionException();
+        } else if (code == 0) {
+          throw TimeoutException();
+        }
+      }
+
+      ssize_t bytes;
+
+      if (in_is_pipe) {
+        bytes = ::splice(in_fd, nullptr, out_fd, nullptr,
+                         FILE_BUFFER_SIZE, SPLICE_F_MOVE);
+      } else {
+        bytes = ::splice(in_fd, nullptr, pipe_fd[1], nullptr,
+                         FILE_BUFFER_SIZE, SPLICE_F_MOVE | SPLICE_F_MORE);
+      }
+
+      if (bytes == 0) {
+        return bytes_total;
+      } else if (bytes < 0) {
+        if (errno == EINTR || errno == EAGAIN) {
+          continue;
+        } else if ((errno == EINVAL || errno == ENOSYS) && bytes_total == 0) {
+          return -1;
+        } else if (is_file_write_error(errno)) {
+          throw std::runtime_error("Could not write to " + file.string() +
+                                   ", code " + std::to_string(errno) + ".");
+        } else {
+          std::runtime_error err("splice from fd " + std::to_string(in_fd) +
+                                 " failed after " + std::to_string(bytes_total) +
+                                 " bytes, code " + std::to_string(errno));
+          throw ConnectionException(err);
+        }
+      }
+
+      if (in_is_pipe) {
+        bytes_total += bytes;
+        continue;
+      }
+
+      while (bytes > 0) {
+        ssize_t written = ::splice(pipe_fd[0], nullptr, out_fd, nullptr,
+                                   bytes, SPLICE_F_MOVE);
+
+        if (written < 0 && errno == EINTR) {
+          continue;
+        } else if (written <= 0) {
+          throw std::runtime_error("Could not write to " + file.string() +
+                                   ", code " + std::to_string(errno) + ".");
+        }
+
+        bytes -= written;
+        bytes_total += written;
+      }
+    }
+  }
+
+  /**
+     Receives data from a file descriptor until the other end closes it
+     and saves them to a file with splice, without copying them through
+     user space.
+
+     Returns the number of bytes received, or -1 if splice is not supported
+     for the file descriptors involved and nothing has been received
+     (in which case the caller should fall back to a regular copy).
+
+     See splice_to_fd() for the description of the parameters and
+     the exceptions thrown.
+  */
+  static long long receive_file_zero_copy(int in_fd, bool in_is_pipe,
+                                          fs::path file, long timeout_seconds) {
+    fdguard out(::open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666));
+
+    if (out.fd == -1) {
+      throw std::runtime_error("Could not open " + file.string() + " for writing.");
+    }
+
+    return splice_to_fd(in_fd, in_is_pipe, out.fd, file, timeout_seconds);
+  }
+#endif
+
   TCPAcceptor::TCPAcceptor(std::string address, unsigned short port,
                            int max_accepted,
                            bool try_subsequent_ports) : Acceptor(max_accepted) {
@@ -97,6 +354,11 @@ namespace aperf {
     this->buf.reset(new char[buf_size]);
     this->buf_size = buf_size;
     this->start_pos = 0;
+
+    // Timeouts are handled with poll in read(), so the socket must not
+    // have a receive timeout of its own. This is set only once here
+    // rather than around every read.
+    this->socket.setReceiveTimeout(Poco::Timespan());
   }
 
   TCPSocket::~TCPSocket() {
@@ -119,19 +381,68 @@ namespace aperf {
     this->socket.close();
   }
 
+  /**
+     Reads data from the socket.
+
+     If there is a timeout, the socket is read without blocking and
+     polled until the deadline only when no data have arrived yet. This
+     way, the receive timeout of the socket is never changed and reading
+     data which are already there takes a single system call.
+  */
   int TCPSocket::read(char *buf, unsigned int len, long timeout_seconds) {
-    try {
-      this->socket.setReceiveTimeout(Poco::Timespan(timeout_seconds, 0));
-      int bytes = this->socket.receiveBytes(buf, len);
-      this->socket.setReceiveTimeout(Poco::Timespan());
-      return bytes;
-    } catch (net::NetException &e) {
-      this->socket.setReceiveTimeout(Poco::Timespan());
-      throw ConnectionException(e);
-    } catch (Poco::TimeoutException &e) {
-      this->socket.setReceiveTimeout(Poco::Timespan());
-      throw TimeoutException();
+    if (timeout_seconds == NO_TIMEOUT) {
+      try {
+        return this->socket.receiveBytes(buf, len);
+      } catch (net::NetException &e) {
+        throw ConnectionException(e);
+      }
+    }
+
+    int sock_fd = this->socket.impl()->sockfd();
+    std::chrono::steady_clock::time_point deadline =
+      std::chrono::steady_clock::now() + std::chrono::seconds(timeout_seconds);
+
+    while (true) {
+      ssize_t bytes = ::recv(sock_fd, buf, len, MSG_DONTWAIT);
+
+      if (bytes >= 0) {
+        return bytes;
+      } else if (errno == EINTR) {
+        continue;
+      } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        std::runtime_error err("recv from fd " + std::to_string(sock_fd) +
+                               " failed, code " + std::to_string(errno));
+        throw ConnectionException(err);
+      }
+
+      long long remaining_ms =
+        std::chrono::ceil<std::chrono::milliseconds>(
+          deadline - std::chrono::steady_clock::now()).count();
+
+      if (remaining_ms <= 0) {
+        throw TimeoutException();
+      }
+
+      struct pollfd poll_struct;
+      poll_struct.fd = sock_fd;
+      poll_struct.events = POLLIN;
+
+      int code = ::poll(&poll_struct, 1, remaining_ms);
+
+      if (code == -1 && errno != EINTR) {
+        throw ConnectionException();
+      } else if (code == 0) {
+        throw TimeoutException();
+      }
+    }
+  }
+
+  int TCPSocket::get_poll_fd() {
+    if (!this->buffered_msgs.empty()) {
+      return -1;
     }
+
+    return this->socket.impl()->sockfd();
   }
 
   std::string TCPSocket::read(long timeout_seconds) {
@@ -145,17 +456,9 @@ namespace aperf {
       std::string cur_msg = "";
 
       while (true) {
-        int bytes_received;
-
-        if (timeout_seconds == NO_TIMEOUT) {
-          bytes_received =
-            this->socket.receiveBytes(this->buf.get() + this->start_pos,
-                                      this->buf_size - this->start_pos);
-        } else {
-          bytes_received =
-              this->read(this->buf.get() + this->start_pos,
-                         this->buf_size - this->start_pos, timeout_seconds);
-        }
+        int bytes_received =
+          this->read(this->buf.get() + this->start_pos,
+                     this->buf_size - this->start_pos, timeout_seconds);
 
         if (bytes_received == 0) {
           return std::string(this->buf.get(), this->start_pos);
@@ -240,7 +543,41 @@ namespace aperf {
     }
   }
 
+  /**
+     Reads data from the socket until the other end closes it and saves
+     them to a file.
+
+     On Linux, the data are moved from the socket to the file with splice,
+     without copying them through user space. The regular buffered copy
+     is used when this is not supported.
+  */
+  unsigned long long TCPSocket::read(fs::path file, long timeout_seconds) {
+#if BOOST_OS_LINUX
+    long long bytes = receive_file_zero_copy(this->socket.impl()->sockfd(),
+                                             false, file, timeout_seconds);
+
+    if (bytes != -1) {
+      return bytes;
+    }
+#endif
+
+    return Connection::read(file, timeout_seconds);
+  }
+
+  /**
+     Writes a file to the socket.
+
+     On Linux, the file is sent with sendfile, without copying its content
+     through user space. The regular buffered copy is used when this is
+     not supported.
+  */
   void TCPSocket::write(fs::path file) {
+#if BOOST_OS_LINUX
+    if (send_file_zero_copy(this->socket.impl()->sockfd(), file)) {
+      return;
+    }
+#endif
+
     try {
       net::SocketStream socket_stream(this->socket);
       Poco::FileInputStream stream(file, std::ios::in | std::ios::binary);
@@ -334,6 +671,14 @@ namespace aperf {
     return ::read(this->read_fd[0], buf, len);
   }
 
+  int FileDescriptor::get_poll_fd() {
+    if (!this->buffered_msgs.empty()) {
+      return -1;
+    }
+
+    return this->read_fd[0];
+  }
+
   std::string FileDescriptor::read(long timeout_seconds) {
     if (!this->buffered_msgs.empty()) {
       std::string msg = this->buffered_msgs.front();
@@ -435,8 +780,42 @@ namespace aperf {
     }
   }
 
+  /**
+     Reads data from the read pipe until the other end closes it and
+     saves them to a file.
+
+     On Linux, the data are moved from the pipe to the file with splice,
+     without copying them through user space. The regular buffered copy
+     is used when this is not supported.
+  */
+  unsigned long long FileDescriptor::read(fs::path file, long timeout_seconds) {
+#if BOOST_OS_LINUX
+    long long bytes = receive_file_zero_copy(this->read_fd[0], true,
+                                             file, timeout_seconds);
+
+    if (bytes != -1) {
+      return bytes;
+    }
+#endif
+
+    return Connection::read(file, timeout_seconds);
+  }
+
+  /**
+     Writes a file to the write pipe.
+
+     On Linux, the file is sent with sendfile, without copying its content
+     through user space. The regular buffered copy is used when this is
+     not supported.
+  */
   void FileDescriptor::write(fs::path file) {
-    std::unique_ptr<char> buf(new char[FILE_BUFFER_SIZE]);
+#if BOOST_OS_LINUX
+    if (send_file_zero_copy(this->write_fd[1], file)) {
+      return;
+    }
+#endif
+
+    std::unique_ptr<char[]> buf(new char[FILE_BUFFER_SIZE]);
     std::ifstream file_stream(file, std::ios_base::in |
                               std::ios_base::binary);
 
@@ -544,5 +923,438 @@ namespace aperf {
   std::string PipeAcceptor::get_type() {
     return "pipe";
   }
+
+  /**
+     Writes the whole content of a buffer to a file descriptor.
+
+     @param out_fd The file descriptor to write to.
+     @param buf    The buffer.
+     @param len    The number of bytes to write.
+     @param file   The path to the file corresponding to out_fd (used only
+                   in error messages).
+
+     @throw std::runtime_error When the file cannot be written.
+  */
+  static void write_all(int out_fd, const char *buf, std::size_t len,
+                        fs::path file) {
+    while (len > 0) {
+      ssize_t written = ::write(out_fd, buf, len);
+
+      if (written < 0 && errno == EINTR) {
+        continue;
+      } else if (written <= 0) {
+        throw std::runtime_error("Could not write to " + file.string() +
+                                 ", code " + std::to_string(errno) + ".");
+      }
+
+      buf += written;
+      len -= written;
+    }
+  }
+
+  /**
+     Copies the whole content of a file open by another process (received
+     as a file descriptor) to a file descriptor, using copy_file_range
+     (which can share the data blocks if both files are on the same
+     filesystem supporting this) or sendfile where possible.
+
+     Returns the number of bytes copied.
+
+     @param in_fd  The file descriptor of the source file. Its file offset
+                   is not used or modified.
+     @param out_fd The file descriptor to copy the content to.
+     @param file   The path to the file corresponding to out_fd (used only
+                   in error messages).
+
+     @throw std::runtime_error When the source file cannot be read or
+                               the destination file cannot be written.
+  */
+  static unsigned long long copy_fd(int in_fd, int out_fd, fs::path file) {
+    off_t offset = 0;
+
+#if BOOST_OS_LINUX
+    while (true) {
+      ssize_t bytes = ::copy_file_range(in_fd, &offset, out_fd, nullptr,
+                                        1UL << 30, 0);
+
+      if (bytes == 0) {
+        return offset;
+      } else if (bytes < 0 && errno == EINTR) {
+        continue;
+      } else if (bytes < 0) {
+        // E.g. an older kernel or files on different filesystems, continue
+        // with sendfile from where it has stopped
+        break;
+      }
+    }
+
+    while (true) {
+      ssize_t bytes = ::sendfile(out_fd, in_fd, &offset, FILE_BUFFER_SIZE);
+
+      if (bytes == 0) {
+        return offset;
+      } else if (bytes < 0 && errno == EINTR) {
+        continue;
+      } else if (bytes < 0 && (errno == EINVAL || errno == ENOSYS)) {
+        break;
+      } else if (bytes < 0) {
+        throw std::runtime_error("Could not copy the received file to " +
+                                 file.string() + ", code " +
+                                 std::to_string(errno) + ".");
+      }
+    }
+
+    // sendfile is not supported for this kind of file, continue with
+    // a regular copy from where it has stopped
+#endif
+
+    std::unique_ptr<char[]> buf(new char[FILE_BUFFER_SIZE]);
+
+    while (true) {
+      ssize_t bytes = ::pread(in_fd, buf.get(), FILE_BUFFER_SIZE, offset);
+
+      if (bytes == 0) {
+        return offset;
+      } else if (bytes < 0 && errno == EINTR) {
+        continue;
+      } else if (bytes < 0) {
+        throw std::runtime_error("Could not read the received file for " +
+                                 file.string() + ", code " +
+                                 std::to_string(errno) + ".");
+      }
+
+      write_all(out_fd, buf.get(), bytes, file);
+      offset += bytes;
+    }
+  }
+
+  /**
+     Constructs a UnixSocket object.
+
+     @param sock     The Poco::Net::StreamSocket object corresponding to
+                     the already-established Unix domain socket.
+     @param path     The path to the socket file.
+     @param buf_size The buffer size for communication, in bytes.
+  */
+  UnixSocket::UnixSocket(net::StreamSocket &sock, fs::path path,
+                         unsigned int buf_size) : TCPSocket(sock, buf_size) {
+    this->path = path;
+  }
+
+  /**
+     Returns the path to the socket file.
+  */
+  std::string UnixSocket::get_address() {
+    return this->path.string();
+  }
+
+  /**
+     Returns 0, as Unix domain sockets have no ports.
+  */
+  unsigned short UnixSocket::get_port() {
+    return 0;
+  }
+
+  /**
+     Reads a file from the socket and saves it to another file.
+
+     If the other end has passed a file descriptor (see write(fs::path)),
+     the file is copied from the descriptor. Otherwise, data are read from
+     the socket until the other end closes it.
+  */
+  unsigned long long UnixSocket::read(fs::path file, long timeout_seconds) {
+    int sock_fd = this->socket.impl()->sockfd();
+
+    if (timeout_seconds != NO_TIMEOUT) {
+      struct pollfd poll_struct;
+      poll_struct.fd = sock_fd;
+      poll_struct.events = POLLIN;
+
+      int code;
+
+      do {
+        code = ::poll(&poll_struct, 1, 1000 * timeout_seconds);
+      } while (code == -1 && errno == EINTR);
+
+      if (code == -1) {
+        throw ConnectionException();
+      } else if (code == 0) {
+        throw TimeoutException();
+      }
+    }
+
+    // A passed file descriptor always comes with exactly one byte which
+    // is not part of the file, see write(fs::path)
+    char first_byte;
+    union {
+      char buf[CMSG_SPACE(sizeof(int))];
+      struct cmsghdr align;
+    } control;
+
+    struct iovec iov;
+    iov.iov_base = &first_byte;
+    iov.iov_len = 1;
+
+    struct msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t bytes;
+
+    do {
+      bytes = ::recvmsg(sock_fd, &msg, 0);
+    } while (bytes == -1 && errno == EINTR);
+
+    if (bytes == -1) {
+      std::runtime_error err("recvmsg from " + this->path.string() +
+                             " failed, code " + std::to_string(errno));
+      throw ConnectionException(err);
+    }
+
+    int passed_fd = -1;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        std::memcpy(&passed_fd, CMSG_DATA(cmsg), sizeof(int));
+      }
+    }
+
+    fdguard in(passed_fd);
+    fdguard out(::open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666));
+
+    if (out.fd == -1) {
+      throw std::runtime_error("Could not open " + file.string() + " for writing.");
+    }
+
+    if (in.fd != -1) {
+      return copy_fd(in.fd, out.fd, file);
+    } else if (bytes == 0) {
+      return 0;
+    }
+
+    write_all(out.fd, &first_byte, 1, file);
+
+#if BOOST_OS_LINUX
+    long long rest = splice_to_fd(sock_fd, false, out.fd, file, timeout_seconds);
+
+    if (rest != -1) {
+      return 1 + rest;
+    }
+#endif
+
+    std::unique_ptr<char[]> buf(new char[FILE_BUFFER_SIZE]);
+    unsigned long long bytes_total = 1;
+    int bytes_received;
+
+    while ((bytes_received = TCPSocket::read(buf.get(), FILE_BUFFER_SIZE,
+                                             timeout_seconds)) > 0) {
+      write_all(out.fd, buf.get(), bytes_received, file);
+      bytes_total += bytes_received;
+    }
+
+    return bytes_total;
+  }
+
+  /**
+     Passes an open file descriptor of a file to the other end
+     (SCM_RIGHTS) instead of sending its content.
+
+     The descriptor is sent along with one byte which is not part of
+     the file.
+  */
+  void UnixSocket::write(fs::path file) {
+    fdguard in(::open(file.c_str(), O_RDONLY | O_CLOEXEC));
+
+    if (in.fd == -1) {
+      std::runtime_error err("Could not open the file " +
+                             file.string() + "!");
+      throw ConnectionException(err);
+    }
+
+    char byte = 0;
+    union {
+      char buf[CMSG_SPACE(sizeof(int))];
+      struct cmsghdr align;
+    } control;
+    std::memset(control.buf, 0, sizeof(control.buf));
+
+    struct iovec iov;
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+
+    struct msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    std::memcpy(CMSG_DATA(cmsg), &in.fd, sizeof(int));
+
+    int flags = 0;
+
+#ifdef MSG_NOSIGNAL
+    flags |= MSG_NOSIGNAL;
+#endif
+
+    ssize_t bytes;
+
+    do {
+      bytes = ::sendmsg(this->socket.impl()->sockfd(), &msg, flags);
+    } while (bytes == -1 && errno == EINTR);
+
+    if (bytes != 1) {
+      std::runtime_error err("Could not pass the file " + file.string() +
+                             " to " + this->path.string() + ", code " +
+                             std::to_string(errno));
+      throw ConnectionException(err);
+    }
+  }
+
+  /**
+     Constructs a UnixSocketAcceptor object.
+
+     @param path                 The path where the socket file should be
+                                 created.
+     @param max_accepted         A maximum number of connections that
+                                 the acceptor can accept during its lifetime.
+                                 Use UNLIMITED_ACCEPTED for no limit.
+     @param try_subsequent_paths Indicates whether "<path>.1", "<path>.2" etc.
+                                 should be tried instead of path, skipping
+                                 the ones already in use.
+
+     @throw AlreadyInUseException When try_subsequent_paths is false and
+                                  another process listens at path.
+     @throw ConnectionException   In case of any other errors.
+  */
+  UnixSocketAcceptor::UnixSocketAcceptor(fs::path path, int max_accepted,
+                                         bool try_subsequent_paths) : Acceptor(max_accepted) {
+    this->lock_fd = -1;
+
+    if (path.string().find(' ') != std::string::npos) {
+      std::runtime_error err("The socket path " + path.string() +
+                             " must not contain spaces.");
+      throw ConnectionException(err);
+    }
+
+    if (try_subsequent_paths) {
+      unsigned int suffix = 1;
+      bool success = false;
+
+      while (!success) {
+        this->path = path;
+        this->path += "." + std::to_string(suffix);
+
+        try {
+          this->acceptor.bind(net::SocketAddress(net::SocketAddress::UNIX_LOCAL,
+                                                 this->path.string()), false);
+          success = true;
+        } catch (net::NetException &e) {
+          if (e.message().find("already in use") != std::string::npos) {
+            suffix++;
+          } else {
+            throw ConnectionException(e);
+          }
+        }
+      }
+    } else {
+      fs::path lock_path = path;
+      lock_path += ".lock";
+
+      int lock_fd = ::open(lock_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+
+      if (lock_fd == -1) {
+        std::runtime_error err("Could not open " + lock_path.string() +
+                               ", code " + std::to_string(errno));
+        throw ConnectionException(err);
+      }
+
+      if (::flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+        ::close(lock_fd);
+        throw AlreadyInUseException();
+      }
+
+      // Every acceptor listening at path holds the lock, so an existing
+      // socket file is a leftover of a process which has not exited cleanly
+      std::error_code error;
+
+      if (fs::is_socket(path, error)) {
+        fs::remove(path, error);
+      }
+
+      try {
+        this->acceptor.bind(net::SocketAddress(net::SocketAddress::UNIX_LOCAL,
+                                               path.string()), false);
+      } catch (net::NetException &e) {
+        ::close(lock_fd);
+
+        if (e.message().find("already in use") != std::string::npos) {
+          throw AlreadyInUseException();
+        } else {
+          throw ConnectionException(e);
+        }
+      }
+
+      this->path = path;
+      this->lock_fd = lock_fd;
+    }
+
+    try {
+      this->acceptor.listen();
+    } catch (net::NetException &e) {
+      throw ConnectionException(e);
+    }
+  }
+
+  UnixSocketAcceptor::~UnixSocketAcceptor() {
+    this->close();
+  }
+
+  std::unique_ptr<Connection> UnixSocketAcceptor::accept_connection(unsigned int buf_size) {
+    try {
+      net::StreamSocket socket = this->acceptor.acceptConnection();
+      return std::make_unique<UnixSocket>(socket, this->path, buf_size);
+    } catch (net::NetException &e) {
+      throw ConnectionException(e);
+    }
+  }
+
+  /**
+     Returns "<path to the socket file>".
+  */
+  std::string UnixSocketAcceptor::get_connection_instructions() {
+    return this->path.string();
+  }
+
+  std::string UnixSocketAcceptor::get_type() {
+    return "unix";
+  }
+
+  void UnixSocketAcceptor::close() {
+    this->acceptor.close();
+
+    // The path is cleared so that a socket file created later at the same
+    // path by another acceptor is never removed
+    if (!this->path.empty()) {
+      std::error_code error;
+      fs::remove(this->path, error);
+      this->path.clear();
+    }
+
+    // The lock file is not removed, as another process may be waiting
+    // for the lock on it at the same time
+    if (this->lock_fd != -1) {
+      ::close(this->lock_fd);
+      this->lock_fd = -1;
+    }
+  }
 #endif
 }
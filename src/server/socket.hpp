@@ -89,6 +89,26 @@ namespace aperf {
     */
     virtual std::string read(long timeout_seconds = NO_TIMEOUT) = 0;
 
+    /**
+       Reads data from the connection until the other end closes it
+       and saves them to a file, replacing its content if it exists.
+
+       Returns the number of bytes received.
+
+       The default implementation copies the data through a buffer
+       in user space using read(char *, unsigned int, long).
+
+       @param file            The path to the file where received data
+                              should be saved.
+       @param timeout_seconds A maximum number of seconds that can pass
+                              while waiting for every portion of the data.
+
+       @throw TimeoutException    In case of timeout (see timeout_seconds).
+       @throw ConnectionException In case of any connection errors.
+       @throw std::runtime_error  When the file cannot be written.
+    */
+    virtual unsigned long long read(fs::path file, long timeout_seconds);
+
     /**
        Writes a string to the connection.
 
@@ -123,6 +143,20 @@ namespace aperf {
        Gets the buffer size for communication, in bytes.
     */
     virtual unsigned int get_buf_size() = 0;
+
+    /**
+       Gets a file descriptor becoming readable (POLLIN) when new data
+       arrive, so that waiting for the connection can be combined with
+       waiting for other events in poll().
+
+       -1 is returned if there is no such descriptor or the connection
+       has already received data that have not been read yet (the next
+       read call may then return without touching the descriptor).
+       The default implementation always returns -1.
+    */
+    virtual int get_poll_fd() {
+      return -1;
+    }
   };
 
   /**
@@ -148,6 +182,7 @@ namespace aperf {
     virtual unsigned int get_buf_size() = 0;
     virtual int read(char *buf, unsigned int len, long timeout_seconds) = 0;
     virtual std::string read(long timeout_seconds = NO_TIMEOUT) = 0;
+    virtual unsigned long long read(fs::path file, long timeout_seconds) = 0;
     virtual void write(std::string msg, bool new_line = true) = 0;
     virtual void write(fs::path file) = 0;
     virtual void write(unsigned int len, char *buf) = 0;
@@ -255,9 +290,9 @@ namespace aperf {
      A class describing a TCP socket.
   */
   class TCPSocket : public Socket {
-  private:
+  protected:
     net::StreamSocket socket;
-    std::unique_ptr<char> buf;
+    std::unique_ptr<char[]> buf;
     unsigned int buf_size;
     int start_pos;
     std::queue<std::string> buffered_msgs;
@@ -273,23 +308,23 @@ namespace aperf {
     unsigned int get_buf_size();
     int read(char *buf, unsigned int len, long timeout_seconds);
     std::string read(long timeout_seconds = NO_TIMEOUT);
+    unsigned long long read(fs::path file, long timeout_seconds);
     void write(std::string msg, bool new_line);
     void write(fs::path file);
     void write(unsigned int len, char *buf);
+    int get_poll_fd();
   };
 
   /**
      A class describing a TCP acceptor.
   */
   class TCPAcceptor : public Acceptor {
-  private:
+  protected:
     net::ServerSocket acceptor;
 
     TCPAcceptor(std::string address, unsigned short port,
                 int max_accepted,
                 bool try_subsequent_ports);
-
-  protected:
     std::unique_ptr<Connection> accept_connection(unsigned int buf_size);
     void close();
 
@@ -350,7 +385,7 @@ namespace aperf {
     int write_fd[2];
     unsigned int buf_size;
     std::queue<std::string> buffered_msgs;
-    std::unique_ptr<char> buf;
+    std::unique_ptr<char[]> buf;
     int start_pos;
 
   public:
@@ -360,10 +395,12 @@ namespace aperf {
     ~FileDescriptor();
     int read(char *buf, unsigned int len, long timeout_seconds);
     std::string read(long timeout_seconds = NO_TIMEOUT);
+    unsigned long long read(fs::path file, long timeout_seconds);
     void write(std::string msg, bool new_line);
     void write(fs::path file);
     void write(unsigned int len, char *buf);
     unsigned int get_buf_size();
+    int get_poll_fd();
     void close();
   };
 
@@ -411,6 +448,99 @@ namespace aperf {
     std::string get_connection_instructions();
     std::string get_type();
   };
+
+  /**
+     A class describing a Unix domain socket.
+
+     Poco handles Unix domain sockets through the same StreamSocket
+     interface as TCP sockets, so the stream logic is shared with TCPSocket.
+     Files are not copied through the socket though: write(fs::path) passes
+     an open file descriptor of the file to the other end (SCM_RIGHTS) and
+     read(fs::path) copies the file from a received descriptor, falling back
+     to receiving the content through the socket when the other end sends
+     it this way (e.g. an archive created on the fly).
+
+     This is available only when compiled for Unix-based platforms.
+  */
+  class UnixSocket : public TCPSocket {
+  private:
+    fs::path path;
+
+  public:
+    using TCPSocket::read;
+    using TCPSocket::write;
+
+    UnixSocket(net::StreamSocket &sock, fs::path path,
+               unsigned int buf_size);
+    std::string get_address();
+    unsigned short get_port();
+    unsigned long long read(fs::path file, long timeout_seconds);
+    void write(fs::path file);
+  };
+
+  /**
+     A class describing a Unix domain socket acceptor.
+     This is available only when compiled for Unix-based platforms.
+  */
+  class UnixSocketAcceptor : public Acceptor {
+  private:
+    net::ServerSocket acceptor;
+    fs::path path;
+    int lock_fd;
+
+    UnixSocketAcceptor(fs::path path, int max_accepted,
+                       bool try_subsequent_paths);
+
+  protected:
+    std::unique_ptr<Connection> accept_connection(unsigned int buf_size);
+    void close();
+
+  public:
+    /**
+       A UnixSocketAcceptor factory.
+    */
+    class Factory : public Acceptor::Factory {
+    private:
+      fs::path path;
+      bool try_subsequent_paths;
+
+    public:
+      /**
+         Constructs a UnixSocketAcceptor::Factory object.
+
+         @param path                 The path where the socket file should
+                                     be created. Unless try_subsequent_paths
+                                     is true, "<path>.lock" is also created
+                                     for detecting whether the socket file
+                                     is in use.
+         @param try_subsequent_paths Indicates whether "<path>.1", "<path>.2"
+                                     etc. should be tried instead of path,
+                                     skipping the ones already in use. This
+                                     is needed when multiple acceptors are
+                                     made. The chosen path will be reflected
+                                     in the output of
+                                     get_connection_instructions().
+      */
+      Factory(fs::path path, bool try_subsequent_paths = false) {
+        this->path = path;
+        this->try_subsequent_paths = try_subsequent_paths;
+      }
+
+      std::unique_ptr<Acceptor> make_acceptor(int max_accepted) {
+        return std::unique_ptr<Acceptor>(new UnixSocketAcceptor(this->path,
+                                                                max_accepted,
+                                                                this->try_subsequent_paths));
+      }
+
+      std::string get_type() {
+        return "unix";
+      }
+    };
+
+    ~UnixSocketAcceptor();
+    std::string get_connection_instructions();
+    std::string get_type();
+  };
 #endif
 }
 
@@ -0,0 +1,242 @@
+// AdaptivePerf: comprehensive profiling tool based on Linux perf
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "stack.hpp"
+#include <algorithm>
+#include <charconv>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace aperf {
+  /**
+     Gets the stack ID of a callchain, adding the callchain to the table
+     if it hasn't been seen before.
+
+     std::invalid_argument is thrown if the offset of a frame not seen
+     before can't be parsed by parse_offset().
+
+     @param callchain The callchain to intern, ordered from the outermost
+                      to the innermost frame. Each element is a
+                      (symbol name, offset) pair.
+  */
+  unsigned int StackTable::intern(std::vector<std::pair<std::string, std::string> > &callchain) {
+    unsigned int stack_id = NO_STACK;
+
+    for (auto &frame : callchain) {
+      std::string frame_key = frame.first + '\0' + frame.second;
+      unsigned int frame_id;
+
+      auto frame_it = this->frame_ids.find(frame_key);
+
+      if (frame_it == this->frame_ids.end()) {
+        unsigned long long offset;
+
+        if (!parse_offset(frame.second, offset)) {
+          throw std::invalid_argument("Invalid offset: " + frame.second);
+        }
+
+        frame_id = this->frames.size();
+        this->frames.push_back(frame);
+        this->frame_ids[frame_key] = frame_id;
+      } else {
+        frame_id = frame_it->second;
+      }
+
+      unsigned long long stack_key = ((unsigned long long)stack_id << 32) | frame_id;
+      auto stack_it = this->stack_ids.find(stack_key);
+
+      if (stack_it == this->stack_ids.end()) {
+        struct stack_node node;
+        node.parent = stack_id;
+        node.frame = frame_id;
+
+        stack_id = this->stacks.size();
+        this->stacks.push_back(node);
+        this->stack_ids[stack_key] = stack_id;
+      } else {
+        stack_id = stack_it->second;
+      }
+    }
+
+    return stack_id;
+  }
+
+  /**
+     Reconstructs the callchain of a given stack ID.
+
+     @param stack_id  The stack ID returned by intern().
+     @param callchain The vector where the callchain should be stored,
+                      ordered from the outermost to the innermost frame.
+                      Its previous content is discarded.
+  */
+  void StackTable::get_callchain(unsigned int stack_id,
+                                 std::vector<std::pair<std::string, std::string> > &callchain) {
+    callchain.clear();
+
+    while (stack_id != NO_STACK) {
+      struct stack_node &node = this->stacks[stack_id];
+      callchain.push_back(this->frames[node.frame]);
+      stack_id = node.parent;
+    }
+
+    std::reverse(callchain.begin(), callchain.end());
+  }
+
+  /**
+     Gets the frame IDs of a given stack ID.
+
+     @param stack_id  The stack ID returned by intern().
+     @param frame_ids The vector where the frame IDs should be stored,
+                      ordered from the outermost to the innermost frame.
+                      Its previous content is discarded.
+  */
+  void StackTable::get_frame_ids(unsigned int stack_id,
+                                 std::vector<unsigned int> &frame_ids) {
+    frame_ids.clear();
+
+    while (stack_id != NO_STACK) {
+      struct stack_node &node = this->stacks[stack_id];
+      frame_ids.push_back(node.frame);
+      stack_id = node.parent;
+    }
+
+    std::reverse(frame_ids.begin(), frame_ids.end());
+  }
+
+  /**
+     Gets a frame in form of a (symbol name, offset) pair.
+
+     @param frame_id The frame ID obtained from get_frame_ids().
+  */
+  std::pair<std::string, std::string> &StackTable::get_frame(unsigned int frame_id) {
+    return this->frames[frame_id];
+  }
+
+  /**
+     Gets a stack in form of a (parent stack ID, frame ID) pair, where
+     the parent stack ID is NO_STACK for outermost frames.
+
+     @param stack_id The stack ID obtained from intern().
+  */
+  std::pair<unsigned int, unsigned int> StackTable::get_stack(unsigned int stack_id) {
+    struct stack_node &node = this->stacks[stack_id];
+    return std::make_pair(node.parent, node.frame);
+  }
+
+  /**
+     Gets the number of distinct stacks (i.e. callchains and their
+     prefixes) stored in the table.
+  */
+  unsigned int StackTable::get_stack_count() {
+    return this->stacks.size();
+  }
+
+  /**
+     Gets the number of distinct frames stored in the table.
+  */
+  unsigned int StackTable::get_frame_count() {
+    return this->frames.size();
+  }
+
+  /**
+     Parses an offset of a callchain element, i.e. either a hexadecimal
+     number prefixed with "0x" (as produced by Python's hex()) or an empty
+     string meaning no offset (parsed to NO_OFFSET).
+
+     Returns true if the offset has been parsed successfully, false otherwise.
+
+     @param offset The offset to parse.
+     @param result The variable where the parsed offset should be stored.
+  */
+  bool parse_offset(const std::string &offset, unsigned long long &result) {
+    if (offset.empty()) {
+      result = NO_OFFSET;
+      return true;
+    }
+
+    if (offset.size() < 3 || offset[0] != '0' || offset[1] != 'x') {
+      return false;
+    }
+
+    const char *end = offset.data() + offset.size();
+    auto parse_result = std::from_chars(offset.data() + 2, end, result, 16);
+
+    return parse_result.ec == std::errc() && parse_result.ptr == end &&
+      result != NO_OFFSET;
+  }
+
+  /**
+     Formats an offset parsed by parse_offset() back to a string.
+
+     @param offset The offset to format.
+  */
+  std::string format_offset(unsigned long long offset) {
+    if (offset == NO_OFFSET) {
+      return "";
+    }
+
+    char buf[2 + 16];
+    buf[0] = '0';
+    buf[1] = 'x';
+
+    auto format_result = std::to_chars(buf + 2, buf + sizeof(buf), offset, 16);
+    return std::string(buf, format_result.ptr);
+  }
+
+  /**
+     Folds direct and mutual recursion in a callchain.
+
+     Whenever a symbol appears again in the callchain, everything between its
+     outermost occurrence and the new one is removed, so that the whole
+     recursion cycle is represented by the outermost frame only. The offset
+     of the outermost frame is replaced by the offset of the innermost
+     occurrence of its symbol, i.e. the one the rest of the callchain is
+     called from.
+
+     For example, main -> a -> b -> a -> b -> c is folded to main -> a -> b -> c,
+     with "a" having the depth of 2.
+
+     @param callchain The callchain to fold in place, ordered from
+                      the outermost to the innermost frame. Each element is
+                      a (symbol name, offset) pair.
+     @param depths    The vector where the recursion depths of the frames of
+                      the folded callchain should be stored (1 for frames not
+                      involved in any recursion). Its previous content is
+                      discarded.
+  */
+  void fold_recursion(std::vector<std::pair<std::string, std::string> > &callchain,
+                      std::vector<unsigned int> &depths) {
+    std::unordered_map<std::string, unsigned int> positions;
+    unsigned int size = 0;
+
+    depths.clear();
+
+    for (int i = 0; i < callchain.size(); i++) {
+      auto it = positions.find(callchain[i].first);
+
+      if (it == positions.end()) {
+        positions[callchain[i].first] = size;
+
+        if (size != i) {
+          callchain[size] = std::move(callchain[i]);
+        }
+
+        depths.push_back(1);
+        size++;
+      } else {
+        unsigned int position = it->second;
+
+        for (int j = position + 1; j < size; j++) {
+          positions.erase(callchain[j].first);
+        }
+
+        callchain[position].second = std::move(callchain[i].second);
+        depths.resize(position + 1);
+        depths[position]++;
+        size = position + 1;
+      }
+    }
+
+    callchain.resize(size);
+  }
+};
@@ -0,0 +1,65 @@
+// AdaptivePerf: comprehensive profiling tool based on Linux perf
+// Copyright (C) CERN. See LICENSE for details.
+
+#ifndef STACK_HPP_
+#define STACK_HPP_
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define NO_STACK 0xffffffff
+#define NO_OFFSET 0xffffffffffffffffULL
+
+namespace aperf {
+  /**
+     A class hash-consing callchains into stack IDs.
+
+     Every distinct (symbol name, offset) pair is stored once as a frame and
+     every distinct callchain is stored as a (parent stack ID, frame ID) pair,
+     so callchains sharing a common prefix share its storage as well.
+  */
+  class StackTable {
+  private:
+    struct stack_node {
+      unsigned int parent;
+      unsigned int frame;
+    };
+
+    std::vector<std::pair<std::string, std::string> > frames;
+    std::unordered_map<std::string, unsigned int> frame_ids;
+    std::vector<struct stack_node> stacks;
+    std::unordered_map<unsigned long long, unsigned int> stack_ids;
+
+  public:
+    unsigned int intern(std::vector<std::pair<std::string, std::string> > &callchain);
+    void get_callchain(unsigned int stack_id,
+                       std::vector<std::pair<std::string, std::string> > &callchain);
+    void get_frame_ids(unsigned int stack_id,
+                       std::vector<unsigned int> &frame_ids);
+    std::pair<std::string, std::string> &get_frame(unsigned int frame_id);
+    std::pair<unsigned int, unsigned int> get_stack(unsigned int stack_id);
+    unsigned int get_stack_count();
+    unsigned int get_frame_count();
+  };
+
+  bool parse_offset(const std::string &offset, unsigned long long &result);
+  std::string format_offset(unsigned long long offset);
+  void fold_recursion(std::vector<std::pair<std::string, std::string> > &callchain,
+                      std::vector<unsigned int> &depths);
+
+  /**
+     A structure describing one sample in a per-thread sample log.
+
+     The timestamp is in ns and the period is in ns for on-CPU and
+     off-CPU samples or in the units of a custom event otherwise.
+  */
+  struct SampleLogEntry {
+    unsigned long long timestamp;
+    unsigned long long period;
+    unsigned int stack_id;
+    bool offcpu;
+  };
+};
+
+#endif
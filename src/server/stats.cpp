@@ -0,0 +1,126 @@
+// AdaptivePerf: comprehensive profiling tool based on Linux perf
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "stats.hpp"
+#include <bit>
+#include <ctime>
+#include <sys/resource.h>
+
+namespace aperf {
+  /**
+     Constructs a Stopwatch object and starts measuring time.
+  */
+  Stopwatch::Stopwatch() {
+    this->reset();
+  }
+
+  /**
+     Restarts measuring time.
+  */
+  void Stopwatch::reset() {
+    this->start = ch::steady_clock::now();
+  }
+
+  /**
+     Gets the number of nanoseconds elapsed since the construction
+     of the object or the last call to reset().
+  */
+  unsigned long long Stopwatch::elapsed_ns() {
+    return ch::duration_cast<ch::nanoseconds>(ch::steady_clock::now() -
+                                              this->start).count();
+  }
+
+  /**
+     Constructs an empty DurationHistogram object.
+  */
+  DurationHistogram::DurationHistogram() {
+    this->buckets.resize(64, 0);
+    this->count = 0;
+    this->max = 0;
+  }
+
+  /**
+     Adds a measurement to the histogram.
+
+     @param ns A measured duration in nanoseconds.
+  */
+  void DurationHistogram::add(unsigned long long ns) {
+    this->buckets[std::bit_width(ns) == 0 ? 0 : std::bit_width(ns) - 1]++;
+    this->count++;
+
+    if (ns > this->max) {
+      this->max = ns;
+    }
+  }
+
+  /**
+     Gets the approximate value below which a given fraction of
+     measurements falls, in nanoseconds.
+
+     The returned value is the upper bound of the power-of-two bucket
+     where the percentile lies (capped at the maximum measurement), so it
+     overestimates the exact percentile by less than a factor of 2.
+
+     @param fraction A number between 0 and 1 (e.g. 0.99 for the 99th
+                     percentile).
+  */
+  unsigned long long DurationHistogram::get_percentile(double fraction) {
+    if (this->count == 0) {
+      return 0;
+    }
+
+    unsigned long long threshold = fraction * this->count;
+    unsigned long long seen = 0;
+
+    for (int i = 0; i < this->buckets.size(); i++) {
+      seen += this->buckets[i];
+
+      if (seen > threshold) {
+        return std::min(this->max, (2ULL << i) - 1);
+      }
+    }
+
+    return this->max;
+  }
+
+  /**
+     Returns a JSON summary of the histogram with the p50, p99, and
+     maximum values.
+  */
+  nlohmann::json DurationHistogram::to_json() {
+    nlohmann::json result;
+    result["count"] = this->count;
+    result["p50_ns"] = this->get_percentile(0.5);
+    result["p99_ns"] = this->get_percentile(0.99);
+    result["max_ns"] = this->max;
+    return result;
+  }
+
+  /**
+     Gets the CPU time consumed so far by the calling thread, in
+     nanoseconds.
+  */
+  unsigned long long get_thread_cpu_ns() {
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+      return 0;
+    }
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  }
+
+  /**
+     Gets the peak resident set size of the current process, in
+     kilobytes.
+  */
+  unsigned long long get_peak_rss_kb() {
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+      return 0;
+    }
+
+    return usage.ru_maxrss;
+  }
+};
@@ -0,0 +1,50 @@
+// AdaptivePerf: comprehensive profiling tool based on Linux perf
+// Copyright (C) CERN. See LICENSE for details.
+
+#ifndef STATS_HPP_
+#define STATS_HPP_
+
+#include <chrono>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+namespace aperf {
+  namespace ch = std::chrono;
+
+  /**
+     A class measuring the wall-clock time elapsed since its construction
+     or the last call to reset().
+  */
+  class Stopwatch {
+  private:
+    ch::steady_clock::time_point start;
+
+  public:
+    Stopwatch();
+    void reset();
+    unsigned long long elapsed_ns();
+  };
+
+  /**
+     A class describing a histogram of durations with power-of-two
+     buckets, used for approximating percentiles without storing
+     every measurement.
+  */
+  class DurationHistogram {
+  private:
+    std::vector<unsigned long long> buckets;
+    unsigned long long count;
+    unsigned long long max;
+
+  public:
+    DurationHistogram();
+    void add(unsigned long long ns);
+    unsigned long long get_percentile(double fraction);
+    nlohmann::json to_json();
+  };
+
+  unsigned long long get_thread_cpu_ns();
+  unsigned long long get_peak_rss_kb();
+};
+
+#endif
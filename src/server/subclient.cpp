@@ -2,98 +2,414 @@
 // Copyright (C) CERN. See LICENSE for details.
 
 #include "server.hpp"
+#include "compress.hpp"
+#include "rawlog.hpp"
+#include "stats.hpp"
+#include <charconv>
+#include <climits>
+#include <fstream>
 #include <iostream>
+#include <map>
 #include <unordered_set>
 #include <unordered_map>
 
 namespace aperf {
-  void StdSubclient::recurse(nlohmann::json &cur_elem,
+  /**
+     Gets a process/thread ID or a syscall return value from a JSON value
+     sent by the AdaptivePerf "perf" Python scripts.
+
+     Apart from integers, decimal strings are accepted as well since older
+     versions of the scripts send IDs as strings. An exception is thrown
+     if the value is neither of these.
+
+     @param value The JSON value to convert.
+  */
+  static int get_id(nlohmann::json &value) {
+    if (value.is_string()) {
+      std::string &str = value.template get_ref<std::string &>();
+      const char *end = str.data() + str.size();
+      int result;
+      auto parse_result = std::from_chars(str.data(), end, result);
+
+      if (parse_result.ec != std::errc() || parse_result.ptr != end) {
+        throw std::invalid_argument("Invalid ID: " + str);
+      }
+
+      return result;
+    }
+
+    return value.template get<int>();
+  }
+
+  /**
+     Packs a PID and a TID into a single key of a per-thread hash map.
+
+     @param pid The PID.
+     @param tid The TID.
+  */
+  static unsigned long long get_thread_key(int pid, int tid) {
+    return ((unsigned long long)(unsigned int)pid << 32) | (unsigned int)tid;
+  }
+
+  /**
+     Converts a key made by get_thread_key() to a "<PID>_<TID>" string
+     used in the output.
+
+     @param key The key to convert.
+  */
+  static std::string get_thread_key_str(unsigned long long key) {
+    return std::to_string((int)(key >> 32)) + "_" + std::to_string((int)(key & 0xffffffff));
+  }
+
+  /**
+     Inserts a callchain into a tree (internal method).
+
+     The insertion is done iteratively, one tree level per callchain
+     element, so that arbitrarily deep callchains can't overflow the stack.
+
+     @param root            The root node of the tree.
+     @param callchain_parts The callchain to insert, ordered from the outermost
+                            to the innermost frame.
+     @param depths          The recursion depths of the callchain elements as
+                            returned by fold_recursion(), or an empty vector
+                            if recursion folding is not done.
+     @param period          The period to add to every node on the path.
+     @param time_ordered    Whether the tree is time-ordered.
+     @param offcpu          Whether the callchain comes from an off-CPU sample.
+  */
+  void StdSubclient::recurse(TreeNode &root,
                              std::vector<std::pair<std::string, std::string> > &callchain_parts,
-                             int callchain_index,
+                             std::vector<unsigned int> &depths,
                              unsigned long long period,
                              bool time_ordered, bool offcpu) {
-    std::pair<std::string, std::string> p = callchain_parts[callchain_index];
-    nlohmann::json &arr = cur_elem["children"];
-    nlohmann::json *elem;
+    TreeNode *cur_elem = &root;
 
-    bool last_block = callchain_index == callchain_parts.size() - 1;
+    for (int callchain_index = 0; callchain_index < callchain_parts.size();
+         callchain_index++) {
+      std::pair<std::string, std::string> &p = callchain_parts[callchain_index];
+      std::vector<TreeNode> &arr = cur_elem->children;
+      TreeNode *elem;
 
-    if (!offcpu) {
-      cur_elem["cold"] = false;
-    }
+      bool last_block = callchain_index == callchain_parts.size() - 1;
 
-    if (time_ordered) {
-      if (arr.empty() || arr.back()["name"] != p.first ||
-          (last_block &&
-           arr.back()["cold"] != offcpu) ||
-          (last_block &&
-           !arr.back()["children"].empty()) ||
-          (!last_block &&
-           arr.back()["children"].empty())) {
-        nlohmann::json new_elem;
-        new_elem["name"] = p.first;
-        new_elem["offsets"] = nlohmann::json::object();
-        new_elem["value"] = 0;
-        new_elem["children"] = nlohmann::json::array();
-        new_elem["cold"] = offcpu;
-        arr.push_back(new_elem);
+      if (!offcpu) {
+        cur_elem->cold = false;
       }
 
-      elem = &arr.back();
-    } else {
-      bool found = false;
-      int cold_index = -1;
-      int hot_index = -1;
+      if (time_ordered) {
+        if (arr.empty() || arr.back().name != p.first ||
+            (last_block &&
+             arr.back().cold != offcpu) ||
+            (last_block &&
+             !arr.back().children.empty()) ||
+            (!last_block &&
+             arr.back().children.empty())) {
+          this->tree_nodes++;
+          arr.push_back(TreeNode(p.first, offcpu));
+        }
+
+        elem = &arr.back();
+      } else {
+        bool found = false;
+        int cold_index = -1;
+        int hot_index = -1;
+
+        for (int i = 0; i < arr.size(); i++) {
+          if (arr[i].name == p.first &&
+              (!last_block || arr[i].cold == offcpu)) {
+            found = true;
 
-      for (int i = 0; i < arr.size(); i++) {
-        if (arr[i]["name"] == p.first &&
-            (!last_block || arr[i]["cold"] == offcpu)) {
-          found = true;
+            if (arr[i].cold) {
+              cold_index = i;
+            } else {
+              hot_index = i;
+            }
+          }
+        }
 
-          if (arr[i]["cold"]) {
-            cold_index = i;
+        if (found) {
+          if (cold_index == -1) {
+            elem = &arr[hot_index];
+          } else if (hot_index == -1) {
+            elem = &arr[cold_index];
+          } else if (offcpu) {
+            elem = &arr[cold_index];
           } else {
-            hot_index = i;
+            elem = &arr[hot_index];
           }
+        } else {
+          this->tree_nodes++;
+          arr.push_back(TreeNode(p.first, offcpu));
+          elem = &arr.back();
         }
       }
 
-      if (found) {
-        if (cold_index == -1) {
-          elem = &arr[hot_index];
-        } else if (hot_index == -1) {
-          elem = &arr[cold_index];
-        } else if (offcpu) {
-          elem = &arr[cold_index];
-        } else {
-          elem = &arr[hot_index];
+      elem->value += period;
+
+      // Offsets are validated when callchains are interned, so parsing
+      // can't fail here.
+      unsigned long long offset;
+      parse_offset(p.second, offset);
+      elem->add_offset(offset, period);
+
+      if (!depths.empty() && depths[callchain_index] > 1) {
+        elem->add_recursion(depths[callchain_index], period);
+      }
+
+      cur_elem = elem;
+    }
+  }
+
+  /**
+     Builds the aggregated and time-ordered trees of a thread by replaying
+     its sample log in order (internal method).
+
+     Consecutive samples with the same stack and on/off-CPU state are folded
+     into one before being inserted, which produces the same trees as
+     inserting them one by one. The trees are built as TreeNode objects
+     and converted to JSON at the end.
+
+     @param log                     The sample log of the thread.
+     @param from                    The smallest timestamp of a sample to
+                                    include.
+     @param to                      The timestamp from which samples should
+                                    no longer be included.
+     @param output                  The JSON object where the aggregated tree
+                                    should be stored.
+     @param output_time_ordered     The JSON object where the time-ordered tree
+                                    should be stored.
+     @param recurse_ns              A pointer to a counter which the time spent
+                                    on building the aggregated tree should be
+                                    added to (or nullptr).
+     @param recurse_time_ordered_ns A pointer to a counter which the time spent
+                                    on building the time-ordered tree should be
+                                    added to (or nullptr).
+  */
+  void StdSubclient::replay_log(std::vector<SampleLogEntry> &log,
+                                unsigned long long from,
+                                unsigned long long to,
+                                nlohmann::json &output,
+                                nlohmann::json &output_time_ordered,
+                                unsigned long long *recurse_ns,
+                                unsigned long long *recurse_time_ordered_ns) {
+    // "cold" will switch to false as soon as on-CPU activity is encountered
+    TreeNode root("all", true);
+    TreeNode root_time_ordered("all", true);
+
+    auto in_range = [from, to](struct SampleLogEntry &entry) {
+      return entry.timestamp >= from && entry.timestamp < to;
+    };
+
+    unsigned long long total_period = 0;
+    std::vector<std::pair<std::string, std::string> > callchain;
+    std::vector<unsigned int> depths;
+    bool fold = this->context.get_session_settings().fold_recursion;
+    int i = 0;
+
+    while (i < log.size()) {
+      if (!in_range(log[i])) {
+        i++;
+        continue;
+      }
+
+      unsigned int stack_id = log[i].stack_id;
+      bool offcpu = log[i].offcpu;
+      unsigned long long period = log[i].period;
+
+      for (i++; i < log.size(); i++) {
+        if (!in_range(log[i])) {
+          continue;
         }
-      } else {
-        nlohmann::json new_elem;
-        new_elem["name"] = p.first;
-        new_elem["offsets"] = nlohmann::json::object();
-        new_elem["value"] = 0;
-        new_elem["children"] = nlohmann::json::array();
-        new_elem["cold"] = offcpu;
-
-        arr.push_back(new_elem);
-        elem = &arr.back();
+
+        if (log[i].stack_id != stack_id || log[i].offcpu != offcpu) {
+          break;
+        }
+
+        period += log[i].period;
       }
+
+      this->stack_table.get_callchain(stack_id, callchain);
+
+      Stopwatch recurse_watch;
+
+      if (fold) {
+        fold_recursion(callchain, depths);
+      }
+
+      recurse(root, callchain, depths, period, false, offcpu);
+
+      if (recurse_ns != nullptr) {
+        *recurse_ns += recurse_watch.elapsed_ns();
+      }
+
+      recurse_watch.reset();
+      recurse(root_time_ordered, callchain, depths, period, true, offcpu);
+
+      if (recurse_time_ordered_ns != nullptr) {
+        *recurse_time_ordered_ns += recurse_watch.elapsed_ns();
+      }
+
+      total_period += period;
     }
 
-    (*elem)["value"] = (unsigned long long)(*elem)["value"] + period;
+    root.value = total_period;
+    root_time_ordered.value = total_period;
 
-    unsigned long long old_value = 0;
+    Stopwatch to_json_watch;
+    root.to_json(output);
 
-    if ((*elem)["offsets"].contains(p.second)) {
-      old_value = (unsigned long long)(*elem)["offsets"][p.second];
+    if (recurse_ns != nullptr) {
+      *recurse_ns += to_json_watch.elapsed_ns();
     }
 
-    (*elem)["offsets"][p.second] = old_value + period;
+    to_json_watch.reset();
+    root_time_ordered.to_json(output_time_ordered);
 
-    if (!last_block) {
-      recurse(*elem, callchain_parts, callchain_index + 1, period,
-              time_ordered, offcpu);
+    if (recurse_time_ordered_ns != nullptr) {
+      *recurse_time_ordered_ns += to_json_watch.elapsed_ns();
+    }
+  }
+
+  /**
+     Builds the per-thread timeline flame graphs for the time bucket sizes
+     requested in the session settings and stores them in the "timeline"
+     object of the result (internal method).
+
+     The "timeline" object has the following structure:
+     {"frames": [<symbol name>, ...],
+      "threads": {"<PID>_<TID>": {"<bucket size in ms>": [[<bucket index>, <nodes>], ...]}}}
+
+     where every flame graph is a flat array of nodes, each described by
+     four consecutive integers: the index of the parent node (-1 for children
+     of the root), the index of the symbol name in "frames", the sum of
+     sample periods, and 1 if the node has only off-CPU activity or 0 otherwise.
+     Parents always come before their children. Offsets are not included and
+     buckets without samples are omitted.
+
+     @param start_time The timestamp of the profile start, in ns.
+  */
+  void StdSubclient::build_timeline(unsigned long long start_time) {
+    std::vector<unsigned long long> &bucket_sizes_ms =
+      this->context.get_session_settings().timeline_buckets_ms;
+
+    nlohmann::json &timeline = this->json_result["timeline"];
+    timeline["frames"] = nlohmann::json::array();
+    timeline["threads"] = nlohmann::json::object();
+
+    std::unordered_map<unsigned int, unsigned int> frame_to_name;
+    std::unordered_map<std::string, unsigned int> name_indices;
+    std::vector<unsigned int> frame_ids;
+
+    for (auto &elem : this->sample_logs) {
+      std::vector<SampleLogEntry> &log = elem.second;
+      nlohmann::json &thread_timeline = timeline["threads"][get_thread_key_str(elem.first)];
+
+      for (auto bucket_size_ms : bucket_sizes_ms) {
+        if (bucket_size_ms == 0) {
+          continue;
+        }
+
+        unsigned long long bucket_size = bucket_size_ms * 1000000ULL;
+
+        // Samples are aggregated by (stack ID, on/off-CPU) within each bucket
+        // first, keeping the order of first appearance.
+        std::map<unsigned long long,
+                 std::vector<std::pair<unsigned long long, unsigned long long> > > buckets;
+        std::map<unsigned long long,
+                 std::unordered_map<unsigned long long, unsigned int> > bucket_indices;
+
+        for (auto &entry : log) {
+          unsigned long long bucket = (entry.timestamp > start_time ?
+                                       entry.timestamp - start_time : 0) / bucket_size;
+          unsigned long long key = ((unsigned long long)entry.stack_id << 1) | entry.offcpu;
+
+          auto &indices = bucket_indices[bucket];
+          auto it = indices.find(key);
+
+          if (it == indices.end()) {
+            indices[key] = buckets[bucket].size();
+            buckets[bucket].push_back(std::make_pair(key, entry.period));
+          } else {
+            buckets[bucket][it->second].second += entry.period;
+          }
+        }
+
+        nlohmann::json &result = thread_timeline[std::to_string(bucket_size_ms)];
+        result = nlohmann::json::array();
+
+        for (auto &bucket : buckets) {
+          std::vector<long long> parents;
+          std::vector<unsigned int> names;
+          std::vector<unsigned long long> values;
+          std::vector<bool> cold;
+          std::unordered_map<unsigned long long, unsigned int> nodes;
+
+          for (auto &sample : bucket.second) {
+            bool offcpu = sample.first & 1;
+            this->stack_table.get_frame_ids(sample.first >> 1, frame_ids);
+
+            long long parent = -1;
+
+            for (auto frame_id : frame_ids) {
+              auto name_it = frame_to_name.find(frame_id);
+              unsigned int name_index;
+
+              if (name_it == frame_to_name.end()) {
+                std::string &name = this->stack_table.get_frame(frame_id).first;
+                auto index_it = name_indices.find(name);
+
+                if (index_it == name_indices.end()) {
+                  name_index = name_indices.size();
+                  name_indices[name] = name_index;
+                  timeline["frames"].push_back(name);
+                } else {
+                  name_index = index_it->second;
+                }
+
+                frame_to_name[frame_id] = name_index;
+              } else {
+                name_index = name_it->second;
+              }
+
+              unsigned long long node_key =
+                ((unsigned long long)(parent + 1) << 32) | name_index;
+              auto node_it = nodes.find(node_key);
+              unsigned int node;
+
+              if (node_it == nodes.end()) {
+                node = parents.size();
+                nodes[node_key] = node;
+                parents.push_back(parent);
+                names.push_back(name_index);
+                values.push_back(0);
+                cold.push_back(true);
+              } else {
+                node = node_it->second;
+              }
+
+              values[node] += sample.second;
+
+              if (!offcpu) {
+                cold[node] = false;
+              }
+
+              parent = node;
+            }
+          }
+
+          nlohmann::json flat_nodes = nlohmann::json::array();
+
+          for (int i = 0; i < parents.size(); i++) {
+            flat_nodes.push_back(parents[i]);
+            flat_nodes.push_back(names[i]);
+            flat_nodes.push_back(values[i]);
+            flat_nodes.push_back(cold[i] ? 1 : 0);
+          }
+
+          nlohmann::json bucket_arr = {bucket.first, flat_nodes};
+          result.push_back(bucket_arr);
+        }
+      }
     }
   }
 
@@ -105,68 +421,224 @@ namespace aperf {
                                                                     profiled_filename,
                                                                     buf_size) {
     this->json_result = nlohmann::json::object();
+    this->tree_nodes = 0;
   }
 
   void StdSubclient::process() {
-    struct offcpu_region {
-      unsigned long long timestamp;
-      unsigned long long period;
+    struct backpressure_stall {
+      int pid;
+      int tid;
+      unsigned long long bucket_start;
+      unsigned long long stall_time;
+      unsigned long long stall_count;
     };
 
-    struct sample_result {
-      std::string event_type;
-      nlohmann::json output;
-      nlohmann::json output_time_ordered;
-      unsigned long long total_period = 0;
-      std::vector<struct offcpu_region> offcpu_regions;
+    Stopwatch process_watch;
+    unsigned long long cpu_start = get_thread_cpu_ns();
+    unsigned long long lines = 0, bytes = 0, samples = 0, invalid_lines = 0;
+    unsigned long long wait_ns = 0, parse_ns = 0;
+    unsigned long long recurse_ns = 0, recurse_time_ordered_ns = 0;
+    unsigned long long timeline_ns = 0;
+    DurationHistogram line_histogram;
+
+    auto save_stats = [&]() {
+      nlohmann::json &stats = this->json_result["stats"];
+      unsigned long long total_ns = process_watch.elapsed_ns();
+
+      stats["lines"] = lines;
+      stats["bytes"] = bytes;
+      stats["samples"] = samples;
+      stats["invalid_lines"] = invalid_lines;
+      stats["tree_nodes"] = this->tree_nodes;
+      stats["stacks"] = this->stack_table.get_stack_count();
+      stats["frames"] = this->stack_table.get_frame_count();
+      stats["wait_ns"] = wait_ns;
+      stats["parse_ns"] = parse_ns;
+      stats["recurse_ns"] = recurse_ns;
+      stats["recurse_time_ordered_ns"] = recurse_time_ordered_ns;
+      stats["timeline_ns"] = timeline_ns;
+      stats["total_ns"] = total_ns;
+      stats["cpu_ns"] = get_thread_cpu_ns() - cpu_start;
+      stats["lines_per_second"] = total_ns == 0 ? 0.0 : lines * 1e9 / total_ns;
+      stats["line_latency"] = line_histogram.to_json();
     };
 
     try {
       std::unordered_set<std::string> messages_received;
-      std::unordered_map<std::string, std::vector<std::pair<std::string, std::string> > > tid_dict;
-      std::unordered_map<
-        std::string,
-        std::unordered_map<
-          std::string,
-          struct sample_result > > subprocesses;
-      std::unordered_map<std::string, std::string> combo_dict;
-      std::unordered_map<std::string, unsigned long long> exit_time_dict;
-      std::unordered_map<std::string, std::vector<std::pair<std::string, unsigned long long> > > name_time_dict;
-      std::unordered_map<std::string, std::string> tree;
+      std::unordered_map<int, std::vector<std::pair<std::string, std::string> > > tid_dict;
+      // TID -> PID of a thread/process, -1 if the PID is unknown
+      std::unordered_map<int, int> pid_dict;
+      std::unordered_map<int, unsigned long long> exit_time_dict;
+      std::unordered_map<int, std::vector<std::pair<std::string, unsigned long long> > > name_time_dict;
+      // TID -> TID of the parent thread/process, -1 if there is no parent
+      std::unordered_map<int, int> tree;
+      std::vector<struct backpressure_stall> backpressure;
 
       std::string extra_event_name = "";
       bool first_event_received = false;
-      std::vector<std::pair<unsigned long long, std::string> > added_list;
+      std::vector<std::pair<unsigned long long, int> > added_list;
 
       unsigned long long start_time = 0;
       bool start_time_set = false;
 
+      // Samples are streamed to the raw export as they arrive so that
+      // it does not hold any more of them in memory than one chunk
+      std::unique_ptr<RawSampleWriter> raw_writer;
+      fs::path raw_path = this->context.get_raw_export_path();
+
+      if (!raw_path.empty()) {
+        raw_writer = std::make_unique<RawSampleWriter>(raw_path.string() + ".samples");
+      }
+
+      // Samples received before the profiling start timestamp is known
+      // (e.g. when perf-script starts sending them before the frontend
+      // sends the timestamp) are held here and filtered by their own
+      // timestamps once it is known, so that which samples are included
+      // does not depend on when they arrive.
+      std::vector<nlohmann::json> pending_samples;
+
+      auto add_sample = [&](nlohmann::json &obj) {
+        std::string event_type;
+        int pid, tid, cpu;
+        unsigned long long timestamp, period;
+        std::vector<std::pair<std::string, std::string> > callchain;
+        try {
+          event_type = obj["event_type"];
+          pid = get_id(obj["pid"]);
+          tid = get_id(obj["tid"]);
+          cpu = obj.contains("cpu") ? get_id(obj["cpu"]) : -1;
+          timestamp = obj["time"];
+          period = obj["period"];
+          callchain = obj["callchain"].template get<
+            std::vector<std::pair<std::string, std::string> > >();
+        } catch (...) {
+          std::cerr << "The recently received sample JSON is invalid, ignoring." << std::endl;
+          invalid_lines++;
+          return;
+        }
+
+        // Samples taken before the profiling start are not included
+        if (timestamp < start_time) {
+          return;
+        }
+
+        if (!first_event_received) {
+          first_event_received = true;
+
+          if (event_type == "offcpu-time" || event_type == "task-clock") {
+            extra_event_name = "";
+
+            if (timestamp - period < start_time) {
+              period = timestamp - start_time;
+            }
+          } else {
+            extra_event_name = event_type;
+          }
+        } else if ((extra_event_name != "" && event_type != extra_event_name) ||
+                   (extra_event_name == "" && event_type != "offcpu-time" && event_type != "task-clock")) {
+          std::cerr << "The recently received sample JSON is of different event type than expected ";
+          std::cerr << "(received: " << event_type << ", expected: ";
+          std::cerr << (extra_event_name == "" ? "task-clock or offcpu-time" : extra_event_name);
+          std::cerr << "), ignoring." << std::endl;
+          return;
+        }
+
+        if (callchain.empty()) {
+          callchain.push_back(std::make_pair("(just thread/process)", ""));
+        }
+
+        struct SampleLogEntry entry;
+        entry.timestamp = timestamp;
+        entry.period = period;
+
+        try {
+          entry.stack_id = this->stack_table.intern(callchain);
+        } catch (std::invalid_argument &e) {
+          std::cerr << "The recently received sample JSON has an invalid callchain ";
+          std::cerr << "(" << e.what() << "), ignoring." << std::endl;
+          invalid_lines++;
+          return;
+        }
+
+        entry.offcpu = event_type == "offcpu-time";
+
+        this->sample_logs[get_thread_key(pid, tid)].push_back(entry);
+        samples++;
+
+        if (raw_writer) {
+          RawSample raw_sample = {timestamp, pid, tid, cpu, period,
+                                  entry.stack_id, entry.offcpu};
+          raw_writer->add(raw_sample);
+        }
+      };
+
+      auto add_pending_samples = [&]() {
+        for (auto &obj : pending_samples) {
+          add_sample(obj);
+        }
+
+        pending_samples.clear();
+      };
+
       {
-        std::shared_ptr<Connection> connection = this->acceptor->accept(this->buf_size);
+        std::unique_ptr<Connection> accepted = this->acceptor->accept(this->buf_size);
+        std::vector<std::string> &wire_compression =
+          this->context.get_session_settings().wire_compression;
+
+        if (!wire_compression.empty()) {
+          accepted = CompressedConnection::negotiate_accepted(std::move(accepted),
+                                                              wire_compression,
+                                                              NO_TIMEOUT);
+        }
+
+        std::shared_ptr<Connection> connection = std::move(accepted);
         this->context.notify();
 
+        Stopwatch line_watch;
+        bool line_pending = false;
+
         while (true) {
+          if (line_pending) {
+            line_histogram.add(line_watch.elapsed_ns());
+          }
+
+          Stopwatch wait_watch;
           std::string line = connection->read();
+          wait_ns += wait_watch.elapsed_ns();
 
           if (line == "<STOP>") {
             break;
           }
 
+          line_watch.reset();
+          line_pending = true;
+          lines++;
+          bytes += line.size() + 1;
+
           start_time_set = this->context.get_profile_start_tstamp(&start_time);
 
+          if (start_time_set && !pending_samples.empty()) {
+            add_pending_samples();
+          }
+
           nlohmann::json obj;
+          Stopwatch parse_watch;
 
           try {
             obj = nlohmann::json::parse(line);
           } catch (...) {
             std::cerr << "Could not parse the recently-received line to JSON, ignoring." << std::endl;
+            invalid_lines++;
             continue;
           }
 
+          parse_ns += parse_watch.elapsed_ns();
+
           if (!obj.is_object() || !obj.contains("type")) {
             std::cerr << "The recently-received JSON is not an object of type "
                          "{\"type\": ..., ...}, ignoring."
                       << std::endl;
+            invalid_lines++;
             continue;
           }
 
@@ -174,47 +646,49 @@ namespace aperf {
           messages_received.insert(type);
 
           if (type == "syscall") {
-            std::string ret_value;
+            int ret_value;
             std::vector<std::pair<std::string, std::string> > callchain;
 
             try {
-              ret_value = obj["ret_value"];
+              ret_value = get_id(obj["ret_value"]);
               callchain = obj["callchain"].template get<
                 std::vector<std::pair<std::string, std::string> > >();
             } catch (...) {
               std::cerr << "The recently-received syscall JSON is invalid, ignoring." << std::endl;
+              invalid_lines++;
               continue;
             }
 
             tid_dict[ret_value] = callchain;
           } else if (type == "syscall_meta") {
-            std::string syscall_type, comm_name, pid, tid, ret_value;
+            std::string syscall_type, comm_name;
+            int pid, tid, ret_value;
             unsigned long long time;
 
             try {
               syscall_type = obj["subtype"];
               comm_name = obj["comm"];
-              pid = obj["pid"];
-              tid = obj["tid"];
+              pid = get_id(obj["pid"]);
+              tid = get_id(obj["tid"]);
               time = obj["time"];
-              ret_value = obj["ret_value"];
+              ret_value = get_id(obj["ret_value"]);
             } catch (...) {
               std::cerr << "The recently-received syscall tree JSON is invalid, ignoring." << std::endl;
+              invalid_lines++;
               continue;
             }
 
-            std::string pid_tid = pid + "/" + tid;
             bool added_to_name_time_dict = false;
 
             if (tree.find(tid) == tree.end()) {
-              tree[tid] = "";
+              tree[tid] = -1;
               added_list.push_back(std::make_pair(time, tid));
 
               name_time_dict[tid].push_back(std::make_pair(comm_name, time));
               added_to_name_time_dict = true;
             }
 
-            combo_dict[tid] = pid + "/" + tid;
+            pid_dict[tid] = pid;
 
             if (syscall_type == "new_proc") {
               if (tree.find(ret_value) == tree.end()) {
@@ -222,97 +696,78 @@ namespace aperf {
               }
 
               tree[ret_value] = tid;
-              combo_dict[ret_value] = "?/" + ret_value;
+              pid_dict[ret_value] = -1;
               name_time_dict[ret_value].push_back(std::make_pair(comm_name, time));
             } else if (syscall_type == "execve" && !added_to_name_time_dict) {
               name_time_dict[tid].push_back(std::make_pair(comm_name, time));
             } else if (syscall_type == "exit") {
               exit_time_dict[tid] = time;
             }
-          } else if (type == "sample" && start_time_set) {
-            std::string event_type, pid, tid;
-            unsigned long long timestamp, period;
-            std::vector<std::pair<std::string, std::string> > callchain;
+          } else if (type == "backpressure") {
             try {
-              event_type = obj["event_type"];
-              pid = obj["pid"];
-              tid = obj["tid"];
-              timestamp = obj["time"];
-              period = obj["period"];
-              callchain = obj["callchain"].template get<
-                std::vector<std::pair<std::string, std::string> > >();
+              for (auto &entry : obj["data"]) {
+                struct backpressure_stall stall;
+                stall.pid = get_id(entry[0]);
+                stall.tid = get_id(entry[1]);
+                stall.bucket_start = entry[2];
+                stall.stall_time = entry[3];
+                stall.stall_count = entry[4];
+                backpressure.push_back(stall);
+              }
             } catch (...) {
-              std::cerr << "The recently received sample JSON is invalid, ignoring." << std::endl;
+              std::cerr << "The recently-received back-pressure JSON is invalid, ignoring." << std::endl;
+              invalid_lines++;
               continue;
             }
-
-            if (!first_event_received) {
-              first_event_received = true;
-
-              if (event_type == "offcpu-time" || event_type == "task-clock") {
-                extra_event_name = "";
-
-                if (timestamp - period < start_time) {
-                  period = timestamp - start_time;
-                }
-              } else {
-                extra_event_name = event_type;
-              }
-            } else if ((extra_event_name != "" && event_type != extra_event_name) ||
-                       (extra_event_name == "" && event_type != "offcpu-time" && event_type != "task-clock")) {
-              std::cerr << "The recently received sample JSON is of different event type than expected ";
-              std::cerr << "(received: " << event_type << ", expected: ";
-              std::cerr << (extra_event_name == "" ? "task-clock or offcpu-time" : extra_event_name);
-              std::cerr << "), ignoring." << std::endl;
-              continue;
+          } else if (type == "sample") {
+            if (start_time_set) {
+              add_sample(obj);
+            } else {
+              pending_samples.push_back(std::move(obj));
             }
+          }
+        }
+      }
 
-            if (subprocesses.find(pid) == subprocesses.end()) {
-              std::unordered_map<std::string, struct sample_result > new_map;
-              subprocesses[pid] = new_map;
-            }
+      if (!start_time_set) {
+        start_time_set = this->context.wait_for_profile_start_tstamp(&start_time);
+      }
 
-            if (subprocesses[pid].find(tid) == subprocesses[pid].end()) {
-              subprocesses[pid][tid] = {};
-              struct sample_result &res = subprocesses[pid][tid];
-
-              res.output["name"] = "all";
-              res.output["value"] = 0;
-              res.output["children"] = nlohmann::json::array();
-              // Will switch to false as soon as on-CPU activity is encountered
-              res.output["cold"] = true;
-
-              res.output_time_ordered["name"] = "all";
-              res.output_time_ordered["value"] = 0;
-              res.output_time_ordered["children"] = nlohmann::json::array();
-              // Will switch to false as soon as on-CPU activity is encountered
-              res.output_time_ordered["cold"] = true;
-            }
+      if (start_time_set) {
+        add_pending_samples();
+      }
 
-            struct sample_result &res = subprocesses[pid][tid];
+      if (raw_writer) {
+        raw_writer->close();
 
-            if (callchain.empty()) {
-              callchain.push_back(std::make_pair("(just thread/process)", ""));
-            }
+        nlohmann::json dictionary;
+        dictionary["event"] = extra_event_name == "" ? "walltime" : extra_event_name;
+        dictionary["start_time"] = start_time;
+        dictionary["frames"] = nlohmann::json::array();
+        dictionary["stacks"] = nlohmann::json::array();
 
-            if (event_type == "offcpu-time") {
-              struct offcpu_region reg;
-              reg.timestamp = timestamp - period;
-              reg.period = period;
-              res.offcpu_regions.push_back(reg);
-            }
+        for (unsigned int i = 0; i < this->stack_table.get_frame_count(); i++) {
+          std::pair<std::string, std::string> &frame = this->stack_table.get_frame(i);
+          dictionary["frames"].push_back({frame.first, frame.second});
+        }
 
-            recurse(res.output, callchain, 0, period, false,
-                    event_type == "offcpu-time");
-            recurse(res.output_time_ordered, callchain, 0, period,
-                    true, event_type == "offcpu-time");
+        for (unsigned int i = 0; i < this->stack_table.get_stack_count(); i++) {
+          std::pair<unsigned int, unsigned int> stack = this->stack_table.get_stack(i);
+          dictionary["stacks"].push_back({stack.first == NO_STACK ? -1 : (long long)stack.first,
+                                          stack.second});
+        }
 
-            res.total_period += period;
-          }
+        std::ofstream dictionary_stream(raw_path.string() + ".stacks.json");
+        dictionary_stream << dictionary.dump() << std::endl;
+
+        if (!dictionary_stream) {
+          throw std::runtime_error("Could not write the raw export stack dictionary to " +
+                                   raw_path.string() + ".stacks.json.");
         }
       }
 
       if (!start_time_set) {
+        save_stats();
         return;
       }
 
@@ -328,21 +783,22 @@ namespace aperf {
         }
 
         if (msg == "syscall") {
-          this->json_result[msg_key] = tid_dict;
+          this->json_result[msg_key] = nlohmann::json::object();
+
+          for (auto &elem : tid_dict) {
+            this->json_result[msg_key][std::to_string(elem.first)] = elem.second;
+          }
         } else if (msg == "syscall_meta") {
           this->json_result[msg_key] = nlohmann::json::array();
-          this->json_result[msg_key].push_back(nlohmann::json::array());
-          this->json_result[msg_key].push_back(nlohmann::json::object());
 
-          nlohmann::json &result_list = this->json_result[msg_key][0];
-          nlohmann::json &result_map = this->json_result[msg_key][1];
-          std::unordered_set<std::string> added_identifiers;
+          nlohmann::json &result_list = this->json_result[msg_key];
+          std::unordered_set<int> added_identifiers;
 
           for (int i = 0; i < added_list.size(); i++) {
-            std::string k = added_list[i].second;
-            std::string p = tree[k];
+            int k = added_list[i].second;
+            int p = tree[k];
 
-            if (!p.empty() && added_identifiers.find(p) == added_identifiers.end()) {
+            if (p != -1 && added_identifiers.find(p) == added_identifiers.end()) {
               continue;
             }
 
@@ -366,7 +822,8 @@ namespace aperf {
             }
 
             elem["tag"][0] = name_time_dict[k][dominant_name_index].first;
-            elem["tag"][1] = combo_dict[k];
+            elem["tag"][1] = (pid_dict[k] == -1 ? "?" : std::to_string(pid_dict[k])) +
+              "/" + std::to_string(k);
             elem["tag"][2] = name_time_dict[k][0].second;
 
             if (exit_time_dict.find(k) != exit_time_dict.end()) {
@@ -375,18 +832,18 @@ namespace aperf {
               elem["tag"][3] = -1;
             }
 
-            if (p.empty()) {
+            elem["identifier"] = k;
+
+            if (p == -1) {
               elem["parent"] = nullptr;
             } else {
               elem["parent"] = p;
             }
 
-            result_list.push_back(k);
-            result_map[k] = elem;
+            result_list.push_back(elem);
           }
 
-          for (auto &pair : result_map.items()) {
-            auto &elem = pair.value();
+          for (auto &elem : result_list) {
             if (start_time >= elem["tag"][2]) {
               elem["tag"][3] = (unsigned long long)elem["tag"][3] - (start_time - (unsigned long long)elem["tag"][2]);
               elem["tag"][2] = 0;
@@ -394,40 +851,69 @@ namespace aperf {
               elem["tag"][2] = (unsigned long long)elem["tag"][2] - start_time;
             }
           }
+        } else if (msg == "backpressure") {
+          this->json_result[msg_key] = nlohmann::json::object();
+
+          for (auto &stall : backpressure) {
+            nlohmann::json stall_arr = {
+              stall.bucket_start > start_time ? stall.bucket_start - start_time : 0,
+              stall.stall_time,
+              stall.stall_count
+            };
+
+            this->json_result[msg_key][get_thread_key_str(get_thread_key(stall.pid,
+                                                                         stall.tid))].push_back(stall_arr);
+          }
         } else if (msg == "sample") {
-          for (auto &elem : subprocesses) {
-            for (auto &elem2 : elem.second) {
-              struct sample_result &res = elem2.second;
-              res.output["value"] = res.total_period;
-              res.output_time_ordered["value"] = res.total_period;
+          this->json_result[msg_key] = nlohmann::json::array();
+
+          for (auto &elem : this->sample_logs) {
+            std::vector<SampleLogEntry> &log = elem.second;
+            nlohmann::json output, output_time_ordered;
 
-              nlohmann::json &pid_tid_result = this->json_result[msg_key][elem.first + "_" + elem2.first];
-              std::string event_name;
+            this->replay_log(log, 0, ULLONG_MAX, output, output_time_ordered,
+                             &recurse_ns, &recurse_time_ordered_ns);
 
-              if (extra_event_name == "") {
-                event_name = "walltime";
-                pid_tid_result["sampled_time"] = res.total_period;
-                pid_tid_result["offcpu_regions"] = nlohmann::json::array();
+            this->json_result[msg_key].push_back({(int)(elem.first >> 32),
+                                                  (int)(elem.first & 0xffffffff),
+                                                  nlohmann::json::object()});
+            nlohmann::json &pid_tid_result = this->json_result[msg_key].back()[2];
+            std::string event_name;
 
-                for (int i = 0; i < res.offcpu_regions.size(); i++) {
+            if (extra_event_name == "") {
+              event_name = "walltime";
+              pid_tid_result["sampled_time"] = output["value"];
+              pid_tid_result["offcpu_regions"] = nlohmann::json::array();
+
+              for (auto &entry : log) {
+                if (entry.offcpu) {
                   nlohmann::json offcpu_arr = {
-                    res.offcpu_regions[i].timestamp,
-                    res.offcpu_regions[i].period
+                    entry.timestamp - entry.period,
+                    entry.period
                   };
 
                   pid_tid_result["offcpu_regions"].push_back(offcpu_arr);
                 }
-              } else {
-                event_name = extra_event_name;
               }
-
-              pid_tid_result[event_name] = nlohmann::json::array();
-              pid_tid_result[event_name].push_back(res.output);
-              pid_tid_result[event_name].push_back(res.output_time_ordered);
+            } else {
+              event_name = extra_event_name;
             }
+
+            pid_tid_result[event_name] = nlohmann::json::array();
+            pid_tid_result[event_name].push_back(output);
+            pid_tid_result[event_name].push_back(output_time_ordered);
           }
         }
       }
+
+      if (!this->context.get_session_settings().timeline_buckets_ms.empty() &&
+          !this->sample_logs.empty()) {
+        Stopwatch timeline_watch;
+        this->build_timeline(start_time);
+        timeline_ns = timeline_watch.elapsed_ns();
+      }
+
+      save_stats();
     } catch (...) {
       std::rethrow_exception(std::current_exception());
     }
@@ -436,4 +922,34 @@ namespace aperf {
   nlohmann::json & StdSubclient::get_result() {
     return this->json_result;
   }
+
+  /**
+     Gets the aggregated and time-ordered trees of a thread built only from
+     its samples within a given time range, in form of a JSON array
+     [aggregated tree, time-ordered tree].
+
+     This can be called only after process() finishes. The trees are derived
+     from the per-thread sample log kept by the subclient, so no
+     reprocessing of the profiling data is needed.
+
+     @param pid  The PID of the thread.
+     @param tid  The TID of the thread.
+     @param from The smallest timestamp of a sample to include, in ns
+                 (as sent by "perf", i.e. not relative to the profile start).
+     @param to   The timestamp from which samples should no longer be
+                 included, in ns.
+  */
+  nlohmann::json StdSubclient::get_sample_trees(int pid, int tid,
+                                                unsigned long long from,
+                                                unsigned long long to) {
+    nlohmann::json output, output_time_ordered;
+    std::vector<SampleLogEntry> empty_log;
+
+    auto it = this->sample_logs.find(get_thread_key(pid, tid));
+
+    this->replay_log(it == this->sample_logs.end() ? empty_log : it->second,
+                     from, to, output, output_time_ordered, nullptr, nullptr);
+
+    return nlohmann::json::array({output, output_time_ordered});
+  }
 };
@@ -0,0 +1,615 @@
+// AdaptivePerf: comprehensive profiling tool based on Linux perf
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "tree.hpp"
+#include "stack.hpp"
+#include <algorithm>
+#include <cmath>
+#include <unordered_map>
+
+namespace aperf {
+  /**
+     Constructs a TreeNode object with the value of 0 and no offsets,
+     children, and recursion statistics.
+
+     @param name The name of the node (usually a symbol name).
+     @param cold Whether the node has only off-CPU activity.
+  */
+  TreeNode::TreeNode(std::string name, bool cold) {
+    this->name = name;
+    this->value = 0;
+    this->cold = cold;
+    this->recursion_max_depth = 0;
+    this->recursion_period = 0;
+    this->recursion_depth_sum = 0;
+  }
+
+  /**
+     Adds a period to a given offset of the node.
+
+     @param offset The offset parsed by parse_offset().
+     @param period The period to add.
+  */
+  void TreeNode::add_offset(unsigned long long offset, unsigned long long period) {
+    auto it = std::lower_bound(this->offsets.begin(), this->offsets.end(), offset,
+                               [](auto &elem, unsigned long long offset) {
+                                 return elem.first < offset;
+                               });
+
+    if (it != this->offsets.end() && it->first == offset) {
+      it->second += period;
+    } else {
+      this->offsets.insert(it, std::make_pair(offset, period));
+    }
+  }
+
+  /**
+     Adds a sample where a recursion cycle starting at the node
+     was folded (see fold_recursion()) to the recursion statistics of
+     the node.
+
+     @param depth  The recursion depth.
+     @param period The period of the sample.
+  */
+  void TreeNode::add_recursion(unsigned int depth, unsigned long long period) {
+    this->recursion_max_depth = std::max(this->recursion_max_depth, depth);
+    this->recursion_period += period;
+    this->recursion_depth_sum += depth * period;
+  }
+
+  /**
+     Converts the flame graph rooted at the node to JSON.
+
+     The conversion is done iteratively so that arbitrarily deep flame
+     graphs can't overflow the stack. The node the method is called on is
+     treated as the root, so it has no "offsets" field.
+
+     "recursion" describes only the samples where a recursion cycle
+     starting at a node was folded: max_depth is the largest recursion
+     depth seen, period is the sum of periods of these samples, and
+     depth_sum is the sum of their depths weighted by their periods (i.e.
+     depth_sum / period is the mean depth). It is present only in the nodes
+     where such samples exist.
+
+     @param output The JSON object where the flame graph should be stored.
+  */
+  void TreeNode::to_json(nlohmann::json &output) {
+    std::vector<std::pair<TreeNode *, nlohmann::json *> > stack;
+    stack.push_back(std::make_pair(this, &output));
+
+    while (!stack.empty()) {
+      TreeNode *node = stack.back().first;
+      nlohmann::json &result = *stack.back().second;
+      stack.pop_back();
+
+      result["name"] = node->name;
+      result["value"] = node->value;
+      result["cold"] = node->cold;
+
+      if (node != this) {
+        nlohmann::json &offsets = result["offsets"];
+        offsets = nlohmann::json::object();
+
+        for (auto &offset : node->offsets) {
+          offsets[format_offset(offset.first)] = offset.second;
+        }
+      }
+
+      if (node->recursion_period > 0) {
+        nlohmann::json &recursion = result["recursion"];
+        recursion["max_depth"] = node->recursion_max_depth;
+        recursion["period"] = node->recursion_period;
+        recursion["depth_sum"] = node->recursion_depth_sum;
+      }
+
+      nlohmann::json &children = result["children"];
+      children = nlohmann::json::array();
+
+      for (int i = 0; i < node->children.size(); i++) {
+        children.push_back(nlohmann::json::object());
+      }
+
+      // The children array is not modified after this point, so pointers
+      // to its elements stay valid.
+      for (int i = node->children.size() - 1; i >= 0; i--) {
+        stack.push_back(std::make_pair(&node->children[i], &children[i]));
+      }
+    }
+  }
+
+  /**
+     Combines the value, "cold" flag, offsets, and recursion statistics
+     of a flame graph node into another node, leaving their children
+     untouched (internal function).
+
+     @param dst The node to combine into.
+     @param src The node to combine.
+  */
+  static void combine_nodes(nlohmann::json &dst, nlohmann::json &src) {
+    dst["value"] = (unsigned long long)dst["value"] + (unsigned long long)src["value"];
+    dst["cold"] = dst["cold"] && src["cold"];
+
+    if (src.contains("offsets")) {
+      for (auto &offset : src["offsets"].items()) {
+        unsigned long long old_value = 0;
+
+        if (dst["offsets"].contains(offset.key())) {
+          old_value = (unsigned long long)dst["offsets"][offset.key()];
+        }
+
+        dst["offsets"][offset.key()] = old_value + (unsigned long long)offset.value();
+      }
+    }
+
+    if (src.contains("recursion")) {
+      nlohmann::json &src_recursion = src["recursion"];
+      nlohmann::json &dst_recursion = dst["recursion"];
+
+      if (dst_recursion.is_null()) {
+        dst_recursion = src_recursion;
+      } else {
+        dst_recursion["max_depth"] = std::max((unsigned int)dst_recursion["max_depth"],
+                                              (unsigned int)src_recursion["max_depth"]);
+        dst_recursion["period"] = (unsigned long long)dst_recursion["period"] +
+          (unsigned long long)src_recursion["period"];
+        dst_recursion["depth_sum"] = (unsigned long long)dst_recursion["depth_sum"] +
+          (unsigned long long)src_recursion["depth_sum"];
+      }
+    }
+  }
+
+  /**
+     Copies a flame graph iteratively so that arbitrarily deep flame
+     graphs can't overflow the stack (internal function).
+
+     @param src The flame graph to copy.
+  */
+  static nlohmann::json copy_tree(nlohmann::json &src) {
+    nlohmann::json result;
+    std::vector<std::pair<nlohmann::json *, nlohmann::json *> > stack;
+    stack.push_back(std::make_pair(&result, &src));
+
+    while (!stack.empty()) {
+      nlohmann::json &dst_node = *stack.back().first;
+      nlohmann::json &src_node = *stack.back().second;
+      stack.pop_back();
+
+      dst_node = nlohmann::json::object();
+
+      for (auto &field : src_node.items()) {
+        if (field.key() != "children") {
+          dst_node[field.key()] = field.value();
+        }
+      }
+
+      nlohmann::json &src_children = src_node["children"];
+      nlohmann::json &dst_children = dst_node["children"];
+      dst_children = nlohmann::json::array();
+
+      for (int i = 0; i < src_children.size(); i++) {
+        dst_children.push_back(nlohmann::json::object());
+      }
+
+      // The children array is not modified after this point, so pointers
+      // to its elements stay valid.
+      for (int i = src_children.size() - 1; i >= 0; i--) {
+        stack.push_back(std::make_pair(&dst_children[i], &src_children[i]));
+      }
+    }
+
+    return result;
+  }
+
+  /**
+     Merges an aggregated (i.e. not time-ordered) flame graph into another one.
+
+     Nodes are matched among the children of already-matched nodes in
+     the same way as StdSubclient matches callchain elements when building
+     an aggregated tree: a leaf matches a node with the same name and
+     "cold" flag, and a non-leaf matches a node with the same name,
+     preferring an off-CPU-only one if it is off-CPU-only itself and an
+     on-CPU one otherwise when there are both. Values, offsets, and
+     recursion statistics of matched nodes are combined and unmatched
+     nodes are copied along with their subtrees.
+
+     The result is the same as the tree built from the samples of dst
+     followed by the samples of src, except when a non-leaf src node has
+     samples which StdSubclient would have split between an on-CPU and
+     an off-CPU dst sibling (i.e. samples ending in the node, which are
+     matched only with a node of the same "cold" flag, or off-CPU samples
+     in a node which is not off-CPU-only). These end up in one sibling
+     along with the rest of the node.
+
+     @param dst The flame graph to merge into. If it is null, it becomes
+                a copy of src.
+     @param src The flame graph to merge.
+  */
+  void merge_trees(nlohmann::json &dst, nlohmann::json &src) {
+    if (dst.is_null()) {
+      dst = copy_tree(src);
+      return;
+    }
+
+    combine_nodes(dst, src);
+
+    // Every pair is a dst node and a src node already combined into it
+    // whose children are still to be merged. Merging is done iteratively
+    // so that arbitrarily deep flame graphs can't overflow the stack.
+    std::vector<std::pair<nlohmann::json *, nlohmann::json *> > stack;
+    stack.push_back(std::make_pair(&dst, &src));
+
+    while (!stack.empty()) {
+      nlohmann::json &dst_node = *stack.back().first;
+      nlohmann::json &src_node = *stack.back().second;
+      stack.pop_back();
+
+      nlohmann::json &dst_children = dst_node["children"];
+      nlohmann::json &src_children = src_node["children"];
+      std::unordered_map<std::string, std::vector<int> > indices;
+      std::vector<std::pair<int, nlohmann::json *> > matched;
+
+      for (int i = 0; i < dst_children.size(); i++) {
+        indices[dst_children[i]["name"].template get<std::string>()].push_back(i);
+      }
+
+      for (auto &child : src_children) {
+        std::vector<int> &candidates = indices[child["name"].template get<std::string>()];
+        bool leaf = child["children"].empty();
+        bool cold = child["cold"];
+        int cold_index = -1;
+        int hot_index = -1;
+
+        // "cold" flags of candidates can change as src children are
+        // combined, so they are checked every time.
+        for (int index : candidates) {
+          if (dst_children[index]["cold"]) {
+            if (!leaf || cold) {
+              cold_index = index;
+            }
+          } else if (!leaf || !cold) {
+            hot_index = index;
+          }
+        }
+
+        int index;
+
+        if (cold_index == -1 && hot_index == -1) {
+          candidates.push_back(dst_children.size());
+          dst_children.push_back(copy_tree(child));
+          continue;
+        } else if (cold_index == -1) {
+          index = hot_index;
+        } else if (hot_index == -1) {
+          index = cold_index;
+        } else {
+          index = cold ? cold_index : hot_index;
+        }
+
+        combine_nodes(dst_children[index], child);
+        matched.push_back(std::make_pair(index, &child));
+      }
+
+      // The children array is not modified after this point, so pointers
+      // to its elements stay valid. Pairs are pushed in reverse so that
+      // src children are merged in their order.
+      for (int i = matched.size() - 1; i >= 0; i--) {
+        stack.push_back(std::make_pair(&dst_children[matched[i].first],
+                                       matched[i].second));
+      }
+    }
+  }
+
+  /**
+     Appends a time-ordered flame graph to another one, as if the samples
+     of src were inserted into dst right after the samples it already has
+     (e.g. when they come from consecutive time ranges of a profile).
+
+     The first child of every src node on the way down from the root is
+     combined with the last child of the matching dst node if
+     StdSubclient would have continued the last child when inserting
+     the sample, i.e. if they have the same name and are either both
+     leaves with the same "cold" flag or both non-leaves. All other
+     children are appended along with their subtrees.
+
+     @param dst The time-ordered flame graph to append to. If it is null,
+                it becomes a copy of src.
+     @param src The time-ordered flame graph to append.
+  */
+  void append_time_ordered_tree(nlohmann::json &dst, nlohmann::json &src) {
+    if (dst.is_null()) {
+      dst = copy_tree(src);
+      return;
+    }
+
+    // Only one pair of children can be combined on every level, so
+    // the flame graphs are walked down in a loop.
+    nlohmann::json *dst_node = &dst;
+    nlohmann::json *src_node = &src;
+
+    while (dst_node != nullptr) {
+      combine_nodes(*dst_node, *src_node);
+
+      nlohmann::json &dst_children = (*dst_node)["children"];
+      nlohmann::json &src_children = (*src_node)["children"];
+      bool combine_first = false;
+
+      if (!src_children.empty() && !dst_children.empty()) {
+        nlohmann::json &last = dst_children.back();
+        nlohmann::json &first = src_children[0];
+        bool leaf = first["children"].empty();
+
+        combine_first = last["name"] == first["name"] &&
+          last["children"].empty() == leaf &&
+          (!leaf || last["cold"] == first["cold"]);
+      }
+
+      int last_index = dst_children.size() - 1;
+
+      for (int i = combine_first ? 1 : 0; i < src_children.size(); i++) {
+        dst_children.push_back(copy_tree(src_children[i]));
+      }
+
+      if (combine_first) {
+        dst_node = &dst_children[last_index];
+        src_node = &src_children[0];
+      } else {
+        dst_node = nullptr;
+      }
+    }
+  }
+
+  /**
+     Merges a flat flame graph (as saved in timeline.json, see
+     StdSubclient::build_timeline()) into another one.
+
+     Nodes are matched by their parents and symbol name indices, so both
+     flame graphs must use the same symbol name indices. Values of matched
+     nodes are summed and their off-CPU-only flags are combined. Unmatched
+     nodes are appended in their order in src, so parents still come
+     before their children.
+
+     @param dst The flat flame graph to merge into.
+     @param src The flat flame graph to merge.
+  */
+  void merge_flat_trees(nlohmann::json &dst, nlohmann::json &src) {
+    std::unordered_map<unsigned long long, unsigned int> indices;
+
+    auto get_key = [](long long parent, unsigned int name) {
+      return ((unsigned long long)(parent + 1) << 32) | name;
+    };
+
+    for (int i = 0; i < dst.size(); i += 4) {
+      indices[get_key(dst[i], dst[i + 1])] = i / 4;
+    }
+
+    std::vector<long long> node_map;
+
+    for (int i = 0; i < src.size(); i += 4) {
+      long long parent = src[i];
+
+      if (parent != -1) {
+        parent = node_map[parent];
+      }
+
+      unsigned int name = src[i + 1];
+      unsigned long long key = get_key(parent, name);
+      auto it = indices.find(key);
+
+      if (it == indices.end()) {
+        unsigned int node = dst.size() / 4;
+        indices[key] = node;
+        node_map.push_back(node);
+
+        dst.push_back(parent);
+        dst.push_back(name);
+        dst.push_back(src[i + 2]);
+        dst.push_back(src[i + 3]);
+      } else {
+        unsigned int node = it->second;
+        node_map.push_back(node);
+
+        dst[4 * node + 2] = (unsigned long long)dst[4 * node + 2] +
+          (unsigned long long)src[i + 2];
+        dst[4 * node + 3] = (int)dst[4 * node + 3] & (int)src[i + 3];
+      }
+    }
+  }
+
+  /**
+     Collects the values of all nodes of a flame graph except its root
+     (internal function).
+
+     @param tree   The flame graph.
+     @param values The vector to append the values to.
+  */
+  static void collect_values(nlohmann::json &tree,
+                             std::vector<unsigned long long> &values) {
+    std::vector<nlohmann::json *> stack;
+    stack.push_back(&tree);
+
+    while (!stack.empty()) {
+      nlohmann::json &node = *stack.back();
+      stack.pop_back();
+
+      for (auto &child : node["children"]) {
+        values.push_back(child["value"]);
+        stack.push_back(&child);
+      }
+    }
+  }
+
+  /**
+     Counts the nodes a flame graph would have after pruning it with
+     a given threshold, including "[pruned]" nodes (internal function).
+
+     @param tree         The flame graph.
+     @param threshold    The pruning threshold (see prune_tree()).
+     @param time_ordered Whether the flame graph is time-ordered.
+  */
+  static unsigned long long count_pruned(nlohmann::json &tree,
+                                         unsigned long long threshold,
+                                         bool time_ordered) {
+    unsigned long long count = 1;
+    std::vector<nlohmann::json *> stack;
+    stack.push_back(&tree);
+
+    while (!stack.empty()) {
+      nlohmann::json &node = *stack.back();
+      stack.pop_back();
+
+      bool pruned_open = false;
+
+      for (auto &child : node["children"]) {
+        if ((unsigned long long)child["value"] < threshold) {
+          if (!pruned_open) {
+            count++;
+            pruned_open = true;
+          }
+        } else {
+          if (time_ordered) {
+            pruned_open = false;
+          }
+
+          count++;
+          stack.push_back(&child);
+        }
+      }
+    }
+
+    return count;
+  }
+
+  /**
+     Prunes a flame graph with a given threshold (internal function).
+
+     @param tree         The flame graph.
+     @param threshold    The pruning threshold (see prune_tree()).
+     @param time_ordered Whether the flame graph is time-ordered.
+  */
+  static void apply_pruning(nlohmann::json &tree,
+                            unsigned long long threshold,
+                            bool time_ordered) {
+    std::vector<nlohmann::json *> stack;
+    stack.push_back(&tree);
+
+    while (!stack.empty()) {
+      nlohmann::json &node = *stack.back();
+      stack.pop_back();
+
+      nlohmann::json children = nlohmann::json::array();
+      std::vector<int> kept;
+      int pruned_index = -1;
+
+      for (auto &child : node["children"]) {
+        if ((unsigned long long)child["value"] < threshold) {
+          if (pruned_index == -1) {
+            nlohmann::json pruned;
+            pruned["name"] = PRUNED_NODE_NAME;
+            pruned["offsets"] = nlohmann::json::object();
+            pruned["value"] = child["value"];
+            pruned["children"] = nlohmann::json::array();
+            pruned["cold"] = child["cold"];
+
+            pruned_index = children.size();
+            children.push_back(pruned);
+          } else {
+            nlohmann::json &pruned = children[pruned_index];
+            pruned["value"] = (unsigned long long)pruned["value"] +
+              (unsigned long long)child["value"];
+            pruned["cold"] = pruned["cold"] && child["cold"];
+          }
+        } else {
+          if (time_ordered) {
+            pruned_index = -1;
+          }
+
+          kept.push_back(children.size());
+          children.push_back(std::move(child));
+        }
+      }
+
+      nlohmann::json &new_children = node["children"];
+      new_children.swap(children);
+
+      // The children array is not modified after this point, so pointers
+      // to its elements stay valid.
+      for (int index : kept) {
+        stack.push_back(&new_children[index]);
+      }
+    }
+  }
+
+  /**
+     Prunes a flame graph by collapsing insignificant subtrees into
+     synthetic "[pruned]" nodes.
+
+     A subtree is insignificant if the value of its root is smaller than
+     a threshold. All insignificant children of a node are collapsed into
+     a single "[pruned]" child whose value is the sum of their values, so
+     the values of all remaining nodes (and the total) stay the same. In
+     time-ordered flame graphs, only consecutive insignificant children
+     are collapsed together so that the order of samples is preserved.
+
+     The threshold is the smallest one satisfying both min_fraction and
+     max_nodes. Because the value of a node is never smaller than the
+     value of any of its children, the remaining nodes always form
+     a single tree.
+
+     Returns the number of nodes removed from the flame graph (i.e.
+     the number of nodes before pruning minus the number of nodes after
+     pruning, including "[pruned]" nodes).
+
+     @param tree         The flame graph to prune.
+     @param min_fraction The minimum fraction of the total value (i.e.
+                         the value of the root) a subtree must have to be
+                         kept. 0 means no minimum.
+     @param max_nodes    The maximum number of nodes the flame graph can
+                         have after pruning (it is not guaranteed to be met
+                         if it is smaller than 2). 0 means no maximum.
+     @param time_ordered Whether the flame graph is time-ordered.
+  */
+  unsigned long long prune_tree(nlohmann::json &tree, double min_fraction,
+                                unsigned long long max_nodes,
+                                bool time_ordered) {
+    std::vector<unsigned long long> values;
+    collect_values(tree, values);
+
+    unsigned long long node_count = values.size() + 1;
+    unsigned long long threshold = 0;
+
+    if (min_fraction > 0) {
+      threshold = std::ceil(min_fraction * (unsigned long long)tree["value"]);
+    }
+
+    if (max_nodes > 0 && count_pruned(tree, threshold, time_ordered) > max_nodes) {
+      // The number of nodes after pruning never increases with the
+      // threshold, so the smallest sufficient threshold can be found by
+      // binary search over the node values.
+      std::sort(values.begin(), values.end());
+      values.erase(std::unique(values.begin(), values.end()), values.end());
+      values.push_back(values.back() + 1);
+
+      auto begin = std::upper_bound(values.begin(), values.end(), threshold);
+      auto end = values.end() - 1;
+
+      while (begin < end) {
+        auto middle = begin + (end - begin) / 2;
+
+        if (count_pruned(tree, *middle, time_ordered) > max_nodes) {
+          begin = middle + 1;
+        } else {
+          end = middle;
+        }
+      }
+
+      threshold = *begin;
+    }
+
+    if (threshold == 0) {
+      return 0;
+    }
+
+    apply_pruning(tree, threshold, time_ordered);
+    return node_count - count_pruned(tree, 0, time_ordered);
+  }
+};
@@ -0,0 +1,48 @@
+// AdaptivePerf: comprehensive profiling tool based on Linux perf
+// Copyright (C) CERN. See LICENSE for details.
+
+#ifndef TREE_HPP_
+#define TREE_HPP_
+
+#include <nlohmann/json.hpp>
+#include <string>
+#include <vector>
+
+#define PRUNED_NODE_NAME "[pruned]"
+
+namespace aperf {
+  /**
+     A structure describing a flame graph node while the flame graph is
+     being built by StdSubclient.
+
+     It has the same content as a node of the JSON flame graph saved by
+     adaptiveperf-server, but offsets are stored as a vector of
+     (offset parsed by parse_offset(), period) pairs sorted by offset rather
+     than as a JSON object. The JSON form is produced only at the end by
+     to_json().
+  */
+  struct TreeNode {
+    std::string name;
+    unsigned long long value;
+    bool cold;
+    std::vector<std::pair<unsigned long long, unsigned long long> > offsets;
+    std::vector<TreeNode> children;
+    unsigned int recursion_max_depth;
+    unsigned long long recursion_period;
+    unsigned long long recursion_depth_sum;
+
+    TreeNode(std::string name, bool cold);
+    void add_offset(unsigned long long offset, unsigned long long period);
+    void add_recursion(unsigned int depth, unsigned long long period);
+    void to_json(nlohmann::json &output);
+  };
+
+  void merge_trees(nlohmann::json &dst, nlohmann::json &src);
+  void append_time_ordered_tree(nlohmann::json &dst, nlohmann::json &src);
+  void merge_flat_trees(nlohmann::json &dst, nlohmann::json &src);
+  unsigned long long prune_tree(nlohmann::json &tree, double min_fraction,
+                                unsigned long long max_nodes,
+                                bool time_ordered);
+};
+
+#endif
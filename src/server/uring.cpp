@@ -0,0 +1,797 @@
+// AdaptivePerf: comprehensive profiling tool based on Linux perf
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "uring.hpp"
+
+#ifdef IO_URING_AVAILABLE
+#include <cstring>
+#include <fstream>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <Poco/Net/NetException.h>
+
+#define IO_URING_KIND_WAKEUP 0
+#define IO_URING_KIND_RECEIVE 1
+#define IO_URING_KIND_CANCEL 2
+
+#define IO_URING_COMMAND_ADD 0
+#define IO_URING_COMMAND_REMOVE 1
+#define IO_URING_COMMAND_RESUME 2
+
+namespace aperf {
+  static int io_uring_setup(unsigned int entries, struct io_uring_params *params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+  }
+
+  static int io_uring_enter(int fd, unsigned int to_submit,
+                            unsigned int min_complete, unsigned int flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                   flags, nullptr, 0);
+  }
+
+  static int io_uring_register(int fd, unsigned int opcode,
+                               void *arg, unsigned int nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+  }
+
+  /**
+     Sets up an io_uring instance and starts the thread servicing it.
+
+     @throw std::runtime_error When io_uring or any of its features
+                               used by the reactor is not available
+                               (e.g. the kernel is too old or io_uring
+                               is disabled by the system administrator).
+  */
+  IoUringReactor::IoUringReactor() {
+    this->ring_fd = -1;
+    this->event_fd = -1;
+    this->sq_ptr = MAP_FAILED;
+    this->cq_ptr = MAP_FAILED;
+    this->sqes_ptr = MAP_FAILED;
+    this->buf_ring = MAP_FAILED;
+    this->to_submit = 0;
+    this->next_id = 1;
+    this->stopping = false;
+
+    struct io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = IO_URING_ENTRIES * 4;
+
+    this->ring_fd = io_uring_setup(IO_URING_ENTRIES, &params);
+
+    if (this->ring_fd < 0) {
+      throw std::runtime_error("Could not set up io_uring: " +
+                               std::string(std::strerror(errno)));
+    }
+
+    this->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    this->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    this->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    this->sq_ptr = mmap(nullptr, this->sq_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, this->ring_fd,
+                        IORING_OFF_SQ_RING);
+    this->cq_ptr = mmap(nullptr, this->cq_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, this->ring_fd,
+                        IORING_OFF_CQ_RING);
+    this->sqes_ptr = mmap(nullptr, this->sqes_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, this->ring_fd,
+                          IORING_OFF_SQES);
+
+    if (this->sq_ptr == MAP_FAILED || this->cq_ptr == MAP_FAILED ||
+        this->sqes_ptr == MAP_FAILED) {
+      this->release();
+      throw std::runtime_error("Could not map the io_uring rings.");
+    }
+
+    char *sq = (char *)this->sq_ptr;
+    char *cq = (char *)this->cq_ptr;
+
+    this->sq_head = (unsigned *)(sq + params.sq_off.head);
+    this->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    this->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    this->sq_array = (unsigned *)(sq + params.sq_off.array);
+    this->sq_entries = params.sq_entries;
+    this->cq_head = (unsigned *)(cq + params.cq_off.head);
+    this->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    this->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    this->cqes = cq + params.cq_off.cqes;
+
+    this->buf_ring_size = IO_URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    this->buf_ring = mmap(nullptr, this->buf_ring_size,
+                          PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (this->buf_ring == MAP_FAILED) {
+      this->release();
+      throw std::runtime_error("Could not allocate the io_uring buffer ring.");
+    }
+
+    struct io_uring_buf_reg buf_reg;
+    std::memset(&buf_reg, 0, sizeof(buf_reg));
+    buf_reg.ring_addr = (unsigned long long)this->buf_ring;
+    buf_reg.ring_entries = IO_URING_BUF_COUNT;
+    buf_reg.bgid = 0;
+
+    if (io_uring_register(this->ring_fd, IORING_REGISTER_PBUF_RING,
+                          &buf_reg, 1) != 0) {
+      this->release();
+      throw std::runtime_error("io_uring does not support provided buffer "
+                               "rings (Linux 5.19+ is required).");
+    }
+
+    this->bufs.reset(new char[(std::size_t)IO_URING_BUF_COUNT * IO_URING_BUF_SIZE]);
+
+    for (unsigned short i = 0; i < IO_URING_BUF_COUNT; i++) {
+      this->provide_buffer(i);
+    }
+
+    // Registered files are an optimisation only, so the reactor works
+    // with regular file descriptors if a sparse file table cannot be
+    // registered.
+    struct io_uring_rsrc_register files_reg;
+    std::memset(&files_reg, 0, sizeof(files_reg));
+    files_reg.nr = IO_URING_FILES;
+    files_reg.flags = IORING_RSRC_REGISTER_SPARSE;
+
+    this->fixed_files = io_uring_register(this->ring_fd, IORING_REGISTER_FILES2,
+                                          &files_reg, sizeof(files_reg)) == 0;
+
+    if (this->fixed_files) {
+      for (int i = IO_URING_FILES - 1; i >= 0; i--) {
+        this->free_slots.push_back(i);
+      }
+    }
+
+    this->event_fd = eventfd(0, EFD_CLOEXEC);
+
+    if (this->event_fd == -1) {
+      this->release();
+      throw std::runtime_error("Could not create an eventfd for io_uring.");
+    }
+
+    this->arm_wakeup();
+    this->thread = std::thread(&IoUringReactor::run, this);
+  }
+
+  /**
+     Stops the reactor thread and tears down the io_uring instance.
+
+     Any receive requests still in flight are cancelled by the kernel.
+  */
+  IoUringReactor::~IoUringReactor() {
+    this->stopping = true;
+
+    unsigned long long value = 1;
+    if (::write(this->event_fd, &value, sizeof(value)) == -1) { }
+
+    this->thread.join();
+    this->release();
+  }
+
+  /**
+     Unmaps the rings and closes the file descriptors of the reactor
+     (internal method).
+  */
+  void IoUringReactor::release() {
+    if (this->sq_ptr != MAP_FAILED) {
+      munmap(this->sq_ptr, this->sq_size);
+    }
+
+    if (this->cq_ptr != MAP_FAILED) {
+      munmap(this->cq_ptr, this->cq_size);
+    }
+
+    if (this->sqes_ptr != MAP_FAILED) {
+      munmap(this->sqes_ptr, this->sqes_size);
+    }
+
+    if (this->ring_fd != -1) {
+      ::close(this->ring_fd);
+    }
+
+    if (this->buf_ring != MAP_FAILED) {
+      munmap(this->buf_ring, this->buf_ring_size);
+    }
+
+    if (this->event_fd != -1) {
+      ::close(this->event_fd);
+    }
+  }
+
+  /**
+     Gets a zeroed submission queue entry, submitting the pending ones
+     first if the submission queue is full (internal method).
+  */
+  void *IoUringReactor::get_sqe() {
+    unsigned tail = *this->sq_tail;
+
+    while (tail - __atomic_load_n(this->sq_head, __ATOMIC_ACQUIRE) >= this->sq_entries) {
+      unsigned pending = this->to_submit;
+      this->submit(false);
+
+      if (this->to_submit == pending) {
+        throw std::runtime_error("The io_uring submission queue is full.");
+      }
+    }
+
+    unsigned index = tail & *this->sq_mask;
+    struct io_uring_sqe *sqe = (struct io_uring_sqe *)this->sqes_ptr + index;
+    std::memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+    this->sq_array[index] = index;
+    __atomic_store_n(this->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    this->to_submit++;
+
+    return sqe;
+  }
+
+  /**
+     Submits the pending submission queue entries (internal method).
+
+     @param wait Indicates whether the call should block until at least
+                 one completion is available.
+  */
+  void IoUringReactor::submit(bool wait) {
+    while (true) {
+      int ret = io_uring_enter(this->ring_fd, this->to_submit, wait ? 1 : 0,
+                               wait ? IORING_ENTER_GETEVENTS : 0);
+
+      if (ret >= 0) {
+        this->to_submit -= std::min((unsigned)ret, this->to_submit);
+        return;
+      } else if (errno == EAGAIN || errno == EBUSY) {
+        // The completion queue needs to be reaped first.
+        return;
+      } else if (errno != EINTR) {
+        throw std::runtime_error("io_uring_enter failed: " +
+                                 std::string(std::strerror(errno)));
+      }
+    }
+  }
+
+  /**
+     Gives a buffer back to the kernel for receiving data (internal method).
+
+     @param id The ID of the buffer.
+  */
+  void IoUringReactor::provide_buffer(unsigned short id) {
+    // struct io_uring_buf_ring is not used here because its flexible
+    // array member is not laid out at offset 0 when compiled as C++.
+    // The ring tail is overlaid with the resv field of the first entry.
+    struct io_uring_buf *ring = (struct io_uring_buf *)this->buf_ring;
+    unsigned short tail = ring[0].resv;
+    struct io_uring_buf *buf = &ring[tail & (IO_URING_BUF_COUNT - 1)];
+
+    buf->addr = (unsigned long long)(this->bufs.get() +
+                                     (std::size_t)id * IO_URING_BUF_SIZE);
+    buf->len = IO_URING_BUF_SIZE;
+    buf->bid = id;
+
+    __atomic_store_n(&ring[0].resv, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+  }
+
+  /**
+     Submits a read from the eventfd used for waking up the reactor
+     thread (internal method).
+  */
+  void IoUringReactor::arm_wakeup() {
+    struct io_uring_sqe *sqe = (struct io_uring_sqe *)this->get_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = this->event_fd;
+    sqe->addr = (unsigned long long)&this->event_value;
+    sqe->len = sizeof(this->event_value);
+    sqe->off = (unsigned long long)-1;
+    sqe->user_data = IO_URING_KIND_WAKEUP;
+  }
+
+  /**
+     Submits a multishot receive request for a connection (internal method).
+
+     @param id     The ID of the connection.
+     @param stream The state of the connection.
+  */
+  void IoUringReactor::arm_receive(unsigned long long id,
+                                   std::shared_ptr<IoUringStream> &stream) {
+    struct io_uring_sqe *sqe = (struct io_uring_sqe *)this->get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = (id << 2) | IO_URING_KIND_RECEIVE;
+
+    if (stream->slot != -1) {
+      sqe->fd = stream->slot;
+      sqe->flags |= IOSQE_FIXED_FILE;
+    } else {
+      sqe->fd = stream->fd;
+    }
+
+    stream->receiving = true;
+  }
+
+  /**
+     Submits a cancellation of the receive request of a connection
+     (internal method).
+
+     @param id The ID of the connection.
+  */
+  void IoUringReactor::cancel_receive(unsigned long long id) {
+    struct io_uring_sqe *sqe = (struct io_uring_sqe *)this->get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (id << 2) | IO_URING_KIND_RECEIVE;
+    sqe->user_data = (id << 2) | IO_URING_KIND_CANCEL;
+  }
+
+  /**
+     Removes the file descriptor of a connection from the registered
+     file table (internal method).
+
+     @param stream The state of the connection.
+  */
+  void IoUringReactor::unregister(std::shared_ptr<IoUringStream> &stream) {
+    if (stream->slot == -1) {
+      return;
+    }
+
+    int fd = -1;
+    struct io_uring_files_update update;
+    std::memset(&update, 0, sizeof(update));
+    update.offset = stream->slot;
+    update.fds = (unsigned long long)&fd;
+
+    if (io_uring_register(this->ring_fd, IORING_REGISTER_FILES_UPDATE,
+                          &update, 1) == 1) {
+      this->free_slots.push_back(stream->slot);
+    }
+
+    stream->slot = -1;
+  }
+
+  /**
+     Handles a completion of a receive request (internal method).
+
+     @param id    The ID of the connection.
+     @param res   The result of the completion.
+     @param flags The flags of the completion.
+  */
+  void IoUringReactor::handle_receive(unsigned long long id, int res,
+                                      unsigned int flags) {
+    auto it = this->streams.find(id);
+
+    if (it == this->streams.end()) {
+      if (flags & IORING_CQE_F_BUFFER) {
+        this->provide_buffer(flags >> IORING_CQE_BUFFER_SHIFT);
+      }
+
+      return;
+    }
+
+    std::shared_ptr<IoUringStream> stream = it->second;
+    bool more = flags & IORING_CQE_F_MORE;
+    bool cancel = false;
+
+    if (res > 0) {
+      unsigned short buf_id = flags >> IORING_CQE_BUFFER_SHIFT;
+
+      {
+        std::lock_guard<std::mutex> lock(stream->mutex);
+
+        if (!stream->closing) {
+          stream->chunks.emplace_back(this->bufs.get() +
+                                      (std::size_t)buf_id * IO_URING_BUF_SIZE, res);
+          stream->queued += res;
+
+          if (more && !stream->paused &&
+              stream->queued >= IO_URING_MAX_QUEUED) {
+            stream->paused = true;
+            cancel = true;
+          }
+        }
+      }
+
+      this->provide_buffer(buf_id);
+      stream->received = true;
+      stream->cond.notify_all();
+
+      if (cancel) {
+        this->cancel_receive(id);
+      }
+    }
+
+    if (more) {
+      return;
+    }
+
+    stream->receiving = false;
+
+    if (stream->closing) {
+      this->unregister(stream);
+      this->streams.erase(it);
+      return;
+    }
+
+    bool rearm = false;
+
+    {
+      std::lock_guard<std::mutex> lock(stream->mutex);
+
+      if (res == 0) {
+        stream->eof = true;
+      } else if (res > 0 || res == -ENOBUFS || res == -ECANCELED) {
+        // A multishot request can be terminated by the kernel at any
+        // time (e.g. when it runs out of provided buffers), in which case
+        // it has to be resubmitted unless receiving is paused.
+        rearm = !stream->paused;
+      } else if (res == -EINVAL && !stream->received) {
+        // Multishot receive is not supported by the kernel.
+        stream->fallback = true;
+      } else {
+        stream->error = -res;
+        stream->eof = true;
+      }
+    }
+
+    stream->cond.notify_all();
+
+    if (rearm) {
+      this->arm_receive(id, stream);
+    }
+  }
+
+  /**
+     Queues a command for the reactor thread and wakes it up
+     (internal method).
+
+     @param type   The type of the command.
+     @param stream The state of the connection the command is about.
+  */
+  void IoUringReactor::command(int type, std::shared_ptr<IoUringStream> &stream) {
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->commands.push_back(std::make_pair(type, stream));
+    }
+
+    unsigned long long value = 1;
+    if (::write(this->event_fd, &value, sizeof(value)) == -1) { }
+  }
+
+  /**
+     Starts servicing a connection.
+
+     @param stream The state of the connection, where the received data
+                   will be queued.
+     @param fd     The file descriptor of the connection socket. It must
+                   stay open until remove() is called.
+  */
+  void IoUringReactor::add(std::shared_ptr<IoUringStream> &stream, int fd) {
+    stream->fd = fd;
+    this->command(IO_URING_COMMAND_ADD, stream);
+  }
+
+  /**
+     Stops servicing a connection.
+
+     @param stream The state of the connection.
+  */
+  void IoUringReactor::remove(std::shared_ptr<IoUringStream> &stream) {
+    this->command(IO_URING_COMMAND_REMOVE, stream);
+  }
+
+  /**
+     Resumes receiving data for a connection after it has been paused
+     because of too many queued bytes.
+
+     @param stream The state of the connection.
+  */
+  void IoUringReactor::resume(std::shared_ptr<IoUringStream> &stream) {
+    this->command(IO_URING_COMMAND_RESUME, stream);
+  }
+
+  /**
+     Runs the loop of the reactor thread (internal method).
+
+     If io_uring fails, all connections serviced by the reactor are
+     ended with an error.
+  */
+  void IoUringReactor::run() {
+    try {
+      std::vector<std::pair<int, std::shared_ptr<IoUringStream> > > cur_commands;
+
+      while (!this->stopping) {
+        {
+          std::lock_guard<std::mutex> lock(this->mutex);
+          cur_commands.swap(this->commands);
+        }
+
+        for (auto &command : cur_commands) {
+          std::shared_ptr<IoUringStream> &stream = command.second;
+
+          if (command.first == IO_URING_COMMAND_ADD) {
+            stream->id = this->next_id++;
+            this->streams[stream->id] = stream;
+
+            if (!this->free_slots.empty()) {
+              int slot = this->free_slots.back();
+              struct io_uring_files_update update;
+              std::memset(&update, 0, sizeof(update));
+              update.offset = slot;
+              update.fds = (unsigned long long)&stream->fd;
+
+              if (io_uring_register(this->ring_fd, IORING_REGISTER_FILES_UPDATE,
+                                    &update, 1) == 1) {
+                stream->slot = slot;
+                this->free_slots.pop_back();
+              }
+            }
+
+            this->arm_receive(stream->id, stream);
+          } else if (command.first == IO_URING_COMMAND_REMOVE) {
+            if (stream->id == 0 || stream->closing) {
+              continue;
+            }
+
+            stream->closing = true;
+
+            if (stream->receiving) {
+              this->cancel_receive(stream->id);
+            } else {
+              this->unregister(stream);
+              this->streams.erase(stream->id);
+            }
+          } else if (command.first == IO_URING_COMMAND_RESUME) {
+            if (!stream->closing && !stream->receiving &&
+                this->streams.find(stream->id) != this->streams.end()) {
+              this->arm_receive(stream->id, stream);
+            }
+          }
+        }
+
+        cur_commands.clear();
+        this->submit(true);
+
+        unsigned head = *this->cq_head;
+        unsigned tail = __atomic_load_n(this->cq_tail, __ATOMIC_ACQUIRE);
+
+        while (head != tail) {
+          struct io_uring_cqe *cqe = (struct io_uring_cqe *)this->cqes +
+            (head & *this->cq_mask);
+          unsigned long long user_data = cqe->user_data;
+          int res = cqe->res;
+          unsigned int flags = cqe->flags;
+
+          head++;
+          __atomic_store_n(this->cq_head, head, __ATOMIC_RELEASE);
+
+          switch (user_data & 3) {
+          case IO_URING_KIND_WAKEUP:
+            this->arm_wakeup();
+            break;
+
+          case IO_URING_KIND_RECEIVE:
+            this->handle_receive(user_data >> 2, res, flags);
+            break;
+
+          default:
+            break;
+          }
+
+          tail = __atomic_load_n(this->cq_tail, __ATOMIC_ACQUIRE);
+        }
+      }
+    } catch (std::exception &e) {
+      std::cerr << "Warning: io_uring reactor has failed, ending all of ";
+      std::cerr << "its connections. Error details: " << e.what() << std::endl;
+
+      for (auto &elem : this->streams) {
+        {
+          std::lock_guard<std::mutex> lock(elem.second->mutex);
+          elem.second->error = EIO;
+          elem.second->eof = true;
+        }
+
+        elem.second->cond.notify_all();
+      }
+    }
+  }
+
+  /**
+     Constructs an IoUringSocket object.
+
+     @param sock     The Poco::Net::StreamSocket object corresponding to
+                     the already-established TCP socket.
+     @param buf_size The buffer size for communication, in bytes.
+     @param reactor  The reactor receiving data from the socket.
+  */
+  IoUringSocket::IoUringSocket(net::StreamSocket &sock, unsigned int buf_size,
+                               std::shared_ptr<IoUringReactor> &reactor) :
+    TCPSocket(sock, buf_size) {
+    this->reactor = reactor;
+    this->stream = std::make_shared<IoUringStream>();
+    this->reactor->add(this->stream, this->socket.impl()->sockfd());
+  }
+
+  IoUringSocket::~IoUringSocket() {
+    this->reactor->remove(this->stream);
+  }
+
+  /**
+     Reads data received by the reactor from the socket.
+
+     If the reactor cannot receive data from the socket, they are
+     read directly as in TCPSocket.
+  */
+  int IoUringSocket::read(char *buf, unsigned int len, long timeout_seconds) {
+    std::unique_lock<std::mutex> lock(this->stream->mutex);
+    IoUringStream *stream = this->stream.get();
+
+    auto ready = [stream]() {
+      return !stream->chunks.empty() || stream->eof || stream->fallback;
+    };
+
+    if (timeout_seconds == NO_TIMEOUT) {
+      stream->cond.wait(lock, ready);
+    } else if (!stream->cond.wait_for(lock, std::chrono::seconds(timeout_seconds),
+                                      ready)) {
+      throw TimeoutException();
+    }
+
+    if (stream->chunks.empty()) {
+      if (stream->fallback) {
+        lock.unlock();
+        return TCPSocket::read(buf, len, timeout_seconds);
+      }
+
+      if (stream->error != 0) {
+        std::runtime_error err(std::strerror(stream->error));
+        throw ConnectionException(err);
+      }
+
+      return 0;
+    }
+
+    unsigned int bytes = 0;
+
+    while (bytes < len && !stream->chunks.empty()) {
+      std::string &chunk = stream->chunks.front();
+      std::size_t size = std::min((std::size_t)(len - bytes),
+                                  chunk.size() - stream->chunk_pos);
+
+      std::memcpy(buf + bytes, chunk.data() + stream->chunk_pos, size);
+      bytes += size;
+      stream->chunk_pos += size;
+
+      if (stream->chunk_pos == chunk.size()) {
+        stream->chunks.pop_front();
+        stream->chunk_pos = 0;
+      }
+    }
+
+    stream->queued -= bytes;
+
+    if (stream->paused && stream->queued < IO_URING_MAX_QUEUED / 2) {
+      stream->paused = false;
+      lock.unlock();
+      this->reactor->resume(this->stream);
+    }
+
+    return bytes;
+  }
+
+  /**
+     Reads data received by the reactor from the socket until the other end
+     closes it and saves them to a file.
+
+     The queued chunks are written to the file as they are, without
+     copying them to an intermediate buffer.
+  */
+  unsigned long long IoUringSocket::read(fs::path file, long timeout_seconds) {
+    std::ofstream f;
+    unsigned long long bytes_total = 0;
+    IoUringStream *stream = this->stream.get();
+
+    auto ready = [stream]() {
+      return !stream->chunks.empty() || stream->eof || stream->fallback;
+    };
+
+    while (true) {
+      std::unique_lock<std::mutex> lock(stream->mutex);
+
+      if (timeout_seconds == NO_TIMEOUT) {
+        stream->cond.wait(lock, ready);
+      } else if (!stream->cond.wait_for(lock, std::chrono::seconds(timeout_seconds),
+                                        ready)) {
+        throw TimeoutException();
+      }
+
+      if (stream->chunks.empty()) {
+        if (stream->fallback) {
+          lock.unlock();
+          return TCPSocket::read(file, timeout_seconds);
+        }
+
+        if (stream->error != 0) {
+          std::runtime_error err(std::strerror(stream->error));
+          throw ConnectionException(err);
+        }
+
+        break;
+      }
+
+      std::string chunk = std::move(stream->chunks.front());
+      std::size_t pos = stream->chunk_pos;
+      stream->chunks.pop_front();
+      stream->chunk_pos = 0;
+      stream->queued -= chunk.size() - pos;
+
+      bool resume = stream->paused && stream->queued < IO_URING_MAX_QUEUED / 2;
+
+      if (resume) {
+        stream->paused = false;
+      }
+
+      lock.unlock();
+
+      if (resume) {
+        this->reactor->resume(this->stream);
+      }
+
+      if (!f.is_open()) {
+        f.open(file, std::ios_base::out | std::ios_base::binary);
+
+        if (!f) {
+          throw std::runtime_error("Could not open " + file.string() + " for writing.");
+        }
+      }
+
+      f.write(chunk.data() + pos, chunk.size() - pos);
+
+      if (!f) {
+        throw std::runtime_error("Could not write to " + file.string() + ".");
+      }
+
+      bytes_total += chunk.size() - pos;
+    }
+
+    if (!f.is_open()) {
+      f.open(file, std::ios_base::out | std::ios_base::binary);
+
+      if (!f) {
+        throw std::runtime_error("Could not open " + file.string() + " for writing.");
+      }
+    }
+
+    return bytes_total;
+  }
+
+  /**
+     Returns -1 as the incoming data are consumed by the reactor thread
+     and never wait in the socket itself.
+  */
+  int IoUringSocket::get_poll_fd() {
+    return -1;
+  }
+
+  IoUringAcceptor::IoUringAcceptor(std::string address, unsigned short port,
+                                   int max_accepted,
+                                   bool try_subsequent_ports,
+                                   std::shared_ptr<IoUringReactor> &reactor) :
+    TCPAcceptor(address, port, max_accepted, try_subsequent_ports) {
+    this->reactor = reactor;
+  }
+
+  std::unique_ptr<Connection> IoUringAcceptor::accept_connection(unsigned int buf_size) {
+    try {
+      net::StreamSocket socket = this->acceptor.acceptConnection();
+      return std::make_unique<IoUringSocket>(socket, buf_size, this->reactor);
+    } catch (net::NetException &e) {
+      throw ConnectionException(e);
+    }
+  }
+};
+#endif
@@ -0,0 +1,226 @@
+// AdaptivePerf: comprehensive profiling tool based on Linux perf
+// Copyright (C) CERN. See LICENSE for details.
+
+#ifndef URING_HPP_
+#define URING_HPP_
+
+#include "socket.hpp"
+
+#ifdef IO_URING_AVAILABLE
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#define IO_URING_ENTRIES 512
+#define IO_URING_BUF_COUNT 256
+#define IO_URING_BUF_SIZE 65536
+#define IO_URING_FILES 1024
+
+// Receiving from a connection is paused when this many bytes are queued
+// and not read yet and resumed when the queue drops below half of it.
+#define IO_URING_MAX_QUEUED 33554432
+
+namespace aperf {
+  class IoUringReactor;
+
+  /**
+     A structure describing the state of a connection serviced by
+     IoUringReactor, shared between the reactor thread and the thread
+     reading from the connection.
+  */
+  struct IoUringStream {
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<std::string> chunks;
+    std::size_t chunk_pos = 0;
+    unsigned long long queued = 0;
+    bool eof = false;
+    int error = 0;
+    bool fallback = false;
+    bool paused = false;
+
+    // The fields below are accessed only by the reactor thread.
+    int fd = -1;
+    int slot = -1;
+    unsigned long long id = 0;
+    bool receiving = false;
+    bool received = false;
+    bool closing = false;
+  };
+
+  /**
+     A class describing an io_uring instance together with a thread
+     servicing it.
+
+     Every connection added to the reactor has one multishot receive
+     request in flight, which completes every time new data arrive
+     without being resubmitted. The data are received into buffers
+     provided to the kernel upfront and the socket file descriptors are
+     registered with io_uring so that they are not looked up on every
+     completion. This way, one thread calling io_uring_enter services all
+     connections instead of every connection having its own thread blocked
+     in a receive system call.
+
+     The received data are queued in IoUringStream objects and read
+     from there by IoUringSocket.
+
+     This is available only when compiled for Linux with io_uring
+     headers supporting provided buffer rings (Linux 5.19+).
+  */
+  class IoUringReactor {
+  private:
+    int ring_fd;
+    int event_fd;
+    unsigned long long event_value;
+
+    void *sq_ptr;
+    std::size_t sq_size;
+    void *cq_ptr;
+    std::size_t cq_size;
+    void *sqes_ptr;
+    std::size_t sqes_size;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    void *cqes;
+    unsigned to_submit;
+
+    void *buf_ring;
+    std::size_t buf_ring_size;
+    std::unique_ptr<char[]> bufs;
+
+    bool fixed_files;
+    std::vector<int> free_slots;
+
+    std::mutex mutex;
+    std::vector<std::pair<int, std::shared_ptr<IoUringStream> > > commands;
+    std::unordered_map<unsigned long long, std::shared_ptr<IoUringStream> > streams;
+    unsigned long long next_id;
+    std::atomic<bool> stopping;
+    std::thread thread;
+
+    void *get_sqe();
+    void submit(bool wait);
+    void release();
+    void provide_buffer(unsigned short id);
+    void arm_wakeup();
+    void arm_receive(unsigned long long id, std::shared_ptr<IoUringStream> &stream);
+    void cancel_receive(unsigned long long id);
+    void unregister(std::shared_ptr<IoUringStream> &stream);
+    void handle_receive(unsigned long long id, int res, unsigned int flags);
+    void command(int type, std::shared_ptr<IoUringStream> &stream);
+    void run();
+
+  public:
+    IoUringReactor();
+    ~IoUringReactor();
+    void add(std::shared_ptr<IoUringStream> &stream, int fd);
+    void remove(std::shared_ptr<IoUringStream> &stream);
+    void resume(std::shared_ptr<IoUringStream> &stream);
+  };
+
+  /**
+     A class describing a TCP socket whose incoming data are received
+     by IoUringReactor.
+
+     Writing is done the same way as in TCPSocket. If the kernel does not
+     support multishot receive requests (Linux 6.0+), the socket falls
+     back to receiving data as TCPSocket does.
+  */
+  class IoUringSocket : public TCPSocket {
+  private:
+    std::shared_ptr<IoUringReactor> reactor;
+    std::shared_ptr<IoUringStream> stream;
+
+  public:
+    using TCPSocket::read;
+
+    IoUringSocket(net::StreamSocket &sock, unsigned int buf_size,
+                  std::shared_ptr<IoUringReactor> &reactor);
+    ~IoUringSocket();
+    int read(char *buf, unsigned int len, long timeout_seconds);
+    unsigned long long read(fs::path file, long timeout_seconds);
+    int get_poll_fd();
+  };
+
+  /**
+     A class describing a TCP acceptor producing IoUringSocket objects.
+
+     The other end connects the same way as to TCPAcceptor.
+  */
+  class IoUringAcceptor : public TCPAcceptor {
+  private:
+    std::shared_ptr<IoUringReactor> reactor;
+
+    IoUringAcceptor(std::string address, unsigned short port,
+                    int max_accepted,
+                    bool try_subsequent_ports,
+                    std::shared_ptr<IoUringReactor> &reactor);
+
+  protected:
+    std::unique_ptr<Connection> accept_connection(unsigned int buf_size);
+
+  public:
+    /**
+       An IoUringAcceptor factory.
+    */
+    class Factory : public Acceptor::Factory {
+    private:
+      std::string address;
+      unsigned short port;
+      bool try_subsequent_ports;
+      std::vector<std::shared_ptr<IoUringReactor> > reactors;
+      std::atomic<unsigned int> next_reactor;
+
+    public:
+      /**
+         Constructs an IoUringAcceptor::Factory object.
+
+         @param address              An address where the TCP server should listen at.
+         @param port                 A port where the TCP server should listen at.
+         @param try_subsequent_ports See TCPAcceptor::Factory.
+         @param reactors             The reactors servicing the accepted
+                                     connections. They are assigned to the
+                                     acceptors made by the factory in
+                                     a round-robin way and can be shared
+                                     with other factories.
+      */
+      Factory(std::string address, unsigned short port,
+              bool try_subsequent_ports,
+              std::vector<std::shared_ptr<IoUringReactor> > &reactors) {
+        this->address = address;
+        this->port = port;
+        this->try_subsequent_ports = try_subsequent_ports;
+        this->reactors = reactors;
+        this->next_reactor = 0;
+      }
+
+      std::unique_ptr<Acceptor> make_acceptor(int max_accepted) {
+        std::shared_ptr<IoUringReactor> &reactor =
+          this->reactors[this->next_reactor++ % this->reactors.size()];
+        return std::unique_ptr<Acceptor>(new IoUringAcceptor(this->address,
+                                                             this->port,
+                                                             max_accepted,
+                                                             this->try_subsequent_ports,
+                                                             reactor));
+      }
+
+      std::string get_type() {
+        return "tcp";
+      }
+    };
+  };
+};
+#endif
+
+#endif
@@ -5,6 +5,7 @@
 #define MOCKS_HPP_
 
 #include "server.hpp"
+#include <atomic>
 #include <filesystem>
 #include <fstream>
 #include <gmock/gmock.h>
@@ -63,7 +64,7 @@ namespace test {
         this->call_constructor = call_constructor;
       }
 
-      std::unique_ptr<Subclient> make_subclient(aperf::Notifiable &context,
+      std::unique_ptr<Subclient> make_subclient(aperf::Client &context,
                                                 std::string profiled_filename,
                                                 unsigned int buf_size) {
         std::unique_ptr<StrictMock<MockSubclient> > subclient(new StrictMock<MockSubclient>(context));
@@ -135,6 +136,10 @@ namespace test {
                                   unsigned long long));
     MOCK_METHOD(void, real_process, (fs::path));
     MOCK_METHOD(void, notify, (), (override));
+    MOCK_METHOD(bool, get_profile_start_tstamp, (unsigned long long *), (override));
+    MOCK_METHOD(bool, wait_for_profile_start_tstamp, (unsigned long long *), (override));
+    MOCK_METHOD(aperf::SessionSettings &, get_session_settings, (), (override));
+    MOCK_METHOD(fs::path, get_raw_export_path, (), (override));
 
     void set_interrupt_ptr(volatile bool *interrupted) {
       this->interrupted = interrupted;
@@ -157,25 +162,29 @@ namespace test {
     MOCK_METHOD(void, close, (), (override));
     MOCK_METHOD(int, read, (char *, unsigned int, long), (override));
     MOCK_METHOD(std::string, read, (long), (override));
+    MOCK_METHOD(unsigned long long, read, (fs::path, long), (override));
     MOCK_METHOD(void, write, (std::string, bool), (override));
     MOCK_METHOD(void, write, (fs::path), (override));
+    MOCK_METHOD(void, write, (unsigned int, char *), (override));
   };
 
   class MockAcceptor : public aperf::Acceptor {
   private:
-    std::function<void(MockConnection &)> connection_init;
+    std::function<void(MockConnection &, int)> connection_init;
+    int index;
 
   protected:
-    MockAcceptor(std::function<void(MockConnection &)> connection_init,
-                 int max_accepted) : Acceptor(max_accepted) {
+    MockAcceptor(std::function<void(MockConnection &, int)> connection_init,
+                 int index, int max_accepted) : Acceptor(max_accepted) {
       this->connection_init = connection_init;
+      this->index = index;
     }
 
     std::unique_ptr<aperf::Connection> accept_connection(unsigned int buf_size) {
       this->real_accept(buf_size);
 
       std::unique_ptr<MockConnection> connection = std::make_unique<MockConnection>();
-      this->connection_init(*connection);
+      this->connection_init(*connection, this->index);
       return connection;
     }
 
@@ -183,20 +192,34 @@ namespace test {
     class Factory : public aperf::Acceptor::Factory {
     private:
       std::function<void(MockAcceptor &)> acceptor_init;
-      std::function<void(MockConnection &)> connection_init;
+      std::function<void(MockConnection &, int)> connection_init;
       bool call_constructor;
+      std::atomic_int made;
 
     public:
       Factory(std::function<void(MockAcceptor &)> acceptor_init,
               std::function<void(MockConnection &)> connection_init,
+              bool call_constructor) : Factory(acceptor_init,
+                                               [connection_init](MockConnection &c, int) {
+                                                 connection_init(c);
+                                               }, call_constructor) { }
+
+      // connection_init is additionally given the index of the acceptor
+      // accepting the connection, i.e. the number of acceptors made by
+      // the factory before it (e.g. the index of a subclient made by
+      // StdClient).
+      Factory(std::function<void(MockAcceptor &)> acceptor_init,
+              std::function<void(MockConnection &, int)> connection_init,
               bool call_constructor) {
         this->acceptor_init = acceptor_init;
         this->connection_init = connection_init;
         this->call_constructor = call_constructor;
+        this->made = 0;
       }
 
       std::unique_ptr<Acceptor> make_acceptor(int max_accepted) {
         std::unique_ptr<StrictMock<MockAcceptor> > acceptor(new StrictMock<MockAcceptor>(connection_init,
+                                                                                         this->made++,
                                                                                          max_accepted));
         this->acceptor_init(*acceptor);
 
@@ -0,0 +1,381 @@
+// AdaptivePerf: comprehensive profiling tool based on Linux perf
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "mocks.hpp"
+#include "pack.hpp"
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <mutex>
+#include <unistd.h>
+
+using namespace testing;
+
+static std::string sample(nlohmann::json pid, nlohmann::json tid,
+                          unsigned long long time, unsigned long long period,
+                          bool offcpu, std::vector<std::string> symbols) {
+  nlohmann::json obj;
+  obj["type"] = "sample";
+  obj["event_type"] = offcpu ? "offcpu-time" : "task-clock";
+  obj["pid"] = pid;
+  obj["tid"] = tid;
+  obj["time"] = time;
+  obj["period"] = period;
+  obj["callchain"] = nlohmann::json::array();
+
+  for (auto &symbol : symbols) {
+    obj["callchain"].push_back({symbol, "0x1"});
+  }
+
+  return obj.dump();
+}
+
+static nlohmann::json read_json(fs::path path) {
+  std::ifstream f(path);
+  return nlohmann::json::parse(f);
+}
+
+/**
+   Runs whole profiling sessions through StdClient and StdSubclient, with
+   the frontend and the profilers replaced by mocked connections.
+*/
+class StdClientSessionTest : public Test {
+protected:
+  fs::path working_dir;
+
+  void SetUp() {
+    this->working_dir = fs::temp_directory_path() /
+      ("aperf-test-client-session-" + std::to_string(getpid()) + "-" +
+       UnitTest::GetInstance()->current_test_info()->name());
+    fs::remove_all(this->working_dir);
+    fs::create_directories(this->working_dir);
+  }
+
+  void TearDown() {
+    fs::remove_all(this->working_dir);
+  }
+
+  /**
+     Runs a session and returns the messages written by the client to
+     the frontend.
+
+     @param frontend_lines The messages sent by the frontend, in order,
+                           including the profile start timestamp.
+     @param streams        The messages sent by the profiler of each
+                           subclient, in order. The subclients start
+                           receiving them only after the client has
+                           acknowledged the profile start timestamp.
+  */
+  std::vector<std::string> run(std::vector<std::string> frontend_lines,
+                               std::vector<std::vector<std::string> > streams) {
+    std::promise<void> started;
+    std::shared_future<void> started_future = started.get_future().share();
+    std::mutex messages_mutex;
+    std::vector<std::string> messages;
+    std::deque<std::string> to_send(frontend_lines.begin(), frontend_lines.end());
+
+    std::unique_ptr<aperf::Acceptor::Factory> acceptor_factory =
+      std::make_unique<test::MockAcceptor::Factory>([&](test::MockAcceptor &a) {
+        EXPECT_CALL(a, construct(1)).Times(1);
+        EXPECT_CALL(a, real_accept(_)).Times(1);
+        EXPECT_CALL(a, get_connection_instructions).WillRepeatedly(Return("instr"));
+        EXPECT_CALL(a, close).Times(AnyNumber());
+      }, [&, started_future](test::MockConnection &c, int index) {
+        InSequence sequence;
+        bool first = true;
+
+        for (auto &line : streams[index]) {
+          EXPECT_CALL(c, read(NO_TIMEOUT))
+            .WillOnce(InvokeWithoutArgs([started_future, line, first]() {
+              if (first) {
+                started_future.wait();
+              }
+
+              return line;
+            }));
+          first = false;
+        }
+
+        EXPECT_CALL(c, read(NO_TIMEOUT))
+          .WillOnce(InvokeWithoutArgs([started_future]() {
+            started_future.wait();
+            return std::string("<STOP>");
+          }));
+        EXPECT_CALL(c, close).Times(AnyNumber());
+      }, true);
+
+    std::unique_ptr<aperf::Subclient::Factory> subclient_factory =
+      std::make_unique<aperf::StdSubclient::Factory>(acceptor_factory);
+    aperf::StdClient::Factory client_factory(subclient_factory);
+
+    std::unique_ptr<aperf::Connection> connection =
+      std::make_unique<test::MockConnection>();
+    test::MockConnection *frontend =
+      static_cast<test::MockConnection *>(connection.get());
+
+    EXPECT_CALL(*frontend, get_buf_size).WillRepeatedly(Return(1024));
+    EXPECT_CALL(*frontend, close).Times(AnyNumber());
+    EXPECT_CALL(*frontend, read(An<long>()))
+      .WillRepeatedly(Invoke([&](long) {
+        if (to_send.empty()) {
+          return std::string();
+        }
+
+        std::string line = to_send.front();
+        to_send.pop_front();
+        return line;
+      }));
+    EXPECT_CALL(*frontend, write(An<std::string>(), An<bool>()))
+      .WillRepeatedly(Invoke([&](std::string msg, bool) {
+        std::unique_lock lock(messages_mutex);
+        messages.push_back(msg);
+
+        if (msg == "tstamp_ack") {
+          started.set_value();
+        }
+      }));
+
+    std::unique_ptr<aperf::Acceptor> file_acceptor = nullptr;
+    std::unique_ptr<aperf::Client> client =
+      client_factory.make_client(connection, file_acceptor, 10);
+    client->process(this->working_dir);
+    return messages;
+  }
+};
+
+TEST_F(StdClientSessionTest, LegacyFrontendTest) {
+  // Frontends older than protocol version 2 send neither the protocol
+  // version, the session settings nor the overhead message
+  std::vector<std::string> messages = run({
+      "start1 result",
+      "test",
+      "1000"
+    }, {
+      {
+        sample(10, 11, 1100, 100, false, {"main", "foo"}),
+        sample(10, 11, 1200, 100, false, {"main"})
+      }
+    });
+
+  std::vector<std::string> expected_messages = {
+    "mock instr",
+    "start_profile",
+    "tstamp_ack",
+    "profiling_finished",
+    "finished"
+  };
+
+  ASSERT_EQ(messages, expected_messages);
+
+  fs::path processed = this->working_dir / "result" / "processed";
+  ASSERT_TRUE(fs::exists(processed / "10_11.json"));
+  ASSERT_FALSE(fs::exists(processed / "timeline.json"));
+
+  nlohmann::json metadata = read_json(processed / "metadata.json");
+  ASSERT_EQ(metadata["sampled_times"]["10_11"], 200);
+  ASSERT_FALSE(metadata.contains("overhead"));
+}
+
+TEST_F(StdClientSessionTest, TimelineTest) {
+  std::vector<std::string> messages = run({
+      "protocol 3",
+      "start2 result",
+      "test",
+      "{\"timeline_buckets_ms\": [100]}",
+      "1000000000",
+      "overhead {\"perf\": 1}"
+    }, {
+      {
+        sample(10, 11, 1050000000, 50000000, false, {"main", "foo"})
+      },
+      {
+        sample(10, 12, 1050000000, 50000000, false, {"main", "bar"}),
+        sample(10, 12, 1250000000, 100000000, true, {"main", "foo"})
+      }
+    });
+
+  ASSERT_EQ(messages.back(), "finished");
+
+  fs::path processed = this->working_dir / "result" / "processed";
+
+  // The frame tables of the subclients are merged into one in the
+  // subclient order, with the flame graph nodes of the second subclient
+  // renumbered accordingly
+  nlohmann::json expected = nlohmann::json::parse(R"({
+    "bucket_sizes_ms": [100],
+    "frames": ["main", "foo", "bar"],
+    "threads": {
+      "10_11": {
+        "100": [[0, [-1, 0, 50000000, 0, 0, 1, 50000000, 0]]]
+      },
+      "10_12": {
+        "100": [
+          [0, [-1, 0, 50000000, 0, 0, 2, 50000000, 0]],
+          [2, [-1, 0, 100000000, 1, 0, 1, 100000000, 1]]
+        ]
+      }
+    }
+  })");
+
+  nlohmann::json timeline = read_json(processed / "timeline.json");
+  ASSERT_EQ(timeline, expected);
+
+  nlohmann::json metadata = read_json(processed / "metadata.json");
+  ASSERT_EQ(metadata["overhead"]["perf"], 1);
+}
+
+TEST_F(StdClientSessionTest, PackThreadsTest) {
+  std::vector<std::string> stream = {
+    sample(10, 11, 1100, 100, false, {"main", "foo"}),
+    sample(10, 12, 1200, 100, true, {"main"})
+  };
+
+  run({
+      "protocol 3",
+      "start1 packed",
+      "test",
+      "{\"pack_threads\": true}",
+      "1000",
+      "overhead {}"
+    }, {stream});
+
+  run({
+      "protocol 3",
+      "start1 unpacked",
+      "test",
+      "{}",
+      "1000",
+      "overhead {}"
+    }, {stream});
+
+  fs::path packed = this->working_dir / "packed" / "processed";
+  fs::path unpacked = this->working_dir / "unpacked" / "processed";
+
+  // Threads are stored in threads.pack instead of separate files, with
+  // the same content
+  ASSERT_FALSE(fs::exists(packed / "10_11.json"));
+  ASSERT_TRUE(fs::exists(packed / "threads.pack"));
+
+  nlohmann::json index = aperf::read_pack_index(packed / "threads.pack");
+  ASSERT_EQ(index.size(), 2);
+
+  for (std::string key : {"10_11", "10_12"}) {
+    ASSERT_EQ(aperf::read_pack_entry(packed / "threads.pack", index, key),
+              read_json(unpacked / (key + ".json")));
+  }
+}
+
+TEST_F(StdClientSessionTest, GroupThreadsTest) {
+  std::vector<std::string> samples = {
+    sample(10, 11, 1100, 100, false, {"main", "foo"}),
+    sample(10, 11, 1200, 100, true, {"main", "bar"}),
+    sample(10, 12, 1300, 100, false, {"main", "bar", "baz"}),
+    sample(10, 12, 1400, 100, false, {"main", "foo", "qux"}),
+    sample(10, 12, 1500, 100, true, {"main", "foo"})
+  };
+
+  run({
+      "protocol 3",
+      "start1 grouped",
+      "test",
+      "{\"group_threads\": \"process\"}",
+      "1000",
+      "overhead {}"
+    }, {samples});
+
+  // The same samples coming from a single thread
+  std::vector<std::string> single_thread_samples;
+
+  for (auto &line : samples) {
+    nlohmann::json obj = nlohmann::json::parse(line);
+    obj["tid"] = 11;
+    single_thread_samples.push_back(obj.dump());
+  }
+
+  run({
+      "protocol 3",
+      "start1 single",
+      "test",
+      "{\"group_threads\": \"process\"}",
+      "1000",
+      "overhead {}"
+    }, {single_thread_samples});
+
+  fs::path grouped = this->working_dir / "grouped" / "processed";
+  fs::path single = this->working_dir / "single" / "processed";
+
+  nlohmann::json metadata = read_json(grouped / "metadata.json");
+  nlohmann::json expected_groups = nlohmann::json::parse(R"({
+    "10_g0": {"name": "*", "threads": ["10_11", "10_12"]}
+  })");
+
+  ASSERT_EQ(metadata["thread_groups"], expected_groups);
+  ASSERT_EQ(metadata["thread_totals"]["10_11"]["walltime"], 200);
+  ASSERT_EQ(metadata["thread_totals"]["10_12"]["walltime"], 300);
+  ASSERT_FALSE(fs::exists(grouped / "10_11.json"));
+
+  // The group tree is the tree the whole process would have if all its
+  // samples came from one thread
+  ASSERT_EQ(read_json(grouped / "10_g0.json"), read_json(single / "10_g0.json"));
+}
+
+TEST_F(StdClientSessionTest, TimeChunksTest) {
+  auto ms = [](unsigned long long value) { return value * 1000000ULL; };
+
+  std::vector<std::string> first_chunk = {
+    sample(10, 11, ms(1050), ms(50), false, {"main", "foo"}),
+    sample(10, 12, ms(1100), ms(100), false, {"main"}),
+    sample(10, 11, ms(1180), ms(30), true, {"main", "bar"})
+  };
+
+  std::vector<std::string> second_chunk = {
+    sample(10, 11, ms(1190), ms(10), true, {"main", "bar"}),
+    sample(10, 12, ms(1300), ms(100), false, {"main"}),
+    sample(10, 11, ms(1400), ms(100), false, {"main", "foo", "baz"}),
+    sample(10, 13, ms(1450), ms(50), false, {"main"})
+  };
+
+  std::vector<std::string> whole = first_chunk;
+  whole.insert(whole.end(), second_chunk.begin(), second_chunk.end());
+
+  run({
+      "protocol 3",
+      "start1 whole",
+      "test",
+      "{\"timeline_buckets_ms\": [100]}",
+      std::to_string(ms(1000)),
+      "overhead {}"
+    }, {whole});
+
+  run({
+      "protocol 3",
+      "start2 chunked",
+      "test",
+      "{\"timeline_buckets_ms\": [100], \"time_chunks\": 2}",
+      std::to_string(ms(1000)),
+      "overhead {}"
+    }, {first_chunk, second_chunk});
+
+  fs::path whole_path = this->working_dir / "whole" / "processed";
+  fs::path chunked_path = this->working_dir / "chunked" / "processed";
+
+  // Trees from both chunks are merged into the same trees as if the
+  // samples had been processed in one go
+  for (std::string key : {"10_11", "10_12", "10_13"}) {
+    ASSERT_EQ(read_json(chunked_path / (key + ".json")),
+              read_json(whole_path / (key + ".json")));
+  }
+
+  nlohmann::json whole_metadata = read_json(whole_path / "metadata.json");
+  nlohmann::json chunked_metadata = read_json(chunked_path / "metadata.json");
+
+  ASSERT_EQ(chunked_metadata["sampled_times"], whole_metadata["sampled_times"]);
+  ASSERT_EQ(chunked_metadata["offcpu_regions"], whole_metadata["offcpu_regions"]);
+  ASSERT_EQ(chunked_metadata["sampled_times"]["10_11"], ms(190));
+
+  // Bucket 1 has samples from both chunks
+  ASSERT_EQ(read_json(chunked_path / "timeline.json"),
+            read_json(whole_path / "timeline.json"));
+}
@@ -0,0 +1,98 @@
+// AdaptivePerf: comprehensive profiling tool based on Linux perf
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "codestore.hpp"
+#include <gtest/gtest.h>
+#include <archive.h>
+#include <archive_entry.h>
+#include <fstream>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+TEST(CodeStoreTest, HashTest) {
+  ASSERT_EQ(aperf::CodeStore::hash_data("abc"),
+            "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+  ASSERT_TRUE(aperf::CodeStore::is_valid_hash(aperf::CodeStore::hash_data("")));
+  ASSERT_FALSE(aperf::CodeStore::is_valid_hash("abc"));
+  ASSERT_FALSE(aperf::CodeStore::is_valid_hash(
+                 "BA7816BF8F01CFEA414140DE5DAE2223B00361A396177A9CB410FF61F20015AD"));
+  ASSERT_FALSE(aperf::CodeStore::is_valid_hash(
+                 "../816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"));
+}
+
+TEST(CodeStoreTest, DedupTest) {
+  fs::path dir = fs::temp_directory_path() /
+    ("aperf_test_codestore_" + std::to_string(getpid()));
+  fs::path file1 = dir / "a.cpp", file2 = dir / "b.cpp";
+
+  fs::create_directories(dir);
+  std::ofstream(file1) << "int main() { return 0; }" << std::endl;
+  std::ofstream(file2) << "int main() { return 0; }" << std::endl;
+
+  aperf::CodeStore store(dir / "store");
+
+  bool added;
+  std::string hash1 = store.add_file(file1, &added);
+  ASSERT_TRUE(added);
+  ASSERT_TRUE(store.contains(hash1));
+  ASSERT_EQ(store.get_blob_path(hash1),
+            store.get_root() / hash1.substr(0, 2) / hash1);
+
+  std::string hash2 = store.add_file(file2, &added);
+  ASSERT_FALSE(added);
+  ASSERT_EQ(hash1, hash2);
+  ASSERT_EQ(aperf::CodeStore::hash_file(store.get_blob_path(hash1)), hash1);
+
+  std::string hash3 = aperf::CodeStore::hash_data("void f();\n");
+  ASSERT_FALSE(store.add_blob(hash3, "void g();\n"));
+  ASSERT_FALSE(store.contains(hash3));
+  ASSERT_TRUE(store.add_blob(hash3, "void f();\n"));
+  ASSERT_TRUE(store.contains(hash3));
+
+  fs::remove_all(dir);
+}
+
+TEST(CodeStoreTest, TruncatedArchiveTest) {
+  fs::path dir = fs::temp_directory_path() /
+    ("aperf_test_codestore_archive_" + std::to_string(getpid()));
+  fs::path archive_path = dir / "upload.tar";
+
+  fs::create_directories(dir);
+
+  std::string data(100000, 'a');
+  std::string hash = aperf::CodeStore::hash_data(data);
+
+  struct archive *arch = archive_write_new();
+  archive_write_set_format_pax_restricted(arch);
+  ASSERT_EQ(archive_write_open_filename(arch, archive_path.c_str()), ARCHIVE_OK);
+
+  struct archive_entry *entry = archive_entry_new();
+  archive_entry_set_pathname(entry, hash.c_str());
+  archive_entry_set_size(entry, data.size());
+  archive_entry_set_filetype(entry, AE_IFREG);
+  archive_entry_set_perm(entry, 0644);
+  ASSERT_EQ(archive_write_header(arch, entry), ARCHIVE_OK);
+  ASSERT_EQ(archive_write_data(arch, data.c_str(), data.size()), data.size());
+  archive_entry_free(entry);
+  archive_write_close(arch);
+  archive_write_free(arch);
+
+  unsigned long long rejected;
+
+  {
+    aperf::CodeStore store(dir / "store");
+    ASSERT_EQ(store.add_archive(archive_path, &rejected), 1);
+    ASSERT_EQ(rejected, 0);
+    ASSERT_TRUE(store.contains(hash));
+  }
+
+  // A truncated upload is rejected rather than partially accepted
+  fs::resize_file(archive_path, 50000);
+
+  aperf::CodeStore store(dir / "store_truncated");
+  ASSERT_THROW(store.add_archive(archive_path, &rejected), std::runtime_error);
+  ASSERT_FALSE(store.contains(hash));
+
+  fs::remove_all(dir);
+}
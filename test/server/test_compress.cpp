@@ -0,0 +1,161 @@
+// AdaptivePerf: comprehensive profiling tool based on Linux perf
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "compress.hpp"
+#include <gtest/gtest.h>
+#include <future>
+#include <fstream>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+static unsigned short get_port(aperf::Acceptor &acceptor) {
+  std::string instrs = acceptor.get_connection_instructions();
+  return std::stoi(instrs.substr(instrs.find('_') + 1));
+}
+
+static std::unique_ptr<aperf::Connection> connect(unsigned short port,
+                                                  std::vector<std::string> methods) {
+  Poco::Net::StreamSocket socket;
+  socket.connect(Poco::Net::SocketAddress("127.0.0.1", port));
+  std::unique_ptr<aperf::Connection> connection =
+    std::make_unique<aperf::TCPSocket>(socket, 1024);
+  return aperf::CompressedConnection::negotiate(std::move(connection), methods);
+}
+
+TEST(WireCodecTest, RoundTrip) {
+  std::string data;
+
+  for (int i = 0; i < 200000; i++) {
+    data += "sample " + std::to_string(i % 97) + " " + std::to_string(i * 31 % 1013) + "\n";
+  }
+
+  for (std::string &name : aperf::WireCodec::get_supported()) {
+    std::unique_ptr<aperf::WireCodec> compressor = aperf::WireCodec::make(name);
+    std::unique_ptr<aperf::WireCodec> decompressor = aperf::WireCodec::make(name);
+    std::string compressed, decompressed;
+
+    compressor->compress(data.data(), data.size() / 2, aperf::WireCodec::NO_FLUSH,
+                         compressed);
+    compressor->compress(data.data() + data.size() / 2, 10,
+                         aperf::WireCodec::FLUSH, compressed);
+
+    // Everything passed so far must be decompressible after FLUSH
+    decompressor->decompress(compressed.data(), compressed.size(), decompressed);
+    ASSERT_EQ(decompressed, data.substr(0, data.size() / 2 + 10)) << name;
+
+    std::size_t flushed = compressed.size();
+    compressor->compress(data.data() + data.size() / 2 + 10,
+                         data.size() - data.size() / 2 - 10,
+                         aperf::WireCodec::END, compressed);
+
+    // Another stream following the finished one
+    compressor->compress("next\n", 5, aperf::WireCodec::END, compressed);
+
+    decompressor->decompress(compressed.data() + flushed, compressed.size() - flushed,
+                             decompressed);
+    ASSERT_TRUE(decompressed == data + "next\n") << name;
+    ASSERT_LT(compressed.size(), data.size() / 2) << name;
+  }
+
+  ASSERT_THROW(aperf::WireCodec::make("lz4"), std::runtime_error);
+}
+
+TEST(CompressedConnectionTest, LinesAndFile) {
+  fs::path src = fs::temp_directory_path() /
+    ("aperf_test_compress_src_" + std::to_string(getpid()));
+  fs::path dst = fs::temp_directory_path() /
+    ("aperf_test_compress_dst_" + std::to_string(getpid()));
+
+  std::string data(3 * FILE_BUFFER_SIZE + 123, '\0');
+
+  for (std::size_t i = 0; i < data.size(); i++) {
+    data[i] = (char)(i % 251 < 128 ? 'a' + i % 7 : i * 13);
+  }
+
+  std::ofstream(src, std::ios::binary) << data;
+
+  for (std::string &name : aperf::WireCodec::get_supported()) {
+    aperf::TCPAcceptor::Factory factory("127.0.0.1", 4937, true);
+    std::unique_ptr<aperf::Acceptor> tcp_acceptor = factory.make_acceptor(2);
+    unsigned short port = get_port(*tcp_acceptor);
+    aperf::CompressedAcceptor acceptor(tcp_acceptor, {"zlib:9", "zstd:1"}, 5);
+
+    std::future<void> sender = std::async([&]() {
+      std::vector<std::string> methods = {"none", name + ":2", "zlib"};
+
+      {
+        std::unique_ptr<aperf::Connection> connection = connect(port, methods);
+        ASSERT_NE(dynamic_cast<aperf::CompressedConnection *>(connection.get()), nullptr);
+        connection->write("first", true);
+        connection->write("", true);
+        connection->write(std::string(100000, 'x'), false);
+        connection->write("y\nlast", false);
+      }
+
+      {
+        std::unique_ptr<aperf::Connection> connection = connect(port, methods);
+        connection->write(src);
+      }
+    });
+
+    {
+      std::unique_ptr<aperf::Connection> connection = acceptor.accept(1024);
+      ASSERT_EQ(connection->read(5), "first");
+      ASSERT_EQ(connection->read(5), std::string(100000, 'x') + "y");
+      ASSERT_EQ(connection->read(5), "last");
+      ASSERT_EQ(connection->read(5), "");
+
+      aperf::CompressedConnection *compressed =
+        dynamic_cast<aperf::CompressedConnection *>(connection.get());
+      ASSERT_NE(compressed, nullptr);
+      ASSERT_LT(compressed->get_wire_bytes(), compressed->get_raw_bytes() / 10);
+    }
+
+    {
+      std::unique_ptr<aperf::Connection> connection = acceptor.accept(1);
+      ASSERT_EQ(connection->read(dst, 5), data.size());
+    }
+
+    sender.get();
+
+    std::ifstream stream(dst, std::ios::binary);
+    std::string received((std::istreambuf_iterator<char>(stream)),
+                         std::istreambuf_iterator<char>());
+    ASSERT_TRUE(received == data) << name;
+  }
+
+  fs::remove(src);
+  fs::remove(dst);
+}
+
+TEST(CompressedConnectionTest, NoCommonMethod) {
+  aperf::TCPAcceptor::Factory factory("127.0.0.1", 4937, true);
+  std::unique_ptr<aperf::Acceptor> tcp_acceptor = factory.make_acceptor(2);
+  unsigned short port = get_port(*tcp_acceptor);
+  aperf::CompressedAcceptor acceptor(tcp_acceptor, {"zlib"}, 5);
+
+  std::future<void> sender = std::async([&]() {
+    {
+      std::unique_ptr<aperf::Connection> connection = connect(port, {"lz4"});
+      ASSERT_EQ(dynamic_cast<aperf::CompressedConnection *>(connection.get()), nullptr);
+      connection->write("plain", true);
+    }
+
+    {
+      Poco::Net::StreamSocket socket;
+      socket.connect(Poco::Net::SocketAddress("127.0.0.1", port));
+      aperf::TCPSocket connection(socket, 1024);
+      connection.write("wrong offer", true);
+    }
+  });
+
+  {
+    std::unique_ptr<aperf::Connection> connection = acceptor.accept(1024);
+    ASSERT_EQ(dynamic_cast<aperf::CompressedConnection *>(connection.get()), nullptr);
+    ASSERT_EQ(connection->read(5), "plain");
+  }
+
+  ASSERT_THROW(acceptor.accept(1024), aperf::ConnectionException);
+  sender.get();
+}
@@ -0,0 +1,44 @@
+// AdaptivePerf: comprehensive profiling tool based on Linux perf
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "pack.hpp"
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+TEST(PackTest, RoundTripTest) {
+  fs::path path = fs::temp_directory_path() /
+    ("aperf_test_pack_" + std::to_string(getpid()) + ".pack");
+
+  nlohmann::json entries;
+  entries["1000_1000"] = {{"walltime", {{{"name", "all"}, {"value", 5}}}}};
+  entries["1000_1001"] = {{"sampled_time", 12}};
+  entries["1001_1001"] = nlohmann::json::object();
+
+  aperf::write_pack(path, entries);
+
+  nlohmann::json index = aperf::read_pack_index(path);
+
+  ASSERT_EQ(index.size(), 3);
+
+  for (auto &entry : entries.items()) {
+    ASSERT_EQ(aperf::read_pack_entry(path, index, entry.key()), entry.value());
+  }
+
+  ASSERT_THROW(aperf::read_pack_entry(path, index, "1_1"), std::runtime_error);
+
+  fs::remove(path);
+}
+
+TEST(PackTest, EmptyTest) {
+  fs::path path = fs::temp_directory_path() /
+    ("aperf_test_pack_empty_" + std::to_string(getpid()) + ".pack");
+
+  nlohmann::json entries = nlohmann::json::object();
+  aperf::write_pack(path, entries);
+
+  ASSERT_EQ(aperf::read_pack_index(path), nlohmann::json::object());
+
+  fs::remove(path);
+}
@@ -0,0 +1,109 @@
+// AdaptivePerf: comprehensive profiling tool based on Linux perf
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "rawlog.hpp"
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+TEST(RawLogTest, VarintTest) {
+  std::vector<unsigned long long> values = {0, 1, 127, 128, 300, 0xffffffffULL,
+                                            0xffffffffffffffffULL};
+  std::string buf;
+
+  for (auto value : values) {
+    aperf::write_varint(buf, value);
+  }
+
+  ASSERT_EQ(buf.substr(0, 5), std::string("\x00\x01\x7f\x80\x01", 5));
+
+  std::size_t pos = 0;
+
+  for (auto value : values) {
+    unsigned long long result;
+    ASSERT_TRUE(aperf::read_varint(buf, pos, result));
+    ASSERT_EQ(result, value);
+  }
+
+  ASSERT_EQ(pos, buf.size());
+
+  unsigned long long result;
+  std::string truncated("\x80\x80", 2);
+  pos = 0;
+  ASSERT_FALSE(aperf::read_varint(truncated, pos, result));
+  ASSERT_EQ(pos, 0);
+}
+
+TEST(RawLogTest, RoundTripTest) {
+  fs::path path = fs::temp_directory_path() /
+    ("aperf_test_rawlog_" + std::to_string(getpid()) + ".samples");
+
+  std::vector<aperf::RawSample> samples;
+
+  // More than two chunks, with timestamps going backwards and
+  // IDs and CPUs changing in both directions
+  for (unsigned int i = 0; i < 2 * RAW_CHUNK_SAMPLES + 10; i++) {
+    aperf::RawSample sample;
+    sample.timestamp = 1000000000000ULL + i * 1000 - (i % 3 == 0 ? 1500 : 0);
+    sample.pid = 1000 + i % 2;
+    sample.tid = 1000 + i % 7;
+    sample.cpu = i % 11 == 0 ? -1 : i % 4;
+    sample.period = i % 5 == 0 ? 0xffffffffffffULL : 1000;
+    sample.stack_id = (i * 31) % 1000;
+    sample.offcpu = i % 13 == 0;
+    samples.push_back(sample);
+  }
+
+  {
+    aperf::RawSampleWriter writer(path);
+
+    for (auto &sample : samples) {
+      writer.add(sample);
+    }
+
+    writer.close();
+  }
+
+  aperf::RawSampleReader reader(path);
+  std::vector<aperf::RawSample> chunk, result;
+  unsigned int chunks = 0;
+
+  while (reader.read_chunk(chunk)) {
+    result.insert(result.end(), chunk.begin(), chunk.end());
+    chunks++;
+  }
+
+  ASSERT_EQ(chunks, 3);
+  ASSERT_EQ(result.size(), samples.size());
+
+  for (unsigned int i = 0; i < samples.size(); i++) {
+    ASSERT_EQ(result[i].timestamp, samples[i].timestamp);
+    ASSERT_EQ(result[i].pid, samples[i].pid);
+    ASSERT_EQ(result[i].tid, samples[i].tid);
+    ASSERT_EQ(result[i].cpu, samples[i].cpu);
+    ASSERT_EQ(result[i].period, samples[i].period);
+    ASSERT_EQ(result[i].stack_id, samples[i].stack_id);
+    ASSERT_EQ(result[i].offcpu, samples[i].offcpu);
+  }
+
+  ASSERT_LT(fs::file_size(path), samples.size() * 12);
+
+  fs::remove(path);
+}
+
+TEST(RawLogTest, EmptyTest) {
+  fs::path path = fs::temp_directory_path() /
+    ("aperf_test_rawlog_empty_" + std::to_string(getpid()) + ".samples");
+
+  {
+    aperf::RawSampleWriter writer(path);
+  }
+
+  aperf::RawSampleReader reader(path);
+  std::vector<aperf::RawSample> chunk;
+  ASSERT_FALSE(reader.read_chunk(chunk));
+  ASSERT_TRUE(chunk.empty());
+
+  fs::remove(path);
+}
@@ -4,9 +4,15 @@
 #include "socket.hpp"
 #include "consts.hpp"
 #include <gtest/gtest.h>
+#include <chrono>
 #include <future>
+#include <fstream>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
 
 using namespace testing;
+namespace fs = std::filesystem;
 
 class TCPAcceptorTestWithSocket : public Test {
 protected:
@@ -219,3 +225,227 @@ TEST_F(TCPSocketTest, SocketCorrectnessBufSize16) {
 TEST_F(TCPSocketTest, SocketCorrectnessBufSize10001) {
   test_socket_correctness(10001, port, interrupted, future);
 }
+
+inline std::string make_test_file(fs::path path, unsigned int size) {
+  std::string data(size, 0);
+
+  for (unsigned int i = 0; i < size; i++) {
+    data[i] = (i * 7919 + i / 251) % 256;
+  }
+
+  std::ofstream stream(path, std::ios::binary);
+  stream << data;
+  return data;
+}
+
+inline std::string read_test_file(fs::path path) {
+  std::ifstream stream(path, std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(stream), {});
+}
+
+TEST(TCPSocketFileTest, FileRoundTrip) {
+  const unsigned short port = 4817;
+  fs::path src = fs::temp_directory_path() /
+    ("aperf_test_socket_src_" + std::to_string(getpid()));
+  fs::path dst = fs::temp_directory_path() /
+    ("aperf_test_socket_dst_" + std::to_string(getpid()));
+
+  // Larger than FILE_BUFFER_SIZE and not a multiple of it
+  std::string data = make_test_file(src, 3 * FILE_BUFFER_SIZE + 12345);
+
+  Poco::Net::ServerSocket server_socket;
+  server_socket.bind(Poco::Net::SocketAddress("127.0.0.1", port));
+  server_socket.listen();
+
+  std::future<void> sender = std::async([&]() {
+    Poco::Net::StreamSocket socket;
+    socket.connect(Poco::Net::SocketAddress("127.0.0.1", port));
+    aperf::TCPSocket tcp_socket(socket, 1024);
+    tcp_socket.write(src);
+  });
+
+  Poco::Net::StreamSocket sock = server_socket.acceptConnection();
+  aperf::TCPSocket tcp_socket(sock, 1024);
+  ASSERT_EQ(tcp_socket.read(dst, 5), data.size());
+
+  sender.get();
+  ASSERT_EQ(read_test_file(dst), data);
+
+  fs::remove(src);
+  fs::remove(dst);
+}
+
+TEST(FileDescriptorTest, FileRoundTrip) {
+  fs::path src = fs::temp_directory_path() /
+    ("aperf_test_pipe_src_" + std::to_string(getpid()));
+  fs::path dst = fs::temp_directory_path() /
+    ("aperf_test_pipe_dst_" + std::to_string(getpid()));
+
+  std::string data = make_test_file(src, 2 * FILE_BUFFER_SIZE + 777);
+
+  int fd[2];
+  ASSERT_EQ(pipe(fd), 0);
+
+  std::future<void> sender = std::async([&]() {
+    aperf::FileDescriptor connection(nullptr, fd, 1024);
+    connection.write(src);
+  });
+
+  aperf::FileDescriptor connection(fd, nullptr, 1024);
+  ASSERT_EQ(connection.read(dst, 5), data.size());
+
+  sender.get();
+  ASSERT_EQ(read_test_file(dst), data);
+
+  // Nothing is written to the pipe, but its write end stays open
+  int empty_fd[2];
+  ASSERT_EQ(pipe(empty_fd), 0);
+
+  aperf::FileDescriptor empty(empty_fd, nullptr, 1024);
+  ASSERT_THROW({
+      empty.read(dst, 1);
+    }, aperf::TimeoutException);
+
+  ::close(empty_fd[1]);
+
+  fs::remove(src);
+  fs::remove(dst);
+}
+
+TEST(UnixSocketTest, LinesAndFiles) {
+  fs::path socket_path = fs::temp_directory_path() /
+    ("aperf_test_" + std::to_string(getpid()) + ".sock");
+  fs::path src = fs::temp_directory_path() /
+    ("aperf_test_unix_src_" + std::to_string(getpid()));
+  fs::path dst = fs::temp_directory_path() /
+    ("aperf_test_unix_dst_" + std::to_string(getpid()));
+
+  std::string data = make_test_file(src, FILE_BUFFER_SIZE + 4321);
+
+  aperf::UnixSocketAcceptor::Factory factory(socket_path, false);
+  std::unique_ptr<aperf::Acceptor> acceptor = factory.make_acceptor(UNLIMITED_ACCEPTED);
+  ASSERT_EQ(acceptor->get_type(), "unix");
+  ASSERT_EQ(acceptor->get_connection_instructions(), socket_path.string());
+
+  // Only one acceptor can listen at the same path
+  ASSERT_THROW({
+      factory.make_acceptor(UNLIMITED_ACCEPTED);
+    }, aperf::AlreadyInUseException);
+
+  auto connect = [&](unsigned int buf_size) {
+    Poco::Net::StreamSocket socket(Poco::Net::SocketAddress(Poco::Net::SocketAddress::UNIX_LOCAL,
+                                                            socket_path.string()));
+    return std::make_unique<aperf::UnixSocket>(socket, socket_path, buf_size);
+  };
+
+  std::future<std::string> sender = std::async([&]() {
+    std::unique_ptr<aperf::Connection> connection = connect(16);
+    connection->write(SOCKET_LOREM_IPSUM_SHORT, true);
+
+    // A file passed as a file descriptor
+    connect(1)->write(src);
+
+    // A file sent as a stream of data
+    connect(1)->write(data.size(), (char *)data.c_str());
+
+    return connection->read(5);
+  });
+
+  std::unique_ptr<aperf::Connection> connection = acceptor->accept(16);
+  ASSERT_EQ(connection->read(5), SOCKET_LOREM_IPSUM_SHORT);
+
+  ASSERT_EQ(acceptor->accept(1)->read(dst, 5), data.size());
+  ASSERT_EQ(read_test_file(dst), data);
+  fs::remove(dst);
+
+  ASSERT_EQ(acceptor->accept(1)->read(dst, 5), data.size());
+  ASSERT_EQ(read_test_file(dst), data);
+
+  connection->write("done", true);
+  ASSERT_EQ(sender.get(), "done");
+
+  acceptor.reset();
+  ASSERT_FALSE(fs::exists(socket_path));
+
+  fs::path lock_path = socket_path;
+  lock_path += ".lock";
+
+  fs::remove(lock_path);
+  fs::remove(src);
+  fs::remove(dst);
+}
+
+TEST(TCPSocketPollTest, PollFd) {
+  aperf::TCPAcceptor::Factory factory("127.0.0.1", 4957, true);
+  std::unique_ptr<aperf::Acceptor> acceptor = factory.make_acceptor(1);
+  std::string instrs = acceptor->get_connection_instructions();
+  unsigned short port = std::stoi(instrs.substr(instrs.find('_') + 1));
+
+  std::promise<void> reply_read;
+
+  std::future<void> sender = std::async([&]() {
+    Poco::Net::StreamSocket socket;
+    socket.connect(Poco::Net::SocketAddress("127.0.0.1", port));
+    aperf::TCPSocket connection(socket, 1024);
+    connection.write("first\nsecond", true);
+    reply_read.get_future().wait();
+  });
+
+  std::unique_ptr<aperf::Connection> connection = acceptor->accept(1024);
+  int fd = connection->get_poll_fd();
+  ASSERT_NE(fd, -1);
+
+  struct pollfd poll_struct = {fd, POLLIN, 0};
+  ASSERT_EQ(poll(&poll_struct, 1, 5000), 1);
+  ASSERT_EQ(connection->read(5), "first");
+
+  // "second" is buffered already, so polling the socket would not
+  // report it
+  ASSERT_EQ(connection->get_poll_fd(), -1);
+  ASSERT_EQ(connection->read(5), "second");
+  ASSERT_EQ(connection->get_poll_fd(), fd);
+
+  reply_read.set_value();
+  sender.get();
+}
+
+TEST(TCPSocketPollTest, TimedReadKeepsSocketOptions) {
+  aperf::TCPAcceptor::Factory factory("127.0.0.1", 4967, true);
+  std::unique_ptr<aperf::Acceptor> acceptor = factory.make_acceptor(1);
+  std::string instrs = acceptor->get_connection_instructions();
+  unsigned short port = std::stoi(instrs.substr(instrs.find('_') + 1));
+
+  std::future<void> sender = std::async([&]() {
+    Poco::Net::StreamSocket socket;
+    socket.connect(Poco::Net::SocketAddress("127.0.0.1", port));
+    aperf::TCPSocket connection(socket, 1024);
+    connection.write("now", false);
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    connection.write("later", false);
+  });
+
+  std::unique_ptr<aperf::Connection> connection = acceptor->accept(1024);
+  int fd = connection->get_poll_fd();
+  char buf[16];
+  int bytes = 0;
+
+  // Both the data which have already arrived and the ones arriving
+  // while waiting are read
+  while (bytes < 8) {
+    int received = connection->read(buf + bytes, sizeof(buf) - bytes, 5);
+    ASSERT_GT(received, 0);
+    bytes += received;
+  }
+
+  ASSERT_EQ(std::string(buf, bytes), "nowlater");
+  ASSERT_EQ(connection->read(buf, sizeof(buf), 5), 0);
+
+  // The receive timeout of the socket must not be touched by timed reads
+  struct timeval timeout;
+  socklen_t timeout_len = sizeof(timeout);
+  ASSERT_EQ(getsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, &timeout_len), 0);
+  ASSERT_EQ(timeout.tv_sec, 0);
+  ASSERT_EQ(timeout.tv_usec, 0);
+
+  sender.get();
+}
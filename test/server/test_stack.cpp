@@ -0,0 +1,111 @@
+// AdaptivePerf: comprehensive profiling tool based on Linux perf
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "stack.hpp"
+#include <gtest/gtest.h>
+
+TEST(StackTableTest, InternTest) {
+  aperf::StackTable table;
+
+  std::vector<std::pair<std::string, std::string> > callchain1 = {
+    {"main", "0x10"}, {"foo", "0x20"}, {"bar", "0x30"}
+  };
+
+  std::vector<std::pair<std::string, std::string> > callchain2 = {
+    {"main", "0x10"}, {"foo", "0x20"}, {"baz", "0x40"}
+  };
+
+  std::vector<std::pair<std::string, std::string> > callchain3 = {
+    {"main", "0x10"}, {"foo", "0x24"}
+  };
+
+  unsigned int id1 = table.intern(callchain1);
+  unsigned int id2 = table.intern(callchain2);
+  unsigned int id3 = table.intern(callchain3);
+
+  ASSERT_NE(id1, id2);
+  ASSERT_NE(id1, id3);
+  ASSERT_NE(id2, id3);
+  ASSERT_EQ(table.intern(callchain1), id1);
+  ASSERT_EQ(table.intern(callchain2), id2);
+
+  // main, main -> foo, main -> foo -> bar, main -> foo -> baz, main -> foo (0x24)
+  ASSERT_EQ(table.get_stack_count(), 5);
+  ASSERT_EQ(table.get_frame_count(), 5);
+}
+
+TEST(StackTableTest, GetCallchainTest) {
+  aperf::StackTable table;
+
+  std::vector<std::pair<std::string, std::string> > callchain1 = {
+    {"main", "0x10"}, {"foo", "0x20"}, {"bar", "0x30"}
+  };
+
+  std::vector<std::pair<std::string, std::string> > callchain2 = {
+    {"(just thread/process)", ""}
+  };
+
+  unsigned int id1 = table.intern(callchain1);
+  unsigned int id2 = table.intern(callchain2);
+
+  std::vector<std::pair<std::string, std::string> > result;
+
+  table.get_callchain(id1, result);
+  ASSERT_EQ(result, callchain1);
+
+  table.get_callchain(id2, result);
+  ASSERT_EQ(result, callchain2);
+
+  std::vector<std::pair<std::string, std::string> > empty_callchain;
+  ASSERT_EQ(table.intern(empty_callchain), NO_STACK);
+
+  table.get_callchain(NO_STACK, result);
+  ASSERT_TRUE(result.empty());
+}
+
+TEST(StackTableTest, FoldRecursionTest) {
+  std::vector<std::pair<std::string, std::string> > callchain = {
+    {"main", "0x10"}, {"a", "0x20"}, {"b", "0x30"}, {"a", "0x24"},
+    {"b", "0x34"}, {"c", "0x40"}, {"c", "0x44"}, {"c", "0x48"}, {"d", "0x50"}
+  };
+
+  std::vector<std::pair<std::string, std::string> > expected_callchain = {
+    {"main", "0x10"}, {"a", "0x24"}, {"b", "0x34"}, {"c", "0x48"}, {"d", "0x50"}
+  };
+
+  std::vector<unsigned int> expected_depths = {1, 2, 1, 3, 1};
+  std::vector<unsigned int> depths;
+
+  aperf::fold_recursion(callchain, depths);
+
+  ASSERT_EQ(callchain, expected_callchain);
+  ASSERT_EQ(depths, expected_depths);
+}
+
+TEST(StackTableTest, OffsetTest) {
+  unsigned long long offset;
+
+  ASSERT_TRUE(aperf::parse_offset("0x0", offset));
+  ASSERT_EQ(offset, 0);
+  ASSERT_EQ(aperf::format_offset(offset), "0x0");
+
+  ASSERT_TRUE(aperf::parse_offset("0x7f3a9c", offset));
+  ASSERT_EQ(offset, 0x7f3a9c);
+  ASSERT_EQ(aperf::format_offset(offset), "0x7f3a9c");
+
+  ASSERT_TRUE(aperf::parse_offset("", offset));
+  ASSERT_EQ(offset, NO_OFFSET);
+  ASSERT_EQ(aperf::format_offset(offset), "");
+
+  ASSERT_FALSE(aperf::parse_offset("0x", offset));
+  ASSERT_FALSE(aperf::parse_offset("123", offset));
+  ASSERT_FALSE(aperf::parse_offset("0x12g", offset));
+
+  aperf::StackTable table;
+
+  std::vector<std::pair<std::string, std::string> > callchain = {
+    {"main", "0x10"}, {"foo", "bar"}
+  };
+
+  ASSERT_THROW(table.intern(callchain), std::invalid_argument);
+}
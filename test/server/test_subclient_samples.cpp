@@ -0,0 +1,310 @@
+// AdaptivePerf: comprehensive profiling tool based on Linux perf
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "mocks.hpp"
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+#include <climits>
+
+using namespace testing;
+
+static std::string sample(nlohmann::json pid, nlohmann::json tid,
+                          unsigned long long time, unsigned long long period,
+                          bool offcpu, std::vector<std::string> symbols) {
+  nlohmann::json obj;
+  obj["type"] = "sample";
+  obj["event_type"] = offcpu ? "offcpu-time" : "task-clock";
+  obj["pid"] = pid;
+  obj["tid"] = tid;
+  obj["time"] = time;
+  obj["period"] = period;
+  obj["callchain"] = nlohmann::json::array();
+
+  for (auto &symbol : symbols) {
+    obj["callchain"].push_back({symbol, "0x1"});
+  }
+
+  return obj.dump();
+}
+
+class StdSubclientSampleTest : public Test {
+protected:
+  StrictMock<test::MockClient> client;
+  aperf::SessionSettings settings;
+
+  std::unique_ptr<aperf::Subclient> run(std::vector<std::string> lines,
+                                        unsigned long long start_tstamp) {
+    EXPECT_CALL(client, notify).Times(1);
+    EXPECT_CALL(client, get_raw_export_path).WillRepeatedly(Return(fs::path()));
+    EXPECT_CALL(client, get_session_settings).WillRepeatedly(ReturnRef(settings));
+    EXPECT_CALL(client, get_profile_start_tstamp(_))
+      .WillRepeatedly(DoAll(SetArgPointee<0>(start_tstamp), Return(true)));
+
+    std::unique_ptr<aperf::Acceptor::Factory> acceptor_factory =
+      std::make_unique<test::MockAcceptor::Factory>([&](test::MockAcceptor &a) {
+        EXPECT_CALL(a, construct(1)).Times(1);
+        EXPECT_CALL(a, real_accept(_)).Times(1);
+        EXPECT_CALL(a, close).Times(1);
+      }, [&](test::MockConnection &c) {
+        InSequence sequence;
+
+        for (auto &line : lines) {
+          EXPECT_CALL(c, read(NO_TIMEOUT)).WillOnce(Return(line));
+        }
+
+        EXPECT_CALL(c, read(NO_TIMEOUT)).WillOnce(Return("<STOP>"));
+        EXPECT_CALL(c, close).Times(1);
+      }, true);
+
+    aperf::StdSubclient::Factory factory(acceptor_factory);
+    std::unique_ptr<aperf::Subclient> subclient = factory.make_subclient(client, "test",
+                                                                         1024);
+    subclient->process();
+    return subclient;
+  }
+
+  // Gets the per-thread results of a subclient for a given event,
+  // keyed by "<PID>_<TID>".
+  static nlohmann::json get_threads(aperf::Subclient &subclient,
+                                    std::string event = "sample") {
+    nlohmann::json threads = nlohmann::json::object();
+
+    for (auto &thread : subclient.get_result()[event]) {
+      threads[std::to_string((int)thread[0]) + "_" +
+              std::to_string((int)thread[1])] = thread[2];
+    }
+
+    return threads;
+  }
+};
+
+TEST_F(StdSubclientSampleTest, SampleTreesTest) {
+  std::unique_ptr<aperf::Subclient> subclient = run({
+      sample(10, 11, 1100, 100, false, {"main", "foo"}),
+      sample(10, 12, 1150, 50, false, {"main"}),
+      sample(10, 11, 1200, 100, false, {"main", "foo"}),
+      sample(10, 11, 1300, 100, true, {"main", "bar"}),
+      sample(10, 11, 1400, 100, false, {"main", "foo"})
+    }, 1000);
+
+  nlohmann::json threads = get_threads(*subclient);
+  ASSERT_EQ(threads.size(), 2);
+
+  nlohmann::json expected = nlohmann::json::parse(R"({
+    "sampled_time": 400,
+    "offcpu_regions": [[1200, 100]],
+    "walltime": [
+      {"name": "all", "value": 400, "cold": false, "children": [
+        {"name": "main", "value": 400, "cold": false, "offsets": {"0x1": 400}, "children": [
+          {"name": "foo", "value": 300, "cold": false, "offsets": {"0x1": 300}, "children": []},
+          {"name": "bar", "value": 100, "cold": true, "offsets": {"0x1": 100}, "children": []}
+        ]}
+      ]},
+      {"name": "all", "value": 400, "cold": false, "children": [
+        {"name": "main", "value": 400, "cold": false, "offsets": {"0x1": 400}, "children": [
+          {"name": "foo", "value": 200, "cold": false, "offsets": {"0x1": 200}, "children": []},
+          {"name": "bar", "value": 100, "cold": true, "offsets": {"0x1": 100}, "children": []},
+          {"name": "foo", "value": 100, "cold": false, "offsets": {"0x1": 100}, "children": []}
+        ]}
+      ]}
+    ]
+  })");
+
+  ASSERT_EQ(threads["10_11"], expected);
+  ASSERT_EQ(threads["10_12"]["sampled_time"], 50);
+
+  // Time-range queries are answered from the sample log
+  nlohmann::json range = static_cast<aperf::StdSubclient *>(subclient.get())->
+    get_sample_trees(10, 11, 1250, 1400);
+
+  nlohmann::json expected_range = nlohmann::json::parse(R"(
+    {"name": "all", "value": 100, "cold": true, "children": [
+      {"name": "main", "value": 100, "cold": true, "offsets": {"0x1": 100}, "children": [
+        {"name": "bar", "value": 100, "cold": true, "offsets": {"0x1": 100}, "children": []}
+      ]}
+    ]}
+  )");
+
+  ASSERT_EQ(range.size(), 2);
+  ASSERT_EQ(range[0], expected_range);
+  ASSERT_EQ(range[1], expected_range);
+
+  ASSERT_EQ(static_cast<aperf::StdSubclient *>(subclient.get())->
+            get_sample_trees(10, 11, 0, ULLONG_MAX),
+            expected["walltime"]);
+  ASSERT_EQ(static_cast<aperf::StdSubclient *>(subclient.get())->
+            get_sample_trees(10, 13, 0, ULLONG_MAX)[0]["value"], 0);
+}
+
+TEST_F(StdSubclientSampleTest, SamplesBeforeStartTest) {
+  EXPECT_CALL(client, notify).Times(1);
+  EXPECT_CALL(client, get_raw_export_path).WillRepeatedly(Return(fs::path()));
+  EXPECT_CALL(client, get_session_settings).WillRepeatedly(ReturnRef(settings));
+
+  // Samples received before the profile start timestamp is known are
+  // included or dropped based on their own timestamps
+  EXPECT_CALL(client, get_profile_start_tstamp(_))
+    .WillOnce(Return(false))
+    .WillOnce(Return(false))
+    .WillRepeatedly(DoAll(SetArgPointee<0>(1000), Return(true)));
+
+  std::vector<std::string> lines = {
+    sample(10, 11, 900, 100, false, {"main"}),
+    sample(10, 11, 1100, 100, false, {"main"}),
+    sample(10, 11, 1200, 100, false, {"main"})
+  };
+
+  std::unique_ptr<aperf::Acceptor::Factory> acceptor_factory =
+    std::make_unique<test::MockAcceptor::Factory>([&](test::MockAcceptor &a) {
+      EXPECT_CALL(a, construct(1)).Times(1);
+      EXPECT_CALL(a, real_accept(_)).Times(1);
+      EXPECT_CALL(a, close).Times(1);
+    }, [&](test::MockConnection &c) {
+      EXPECT_CALL(c, read(NO_TIMEOUT))
+        .WillOnce(Return(lines[0]))
+        .WillOnce(Return(lines[1]))
+        .WillOnce(Return(lines[2]))
+        .WillOnce(Return("<STOP>"));
+      EXPECT_CALL(c, close).Times(1);
+    }, true);
+
+  aperf::StdSubclient::Factory factory(acceptor_factory);
+  std::unique_ptr<aperf::Subclient> subclient = factory.make_subclient(client, "test",
+                                                                       1024);
+  subclient->process();
+
+  nlohmann::json threads = get_threads(*subclient);
+  ASSERT_EQ(threads["10_11"]["sampled_time"], 200);
+  ASSERT_EQ(subclient->get_result()["stats"]["samples"], 2);
+}
+
+TEST_F(StdSubclientSampleTest, StartAfterSamplesTest) {
+  std::vector<std::string> lines = {
+    sample(10, 11, 900, 100, false, {"main"}),
+    sample(10, 11, 1100, 100, false, {"main"})
+  };
+
+  auto run_without_start = [&](bool start_received) {
+    EXPECT_CALL(client, notify).Times(1);
+    EXPECT_CALL(client, get_raw_export_path).WillRepeatedly(Return(fs::path()));
+    EXPECT_CALL(client, get_session_settings).WillRepeatedly(ReturnRef(settings));
+    EXPECT_CALL(client, get_profile_start_tstamp(_)).WillRepeatedly(Return(false));
+
+    // All samples can arrive before the timestamp, e.g. when perf-script
+    // finishes processing before the frontend sends it
+    if (start_received) {
+      EXPECT_CALL(client, wait_for_profile_start_tstamp(_))
+        .WillOnce(DoAll(SetArgPointee<0>(1000), Return(true)));
+    } else {
+      EXPECT_CALL(client, wait_for_profile_start_tstamp(_)).WillOnce(Return(false));
+    }
+
+    std::unique_ptr<aperf::Acceptor::Factory> acceptor_factory =
+      std::make_unique<test::MockAcceptor::Factory>([&](test::MockAcceptor &a) {
+        EXPECT_CALL(a, construct(1)).Times(1);
+        EXPECT_CALL(a, real_accept(_)).Times(1);
+        EXPECT_CALL(a, close).Times(1);
+      }, [&](test::MockConnection &c) {
+        EXPECT_CALL(c, read(NO_TIMEOUT))
+          .WillOnce(Return(lines[0]))
+          .WillOnce(Return(lines[1]))
+          .WillOnce(Return("<STOP>"));
+        EXPECT_CALL(c, close).Times(1);
+      }, true);
+
+    aperf::StdSubclient::Factory factory(acceptor_factory);
+    std::unique_ptr<aperf::Subclient> subclient = factory.make_subclient(client, "test",
+                                                                         1024);
+    subclient->process();
+    return subclient;
+  };
+
+  std::unique_ptr<aperf::Subclient> subclient = run_without_start(true);
+  nlohmann::json threads = get_threads(*subclient);
+  ASSERT_EQ(threads["10_11"]["sampled_time"], 100);
+  ASSERT_EQ(subclient->get_result()["stats"]["samples"], 1);
+
+  subclient = run_without_start(false);
+  ASSERT_FALSE(subclient->get_result().contains("sample"));
+  ASSERT_EQ(subclient->get_result()["stats"]["samples"], 0);
+}
+
+TEST_F(StdSubclientSampleTest, TimelineTest) {
+  settings.timeline_buckets_ms = {100, 0};
+
+  std::unique_ptr<aperf::Subclient> subclient = run({
+      sample(10, 11, 1050000000, 50000000, false, {"main", "foo"}),
+      sample(10, 11, 1080000000, 30000000, true, {"main", "bar"}),
+      sample(10, 11, 1250000000, 100000000, false, {"main", "foo"})
+    }, 1000000000);
+
+  // Bucket sizes are in milliseconds while timestamps and periods are
+  // in nanoseconds
+
+  nlohmann::json expected = nlohmann::json::parse(R"({
+    "frames": ["main", "foo", "bar"],
+    "threads": {
+      "10_11": {
+        "100": [
+          [0, [-1, 0, 80000000, 0, 0, 1, 50000000, 0, 0, 2, 30000000, 1]],
+          [2, [-1, 0, 100000000, 0, 0, 1, 100000000, 0]]
+        ]
+      }
+    }
+  })");
+
+  ASSERT_EQ(subclient->get_result()["timeline"], expected);
+}
+
+TEST_F(StdSubclientSampleTest, IdFormatsTest) {
+  auto syscall_meta = [](nlohmann::json pid, nlohmann::json tid,
+                         nlohmann::json ret_value) {
+    nlohmann::json obj;
+    obj["type"] = "syscall_meta";
+    obj["subtype"] = "new_proc";
+    obj["comm"] = "test";
+    obj["pid"] = pid;
+    obj["tid"] = tid;
+    obj["time"] = 900;
+    obj["ret_value"] = ret_value;
+    return obj.dump();
+  };
+
+  // Integer IDs and decimal string IDs sent by older scripts give
+  // the same results
+  std::unique_ptr<aperf::Subclient> int_subclient = run({
+      syscall_meta(10, 10, 11),
+      sample(10, 11, 1100, 100, false, {"main", "foo"}),
+      sample(10, 11, 1200, 100, true, {"main"})
+    }, 1000);
+
+  std::unique_ptr<aperf::Subclient> str_subclient = run({
+      syscall_meta("10", "10", "11"),
+      sample("10", "11", 1100, 100, false, {"main", "foo"}),
+      sample("10", "11", 1200, 100, true, {"main"}),
+      sample("10a", "11", 1300, 100, false, {"main"}),
+      sample(10, " 11", 1400, 100, false, {"main"}),
+      sample(10, nullptr, 1500, 100, false, {"main"}),
+      syscall_meta("10", "", "11")
+    }, 1000);
+
+  nlohmann::json int_result = int_subclient->get_result();
+  nlohmann::json str_result = str_subclient->get_result();
+
+  // Invalid IDs make the lines invalid
+  ASSERT_EQ(int_result["stats"]["invalid_lines"], 0);
+  ASSERT_EQ(str_result["stats"]["invalid_lines"], 4);
+
+  int_result.erase("stats");
+  str_result.erase("stats");
+  ASSERT_EQ(int_result, str_result);
+
+  nlohmann::json &threads = int_result["syscall_meta"];
+  ASSERT_EQ(threads.size(), 2);
+  ASSERT_TRUE(threads[0]["identifier"].is_number_integer());
+  ASSERT_EQ(threads[0]["identifier"], 10);
+  ASSERT_TRUE(threads[0]["parent"].is_null());
+  ASSERT_TRUE(threads[1]["identifier"].is_number_integer());
+  ASSERT_EQ(threads[1]["identifier"], 11);
+  ASSERT_EQ(threads[1]["parent"], 10);
+}
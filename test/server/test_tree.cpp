@@ -0,0 +1,293 @@
+// AdaptivePerf: comprehensive profiling tool based on Linux perf
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "tree.hpp"
+#include <gtest/gtest.h>
+
+// Makes a flame graph consisting of a single chain of nodes below
+// the root, all with the same value.
+static nlohmann::json make_chain(int depth, unsigned long long value) {
+  nlohmann::json tree = {{"name", "all"}, {"value", value}, {"cold", false},
+                         {"children", nlohmann::json::array()}};
+  nlohmann::json *node = &tree;
+
+  for (int i = 0; i < depth; i++) {
+    nlohmann::json child = {{"name", "f"}, {"value", value}, {"cold", false},
+                            {"offsets", {{"0x1", value}}},
+                            {"children", nlohmann::json::array()}};
+    (*node)["children"].push_back(child);
+    node = &(*node)["children"][0];
+  }
+
+  return tree;
+}
+
+// Gets the values of the nodes on the path going through the first
+// child of every node, without the root.
+static std::vector<unsigned long long> get_first_path(nlohmann::json &tree) {
+  std::vector<unsigned long long> values;
+  nlohmann::json *node = &tree;
+
+  while (!(*node)["children"].empty()) {
+    node = &(*node)["children"][0];
+    values.push_back((*node)["value"]);
+  }
+
+  return values;
+}
+
+TEST(TreeTest, MergeTest) {
+  nlohmann::json tree1 = nlohmann::json::parse(R"({
+    "name": "all", "value": 10, "cold": false, "children": [
+      {"name": "main", "value": 10, "cold": false, "offsets": {"0x10": 10}, "children": [
+        {"name": "foo", "value": 6, "cold": false, "offsets": {"0x20": 6}, "children": []},
+        {"name": "foo", "value": 4, "cold": true, "offsets": {"0x20": 4}, "children": []}
+      ]}
+    ]
+  })");
+
+  nlohmann::json tree2 = nlohmann::json::parse(R"({
+    "name": "all", "value": 7, "cold": true, "children": [
+      {"name": "main", "value": 5, "cold": false, "offsets": {"0x10": 3, "0x14": 2}, "children": [
+        {"name": "foo", "value": 2, "cold": true, "offsets": {"0x24": 2}, "children": []},
+        {"name": "bar", "value": 3, "cold": false, "offsets": {"0x30": 3}, "children": []}
+      ]},
+      {"name": "start", "value": 2, "cold": true, "offsets": {"0x0": 2}, "children": []}
+    ]
+  })");
+
+  nlohmann::json expected = nlohmann::json::parse(R"({
+    "name": "all", "value": 17, "cold": false, "children": [
+      {"name": "main", "value": 15, "cold": false, "offsets": {"0x10": 13, "0x14": 2}, "children": [
+        {"name": "foo", "value": 6, "cold": false, "offsets": {"0x20": 6}, "children": []},
+        {"name": "foo", "value": 6, "cold": true, "offsets": {"0x20": 4, "0x24": 2}, "children": []},
+        {"name": "bar", "value": 3, "cold": false, "offsets": {"0x30": 3}, "children": []}
+      ]},
+      {"name": "start", "value": 2, "cold": true, "offsets": {"0x0": 2}, "children": []}
+    ]
+  })");
+
+  nlohmann::json result;
+  aperf::merge_trees(result, tree1);
+
+  ASSERT_EQ(result, tree1);
+
+  aperf::merge_trees(result, tree2);
+
+  ASSERT_EQ(result, expected);
+}
+
+TEST(TreeTest, MergeHotColdTest) {
+  // Non-leaves are matched by name, preferring the sibling with the same
+  // "cold" flag, while leaves are matched by name and "cold" flag
+  nlohmann::json dst = nlohmann::json::parse(R"({
+    "name": "all", "value": 6, "cold": false, "children": [
+      {"name": "foo", "value": 2, "cold": false, "children": [
+        {"name": "a", "value": 2, "cold": false, "children": []}
+      ]},
+      {"name": "foo", "value": 2, "cold": true, "children": [
+        {"name": "b", "value": 2, "cold": true, "children": []}
+      ]},
+      {"name": "bar", "value": 2, "cold": true, "children": []}
+    ]
+  })");
+
+  nlohmann::json src = nlohmann::json::parse(R"({
+    "name": "all", "value": 5, "cold": false, "children": [
+      {"name": "foo", "value": 1, "cold": true, "children": [
+        {"name": "b", "value": 1, "cold": true, "children": []}
+      ]},
+      {"name": "foo", "value": 1, "cold": false, "children": [
+        {"name": "a", "value": 1, "cold": false, "children": []}
+      ]},
+      {"name": "bar", "value": 1, "cold": false, "children": []},
+      {"name": "bar", "value": 2, "cold": false, "children": [
+        {"name": "c", "value": 2, "cold": false, "children": []}
+      ]}
+    ]
+  })");
+
+  nlohmann::json expected = nlohmann::json::parse(R"({
+    "name": "all", "value": 11, "cold": false, "children": [
+      {"name": "foo", "value": 3, "cold": false, "children": [
+        {"name": "a", "value": 3, "cold": false, "children": []}
+      ]},
+      {"name": "foo", "value": 3, "cold": true, "children": [
+        {"name": "b", "value": 3, "cold": true, "children": []}
+      ]},
+      {"name": "bar", "value": 2, "cold": true, "children": []},
+      {"name": "bar", "value": 3, "cold": false, "children": [
+        {"name": "c", "value": 2, "cold": false, "children": []}
+      ]}
+    ]
+  })");
+
+  aperf::merge_trees(dst, src);
+
+  ASSERT_EQ(dst, expected);
+}
+
+TEST(TreeTest, AppendTimeOrderedTest) {
+  nlohmann::json tree1 = nlohmann::json::parse(R"({
+    "name": "all", "value": 3, "cold": false, "children": [
+      {"name": "main", "value": 3, "cold": false, "offsets": {"0x10": 3}, "children": [
+        {"name": "foo", "value": 2, "cold": false, "offsets": {"0x20": 2}, "children": []},
+        {"name": "bar", "value": 1, "cold": true, "offsets": {"0x30": 1}, "children": []}
+      ]}
+    ]
+  })");
+
+  nlohmann::json tree2 = nlohmann::json::parse(R"({
+    "name": "all", "value": 7, "cold": false, "children": [
+      {"name": "main", "value": 4, "cold": true, "offsets": {"0x14": 4}, "children": [
+        {"name": "bar", "value": 4, "cold": true, "offsets": {"0x30": 4}, "children": []}
+      ]},
+      {"name": "main", "value": 1, "cold": false, "offsets": {"0x18": 1}, "children": []},
+      {"name": "start", "value": 2, "cold": true, "offsets": {"0x0": 2}, "children": []}
+    ]
+  })");
+
+  nlohmann::json tree3 = nlohmann::json::parse(R"({
+    "name": "all", "value": 1, "cold": false, "children": [
+      {"name": "start", "value": 1, "cold": false, "offsets": {"0x0": 1}, "children": []}
+    ]
+  })");
+
+  // The first samples of tree2 continue the last nodes of tree1, while the
+  // first sample of tree3 is on-CPU unlike the last one of tree2
+  nlohmann::json expected = nlohmann::json::parse(R"({
+    "name": "all", "value": 11, "cold": false, "children": [
+      {"name": "main", "value": 7, "cold": false, "offsets": {"0x10": 3, "0x14": 4}, "children": [
+        {"name": "foo", "value": 2, "cold": false, "offsets": {"0x20": 2}, "children": []},
+        {"name": "bar", "value": 5, "cold": true, "offsets": {"0x30": 5}, "children": []}
+      ]},
+      {"name": "main", "value": 1, "cold": false, "offsets": {"0x18": 1}, "children": []},
+      {"name": "start", "value": 2, "cold": true, "offsets": {"0x0": 2}, "children": []},
+      {"name": "start", "value": 1, "cold": false, "offsets": {"0x0": 1}, "children": []}
+    ]
+  })");
+
+  nlohmann::json result;
+  aperf::append_time_ordered_tree(result, tree1);
+
+  ASSERT_EQ(result, tree1);
+
+  aperf::append_time_ordered_tree(result, tree2);
+  aperf::append_time_ordered_tree(result, tree3);
+
+  ASSERT_EQ(result, expected);
+}
+
+TEST(TreeTest, MergeFlatTest) {
+  nlohmann::json tree1 = {-1, 0, 5, 0,
+                          0, 1, 3, 1};
+
+  nlohmann::json tree2 = {-1, 0, 3, 0,
+                          0, 1, 1, 1,
+                          0, 2, 2, 0,
+                          -1, 2, 4, 1};
+
+  nlohmann::json expected = {-1, 0, 8, 0,
+                             0, 1, 4, 1,
+                             0, 2, 2, 0,
+                             -1, 2, 4, 1};
+
+  aperf::merge_flat_trees(tree1, tree2);
+
+  ASSERT_EQ(tree1, expected);
+}
+
+TEST(TreeTest, PruneTest) {
+  nlohmann::json tree = nlohmann::json::parse(R"({
+    "name": "all", "value": 100, "cold": false, "children": [
+      {"name": "main", "value": 90, "cold": false, "offsets": {"0x10": 90}, "children": [
+        {"name": "foo", "value": 80, "cold": false, "offsets": {"0x20": 80}, "children": [
+          {"name": "baz", "value": 1, "cold": true, "offsets": {"0x40": 1}, "children": []}
+        ]},
+        {"name": "bar", "value": 4, "cold": true, "offsets": {"0x30": 4}, "children": []},
+        {"name": "qux", "value": 6, "cold": false, "offsets": {"0x50": 6}, "children": []}
+      ]},
+      {"name": "start", "value": 10, "cold": true, "offsets": {"0x0": 10}, "children": []}
+    ]
+  })");
+
+  nlohmann::json tree_time_ordered = tree;
+
+  nlohmann::json expected = nlohmann::json::parse(R"({
+    "name": "all", "value": 100, "cold": false, "children": [
+      {"name": "main", "value": 90, "cold": false, "offsets": {"0x10": 90}, "children": [
+        {"name": "foo", "value": 80, "cold": false, "offsets": {"0x20": 80}, "children": [
+          {"name": "[pruned]", "value": 1, "cold": true, "offsets": {}, "children": []}
+        ]},
+        {"name": "[pruned]", "value": 10, "cold": false, "offsets": {}, "children": []}
+      ]},
+      {"name": "start", "value": 10, "cold": true, "offsets": {"0x0": 10}, "children": []}
+    ]
+  })");
+
+  ASSERT_EQ(aperf::prune_tree(tree, 0.1, 0, false), 1);
+  ASSERT_EQ(tree, expected);
+
+  nlohmann::json expected_time_ordered = nlohmann::json::parse(R"({
+    "name": "all", "value": 100, "cold": false, "children": [
+      {"name": "main", "value": 90, "cold": false, "offsets": {"0x10": 90}, "children": [
+        {"name": "[pruned]", "value": 90, "cold": false, "offsets": {}, "children": []}
+      ]},
+      {"name": "[pruned]", "value": 10, "cold": true, "offsets": {}, "children": []}
+    ]
+  })");
+
+  ASSERT_EQ(aperf::prune_tree(tree_time_ordered, 0, 5, true), 3);
+  ASSERT_EQ(tree_time_ordered, expected_time_ordered);
+}
+
+TEST(TreeTest, DeepTreeTest) {
+  // Flame graphs deep enough to overflow the stack if processed
+  // recursively
+  const int depth = 30000;
+  const int half = depth / 2;
+
+  nlohmann::json chain1 = make_chain(depth, 2);
+  nlohmann::json chain2 = make_chain(half, 1);
+
+  std::vector<unsigned long long> expected(depth, 2);
+
+  for (int i = 0; i < half; i++) {
+    expected[i] = 3;
+  }
+
+  nlohmann::json tree;
+  aperf::merge_trees(tree, chain1);
+  aperf::merge_trees(tree, chain2);
+
+  ASSERT_EQ(tree["value"], 3);
+  ASSERT_EQ(get_first_path(tree), expected);
+
+  nlohmann::json tree_time_ordered;
+  aperf::append_time_ordered_tree(tree_time_ordered, chain1);
+  aperf::append_time_ordered_tree(tree_time_ordered, chain2);
+
+  // The last node of chain2 is a leaf, so it isn't combined with
+  // the corresponding non-leaf node of chain1
+  expected[half - 1] = 2;
+
+  ASSERT_EQ(tree_time_ordered["value"], 3);
+  ASSERT_EQ(get_first_path(tree_time_ordered), expected);
+
+  nlohmann::json *node = &tree_time_ordered;
+
+  for (int i = 0; i < half - 1; i++) {
+    node = &(*node)["children"][0];
+  }
+
+  ASSERT_EQ((*node)["children"].size(), 2);
+  ASSERT_EQ((*node)["children"][1]["value"], 1);
+
+  // All nodes below the ones shared by both chains are collapsed into
+  // a single "[pruned]" node
+  ASSERT_EQ(aperf::prune_tree(tree, 0.9, 0, false), depth - half - 1);
+
+  std::vector<unsigned long long> pruned_values = get_first_path(tree);
+  ASSERT_EQ(pruned_values.size(), half + 1);
+  ASSERT_EQ(pruned_values.back(), 2);
+}
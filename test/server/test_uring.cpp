@@ -0,0 +1,116 @@
+// AdaptivePerf: comprehensive profiling tool based on Linux perf
+// Copyright (C) CERN. See LICENSE for details.
+
+#include "uring.hpp"
+#include <gtest/gtest.h>
+#include <chrono>
+#include <future>
+#include <fstream>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+#ifdef IO_URING_AVAILABLE
+static std::vector<std::shared_ptr<aperf::IoUringReactor> > make_reactors() {
+  std::vector<std::shared_ptr<aperf::IoUringReactor> > reactors;
+
+  try {
+    reactors.push_back(std::make_shared<aperf::IoUringReactor>());
+  } catch (std::runtime_error &e) {
+
+  }
+
+  return reactors;
+}
+
+static unsigned short get_port(aperf::Acceptor &acceptor) {
+  std::string instrs = acceptor.get_connection_instructions();
+  return std::stoi(instrs.substr(instrs.find('_') + 1));
+}
+
+TEST(IoUringSocketTest, LinesAndTimeout) {
+  std::vector<std::shared_ptr<aperf::IoUringReactor> > reactors = make_reactors();
+
+  if (reactors.empty()) {
+    GTEST_SKIP() << "io_uring is not available";
+  }
+
+  aperf::IoUringAcceptor::Factory factory("127.0.0.1", 4917, true, reactors);
+  std::unique_ptr<aperf::Acceptor> acceptor = factory.make_acceptor(1);
+  unsigned short port = get_port(*acceptor);
+
+  std::future<std::string> sender = std::async([&]() {
+    Poco::Net::StreamSocket socket;
+    socket.connect(Poco::Net::SocketAddress("127.0.0.1", port));
+    aperf::TCPSocket tcp_socket(socket, 1024);
+    tcp_socket.write("first", true);
+    tcp_socket.write("sec", false);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    tcp_socket.write("ond\nthird", true);
+    std::string long_line(5000, 'x');
+    tcp_socket.write(long_line, true);
+    return tcp_socket.read();
+  });
+
+  std::unique_ptr<aperf::Connection> connection = acceptor->accept(1024);
+  ASSERT_EQ(connection->read(), "first");
+  ASSERT_EQ(connection->read(), "second");
+  ASSERT_EQ(connection->read(), "third");
+  ASSERT_EQ(connection->read(5), std::string(5000, 'x'));
+
+  char buf[16];
+  ASSERT_THROW(connection->read(buf, sizeof(buf), 1), aperf::TimeoutException);
+
+  connection->write("reply", true);
+  ASSERT_EQ(sender.get(), "reply");
+
+  ASSERT_EQ(connection->read(buf, sizeof(buf), 5), 0);
+}
+
+TEST(IoUringSocketTest, FileWithBackpressure) {
+  std::vector<std::shared_ptr<aperf::IoUringReactor> > reactors = make_reactors();
+
+  if (reactors.empty()) {
+    GTEST_SKIP() << "io_uring is not available";
+  }
+
+  fs::path src = fs::temp_directory_path() /
+    ("aperf_test_uring_src_" + std::to_string(getpid()));
+  fs::path dst = fs::temp_directory_path() /
+    ("aperf_test_uring_dst_" + std::to_string(getpid()));
+
+  // Larger than IO_URING_MAX_QUEUED so that receiving is paused
+  // while the file is not read
+  std::string data(IO_URING_MAX_QUEUED + 3 * IO_URING_BUF_SIZE + 123, '\0');
+
+  for (std::size_t i = 0; i < data.size(); i++) {
+    data[i] = (char)(i * 7 + i / 4096);
+  }
+
+  std::ofstream(src, std::ios::binary) << data;
+
+  aperf::IoUringAcceptor::Factory factory("127.0.0.1", 4917, true, reactors);
+  std::unique_ptr<aperf::Acceptor> acceptor = factory.make_acceptor(1);
+  unsigned short port = get_port(*acceptor);
+
+  std::future<void> sender = std::async([&]() {
+    Poco::Net::StreamSocket socket;
+    socket.connect(Poco::Net::SocketAddress("127.0.0.1", port));
+    aperf::TCPSocket tcp_socket(socket, 1024);
+    tcp_socket.write(src);
+  });
+
+  std::unique_ptr<aperf::Connection> connection = acceptor->accept(1024);
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  ASSERT_EQ(connection->read(dst, 5), data.size());
+  sender.get();
+
+  std::ifstream stream(dst, std::ios::binary);
+  std::string received((std::istreambuf_iterator<char>(stream)),
+                       std::istreambuf_iterator<char>());
+  ASSERT_TRUE(received == data);
+
+  fs::remove(src);
+  fs::remove(dst);
+}
+#endif